@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file parser.h
+ * @brief Resumable WebSocket frame parser.
+ */
+#ifndef PARSER_H
+#define PARSER_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/**
+	 * @name Parser events, see @ref ws_parser
+	 */
+	/**@{*/
+	/**
+	 * @brief A frame header was read: opcode, fin and frame_len
+	 * are set.
+	 */
+	#define WS_PARSER_HEADER  0
+	/**
+	 * @brief A chunk of (unmasked) data frame payload.
+	 */
+	#define WS_PARSER_PAYLOAD 1
+	/**
+	 * @brief The last chunk of a data message was given: msg_type
+	 * and msg_size describe it.
+	 */
+	#define WS_PARSER_MESSAGE 2
+	/**
+	 * @brief A whole control frame (close, ping or pong), with its
+	 * payload.
+	 */
+	#define WS_PARSER_CONTROL 3
+	/**@}*/
+
+	/**
+	 * @brief Frame parser state.
+	 *
+	 * Bytes are given in chunks of any size, as they arrive, and
+	 * events are triggered as soon as possible: the parser never
+	 * waits for, nor buffers, whole data frames.
+	 */
+	struct ws_parser
+	{
+		/**
+		 * @brief Event callback: returns 0 to go on, anything
+		 * else to stop parsing.
+		 */
+		int (*on_event)(struct ws_parser *p, int event,
+			const unsigned char *data, size_t len);
+		/**
+		 * @brief User data, for the callback.
+		 */
+		void *data;
+		/**
+		 * @brief Max data message size.
+		 */
+		uint64_t max_size;
+
+		/* Current frame. */
+		unsigned char hdr[14];  /**< Header read so far.        */
+		size_t hdr_len;         /**< Header bytes read.         */
+		size_t hdr_need;        /**< Header length.             */
+		int opcode;             /**< Frame opcode.              */
+		int fin;                /**< Is FIN frame flag.         */
+		uint64_t frame_len;     /**< Payload length.            */
+		uint64_t frame_pos;     /**< Payload bytes read.        */
+		unsigned char ctrl[125];/**< Control frame payload.     */
+
+		/* Current data message. */
+		int msg_type;           /**< Opcode, -1 if none.        */
+		uint64_t msg_size;      /**< Payload bytes so far.      */
+		uint32_t utf8_state;    /**< UTF-8 validation state.    */
+
+		/**
+		 * @brief Close code describing why parsing failed.
+		 */
+		int error;
+	};
+
+	extern void ws_parser_init(struct ws_parser *p,
+		int (*on_event)(struct ws_parser *, int, const unsigned char *, size_t),
+		void *data, uint64_t max_size);
+	extern int ws_parser_feed(struct ws_parser *p, unsigned char *buf,
+		size_t len);
+
+#endif /* PARSER_H */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file uring.h
+ * @brief Minimal io_uring interface, over the raw system calls.
+ */
+#ifndef URING_H
+#define URING_H
+
+	#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+	#include <linux/io_uring.h>
+	#endif
+	#endif
+
+	/* Multishot receives and provided buffer rings: Linux 6.0 headers. */
+	#ifdef IORING_RECV_MULTISHOT
+	/**
+	 * @brief Defined if the io_uring backend can be built.
+	 */
+	#define WS_HAVE_URING
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/**
+	 * @brief Buffer group of the provided receive buffers.
+	 */
+	#define WS_URING_BGID 0
+
+	/**
+	 * @brief An io_uring instance, with a ring of provided receive
+	 * buffers (@ref WS_URING_BGID).
+	 *
+	 * Only the thread that sets it up may use it.
+	 */
+	struct ws_uring
+	{
+		int fd;                       /**< Ring fd.                  */
+
+		/* Submission queue. */
+		unsigned *sq_head;            /**< Consumed by the kernel.   */
+		unsigned *sq_tail;            /**< Published to the kernel.  */
+		unsigned sq_mask;             /**< Ring index mask.          */
+		unsigned sq_entries;          /**< Amount of entries.        */
+		unsigned sq_local;            /**< Tail, not yet published.  */
+		struct io_uring_sqe *sqes;    /**< Entries.                  */
+
+		/* Completion queue. */
+		unsigned *cq_head;            /**< Consumed by us.           */
+		unsigned *cq_tail;            /**< Produced by the kernel.   */
+		unsigned cq_mask;             /**< Ring index mask.          */
+		struct io_uring_cqe *cqes;    /**< Entries.                  */
+
+		/* Provided buffers. */
+		struct io_uring_buf_ring *br; /**< Buffer ring.              */
+		unsigned char *bufs;          /**< Buffers memory.           */
+		unsigned buf_count;           /**< Amount of buffers.        */
+		unsigned buf_size;            /**< Size of each buffer.      */
+		uint16_t br_tail;             /**< Buffer ring tail.         */
+
+		/* Mappings. */
+		void *ring;                   /**< SQ and CQ rings.          */
+		size_t ring_size;             /**< SQ and CQ rings size.     */
+		size_t sqes_size;             /**< Entries size.             */
+	};
+
+	extern int ws_uring_init(struct ws_uring *r, unsigned entries,
+		unsigned buf_count, unsigned buf_size);
+	extern void ws_uring_free(struct ws_uring *r);
+	extern struct io_uring_sqe *ws_uring_sqe(struct ws_uring *r);
+	extern unsigned ws_uring_sq_space(struct ws_uring *r);
+	extern int ws_uring_submit(struct ws_uring *r, unsigned wait);
+	extern struct io_uring_cqe *ws_uring_cqe(struct ws_uring *r);
+	extern void ws_uring_cqe_seen(struct ws_uring *r);
+	extern unsigned char *ws_uring_buf(struct ws_uring *r, unsigned bid);
+	extern void ws_uring_buf_put(struct ws_uring *r, unsigned bid);
+	#endif
+
+#endif /* URING_H */
@@ -38,9 +38,18 @@ extern "C" {
 	 */
 	/**@{*/
 	/**
-	 * @brief Max clients connected simultaneously.
+	 * @brief Max clients connected simultaneously, by default,
+	 * see @ref ws_max_clients.
 	 */
+	#ifndef MAX_CLIENTS
 	#define MAX_CLIENTS    8
+	#endif
+
+	/**
+	 * @brief Highest client fd (exclusive) the connection table
+	 * can hold.
+	 */
+	#define MAX_CLIENT_FD  (1 << 20)
 
 	/**
 	 * @brief Max number of `ws_server` instances running
@@ -88,6 +97,11 @@ extern "C" {
 	 */
 	#define WS_HS_REQ      "Sec-WebSocket-Key"
 
+	/**
+	 * @brief Alias for 'Sec-WebSocket-Protocol'.
+	 */
+	#define WS_HS_PROTO    "Sec-WebSocket-Protocol"
+
 	/**
 	 * @brief Handshake accept message length.
 	 */
@@ -151,6 +165,52 @@ extern "C" {
 	 * @brief Unsupported frame.
 	 */
 	#define WS_FR_OP_UNSUPPORTED 0xF
+
+	/**
+	 * @brief Maximum frame header length, as sent by the server.
+	 */
+	#define WS_FRAME_HDR_MAX 10
+	/**@}*/
+
+	/**
+	 * @name Timing events, see @ref ws_timing
+	 */
+	/**@{*/
+	/**
+	 * @brief A frame (or a broadcast copy of it) was sent.
+	 */
+	#define WS_TIMING_SEND      0
+	/**
+	 * @brief A handshake ended, successfully or not.
+	 */
+	#define WS_TIMING_HANDSHAKE 1
+	/**@}*/
+
+	/**
+	 * @name I/O backends, see @ref ws_backend
+	 */
+	/**@{*/
+	/**
+	 * @brief One blocking thread per connection (default).
+	 */
+	#define WS_BACKEND_THREADS 0
+	/**
+	 * @brief A fixed set of worker threads multiplexing every
+	 * connection with edge-triggered epoll (Linux only).
+	 */
+	#define WS_BACKEND_EPOLL   1
+	/**
+	 * @brief As @ref WS_BACKEND_EPOLL, but each worker also accepts
+	 * its own clients, from its own SO_REUSEPORT listener (Linux only).
+	 */
+	#define WS_BACKEND_SHARDED 2
+	/**
+	 * @brief As @ref WS_BACKEND_SHARDED, but receiving and sending
+	 * through io_uring: multishot accepts and receives, provided
+	 * buffers and linked sends (Linux 6.0+, else falls back to
+	 * @ref WS_BACKEND_SHARDED).
+	 */
+	#define WS_BACKEND_URING   3
 	/**@}*/
 
 	/**
@@ -205,6 +265,12 @@ extern "C" {
 	 * @brief Timeout in milliseconds.
 	 */
 	#define TIMEOUT_MS (500)
+	/**
+	 * @brief How long a send from another thread waits for room
+	 * to a client that is not reading, before giving up (event
+	 * loop backends only, workers never wait).
+	 */
+	#define SEND_TIMEOUT_MS (5000)
 	/**@}*/
 
 	/**
@@ -226,8 +292,8 @@ extern "C" {
 	#define SEND(fd,buf,len) send_all((fd), (buf), (len), MSG_NOSIGNAL)
 	#define RECV(fd,buf,len) recv((fd), (buf), (len), 0)
 	#else
-	#define CLI_SOCK(sock) (fileno(stdout))
-	#define SEND(fd,buf,len) write(fileno(stdout), (buf), (len))
+	#define CLI_SOCK(sock) ((void)(sock), fileno(stdout))
+	#define SEND(fd,buf,len) ((void)(fd), write(fileno(stdout), (buf), (len)))
 	#define RECV(fd,buf,len) read((fd), (buf), (len))
 	#endif
 
@@ -256,13 +322,23 @@ extern "C" {
 	/* Forward declarations. */
 	extern int get_handshake_accept(char *wsKey, unsigned char **dest);
 	extern int get_handshake_response(char *hsrequest, char **hsresponse);
+	extern int get_handshake_protocol(const char *hsrequest,
+		const char *const *protocols);
 	extern char *ws_getaddress(int fd);
+	extern int ws_frame_header(unsigned char *hdr, uint64_t size, int type);
+	extern int ws_sendframe_raw(int fd, const unsigned char *frame,
+		uint64_t size);
 	extern int ws_sendframe(
 		int fd, const char *msg, uint64_t size, bool broadcast, int type);
 	extern int ws_sendframe_txt(int fd, const char *msg, bool broadcast);
 	extern int ws_sendframe_bin(int fd, const char *msg, uint64_t size,
 		bool broadcast);
 	extern int ws_get_state(int fd);
+	extern int ws_get_protocol(int fd);
+	extern void ws_subprotocols(const char *const *protocols);
+	extern void ws_timing(void (*cb)(int event, uint64_t ns, uint64_t bytes));
+	extern int ws_backend(int backend, int workers);
+	extern int ws_max_clients(int max);
 	extern int ws_close_client(int fd);
 	extern int ws_socket(struct ws_events *evs, uint16_t port, int thread_loop);
 
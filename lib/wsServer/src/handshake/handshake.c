@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 /**
  * @dir src/handshake
@@ -122,3 +123,55 @@ int get_handshake_response(char *hsrequest, char **hsresponse)
 	free(accept);
 	return (0);
 }
+
+/**
+ * @brief Picks the subprotocol to be used, among the ones offered
+ * by the client in its Sec-WebSocket-Protocol header(s).
+ *
+ * @param hsrequest Client request, not modified.
+ * @param protocols Subprotocols supported by the server, NULL
+ *                  terminated, may be NULL.
+ *
+ * @return Returns the index, in @p protocols, of the first offered
+ * subprotocol the server supports, or -1 if none.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+int get_handshake_protocol(const char *hsrequest, const char *const *protocols)
+{
+	const char *line; /* Current header line.     */
+	const char *eol;  /* End of the current line. */
+	const char *tok;  /* Current offered value.   */
+	size_t len;       /* Offered value length.    */
+	int i;            /* Loop index.              */
+
+	if (!protocols)
+		return (-1);
+
+	for (line = hsrequest; (eol = strstr(line, "\r\n")) != NULL && eol != line;
+		 line = eol + 2)
+	{
+		if (strncasecmp(line, WS_HS_PROTO ":", sizeof(WS_HS_PROTO)) != 0)
+			continue;
+
+		/* Comma separated list, in client preference order. */
+		for (tok = line + sizeof(WS_HS_PROTO); tok < eol; tok += len + 1)
+		{
+			while (tok < eol && (*tok == ' ' || *tok == '\t'))
+				tok++;
+			for (len = 0; tok + len < eol && tok[len] != ','; len++)
+				;
+			while (len && (tok[len - 1] == ' ' || tok[len - 1] == '\t'))
+				len--;
+
+			for (i = 0; protocols[i]; i++)
+				if (strlen(protocols[i]) == len && !strncmp(protocols[i], tok, len))
+					return (i);
+
+			while (tok + len < eol && tok[len] != ',')
+				len++;
+		}
+	}
+	return (-1);
+}
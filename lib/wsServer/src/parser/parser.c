@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <string.h>
+
+#include <parser.h>
+#include <utf8.h>
+#include <ws.h>
+
+/**
+ * @dir src/parser
+ * @brief Frame parser
+ *
+ * @file parser.c
+ * @brief Resumable WebSocket frame parser: a state machine fed with
+ * the received bytes, in chunks of any size, that triggers events
+ * for headers, payload and complete messages.
+ *
+ * It holds no I/O of its own, so every backend (and the fuzzer,
+ * through ws_file) shares it.
+ */
+
+/**
+ * @brief Checks if a given opcode @p opcode belongs to a
+ * control frame.
+ *
+ * @param opcode Frame opcode.
+ *
+ * @return Returns 1 if is a control frame, 0 otherwise.
+ */
+static inline int is_control(int opcode)
+{
+	return (opcode == WS_FR_OP_CLSE || opcode == WS_FR_OP_PING ||
+		opcode == WS_FR_OP_PONG);
+}
+
+/**
+ * @brief Fails the parsing.
+ *
+ * @param p    Parser.
+ * @param code Close code describing the failure.
+ *
+ * @return Always -1.
+ */
+static int fail(struct ws_parser *p, int code)
+{
+	p->error = code;
+	return (-1);
+}
+
+/**
+ * @brief Triggers an event.
+ *
+ * @param p     Parser.
+ * @param event Event.
+ * @param data  Event data, if any.
+ * @param len   Data length.
+ *
+ * @return Returns 0 to go on, -1 if the callback stopped the parsing.
+ */
+static int emit(struct ws_parser *p, int event, const unsigned char *data, size_t len)
+{
+	if (p->on_event(p, event, data, len))
+	{
+		p->error = 0;
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Initializes the parser @p p.
+ *
+ * @param p        Parser.
+ * @param on_event Event callback.
+ * @param data     User data, for the callback.
+ * @param max_size Max data message size.
+ */
+void ws_parser_init(struct ws_parser *p,
+	int (*on_event)(struct ws_parser *, int, const unsigned char *, size_t),
+	void *data, uint64_t max_size)
+{
+	memset(p, 0, sizeof(*p));
+	p->on_event   = on_event;
+	p->data       = data;
+	p->max_size   = max_size;
+	p->hdr_need   = 2;
+	p->msg_type   = -1;
+	p->utf8_state = UTF8_ACCEPT;
+}
+
+/**
+ * @brief Checks the first two header bytes, and learns the
+ * header length from them.
+ *
+ * @param p Parser.
+ *
+ * @return Returns 0 if valid, -1 otherwise.
+ */
+static int check_start(struct ws_parser *p)
+{
+	int length; /* 7-bit payload length. */
+
+	p->fin    = p->hdr[0] >> WS_FIN_SHIFT;
+	p->opcode = p->hdr[0] & 0xF;
+	length    = p->hdr[1] & 0x7F;
+
+	/*
+	 * Since wsServer do not negotiate extensions if we receive
+	 * a RSV field, we must drop the connection.
+	 */
+	if (p->hdr[0] & 0x70)
+		return (fail(p, WS_CLSE_PROTERR));
+
+	if (p->opcode != WS_FR_OP_CONT && p->opcode != WS_FR_OP_TXT &&
+		p->opcode != WS_FR_OP_BIN && !is_control(p->opcode))
+		return (fail(p, WS_CLSE_PROTERR));
+
+	/* Control frames: FIN and 125 octets at most. */
+	if (is_control(p->opcode) && (!p->fin || length > 125))
+		return (fail(p, WS_CLSE_PROTERR));
+
+	/*
+	 * A CONT frame needs a previous (non-FIN) data frame, and
+	 * a data frame cannot start before the previous message ends.
+	 */
+	if ((p->msg_type == -1 && p->opcode == WS_FR_OP_CONT) ||
+		(p->msg_type != -1 && (p->opcode == WS_FR_OP_TXT ||
+			p->opcode == WS_FR_OP_BIN)))
+		return (fail(p, WS_CLSE_PROTERR));
+
+	/* Clients must mask every frame. */
+	if (!(p->hdr[1] & 0x80))
+		return (fail(p, WS_CLSE_PROTERR));
+
+	p->hdr_need = 2 + 4;
+	if (length == 126)
+		p->hdr_need += 2;
+	else if (length == 127)
+		p->hdr_need += 8;
+	return (0);
+}
+
+/**
+ * @brief Decodes the whole header: length and masks.
+ *
+ * @param p Parser.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int read_header(struct ws_parser *p)
+{
+	size_t masks; /* Masks position. */
+	size_t i;     /* Loop index.     */
+
+	masks        = p->hdr_need - 4;
+	p->frame_len = p->hdr[1] & 0x7F;
+	if (masks > 2)
+	{
+		p->frame_len = 0;
+		for (i = 2; i < masks; i++)
+			p->frame_len = (p->frame_len << 8) | p->hdr[i];
+	}
+
+	/*
+	 * We need to limit the amount supported here, since if
+	 * we follow strictly to the RFC, we have to allow 2^64
+	 * bytes. Also keep in mind that this is still true
+	 * for continuation frames.
+	 */
+	if (!is_control(p->opcode) &&
+		(p->frame_len > p->max_size || p->msg_size + p->frame_len > p->max_size))
+		return (fail(p, WS_CLSE_PROTERR));
+
+	/* Only change the message type if not a CONT frame. */
+	if (p->opcode == WS_FR_OP_TXT || p->opcode == WS_FR_OP_BIN)
+		p->msg_type = p->opcode;
+
+	p->frame_pos = 0;
+	return (emit(p, WS_PARSER_HEADER, NULL, 0));
+}
+
+/**
+ * @brief Handles the payload in @p buf, unmasking it in place.
+ *
+ * @param p   Parser.
+ * @param buf Payload.
+ * @param len Amount of bytes, up to the frame end.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int read_payload(struct ws_parser *p, unsigned char *buf, size_t len)
+{
+	const unsigned char *masks; /* Frame masks. */
+	size_t i;                   /* Loop index.  */
+
+	masks = p->hdr + p->hdr_need - 4;
+	for (i = 0; i < len; i++)
+		buf[i] ^= masks[(p->frame_pos + i) & 3];
+
+	if (is_control(p->opcode))
+	{
+		memcpy(p->ctrl + p->frame_pos, buf, len);
+		p->frame_pos += len;
+		return (0);
+	}
+
+	p->frame_pos += len;
+	p->msg_size += len;
+
+#ifdef VALIDATE_UTF8
+	/* Validate as it comes, any state but reject is fine. */
+	if (p->msg_type == WS_FR_OP_TXT)
+	{
+		p->utf8_state = is_utf8_len_state(buf, len, p->utf8_state);
+		if (p->utf8_state == UTF8_REJECT)
+			return (fail(p, WS_CLSE_INVUTF8));
+	}
+#endif
+
+	return (emit(p, WS_PARSER_PAYLOAD, buf, len));
+}
+
+/**
+ * @brief Ends the current frame: triggers the control frame or
+ * the message complete events, if any.
+ *
+ * @param p Parser.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int end_frame(struct ws_parser *p)
+{
+	p->hdr_len  = 0;
+	p->hdr_need = 2;
+
+	if (is_control(p->opcode))
+	{
+#ifdef VALIDATE_UTF8
+		/* If there is a close reason, check if it is UTF-8 valid. */
+		if (p->opcode == WS_FR_OP_CLSE && p->frame_len > 2 &&
+			!is_utf8_len(p->ctrl + 2, p->frame_len - 2))
+			return (fail(p, WS_CLSE_PROTERR));
+#endif
+		return (emit(p, WS_PARSER_CONTROL, p->ctrl, (size_t)p->frame_len));
+	}
+
+	if (!p->fin)
+		return (0);
+
+#ifdef VALIDATE_UTF8
+	/* A message cannot end in the middle of a character. */
+	if (p->msg_type == WS_FR_OP_TXT && p->utf8_state != UTF8_ACCEPT)
+		return (fail(p, WS_CLSE_INVUTF8));
+#endif
+
+	if (emit(p, WS_PARSER_MESSAGE, NULL, 0) < 0)
+		return (-1);
+
+	p->msg_type   = -1;
+	p->msg_size   = 0;
+	p->utf8_state = UTF8_ACCEPT;
+	return (0);
+}
+
+/**
+ * @brief Parses the next @p len received bytes.
+ *
+ * Frames may be split anywhere between calls, the parser picks up
+ * where it stopped.
+ *
+ * @param p   Parser.
+ * @param buf Received bytes, payload is unmasked in place.
+ * @param len Amount of bytes.
+ *
+ * @return Returns 0 if every byte was parsed, -1 if the parsing
+ * stopped: either the callback asked it (error is 0) or the
+ * frames are invalid (error holds the close code to be sent).
+ *
+ * @note Once it fails, a parser must not be fed again.
+ */
+int ws_parser_feed(struct ws_parser *p, unsigned char *buf, size_t len)
+{
+	uint64_t left; /* Payload left in the frame. */
+	size_t n;      /* Bytes handled.             */
+
+	while (len)
+	{
+		/* Header, byte by byte as it may be split. */
+		if (p->hdr_len < p->hdr_need)
+		{
+			n = p->hdr_need - p->hdr_len;
+			if (n > len)
+				n = len;
+
+			memcpy(p->hdr + p->hdr_len, buf, n);
+			p->hdr_len += n;
+			buf += n;
+			len -= n;
+
+			if (p->hdr_len < p->hdr_need)
+				continue;
+			if (p->hdr_need == 2)
+			{
+				if (check_start(p) < 0)
+					return (-1);
+				continue;
+			}
+			if (read_header(p) < 0)
+				return (-1);
+			if (!p->frame_len && end_frame(p) < 0)
+				return (-1);
+			continue;
+		}
+
+		/* Payload. */
+		left = p->frame_len - p->frame_pos;
+		n    = left < len ? (size_t)left : len;
+
+		if (read_payload(p, buf, n) < 0)
+			return (-1);
+		buf += n;
+		len -= n;
+
+		if (p->frame_pos == p->frame_len && end_frame(p) < 0)
+			return (-1);
+	}
+	return (0);
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* syscall(). */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uring.h>
+
+/**
+ * @dir src/uring
+ * @brief io_uring
+ *
+ * @file uring.c
+ * @brief Sets io_uring instances up and drives their queues, with
+ * the raw system calls: no liburing needed.
+ *
+ * Built empty where io_uring (or recent enough headers) is missing,
+ * see @ref WS_HAVE_URING.
+ */
+
+#ifdef WS_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @brief io_uring_setup(2).
+ */
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+/**
+ * @brief io_uring_enter(2).
+ */
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return ((int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0));
+}
+
+/**
+ * @brief io_uring_register(2).
+ */
+static int sys_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+	return ((int)syscall(__NR_io_uring_register, fd, op, arg, nargs));
+}
+
+/**
+ * @brief Sets an io_uring instance up, and registers its
+ * provided buffers.
+ *
+ * @param r         Ring.
+ * @param entries   Submission queue entries.
+ * @param buf_count Amount of receive buffers, a power of two.
+ * @param buf_size  Size of each one.
+ *
+ * @return Returns 0 if success, -1 if io_uring, or one of the
+ * features needed, is not available.
+ */
+int ws_uring_init(struct ws_uring *r, unsigned entries,
+	unsigned buf_count, unsigned buf_size)
+{
+	struct io_uring_buf_reg reg;
+	struct io_uring_params p;
+	unsigned char *ring;
+	unsigned *array;
+	unsigned i;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	/*
+	 * Completions are only ever reaped by the thread waiting for
+	 * them: let the kernel defer its work until then (Linux 6.1).
+	 */
+	memset(&p, 0, sizeof(p));
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+	if ((r->fd = sys_setup(entries, &p)) < 0 && errno == EINVAL)
+	{
+		memset(&p, 0, sizeof(p));
+		r->fd = sys_setup(entries, &p);
+	}
+	if (r->fd < 0)
+		return (-1);
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+		!(p.features & IORING_FEAT_NODROP))
+		goto fail;
+
+	/* SQ and CQ rings share a mapping. */
+	r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		r->fd, IORING_OFF_SQ_RING);
+	if (r->ring == MAP_FAILED)
+	{
+		r->ring = NULL;
+		goto fail;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+	{
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	ring          = r->ring;
+	r->sq_head    = (unsigned *)(ring + p.sq_off.head);
+	r->sq_tail    = (unsigned *)(ring + p.sq_off.tail);
+	r->sq_mask    = *(unsigned *)(ring + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local   = *r->sq_tail;
+	r->cq_head    = (unsigned *)(ring + p.cq_off.head);
+	r->cq_tail    = (unsigned *)(ring + p.cq_off.tail);
+	r->cq_mask    = *(unsigned *)(ring + p.cq_off.ring_mask);
+	r->cqes       = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/* Entry i always sits at index i. */
+	array = (unsigned *)(ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	/* Provided buffers: the kernel picks one as data arrives. */
+	r->buf_count = buf_count;
+	r->buf_size  = buf_size;
+	r->br = mmap(NULL, buf_count * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED)
+	{
+		r->br = NULL;
+		goto fail;
+	}
+	if (!(r->bufs = malloc((size_t)buf_count * buf_size)))
+		goto fail;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t)(uintptr_t)r->br;
+	reg.ring_entries = buf_count;
+	reg.bgid         = WS_URING_BGID;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+
+	for (i = 0; i < buf_count; i++)
+		ws_uring_buf_put(r, i);
+
+	return (0);
+
+fail:
+	ws_uring_free(r);
+	return (-1);
+}
+
+/**
+ * @brief Releases an io_uring instance.
+ *
+ * @param r Ring.
+ */
+void ws_uring_free(struct ws_uring *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->ring)
+		munmap(r->ring, r->ring_size);
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->br)
+		munmap(r->br, r->buf_count * sizeof(struct io_uring_buf));
+	free(r->bufs);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/**
+ * @brief Returns the amount of free submission queue entries.
+ *
+ * @param r Ring.
+ */
+unsigned ws_uring_sq_space(struct ws_uring *r)
+{
+	return (r->sq_entries -
+		(r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)));
+}
+
+/**
+ * @brief Returns a cleared submission queue entry, submitting
+ * the queued ones first if full.
+ *
+ * @param r Ring.
+ *
+ * @return Returns the entry, or NULL if the ring failed.
+ */
+struct io_uring_sqe *ws_uring_sqe(struct ws_uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!ws_uring_sq_space(r) &&
+		(ws_uring_submit(r, 0) < 0 || !ws_uring_sq_space(r)))
+		return (NULL);
+
+	sqe = &r->sqes[r->sq_local & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_local++;
+	return (sqe);
+}
+
+/**
+ * @brief Submits the queued entries and, if @p wait, waits for
+ * that many completions; all in a single system call.
+ *
+ * @param r    Ring.
+ * @param wait Completions to wait for.
+ *
+ * @return Returns 0 if success (or interrupted), -1 if the
+ * ring failed.
+ */
+int ws_uring_submit(struct ws_uring *r, unsigned wait)
+{
+	unsigned submit;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	submit = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	if (sys_enter(r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0) < 0 &&
+		errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		return (-1);
+	return (0);
+}
+
+/**
+ * @brief Returns the next completion, if any, to be released
+ * with @ref ws_uring_cqe_seen.
+ *
+ * @param r Ring.
+ */
+struct io_uring_cqe *ws_uring_cqe(struct ws_uring *r)
+{
+	unsigned head;
+
+	head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+	return (&r->cqes[head & r->cq_mask]);
+}
+
+/**
+ * @brief Releases the completion returned by @ref ws_uring_cqe.
+ *
+ * @param r Ring.
+ */
+void ws_uring_cqe_seen(struct ws_uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns the data of the provided buffer @p bid.
+ *
+ * @param r   Ring.
+ * @param bid Buffer id, from the completion flags.
+ */
+unsigned char *ws_uring_buf(struct ws_uring *r, unsigned bid)
+{
+	return (r->bufs + (size_t)bid * r->buf_size);
+}
+
+/**
+ * @brief Gives the provided buffer @p bid back to the kernel.
+ *
+ * @param r   Ring.
+ * @param bid Buffer id.
+ */
+void ws_uring_buf_put(struct ws_uring *r, unsigned bid)
+{
+	struct io_uring_buf *buf;
+
+	buf       = &r->br->bufs[r->br_tail & (r->buf_count - 1)];
+	buf->addr = (uint64_t)(uintptr_t)ws_uring_buf(r, bid);
+	buf->len  = r->buf_size;
+	buf->bid  = (uint16_t)bid;
+
+	r->br_tail++;
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+#endif
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* SO_REUSEPORT. */
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -31,6 +32,10 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -47,7 +52,8 @@ typedef int socklen_t;
 #include <unistd.h>
 
 #include <ws.h>
-#include <utf8.h>
+#include <parser.h>
+#include <uring.h>
 
 /**
  * @dir src/
@@ -93,6 +99,37 @@ struct ws_accept
  */
 struct ws_port ports[MAX_PORTS];
 
+/**
+ * @brief WebSocket frame data
+ */
+struct ws_frame_data
+{
+	/**
+	 * @brief Frame parser, resumes where the previous bytes left it.
+	 */
+	struct ws_parser parser;
+	/**
+	 * @brief Message being received.
+	 */
+	unsigned char *msg;
+	/**
+	 * @brief Message length.
+	 */
+	uint64_t msg_len;
+	/**
+	 * @brief Allocated message size.
+	 */
+	uint64_t msg_size;
+	/**
+	 * @brief Client socket file descriptor.
+	 */
+	int sock;
+	/**
+	 * @brief Client connection index.
+	 */
+	int idx;
+};
+
 /**
  * @brief Client socks.
  */
@@ -101,67 +138,275 @@ struct ws_connection
 	int client_sock; /**< Client socket FD.        */
 	int port_index;  /**< Index in the port list.  */
 	int state;       /**< WebSocket current state. */
+	int protocol;    /**< Negotiated subprotocol.  */
+
+	/* Frame data, parser state included. */
+	struct ws_frame_data wfd;
 
 	/* Timeout thread and locks. */
 	pthread_mutex_t mtx_state;
+	pthread_mutex_t mtx_snd;
 	pthread_cond_t cnd_state_close;
+	pthread_cond_t cnd_snd;
 	pthread_t thrd_tout;
 	bool close_thrd;
+
+	/* Event loop backends: handshake request received so far. */
+	unsigned char *in;
+	size_t in_len;
+
+	/* Event loop backends: owner worker. */
+	struct ws_worker *worker;
+
+	/* epoll backends: output the socket did not take yet, see
+	 * @ref ep_send. */
+	unsigned char *out;
+	size_t out_off;  /* Already sent.   */
+	size_t out_len;  /* Queued so far.  */
+	size_t out_size; /* Allocated size. */
+
+	/* Sharded backends: links in the shard of the worker. */
+	struct ws_connection *prev;
+	struct ws_connection *next;
+
+	/* io_uring backend: sends, see @ref ur_send. */
+	struct ur_send *snd_head;    /* Queued, not yet submitted.  */
+	struct ur_send *snd_tail;
+	int snd_inflight;            /* Submitted, not completed.   */
+	size_t snd_bytes;            /* Bytes of every send not yet
+	                                released, inbox included.   */
+	int snd_waiters;             /* Senders waiting for room.   */
+	bool ur_closing;             /* Input is over.              */
+	bool ur_recv_done;           /* Receive request ended.      */
+	bool ur_dirty;               /* In the worker dirty list.   */
+	struct ws_connection *dirty; /* Next in the dirty list.     */
 };
 
 /**
- * @brief Clients list.
+ * @name Connection table
+ *
+ * Connections are indexed by their fd, in chunks of
+ * @ref CONN_CHUNK slots allocated as the fds grow. A chunk is
+ * never freed nor moved, so finding a client is two loads and
+ * takes no lock.
+ */
+/**@{*/
+/**
+ * @brief Bits of the slot index within a chunk.
+ */
+#define CONN_CHUNK_BITS 8
+/**
+ * @brief Connections per chunk.
+ */
+#define CONN_CHUNK (1 << CONN_CHUNK_BITS)
+/**
+ * @brief Amount of chunks, enough for @ref MAX_CLIENT_FD fds.
+ */
+#define CONN_CHUNKS (MAX_CLIENT_FD / CONN_CHUNK)
+/**@}*/
+
+/**
+ * @brief Clients list, indexed by fd, see @ref conn_at.
  */
-struct ws_connection client_socks[MAX_CLIENTS];
+static struct ws_connection *client_socks[CONN_CHUNKS];
 
 /**
- * @brief WebSocket frame data
+ * @brief Max clients, and clients currently connected,
+ * see @ref ws_max_clients.
  */
-struct ws_frame_data
-{
-	/**
-	 * @brief Frame read.
-	 */
-	unsigned char frm[MESSAGE_LENGTH];
-	/**
-	 * @brief Processed message at the moment.
-	 */
-	unsigned char *msg;
-	/**
-	 * @brief Control frame payload
-	 */
-	unsigned char msg_ctrl[125];
-	/**
-	 * @brief Current byte position.
-	 */
-	size_t cur_pos;
-	/**
-	 * @brief Amount of read bytes.
-	 */
-	size_t amt_read;
-	/**
-	 * @brief Frame type, like text or binary.
-	 */
-	int frame_type;
-	/**
-	 * @brief Frame size.
-	 */
-	uint64_t frame_size;
-	/**
-	 * @brief Error flag, set when a read was not possible.
-	 */
-	int error;
-	/**
-	 * @brief Client socket file descriptor.
-	 */
-	int sock;
-};
+static int max_clients = MAX_CLIENTS;
+static int nclients;
 
 /**
  * @brief Global mutex.
  */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+ * @brief Subprotocols supported by the server, NULL terminated,
+ * see @ref ws_subprotocols.
+ */
+static const char *const *subprotocols;
+
+/**
+ * @brief Timing callback, see @ref ws_timing.
+ */
+static void (*timing_cb)(int event, uint64_t ns, uint64_t bytes);
+
+/**
+ * @brief I/O backend, see @ref ws_backend.
+ */
+static int io_backend = WS_BACKEND_THREADS;
+
+#ifdef __linux__
+/**
+ * @brief Max events handled per epoll_wait() call.
+ */
+#define EP_EVENTS 64
+
+/**
+ * @brief Amount of bytes a worker reads at once.
+ */
+#define EP_READ_SIZE (64 * 1024)
+
+/**
+ * @brief Bytes a client of the epoll backends may have queued (not
+ * yet taken by its socket) before other threads wait for room, as a
+ * blocking send would; and before a worker, that cannot wait, drops
+ * the client. See @ref ep_send.
+ */
+#define EP_SEND_MAX  (1 << 20)
+#define EP_SEND_HARD (16 << 20)
+
+/**
+ * @name epoll tags of the events that are not from a client,
+ * whose tag is its fd.
+ */
+/**@{*/
+/**
+ * @brief A listener is readable, the port index is in the low bits.
+ */
+#define EP_LISTEN 0x80000000u
+/**
+ * @brief Broadcasts were queued for the worker.
+ */
+#define EP_WAKE   0x40000000u
+/**@}*/
+
+/**
+ * @brief Link of a broadcast in the queue of a worker.
+ */
+struct ws_bcast_link
+{
+	struct ws_bcast_link *next; /**< Next in the queue. */
+	struct ws_bcast *msg;       /**< Broadcast.         */
+};
+
+/**
+ * @brief A broadcast frame, shared by every worker, each one
+ * sending it to the clients of its own shard.
+ */
+struct ws_bcast
+{
+	int refs;                    /**< Workers yet to send it,
+	                                  and sends in flight.     */
+	int fd;                      /**< Sender, skipped.         */
+	int port_index;              /**< Port of the receivers.   */
+	size_t len;                  /**< Frame length.            */
+	unsigned char *frame;        /**< Frame, after the links.  */
+	struct ws_bcast_link link[]; /**< One per worker.          */
+};
+
+/**
+ * @brief Event loop worker, see @ref ws_backend.
+ */
+struct ws_worker
+{
+	int epfd;                         /**< epoll instance.          */
+	pthread_t thread;                 /**< Worker thread.           */
+	unsigned char buf[EP_READ_SIZE];  /**< Read buffer.             */
+
+	/* Sharded backends only. */
+	int listen_fd[MAX_PORTS];         /**< Listener, per port.      */
+	int evfd;                         /**< Wakes for broadcasts.    */
+	struct ws_bcast_link *bcast;      /**< Queued broadcasts, LIFO. */
+	struct ws_connection *conns;      /**< Shard: its clients.      */
+
+#ifdef WS_HAVE_URING
+	/* io_uring backend only. */
+	struct ws_uring ring;             /**< Its io_uring.            */
+	uint64_t evbuf;                   /**< Eventfd read target.     */
+	struct ur_send *inbox;            /**< Sends from other threads,
+	                                       LIFO.                    */
+	struct ws_connection *dirty;      /**< Clients with sends to
+	                                       submit, or to finish.    */
+	unsigned armed;                   /**< Listeners accepting,
+	                                       bitmask of ports.        */
+	struct __kernel_timespec backoff; /**< Accept retry delay.      */
+#endif
+};
+
+/**
+ * @brief Event loop workers.
+ */
+static struct ws_worker *ep_workers;
+
+/**
+ * @brief Amount of workers, and the next one to get a connection.
+ */
+static int ep_nworkers;
+static unsigned ep_next;
+
+/**
+ * @brief Worker of the calling thread, if any.
+ */
+static pthread_key_t ep_key;
+
+#ifdef WS_HAVE_URING
+/**
+ * @name io_uring backend
+ */
+/**@{*/
+/**
+ * @brief Submission queue entries, per worker.
+ */
+#define UR_ENTRIES 4096
+/**
+ * @brief Provided receive buffers, per worker, and their size.
+ */
+#define UR_BUFS 512
+#define UR_BUF_SIZE (8 * 1024)
+/**
+ * @brief Longest chain of linked sends submitted at once.
+ */
+#define UR_CHAIN 64
+/**
+ * @brief Bytes a client may have queued (not yet sent) before
+ * other threads wait for room, as they would wait for a full
+ * socket with epoll; and before a worker, that cannot wait, drops
+ * the client.
+ */
+#define UR_SEND_MAX  (1 << 20)
+#define UR_SEND_HARD (16 << 20)
+/**
+ * @brief Delay (ms) before accepting again, once an accept failed,
+ * e.g: out of fds.
+ */
+#define UR_BACKOFF_MS 100
+/**
+ * @brief Request types, in the low bits of the user data; the
+ * rest is the client fd, the port index or the send.
+ */
+#define UR_RECV   0
+#define UR_ACCEPT 1
+#define UR_SEND   2
+#define UR_WAKE   3
+#define UR_CANCEL 4
+#define UR_RETRY  5
+#define UR_TYPE   7
+#define UR_SHIFT  3
+/**@}*/
+
+/**
+ * @brief A send to an io_uring client: submitted by its worker,
+ * linked after the previous ones, so they go out in order.
+ */
+struct ur_send
+{
+	struct ur_send *next;       /**< Next queued send.         */
+	int fd;                     /**< Client.                   */
+	size_t len;                 /**< Data length.              */
+	const unsigned char *data;  /**< Data: buf, or msg frame.  */
+	struct ws_bcast *msg;       /**< Broadcast sent, if any.   */
+	uint64_t start;             /**< Queued at (ns), if timed. */
+	unsigned char buf[];        /**< Data copy.                */
+};
+
+static ssize_t ur_send(int idx, const void *buf, size_t len,
+	struct ws_bcast *msg);
+#endif
+#endif
+
 /**
  * @brief Issues an error message and aborts the program.
  *
@@ -224,6 +469,20 @@ static ssize_t send_all(int sockfd, const void *buf, size_t len, int flags)
 	return (0);
 }
 
+/**
+ * @brief Returns the connection slot of the client @p idx.
+ *
+ * @param idx Client index, i.e: its fd, already known to be
+ *            in the table.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static inline struct ws_connection *conn_at(int idx)
+{
+	return (&client_socks[idx >> CONN_CHUNK_BITS][idx & (CONN_CHUNK - 1)]);
+}
+
 /**
  * @brief For a given client @p fd, returns its
  * client index if exists, or -1 otherwise.
@@ -233,179 +492,523 @@ static ssize_t send_all(int sockfd, const void *buf, size_t len, int flags)
  * @return Return the client index or -1 if invalid
  * fd.
  *
+ * @note Lock-free: a connection is published by storing its
+ * fd in its slot, which happens last.
+ *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
 static int get_client_index(int fd)
 {
-	int i;
-	pthread_mutex_lock(&mutex);
-	for (i = 0; i < MAX_CLIENTS; i++)
-		if (client_socks[i].client_sock == fd)
-			break;
-	pthread_mutex_unlock(&mutex);
-	return (i == MAX_CLIENTS ? -1 : i);
+	struct ws_connection *chunk;
+
+	if (fd < 0 || fd >= MAX_CLIENT_FD)
+		return (-1);
+
+	chunk = __atomic_load_n(&client_socks[fd >> CONN_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	if (!chunk ||
+		__atomic_load_n(&chunk[fd & (CONN_CHUNK - 1)].client_sock,
+			__ATOMIC_ACQUIRE) != fd)
+		return (-1);
+
+	return (fd);
 }
 
 /**
- * @brief Returns the current client state for a given
- * client @p idx.
+ * @brief Allocates the chunk @p c of the connection table,
+ * if not yet there.
  *
- * @param idx Client index.
+ * @param c Chunk index.
  *
- * @return Returns the client state, -1 otherwise.
+ * @return Returns 0 if success, -1 if out of memory.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int get_client_state(int idx)
+static int alloc_chunk(int c)
 {
-	int state;
+	struct ws_connection *chunk;
+	int i;
 
-	if (idx < 0 || idx >= MAX_CLIENTS)
+	pthread_mutex_lock(&mutex);
+	if (client_socks[c])
+		goto out;
+
+	chunk = calloc(CONN_CHUNK, sizeof(*chunk));
+	if (!chunk)
+	{
+		pthread_mutex_unlock(&mutex);
 		return (-1);
+	}
 
-	pthread_mutex_lock(&client_socks[idx].mtx_state);
-	state = client_socks[idx].state;
-	pthread_mutex_unlock(&client_socks[idx].mtx_state);
-	return (state);
+	/* Slots live as long as the table: so do their locks. */
+	for (i = 0; i < CONN_CHUNK; i++)
+	{
+		chunk[i].client_sock = -1;
+		if (pthread_mutex_init(&chunk[i].mtx_state, NULL))
+			panic("Error on allocating close mutex");
+		if (pthread_mutex_init(&chunk[i].mtx_snd, NULL))
+			panic("Error on allocating send mutex");
+		if (pthread_cond_init(&chunk[i].cnd_state_close, NULL))
+			panic("Error on allocating condition var\n");
+		if (pthread_cond_init(&chunk[i].cnd_snd, NULL))
+			panic("Error on allocating condition var\n");
+	}
+	__atomic_store_n(&client_socks[c], chunk, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&mutex);
+	return (0);
 }
 
 /**
- * @brief Set a state @p state to the client index
- * @p idx.
+ * @brief Monotonic time (ns), for @ref timing_cb.
  *
- * @param idx Client index.
- * @param state State to be set.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/**
+ * @brief Sends @p len bytes to @p fd and, if timing is enabled,
+ * reports how long it took.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @param fd  Client fd.
+ * @param buf Data to be sent.
+ * @param len Amount of bytes.
+ *
+ * @return Returns the same as SEND: -1 if error.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int set_client_state(int idx, int state)
+static ssize_t send_timed(int fd, const void *buf, size_t len)
 {
-	if (idx < 0 || idx >= MAX_CLIENTS)
-		return (-1);
+	uint64_t start;
+	ssize_t ret;
 
-	if (state < 0 || state > 3)
-		return (-1);
+	if (!timing_cb)
+		return (SEND(fd, buf, len));
 
-	pthread_mutex_lock(&client_socks[idx].mtx_state);
-	client_socks[idx].state = state;
-	pthread_mutex_unlock(&client_socks[idx].mtx_state);
-	return (0);
+	start = now_ns();
+	ret   = SEND(fd, buf, len);
+	timing_cb(WS_TIMING_SEND, now_ns() - start, ret != -1 ? (uint64_t)len : 0);
+	return (ret);
 }
 
+#ifdef __linux__
 /**
- * @brief Close client connection (no close handshake, this should
- * be done earlier), set appropriate state and destroy mutexes.
+ * @brief Watches the client @p idx for room to send, or stops
+ * watching it, see @ref ep_send.
+ *
+ * @param conn Client connection.
+ * @param idx  Client index.
+ * @param out  Whether to watch for room.
+ *
+ * @return Returns 0 if success, -1 otherwise.
  *
- * @param conn_idx Connection index, -1 if should use @p fd.
- * @param fd Optional fd parameter, used when there is no
- *           @p conn_idx.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-static void close_client(int conn_idx, int fd)
+static int ep_arm(struct ws_connection *conn, int idx, bool out)
 {
-	if (conn_idx == -1)
-		conn_idx = get_client_index(fd);
-
-	set_client_state(conn_idx, WS_STATE_CLOSED);
-
-	close_socket(client_socks[conn_idx].client_sock);
+	struct epoll_event ev; /* Watched events. */
 
-	/* Destroy client mutexes and clear fd 'slot'. */
-	pthread_mutex_lock(&mutex);
-		client_socks[conn_idx].client_sock = -1;
-		pthread_cond_destroy(&client_socks[conn_idx].cnd_state_close);
-		pthread_mutex_destroy(&client_socks[conn_idx].mtx_state);
-	pthread_mutex_unlock(&mutex);
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLET | (out ? EPOLLOUT : 0);
+	ev.data.u32 = (uint32_t)idx;
+	return (epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, idx, &ev));
 }
 
 /**
- * @brief Close time-out thread.
+ * @brief Waits until @p len more bytes fit in the output queue of
+ * the client @p idx, see @ref EP_SEND_MAX, for at most
+ * @ref SEND_TIMEOUT_MS milliseconds.
  *
- * For a given client, this routine sleeps until
- * TIMEOUT_MS and closes the connection or returns
- * sooner if already closed connection.
+ * Workers do not wait: they queue up to @ref EP_SEND_HARD bytes,
+ * and drop the client past that.
  *
- * @param p ws_connection Structure Pointer.
+ * @param conn Client connection, its send lock held.
+ * @param idx  Client index.
+ * @param len  Amount of bytes.
  *
- * @return Always NULL.
+ * @return Returns 0 if there is room, -1 if timed out, dropped or
+ * the client is gone.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static void *close_timeout(void *p)
+static int ep_wait_room(struct ws_connection *conn, int idx, size_t len)
 {
-	struct ws_connection *conn = p;
-	struct timespec ts;
-	int state;
+	struct timespec ts; /* Deadline.    */
+	int ret;            /* Wait result. */
 
-	pthread_mutex_lock(&conn->mtx_state);
+	if (pthread_getspecific(ep_key))
+	{
+		if (conn->out_len - conn->out_off + len <= EP_SEND_HARD)
+			return (0);
 
-	clock_gettime(CLOCK_REALTIME, &ts);
-	ts.tv_nsec += MS_TO_NS(TIMEOUT_MS);
+		/* Its worker sees the hang up, and finishes it. */
+		DEBUG("Client %d is not reading, dropping it\n", idx);
+		shutdown(idx, SHUT_RDWR);
+		errno = EAGAIN;
+		return (-1);
+	}
 
-	/* Normalize the time. */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += SEND_TIMEOUT_MS / 1000;
+	ts.tv_nsec += MS_TO_NS(SEND_TIMEOUT_MS % 1000);
 	while (ts.tv_nsec >= 1000000000)
 	{
 		ts.tv_sec++;
 		ts.tv_nsec -= 1000000000;
 	}
 
-	while (conn->state != WS_STATE_CLOSED &&
-		   pthread_cond_timedwait(&conn->cnd_state_close, &conn->mtx_state, &ts) !=
-			   ETIMEDOUT)
-		;
-
-	state = conn->state;
-	pthread_mutex_unlock(&conn->mtx_state);
-
-	/* If already closed. */
-	if (state == WS_STATE_CLOSED)
-		goto quit;
-
-	DEBUG("Timer expired, closing client %d\n", conn->client_sock);
+	/* A single send always fits. */
+	ret = 0;
+	while (conn->out_len > conn->out_off &&
+		conn->out_len - conn->out_off + len > EP_SEND_MAX &&
+		__atomic_load_n(&conn->client_sock, __ATOMIC_RELAXED) == idx && !ret)
+	{
+		ret = pthread_cond_timedwait(&conn->cnd_snd, &conn->mtx_snd, &ts);
+	}
 
-	close_client(-1, conn->client_sock);
-quit:
-	return (NULL);
+	if (__atomic_load_n(&conn->client_sock, __ATOMIC_RELAXED) != idx)
+		return (-1);
+	if (conn->out_len > conn->out_off &&
+		conn->out_len - conn->out_off + len > EP_SEND_MAX)
+	{
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (0);
 }
 
 /**
- * @brief For a valid client index @p idx, starts
- * the timeout thread and set the current state
- * to 'CLOSING'.
+ * @brief Sends @p len bytes to the client @p idx of the epoll
+ * backends, without blocking: what its socket does not take now is
+ * queued, and sent by its worker once there is room, see
+ * @ref ep_flush.
  *
- * @param idx Client index.
+ * @param conn Client connection, its send lock held.
+ * @param idx  Client index.
+ * @param buf  Data to be sent.
+ * @param len  Amount of bytes.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Returns the amount of bytes sent or queued, -1 if error.
+ *
+ * @note Queues are not unbounded, see @ref ep_wait_room.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int start_close_timeout(int idx)
+static ssize_t ep_send(
+	struct ws_connection *conn, int idx, const void *buf, size_t len)
 {
-	if (idx < 0 || idx >= MAX_CLIENTS)
+	const unsigned char *p; /* Bytes left.      */
+	unsigned char *tmp;     /* Grown queue.     */
+	uint64_t start;         /* Send start (ns). */
+	size_t size;            /* Queue size.      */
+	size_t left;            /* Amount left.     */
+	ssize_t n;              /* Sent bytes.      */
+	bool empty;             /* Nothing queued.  */
+
+	start = timing_cb ? now_ns() : 0;
+	if (conn->out_len - conn->out_off + len > EP_SEND_MAX &&
+		ep_wait_room(conn, idx, len) < 0)
 		return (-1);
 
-	pthread_mutex_lock(&client_socks[idx].mtx_state);
-
-	if (client_socks[idx].state != WS_STATE_OPEN)
-		goto out;
-
-	client_socks[idx].state = WS_STATE_CLOSING;
-
-	if (pthread_create(
-			&client_socks[idx].thrd_tout, NULL, close_timeout, &client_socks[idx]))
+	/* Straight to the socket, unless behind queued bytes. */
+	p    = buf;
+	left = len;
+	while (left && conn->out_off == conn->out_len)
 	{
-		pthread_mutex_unlock(&client_socks[idx].mtx_state);
-		panic("Unable to create timeout thread\n");
+		n = send(idx, p, left, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0)
+			return (-1);
+		p    += n;
+		left -= (size_t)n;
 	}
-	client_socks[idx].close_thrd = true;
+
+	if (left)
+	{
+		/* Sent bytes make room first. */
+		empty = conn->out_off == conn->out_len;
+		memmove(conn->out, conn->out + conn->out_off,
+			conn->out_len - conn->out_off);
+		conn->out_len -= conn->out_off;
+		conn->out_off  = 0;
+
+		if (conn->out_len + left > conn->out_size)
+		{
+			size = conn->out_size ? conn->out_size : EP_READ_SIZE;
+			while (size < conn->out_len + left)
+				size *= 2;
+			if (!(tmp = realloc(conn->out, size)))
+				return (-1);
+			conn->out      = tmp;
+			conn->out_size = size;
+		}
+
+		if (empty && ep_arm(conn, idx, true) < 0)
+			return (-1);
+		memcpy(conn->out + conn->out_len, p, left);
+		conn->out_len += left;
+	}
+
+	if (timing_cb)
+		timing_cb(WS_TIMING_SEND, now_ns() - start, (uint64_t)len);
+	return ((ssize_t)len);
+}
+#endif
+
+/**
+ * @brief Sends @p len bytes to the client @p idx, its send lock
+ * held: queued by the epoll backends, see @ref ep_send.
+ *
+ * @param idx Client index.
+ * @param buf Data to be sent.
+ * @param len Amount of bytes.
+ *
+ * @return Returns the amount of bytes sent, -1 if error.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static ssize_t conn_send(int idx, const void *buf, size_t len)
+{
+#ifdef __linux__
+	if (io_backend == WS_BACKEND_EPOLL || io_backend == WS_BACKEND_SHARDED)
+		return (ep_send(conn_at(idx), idx, buf, len));
+#endif
+	return (send_timed(idx, buf, len));
+}
+
+/**
+ * @brief Sends @p len bytes to the client @p fd while holding
+ * its send lock, so that frames sent by different threads
+ * (e.g: the client thread and a broadcaster) are never
+ * interleaved on the wire.
+ *
+ * @param fd  Client fd.
+ * @param buf Data to be sent.
+ * @param len Amount of bytes.
+ *
+ * @return Returns the amount of bytes sent, -1 if error.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static ssize_t send_locked(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+	int idx;
+
+	if ((idx = get_client_index(fd)) == -1)
+		return (send_timed(fd, buf, len));
+
+#ifdef WS_HAVE_URING
+	/* Submitted, in order, by the worker of the client. */
+	if (io_backend == WS_BACKEND_URING)
+		return (ur_send(idx, buf, len, NULL));
+#endif
+
+	/* The client may be gone meanwhile, its fd reused. */
+	pthread_mutex_lock(&conn_at(idx)->mtx_snd);
+	ret = -1;
+	if (__atomic_load_n(&conn_at(idx)->client_sock, __ATOMIC_RELAXED) == fd)
+		ret = conn_send(fd, buf, len);
+	pthread_mutex_unlock(&conn_at(idx)->mtx_snd);
+	return (ret);
+}
+
+/**
+ * @brief Returns the current client state for a given
+ * client @p idx.
+ *
+ * @param idx Client index.
+ *
+ * @return Returns the client state, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int get_client_state(int idx)
+{
+	int state;
+
+	if (idx < 0 || idx >= MAX_CLIENT_FD)
+		return (-1);
+
+	pthread_mutex_lock(&conn_at(idx)->mtx_state);
+	state = conn_at(idx)->state;
+	pthread_mutex_unlock(&conn_at(idx)->mtx_state);
+	return (state);
+}
+
+/**
+ * @brief Set a state @p state to the client index
+ * @p idx.
+ *
+ * @param idx Client index.
+ * @param state State to be set.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int set_client_state(int idx, int state)
+{
+	if (idx < 0 || idx >= MAX_CLIENT_FD)
+		return (-1);
+
+	if (state < 0 || state > 3)
+		return (-1);
+
+	pthread_mutex_lock(&conn_at(idx)->mtx_state);
+	conn_at(idx)->state = state;
+	pthread_mutex_unlock(&conn_at(idx)->mtx_state);
+	return (0);
+}
+
+/**
+ * @brief Close client connection (no close handshake, this should
+ * be done earlier), set appropriate state and free its slot.
+ *
+ * @param idx Connection index.
+ */
+static void close_client(int idx)
+{
+	struct ws_connection *conn = conn_at(idx);
+
+	set_client_state(idx, WS_STATE_CLOSED);
+
+	/*
+	 * Clear the fd 'slot' before the fd can be reused, and while
+	 * holding the send lock: a concurrent sender either sends
+	 * before this, or sees the slot empty.
+	 */
+	pthread_mutex_lock(&conn->mtx_snd);
+		__atomic_store_n(&conn->client_sock, -1, __ATOMIC_RELEASE);
+#ifdef __linux__
+		/* Queued output: whatever the socket still takes, e.g: a close frame. */
+		if (conn->out_off < conn->out_len)
+			send(idx, conn->out + conn->out_off, conn->out_len - conn->out_off,
+				MSG_NOSIGNAL);
+#endif
+		free(conn->out);
+		conn->out      = NULL;
+		conn->out_off  = 0;
+		conn->out_len  = 0;
+		conn->out_size = 0;
+		close_socket(idx);
+		pthread_cond_broadcast(&conn->cnd_snd);
+	pthread_mutex_unlock(&conn->mtx_snd);
+
+	__atomic_sub_fetch(&nclients, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Close time-out thread.
+ *
+ * For a given client, this routine sleeps until
+ * TIMEOUT_MS and shuts the connection down or returns
+ * sooner if already closed connection.
+ *
+ * @param p ws_connection Structure Pointer.
+ *
+ * @return Always NULL.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void *close_timeout(void *p)
+{
+	struct ws_connection *conn = p;
+	struct timespec ts;
+	int state;
+
+	pthread_mutex_lock(&conn->mtx_state);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += MS_TO_NS(TIMEOUT_MS);
+
+	/* Normalize the time. */
+	while (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while (conn->state != WS_STATE_CLOSED &&
+		   pthread_cond_timedwait(&conn->cnd_state_close, &conn->mtx_state, &ts) !=
+			   ETIMEDOUT)
+		;
+
+	state = conn->state;
+	pthread_mutex_unlock(&conn->mtx_state);
+
+	/* If already closed. */
+	if (state == WS_STATE_CLOSED)
+		goto quit;
+
+	DEBUG("Timer expired, closing client %d\n", conn->client_sock);
+
+	/*
+	 * Only shut the socket down: the thread that owns the connection
+	 * sees a disconnection and releases it, as for any other.
+	 */
+#ifndef _WIN32
+	shutdown(conn->client_sock, SHUT_RDWR);
+#else
+	shutdown(conn->client_sock, SD_BOTH);
+#endif
+quit:
+	return (NULL);
+}
+
+/**
+ * @brief For a valid client index @p idx, starts
+ * the timeout thread and set the current state
+ * to 'CLOSING'.
+ *
+ * @param idx Client index.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int start_close_timeout(int idx)
+{
+	if (idx < 0 || idx >= MAX_CLIENT_FD)
+		return (-1);
+
+	pthread_mutex_lock(&conn_at(idx)->mtx_state);
+
+	if (conn_at(idx)->state != WS_STATE_OPEN)
+		goto out;
+
+	conn_at(idx)->state = WS_STATE_CLOSING;
+
+	if (pthread_create(
+			&conn_at(idx)->thrd_tout, NULL, close_timeout, conn_at(idx)))
+	{
+		pthread_mutex_unlock(&conn_at(idx)->mtx_state);
+		panic("Unable to create timeout thread\n");
+	}
+	conn_at(idx)->close_thrd = true;
 out:
-	pthread_mutex_unlock(&client_socks[idx].mtx_state);
+	pthread_mutex_unlock(&conn_at(idx)->mtx_state);
 	return (0);
 }
 
@@ -441,6 +1044,141 @@ char *ws_getaddress(int fd)
 	return (client);
 }
 
+/**
+ * @brief Encodes the header of an unmasked, FIN, WebSocket frame.
+ *
+ * @param hdr  Target buffer, at least @ref WS_FRAME_HDR_MAX bytes long.
+ * @param size Payload size.
+ * @param type Frame type.
+ *
+ * @return Returns the header length, in bytes.
+ */
+int ws_frame_header(unsigned char *hdr, uint64_t size, int type)
+{
+	hdr[0] = (WS_FIN | type);
+
+	/* Split the size between octets. */
+	if (size <= 125)
+	{
+		hdr[1] = size & 0x7F;
+		return (2);
+	}
+
+	/* Size between 126 and 65535 bytes. */
+	else if (size >= 126 && size <= 65535)
+	{
+		hdr[1] = 126;
+		hdr[2] = (size >> 8) & 255;
+		hdr[3] = size & 255;
+		return (4);
+	}
+
+	/* More than 65535 bytes. */
+	hdr[1] = 127;
+	hdr[2] = (unsigned char)((size >> 56) & 255);
+	hdr[3] = (unsigned char)((size >> 48) & 255);
+	hdr[4] = (unsigned char)((size >> 40) & 255);
+	hdr[5] = (unsigned char)((size >> 32) & 255);
+	hdr[6] = (unsigned char)((size >> 24) & 255);
+	hdr[7] = (unsigned char)((size >> 16) & 255);
+	hdr[8] = (unsigned char)((size >> 8) & 255);
+	hdr[9] = (unsigned char)(size & 255);
+	return (10);
+}
+
+/**
+ * @brief Sends an already encoded frame (header and payload).
+ *
+ * Useful for payloads that are sent several times, like cached
+ * responses: the frame can be encoded once, with
+ * @ref ws_frame_header, and then sent as is, with no
+ * intermediate copies.
+ *
+ * @param fd    Target to be send.
+ * @param frame Encoded frame.
+ * @param size  Frame size, header included.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int ws_sendframe_raw(int fd, const unsigned char *frame, uint64_t size)
+{
+	return ((int)send_locked(fd, frame, (size_t)size));
+}
+
+#ifdef __linux__
+/**
+ * @brief Wakes the worker @p w up, see @ref ep_broadcast.
+ *
+ * @param w Worker.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int ep_wake(struct ws_worker *w)
+{
+	uint64_t one; /* Eventfd value. */
+
+	one = 1;
+	return (write(w->evfd, &one, sizeof(one)) < 0 ? -1 : 0);
+}
+
+/**
+ * @brief Routes a broadcast to every worker of the sharded
+ * backends: each one sends it to the clients of its shard, from
+ * its own event loop, instead of the caller sending to them all.
+ *
+ * @param fd         Sender, skipped.
+ * @param port_index Port of the receivers.
+ * @param frame      Encoded frame.
+ * @param len        Frame length.
+ *
+ * @return Returns 0 if queued, -1 if out of memory.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int ep_broadcast(
+	int fd, int port_index, const unsigned char *frame, size_t len)
+{
+	struct ws_bcast_link *head; /* Queue head.       */
+	struct ws_bcast *msg;       /* Shared broadcast. */
+	struct ws_worker *w;        /* Target worker.    */
+	int i;                      /* Loop index.       */
+
+	msg = malloc(sizeof(*msg) + ep_nworkers * sizeof(msg->link[0]) + len);
+	if (!msg)
+		return (-1);
+
+	msg->refs       = ep_nworkers;
+	msg->fd         = fd;
+	msg->port_index = port_index;
+	msg->len        = len;
+	msg->frame      = (unsigned char *)&msg->link[ep_nworkers];
+	memcpy(msg->frame, frame, len);
+
+	for (i = 0; i < ep_nworkers; i++)
+	{
+		w                = &ep_workers[i];
+		msg->link[i].msg = msg;
+
+		head = __atomic_load_n(&w->bcast, __ATOMIC_RELAXED);
+		do
+			msg->link[i].next = head;
+		while (!__atomic_compare_exchange_n(&w->bcast, &head, &msg->link[i], true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+		/* Only an empty queue needs a wake up, see @ref ep_bcast_run. */
+		if (!head && ep_wake(w) < 0)
+		{
+			DEBUG("Cannot wake worker %d up!\n", i);
+		}
+	}
+	return (0);
+}
+#endif
+
 /**
  * @brief Creates and send an WebSocket frame with some payload data.
  *
@@ -458,939 +1196,2224 @@ char *ws_getaddress(int fd)
  *
  * @note If @p size is -1, it is assumed that a text frame is being sent,
  * otherwise, a binary frame. In the later case, the @p size is used.
+ *
+ * @note With @ref WS_BACKEND_SHARDED and @ref WS_BACKEND_URING,
+ * broadcasts are queued to the workers and sent from their event
+ * loops: only the frame sent to @p fd is accounted for in the
+ * return value.
  */
 int ws_sendframe(int fd, const char *msg, uint64_t size, bool broadcast, int type)
 {
-	unsigned char *response; /* Response data.     */
-	unsigned char frame[10]; /* Frame.             */
-	uint8_t idx_first_rData; /* Index data.        */
-	uint64_t length;         /* Message length.    */
-	int idx_response;        /* Index response.    */
-	ssize_t output;          /* Bytes sent.        */
-	ssize_t send_ret;        /* Ret send function  */
-	int sock;                /* File Descript.     */
-	uint64_t i;              /* Loop index.        */
-	int cur_port_index;      /* Current port index */
+	unsigned char *response;    /* Response data.     */
+	unsigned char frame[10];    /* Frame.             */
+	uint8_t idx_first_rData;    /* Index data.        */
+	uint64_t length;            /* Message length.    */
+	int idx_response;           /* Index response.    */
+	ssize_t output;             /* Bytes sent.        */
+	ssize_t send_ret;           /* Ret send function  */
+	struct ws_connection *conn; /* Client connection. */
+	int first;                  /* First fd of chunk. */
+	int sock;                   /* Client fd.         */
+	uint64_t i;                 /* Loop index.        */
+	int cur_port_index;         /* Current port index */
+	bool failed;                /* Some client failed */
+
+	length          = (uint64_t)size;
+	idx_first_rData = (uint8_t)ws_frame_header(frame, length, type);
 
-	frame[0] = (WS_FIN | type);
-	length   = (uint64_t)size;
+	/* Add frame bytes. */
+	idx_response = 0;
+	response     = malloc(sizeof(unsigned char) * (idx_first_rData + length + 1));
+	if (!response)
+		return (-1);
 
-	/* Split the size between octets. */
-	if (length <= 125)
+	for (i = 0; i < idx_first_rData; i++)
 	{
-		frame[1]        = length & 0x7F;
-		idx_first_rData = 2;
+		response[i] = frame[i];
+		idx_response++;
 	}
 
-	/* Size between 126 and 65535 bytes. */
-	else if (length >= 126 && length <= 65535)
+	/* Add data bytes. */
+	for (i = 0; i < length; i++)
 	{
-		frame[1]        = 126;
-		frame[2]        = (length >> 8) & 255;
-		frame[3]        = length & 255;
-		idx_first_rData = 4;
+		response[idx_response] = msg[i];
+		idx_response++;
 	}
 
-	/* More than 65535 bytes. */
-	else
+	response[idx_response] = '\0';
+	output                 = send_locked(fd, response, idx_response);
+
+	if (output != -1 && broadcast && get_client_index(fd) != -1)
 	{
-		frame[1]        = 127;
-		frame[2]        = (unsigned char)((length >> 56) & 255);
-		frame[3]        = (unsigned char)((length >> 48) & 255);
-		frame[4]        = (unsigned char)((length >> 40) & 255);
-		frame[5]        = (unsigned char)((length >> 32) & 255);
-		frame[6]        = (unsigned char)((length >> 24) & 255);
-		frame[7]        = (unsigned char)((length >> 16) & 255);
-		frame[8]        = (unsigned char)((length >> 8) & 255);
-		frame[9]        = (unsigned char)(length & 255);
-		idx_first_rData = 10;
-	}
+		cur_port_index = conn_at(fd)->port_index;
 
-	/* Add frame bytes. */
-	idx_response = 0;
-	response     = malloc(sizeof(unsigned char) * (idx_first_rData + length + 1));
-	if (!response)
+#ifdef __linux__
+		if (io_backend == WS_BACKEND_SHARDED || io_backend == WS_BACKEND_URING)
+		{
+			if (ep_broadcast(fd, cur_port_index, response, idx_response) < 0)
+				output = -1;
+			goto out;
+		}
+#endif
+
+		/* Every slot of every chunk, no lock but the send one. */
+		failed = false;
+		for (first = 0; first < MAX_CLIENT_FD; first += CONN_CHUNK)
+		{
+			if (!__atomic_load_n(&client_socks[first >> CONN_CHUNK_BITS],
+					__ATOMIC_ACQUIRE))
+				continue;
+
+			for (sock = first; sock < first + CONN_CHUNK; sock++)
+			{
+				if (sock == fd || get_client_index(sock) == -1 ||
+					conn_at(sock)->port_index != cur_port_index ||
+					get_client_state(sock) != WS_STATE_OPEN)
+					continue;
+
+				/* Skipped if gone meanwhile, see @ref close_client. */
+				conn = conn_at(sock);
+				pthread_mutex_lock(&conn->mtx_snd);
+				send_ret = 0;
+				if (__atomic_load_n(&conn->client_sock, __ATOMIC_RELAXED) == sock)
+					send_ret = conn_send(sock, response, idx_response);
+				pthread_mutex_unlock(&conn->mtx_snd);
+
+				/* A client failing does not keep the others waiting. */
+				if (send_ret == -1)
+					failed = true;
+				else
+					output += send_ret;
+			}
+		}
+		if (failed)
+			output = -1;
+	}
+
+out:
+	free(response);
+	return ((int)output);
+}
+
+/**
+ * @brief Sends a WebSocket text frame.
+ *
+ * @param fd         Target to be send.
+ * @param msg        Text message to be send.
+ * @param broadcast  Enable/disable broadcast (0-disable/anything-enable).
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ */
+int ws_sendframe_txt(int fd, const char *msg, bool broadcast)
+{
+	return ws_sendframe(fd, msg, (uint64_t)strlen(msg), broadcast, WS_FR_OP_TXT);
+}
+
+/**
+ * @brief Sends a WebSocket binary frame.
+ *
+ * @param fd         Target to be send.
+ * @param msg        Binary message to be send.
+ * @param size       Message size (in bytes).
+ * @param broadcast  Enable/disable broadcast (0-disable/anything-enable).
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ */
+int ws_sendframe_bin(int fd, const char *msg, uint64_t size, bool broadcast)
+{
+	return ws_sendframe(fd, msg, size, broadcast, WS_FR_OP_BIN);
+}
+
+/**
+ * @brief For a given @p fd, gets the current state for
+ * the connection, or -1 if invalid.
+ *
+ * @param fd Client fd.
+ *
+ * @return Returns the connection state or -1 if
+ * invalid @p fd.
+ *
+ * @see WS_STATE_CONNECTING
+ * @see WS_STATE_OPEN
+ * @see WS_STATE_CLOSING
+ * @see WS_STATE_CLOSED
+ */
+int ws_get_state(int fd)
+{
+	int idx;
+
+	if ((idx = get_client_index(fd)) == -1)
+		return (-1);
+
+	return (get_client_state(idx));
+}
+
+/**
+ * @brief For a given @p fd, gets the subprotocol negotiated
+ * in the handshake.
+ *
+ * @param fd Client fd.
+ *
+ * @return Returns the index of the subprotocol in the list
+ * given to @ref ws_subprotocols, or -1 if none was negotiated
+ * or @p fd is invalid.
+ */
+int ws_get_protocol(int fd)
+{
+	int idx;
+
+	if ((idx = get_client_index(fd)) == -1)
+		return (-1);
+
+	return (conn_at(idx)->protocol);
+}
+
+/**
+ * @brief Sets a callback that is told how long sends and
+ * handshakes take, e.g: to keep latency statistics.
+ *
+ * @param cb Callback, receives the event (@ref WS_TIMING_SEND or
+ *           @ref WS_TIMING_HANDSHAKE), its duration (ns) and the
+ *           amount of bytes sent, if any. NULL disables timing.
+ *
+ * @note Must be called before @ref ws_socket. The callback is
+ * called from every connection thread, concurrently.
+ */
+void ws_timing(void (*cb)(int event, uint64_t ns, uint64_t bytes))
+{
+	timing_cb = cb;
+}
+
+/**
+ * @brief Sets the subprotocols (Sec-WebSocket-Protocol values)
+ * the server supports.
+ *
+ * During the handshake, the first subprotocol offered by the
+ * client that is also in @p protocols is selected and echoed
+ * back; clients that offer none of them still connect, with
+ * no subprotocol.
+ *
+ * @param protocols NULL terminated list, must outlive the server.
+ *
+ * @note Must be called before @ref ws_socket.
+ */
+void ws_subprotocols(const char *const *protocols)
+{
+	subprotocols = protocols;
+}
+
+#ifdef __linux__
+/**
+ * @brief Checks whether io_uring, and every feature the io_uring
+ * backend needs, is available.
+ *
+ * @return Returns 0 if so, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int ur_probe(void)
+{
+#ifdef WS_HAVE_URING
+	struct ws_uring ring;
+
+	if (ws_uring_init(&ring, 8, 8, 64) < 0)
+		return (-1);
+	ws_uring_free(&ring);
+	return (0);
+#else
+	return (-1);
+#endif
+}
+#endif
+
+/**
+ * @brief Selects how the connections are served.
+ *
+ * With @ref WS_BACKEND_THREADS (the default), each connection gets
+ * its own thread, blocked while reading. With @ref WS_BACKEND_EPOLL,
+ * @p workers threads serve every connection, each one waiting
+ * on its own (edge-triggered) epoll instance: idle clients cost
+ * no thread at all.
+ *
+ * @ref WS_BACKEND_SHARDED goes further: instead of a single accept
+ * loop handing the clients out, each worker has its own SO_REUSEPORT
+ * listener, accepts its own clients and keeps them in its own shard,
+ * so nothing is shared between workers but broadcasts, which are
+ * queued to each of them. Handshakes and messages then scale with
+ * the amount of workers, one per core being a good start.
+ *
+ * @ref WS_BACKEND_URING shards the same way, but each worker drives
+ * an io_uring instead of epoll: accepts and receives are multishot,
+ * into buffers provided to the kernel, and the sends to a client
+ * are submitted by its worker as a chain of linked requests, so a
+ * single system call submits every pending request and waits for
+ * the next completions.
+ *
+ * @param backend I/O backend.
+ * @param workers Amount of worker threads, ignored by
+ *                @ref WS_BACKEND_THREADS.
+ *
+ * @return Returns 0 if success, 1 if @ref WS_BACKEND_URING is not
+ * available (older kernel, or io_uring disabled) and
+ * @ref WS_BACKEND_SHARDED is used instead, -1 if the backend is not
+ * available (epoll backends are Linux only) or @p workers is invalid.
+ *
+ * @note Must be called before @ref ws_socket. With epoll, the events
+ * of a client are always triggered from the same worker, so a
+ * callback that blocks delays the other clients of that worker.
+ * Sends do not: what a socket does not take is queued, see
+ * @ref ep_send.
+ */
+int ws_backend(int backend, int workers)
+{
+	if (backend == WS_BACKEND_THREADS)
+	{
+		io_backend = backend;
+		return (0);
+	}
+
+#ifdef __linux__
+	if (backend == WS_BACKEND_URING && workers > 0)
+	{
+		if (ur_probe() < 0)
+		{
+			io_backend  = WS_BACKEND_SHARDED;
+			ep_nworkers = workers;
+			return (1);
+		}
+		io_backend  = backend;
+		ep_nworkers = workers;
+		return (0);
+	}
+
+	if ((backend == WS_BACKEND_EPOLL || backend == WS_BACKEND_SHARDED) &&
+		workers > 0)
+	{
+		io_backend  = backend;
+		ep_nworkers = workers;
+		return (0);
+	}
+#else
+	((void)workers);
+#endif
+	return (-1);
+}
+
+/**
+ * @brief Sets how many clients may be connected at once,
+ * @ref MAX_CLIENTS by default. Clients beyond that are
+ * disconnected as soon as accepted.
+ *
+ * The connection table grows with the client fds, up to
+ * @ref MAX_CLIENT_FD, so a large limit costs nothing until used;
+ * the fd limit of the process (RLIMIT_NOFILE) should allow it.
+ *
+ * @param max Max clients.
+ *
+ * @return Returns 0 if success, -1 if @p max is invalid.
+ *
+ * @note Must be called before @ref ws_socket.
+ */
+int ws_max_clients(int max)
+{
+	if (max < 1 || max > MAX_CLIENT_FD)
+		return (-1);
+
+	max_clients = max;
+	return (0);
+}
+
+/**
+ * @brief Close the client connection for the given @p fd
+ * with normal close code (1000) and no reason string.
+ *
+ * @param fd Client fd.
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ *
+ * @note If the client did not send a close frame in
+ * TIMEOUT_MS milliseconds, the server will close the
+ * connection with error code (1002).
+ */
+int ws_close_client(int fd)
+{
+	unsigned char clse_code[2];
+	int cc;
+	int i;
+
+	/* Check if fd belongs to a connected client. */
+	if ((i = get_client_index(fd)) == -1)
+		return (-1);
+
+	/*
+	 * Normal close code: this may be invoked asynchronously, from
+	 * any thread, so nothing from the client frame data is used.
+	 */
+	cc           = WS_CLSE_NORMAL;
+	clse_code[0] = (cc >> 8);
+	clse_code[1] = (cc & 0xFF);
+	if (ws_sendframe(CLI_SOCK(fd), (const char *)clse_code, sizeof(char) * 2, false,
+			WS_FR_OP_CLSE) < 0)
+	{
+		DEBUG("An error has occurred while sending closing frame!\n");
+		return (-1);
+	}
+
+	/*
+	 * Starts the timeout thread: if the client did not send
+	 * a close frame in TIMEOUT_MS milliseconds, the server
+	 * will close the connection with error code (1002).
+	 */
+	start_close_timeout(i);
+	return (0);
+}
+
+/**
+ * @brief Checks is a given opcode @p frame
+ * belongs to a control frame or not.
+ *
+ * @param frame Frame opcode to be checked.
+ *
+ * @return Returns 1 if is a control frame, 0 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static inline int is_control_frame(int frame)
+{
+	return (
+		frame == WS_FR_OP_CLSE || frame == WS_FR_OP_PING || frame == WS_FR_OP_PONG);
+}
+
+/**
+ * @brief Looks for the end of the handshake request, the first
+ * empty line.
+ *
+ * @param buf Received bytes.
+ * @param len Amount of bytes.
+ *
+ * @return Returns the request length, or 0 if incomplete.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static size_t request_length(const unsigned char *buf, size_t len)
+{
+	size_t i;
+	for (i = 3; i < len; i++)
+	{
+		if (buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' &&
+			buf[i - 3] == '\r')
+			return (i + 1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Do the handshake process, once the whole request
+ * was received.
+ *
+ * @param wfd Websocket Frame Data.
+ * @param buf Received bytes, the request may be followed by frames.
+ * @param len Amount of bytes.
+ *
+ * @return Returns the request length if success, 0 if more bytes
+ * are needed, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static ssize_t do_handshake(
+	struct ws_frame_data *wfd, const unsigned char *buf, size_t len)
+{
+	char request[MESSAGE_LENGTH]; /* Handshake request.           */
+	struct ws_connection *conn;   /* Client connection.           */
+	char *response;               /* Handshake response message.  */
+	char *tmp;                    /* Extended response.           */
+	uint64_t start;               /* Handshake start (ns).        */
+	size_t n;                     /* Request length.              */
+	int proto;                    /* Negotiated subprotocol.      */
+	ssize_t sent;                 /* Handshake send result.       */
+	int ret;                      /* Return value.                */
+
+	/* Wait for the empty line with \r\n. */
+	if (!(n = request_length(buf, len)))
+		return (len < sizeof(request) - 1 ? 0 : -1);
+	if (n > sizeof(request) - 1)
+		return (-1);
+
+	memcpy(request, buf, n);
+	request[n] = '\0';
+	start      = timing_cb ? now_ns() : 0;
+	ret        = -1;
+
+	/* Subprotocol, before the request gets tokenized. */
+	proto = get_handshake_protocol(request, subprotocols);
+	conn_at(wfd->idx)->protocol = proto;
+
+	/* Get response. */
+	if (get_handshake_response(request, &response) < 0)
+	{
+		DEBUG("Cannot get handshake response, request was: %s\n", request);
+		goto out;
+	}
+
+	/* Echo the subprotocol, just before the final empty line. */
+	if (proto >= 0)
+	{
+		tmp = realloc(response, strlen(response) + sizeof(WS_HS_PROTO ": ") +
+			strlen(subprotocols[proto]) + 4);
+		if (!tmp)
+		{
+			free(response);
+			goto out;
+		}
+		response = tmp;
+		response[strlen(response) - 2] = '\0';
+		strcat(response, WS_HS_PROTO ": ");
+		strcat(response, subprotocols[proto]);
+		strcat(response, "\r\n\r\n");
+	}
+
+	/* Valid request. */
+	DEBUG("Handshaked, response: \n"
+		  "------------------------------------\n"
+		  "%s"
+		  "------------------------------------\n",
+		response);
+
+	/*
+	 * Open the client and send handshake under its send lock: a
+	 * broadcast seeing it open waits for the response to be sent
+	 * first, and one seeing it connecting was sent before the client
+	 * could know of it. Event loops cannot wait for room, queued
+	 * instead.
+	 */
+	conn = conn_at(wfd->idx);
+	pthread_mutex_lock(&conn->mtx_snd);
+	set_client_state(wfd->idx, WS_STATE_OPEN);
+#ifdef WS_HAVE_URING
+	if (io_backend == WS_BACKEND_URING)
+		sent = ur_send(wfd->idx, response, strlen(response), NULL);
+	else
+#endif
+	if (io_backend != WS_BACKEND_THREADS)
+		sent = conn_send(wfd->idx, response, strlen(response));
+	else
+		sent = SEND(wfd->sock, response, strlen(response));
+	pthread_mutex_unlock(&conn->mtx_snd);
+
+	if (sent < 0)
+	{
+		free(response);
+		DEBUG("As error has occurred while handshaking!\n");
+		goto out;
+	}
+
+	/* Trigger events and clean up buffers. */
+	ports[conn_at(wfd->idx)->port_index].events.onopen(CLI_SOCK(wfd->sock));
+	free(response);
+	ret = 0;
+
+out:
+	if (timing_cb)
+		timing_cb(WS_TIMING_HANDSHAKE, now_ns() - start, 0);
+	return (ret < 0 ? -1 : (ssize_t)n);
+}
+
+/**
+ * @brief Sends a close frame, accordingly with the @p close_code
+ * or the close frame received, in @p payload.
+ *
+ * @param sock Client socket.
+ * @param payload Received close frame payload.
+ * @param len Payload length.
+ * @param close_code Websocket close code, -1 to answer @p payload.
+ *
+ * @return Returns 0 if success, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int do_close(
+	int sock, const unsigned char *payload, size_t len, int close_code)
+{
+	unsigned char clse_code[2]; /* Custom close code.    */
+	int cc;                     /* Close code.           */
+
+	/* If custom close-code. */
+	if (close_code != -1)
+	{
+		cc = close_code;
+		goto custom_close;
+	}
+
+	/* If empty or have a close reason, just re-send. */
+	if (len == 0 || len > 2)
+		goto send;
+
+	/* Parse close code and check if valid, if not, we issue an protocol error. */
+	if (len == 1)
+		cc = payload[0];
+	else
+		cc = ((int)payload[0]) << 8 | payload[1];
+
+	/* Check if it's not valid, if so, we send a protocol error (1002). */
+	if ((cc < 1000 || cc > 1003) && (cc < 1007 || cc > 1011) &&
+		(cc < 3000 || cc > 4999))
+	{
+		cc = WS_CLSE_PROTERR;
+
+	custom_close:
+		clse_code[0] = (cc >> 8);
+		clse_code[1] = (cc & 0xFF);
+
+		if (ws_sendframe(CLI_SOCK(sock), (const char *)clse_code, sizeof(char) * 2,
+				false, WS_FR_OP_CLSE) < 0)
+		{
+			DEBUG("An error has occurred while sending closing frame!\n");
+			return (-1);
+		}
+		return (0);
+	}
+
+	/* Send the received payload. */
+send:
+	if (ws_sendframe(
+			CLI_SOCK(sock), (const char *)payload, len, false, WS_FR_OP_CLSE) < 0)
+	{
+		DEBUG("An error has occurred while sending closing frame!\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Send a pong frame in response to a ping frame.
+ *
+ * Accordingly to the RFC, a pong frame must have the same
+ * data payload as the ping frame, so we just send a
+ * ordinary frame with PONG opcode.
+ *
+ * @param sock Client socket.
+ * @param payload Ping frame payload.
+ * @param len Payload length.
+ *
+ * @return Returns 0 if success and a negative number
+ * otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int do_pong(int sock, const unsigned char *payload, size_t len)
+{
+	if (ws_sendframe(
+			CLI_SOCK(sock), (const char *)payload, len, false, WS_FR_OP_PONG) < 0)
+	{
+		DEBUG("An error has occurred while ponging!\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Handles the events of a client frame parser: gathers
+ * the message payload, triggers the message event, and answers
+ * control frames.
+ *
+ * @param p Parser, see @ref ws_parser.
+ * @param event Parser event.
+ * @param data Event data: payload chunk or control frame payload.
+ * @param len Data length.
+ *
+ * @return Returns 0 to go on, -1 if the connection should end.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int on_frame(
+	struct ws_parser *p, int event, const unsigned char *data, size_t len)
+{
+	struct ws_frame_data *wfd; /* WebSocket frame data. */
+	unsigned char *tmp;        /* Grown message.        */
+	uint64_t size;             /* Needed message size.  */
+
+	wfd = p->data;
+
+	switch (event)
+	{
+	case WS_PARSER_HEADER:
+		/*
+		 * Check our current state: if CLOSING, we only accept close
+		 * frames.
+		 *
+		 * Since the server may, at any time, asynchronously, asks
+		 * to close the client connection, we should terminate
+		 * immediately.
+		 */
+		if (get_client_state(wfd->idx) == WS_STATE_CLOSING &&
+			p->opcode != WS_FR_OP_CLSE)
+		{
+			DEBUG("Unexpected frame received, expected CLOSE (%d), received: (%d)",
+				WS_FR_OP_CLSE, p->opcode);
+			return (-1);
+		}
+
+		/* Room for the whole frame, and the line ending \0. */
+		size = wfd->msg_len + p->frame_len + 1;
+		if (!is_control_frame(p->opcode) && size > wfd->msg_size)
+		{
+			if (!(tmp = realloc(wfd->msg, size)))
+			{
+				DEBUG("Cannot allocate memory, requested: %" PRId64 "\n", size);
+				return (-1);
+			}
+			wfd->msg      = tmp;
+			wfd->msg_size = size;
+		}
+		return (0);
+
+	case WS_PARSER_PAYLOAD:
+		memcpy(wfd->msg + wfd->msg_len, data, len);
+		wfd->msg_len += len;
+		return (0);
+
+	case WS_PARSER_MESSAGE:
+		wfd->msg[wfd->msg_len] = '\0';
+		ports[conn_at(wfd->idx)->port_index].events.onmessage(
+			wfd->sock, wfd->msg, wfd->msg_len, p->msg_type);
+
+		free(wfd->msg);
+		wfd->msg      = NULL;
+		wfd->msg_len  = 0;
+		wfd->msg_size = 0;
+		return (0);
+	}
+
+	/* We should answer to a PING frame as soon as possible. */
+	if (p->opcode == WS_FR_OP_PING)
+		return (do_pong(wfd->sock, data, len));
+
+	/*
+	 * We _never_ send a PING frame, so it's not expected to receive a PONG
+	 * frame. However, the specs states that a client could send an
+	 * unsolicited PONG frame. The server just have to ignore the
+	 * frame.
+	 */
+	if (p->opcode == WS_FR_OP_PONG)
+		return (0);
+
+	/*
+	 * Close frame: we only send a CLOSE frame once, if we're already
+	 * in CLOSING state, there is no need to send.
+	 */
+	if (get_client_state(wfd->idx) != WS_STATE_CLOSING)
+	{
+		set_client_state(wfd->idx, WS_STATE_CLOSING);
+		do_close(wfd->sock, data, len, -1);
+	}
+	return (-1);
+}
+
+/**
+ * @brief Prepares the frame data of the new client @p idx.
+ *
+ * @param idx Client connection index.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void init_frame_data(int idx)
+{
+	struct ws_frame_data *wfd = &conn_at(idx)->wfd;
+
+	ws_parser_init(&wfd->parser, on_frame, wfd, MAX_FRAME_LENGTH);
+	wfd->msg      = NULL;
+	wfd->msg_len  = 0;
+	wfd->msg_size = 0;
+	wfd->sock     = idx;
+	wfd->idx      = idx;
+}
+
+/**
+ * @brief Parses the next @p len bytes received from a client.
+ *
+ * @param wfd Websocket Frame Data.
+ * @param buf Received bytes.
+ * @param len Amount of bytes.
+ *
+ * @return Returns 0 if success, a negative number if the
+ * connection should end.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int feed(struct ws_frame_data *wfd, unsigned char *buf, size_t len)
+{
+	if (ws_parser_feed(&wfd->parser, buf, len) == 0)
+		return (0);
+
+	if (wfd->parser.error == WS_CLSE_INVUTF8)
+	{
+		DEBUG("Dropping invalid UTF-8 message!\n");
+		do_close(wfd->sock, NULL, 0, WS_CLSE_INVUTF8);
+	}
+	else if (wfd->parser.error)
+	{
+		DEBUG("Invalid frame received from client %d\n", wfd->sock);
+	}
+
+	return (-1);
+}
+
+/**
+ * @brief Ends the connection @p idx: triggers the close event,
+ * stops the time-out thread, if any, and closes the socket.
+ *
+ * @param idx    Client connection index.
+ * @param opened Whether the handshake succeeded.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void finish_connection(int idx, bool opened)
+{
+	int clse_thrd; /* Time-out close thread. */
+	int sock;      /* File descriptor.       */
+
+	sock = conn_at(idx)->client_sock;
+
+	/*
+	 * on_close events always occur, whether for client closure
+	 * or server closure, as the server is expected to
+	 * always know when the client disconnects.
+	 */
+	if (opened)
+		ports[conn_at(idx)->port_index].events.onclose(sock);
+
+	/* Partially received message, if any. */
+	free(conn_at(idx)->wfd.msg);
+	conn_at(idx)->wfd.msg = NULL;
+
+	/* Wake up the timeout thread, if any, and wait for it. */
+	pthread_mutex_lock(&conn_at(idx)->mtx_state);
+	clse_thrd               = conn_at(idx)->close_thrd;
+	conn_at(idx)->state = WS_STATE_CLOSED;
+	pthread_cond_signal(&conn_at(idx)->cnd_state_close);
+	pthread_mutex_unlock(&conn_at(idx)->mtx_state);
+
+	if (clse_thrd)
+		pthread_join(conn_at(idx)->thrd_tout, NULL);
+
+	/* Close connectin properly. */
+	close_client(idx);
+}
+
+/**
+ * @brief Takes the slot of the new client @p fd.
+ *
+ * @param fd         Client socket.
+ * @param port_index Index in the port list.
+ * @param w          Worker that owns it, if any.
+ *
+ * @return Returns the client index, or -1 if the server is full.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int new_client(int fd, int port_index, struct ws_worker *w)
+{
+	struct ws_connection *conn;
+
+	if (fd >= MAX_CLIENT_FD)
+		return (-1);
+
+	if (__atomic_add_fetch(&nclients, 1, __ATOMIC_RELAXED) > max_clients ||
+		(!__atomic_load_n(&client_socks[fd >> CONN_CHUNK_BITS], __ATOMIC_ACQUIRE) &&
+			alloc_chunk(fd >> CONN_CHUNK_BITS) < 0))
+	{
+		__atomic_sub_fetch(&nclients, 1, __ATOMIC_RELAXED);
+		return (-1);
+	}
+
+	conn               = conn_at(fd);
+	conn->port_index   = port_index;
+	conn->state        = WS_STATE_CONNECTING;
+	conn->protocol     = -1;
+	conn->close_thrd   = false;
+	conn->in           = NULL;
+	conn->in_len       = 0;
+	conn->worker       = w;
+	conn->snd_head     = NULL;
+	conn->snd_tail     = NULL;
+	conn->snd_inflight = 0;
+	conn->ur_closing   = false;
+	conn->ur_recv_done = false;
+	conn->ur_dirty     = false;
+	init_frame_data(fd);
+
+	/* Publish it, see @ref get_client_index. */
+	__atomic_store_n(&conn->client_sock, fd, __ATOMIC_RELEASE);
+	return (fd);
+}
+
+/**
+ * @brief Establishes to connection with the client and trigger
+ * events when occurs one.
+ *
+ * @param vsock Client connection index.
+ *
+ * @return Returns @p vsock.
+ *
+ * @note This will be run on a different thread.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void *ws_establishconnection(void *vsock)
+{
+	unsigned char frm[MESSAGE_LENGTH]; /* Received bytes.         */
+	struct ws_frame_data *wfd;         /* WebSocket frame data.   */
+	int connection_index;              /* Client connect. index.  */
+	ssize_t used;                      /* Handshake length.       */
+	size_t len;                        /* Bytes in frm.           */
+	ssize_t n;                         /* Read bytes.             */
+
+	connection_index = (int)(intptr_t)vsock;
+	wfd              = &conn_at(connection_index)->wfd;
+
+	/* Do handshake, the request may come in pieces. */
+	len  = 0;
+	used = 0;
+	while (!used && (n = RECV(wfd->sock, frm + len, sizeof(frm) - 1 - len)) > 0)
+	{
+		len += (size_t)n;
+		used = do_handshake(wfd, frm, len);
+	}
+	if (used <= 0)
+	{
+		finish_connection(connection_index, false);
+		return (vsock);
+	}
+
+	/*
+	 * Frames sent along with the request, and then every frame until
+	 * client disconnects or an error occur.
+	 */
+	if (feed(wfd, frm + used, len - (size_t)used) == 0)
+	{
+		while ((n = RECV(wfd->sock, frm, sizeof(frm))) > 0 &&
+			feed(wfd, frm, (size_t)n) == 0)
+			;
+	}
+
+	finish_connection(connection_index, true);
+	return (vsock);
+}
+
+#ifdef __linux__
+/**
+ * @brief Hands the new client @p idx to the worker @p w.
+ *
+ * @param w   Worker, NULL for the next one, round-robin.
+ * @param idx Client connection index.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int ep_add(struct ws_worker *w, int idx)
+{
+	struct epoll_event ev; /* Watched events. */
+	int flags;             /* Socket flags.   */
+	int fd;                /* Client socket.  */
+
+	fd = conn_at(idx)->client_sock;
+	if (!w)
+		w = &ep_workers[__atomic_fetch_add(&ep_next, 1, __ATOMIC_RELAXED) %
+			(unsigned)ep_nworkers];
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return (-1);
+	conn_at(idx)->worker = w;
+
+	/* Bytes that arrived before this are reported as well. */
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.u32 = (uint32_t)idx;
+	return (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+/**
+ * @brief Adds @p conn to the shard of the worker @p w.
+ *
+ * @param w    Worker, the calling one.
+ * @param conn Client connection.
+ *
+ * @note Shards are only touched by their worker, no lock needed.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void shard_link(struct ws_worker *w, struct ws_connection *conn)
+{
+	conn->prev = NULL;
+	conn->next = w->conns;
+	if (w->conns)
+		w->conns->prev = conn;
+	w->conns = conn;
+}
+
+/**
+ * @brief Removes @p conn from the shard of the worker @p w.
+ *
+ * @param w    Worker, the calling one.
+ * @param conn Client connection.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void shard_unlink(struct ws_worker *w, struct ws_connection *conn)
+{
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		w->conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	conn->prev = NULL;
+	conn->next = NULL;
+}
+
+/**
+ * @brief Handles @p len bytes received from the client @p conn:
+ * the handshake request, which may come in pieces, then frames.
+ *
+ * @param conn Client connection.
+ * @param buf  Received bytes.
+ * @param len  Amount of bytes.
+ *
+ * @return Returns 0 if success, a negative number if the
+ * connection should end.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int conn_input(struct ws_connection *conn, unsigned char *buf, size_t len)
+{
+	unsigned char *tmp; /* Grown request buffer. */
+	ssize_t used;       /* Handshake length.     */
+	int ret;            /* Parse result.         */
+
+	if (get_client_state(conn->wfd.idx) != WS_STATE_CONNECTING)
+		return (feed(&conn->wfd, buf, len));
+
+	if (!(tmp = realloc(conn->in, conn->in_len + len)))
 		return (-1);
+	conn->in = tmp;
+	memcpy(conn->in + conn->in_len, buf, len);
+	conn->in_len += len;
+
+	if ((used = do_handshake(&conn->wfd, conn->in, conn->in_len)) <= 0)
+		return ((int)used);
+
+	ret = feed(&conn->wfd, conn->in + used, conn->in_len - (size_t)used);
+
+	free(conn->in);
+	conn->in     = NULL;
+	conn->in_len = 0;
+	return (ret);
+}
+
+/**
+ * @brief Reads everything the client @p idx sent, until the
+ * socket would block, and ends the connection if it is over.
+ *
+ * This is the event loop counterpart of @ref ws_establishconnection.
+ *
+ * @param w   Worker.
+ * @param idx Client connection index.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ep_read(struct ws_worker *w, int idx)
+{
+	struct ws_connection *conn; /* Client connection. */
+	ssize_t n;                  /* Read bytes.        */
+
+	conn = conn_at(idx);
+
+	while (1)
+	{
+		n = RECV(conn->client_sock, w->buf, sizeof(w->buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0 || conn_input(conn, w->buf, (size_t)n) < 0)
+			break;
+	}
+
+	free(conn->in);
+	conn->in     = NULL;
+	conn->in_len = 0;
+
+	/* Out of the shard before its fd can be reused. */
+	if (io_backend == WS_BACKEND_SHARDED)
+		shard_unlink(w, conn);
+
+	finish_connection(idx, get_client_state(idx) != WS_STATE_CONNECTING);
+}
+
+/**
+ * @brief Sends what is queued for the client @p idx, now that its
+ * socket has room, see @ref ep_send; and stops watching for room
+ * once everything is out.
+ *
+ * @param idx Client connection index.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ep_flush(int idx)
+{
+	struct ws_connection *conn; /* Client connection. */
+	ssize_t n;                  /* Sent bytes.        */
+
+	conn = conn_at(idx);
+	pthread_mutex_lock(&conn->mtx_snd);
+	if (__atomic_load_n(&conn->client_sock, __ATOMIC_RELAXED) != idx)
+		goto out;
+
+	while (conn->out_off < conn->out_len)
+	{
+		n = send(idx, conn->out + conn->out_off, conn->out_len - conn->out_off,
+			MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		/* Gone: dropped, the read side finishes it. */
+		if (n < 0)
+		{
+			conn->out_off = conn->out_len;
+			shutdown(idx, SHUT_RDWR);
+			break;
+		}
+		conn->out_off += (size_t)n;
+	}
+
+	if (conn->out_off == conn->out_len)
+	{
+		free(conn->out);
+		conn->out      = NULL;
+		conn->out_off  = 0;
+		conn->out_len  = 0;
+		conn->out_size = 0;
+		ep_arm(conn, idx, false);
+	}
+
+	/* Room again, see @ref ep_wait_room. */
+	pthread_cond_broadcast(&conn->cnd_snd);
+out:
+	pthread_mutex_unlock(&conn->mtx_snd);
+}
+
+/**
+ * @brief Takes the broadcasts queued for the worker @p w.
+ *
+ * @param w Worker.
+ *
+ * @return Returns the broadcasts, in the order they were sent.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static struct ws_bcast_link *bcast_take(struct ws_worker *w)
+{
+	struct ws_bcast_link *link; /* Current broadcast.  */
+	struct ws_bcast_link *next; /* Next broadcast.     */
+	struct ws_bcast_link *prev; /* Previous broadcast. */
+
+	link = __atomic_exchange_n(&w->bcast, NULL, __ATOMIC_ACQUIRE);
+	for (prev = NULL; link; link = next)
+	{
+		next       = link->next;
+		link->next = prev;
+		prev       = link;
+	}
+	return (prev);
+}
+
+/**
+ * @brief Drops a reference to the broadcast @p msg, the last
+ * one frees it, links included.
+ *
+ * @param msg Broadcast.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void bcast_put(struct ws_bcast *msg)
+{
+	if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(msg);
+}
+
+/**
+ * @brief Sends the broadcasts queued for the worker @p w to
+ * the clients of its shard.
+ *
+ * @param w Worker.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ep_bcast_run(struct ws_worker *w)
+{
+	struct ws_bcast_link *link; /* Current broadcast.   */
+	struct ws_bcast_link *next; /* Next broadcast.      */
+	struct ws_connection *conn; /* Client connection.   */
+	struct ws_bcast *msg;       /* Broadcast.           */
+	uint64_t val;               /* Eventfd value.       */
+
+	/*
+	 * Reset the wake up before taking the queue: a broadcast queued
+	 * after this finds the queue empty, and wakes us up again.
+	 */
+	if (read(w->evfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+	{
+		DEBUG("Cannot read the worker eventfd!\n");
+	}
+
+	for (link = bcast_take(w); link; link = next)
+	{
+		next = link->next;
+		msg  = link->msg;
+
+		for (conn = w->conns; conn; conn = conn->next)
+		{
+			if (conn->client_sock == msg->fd ||
+				conn->port_index != msg->port_index ||
+				get_client_state(conn->client_sock) != WS_STATE_OPEN)
+				continue;
+
+			/* Queued if it does not fit, never waited for. */
+			pthread_mutex_lock(&conn->mtx_snd);
+			ep_send(conn, conn->client_sock, msg->frame, msg->len);
+			pthread_mutex_unlock(&conn->mtx_snd);
+		}
+
+		bcast_put(msg);
+	}
+}
+
+/**
+ * @brief Accepts every pending client of the port @p port_index,
+ * from the listener of the worker @p w, and adds them to its shard.
+ *
+ * @param w          Worker, the calling one.
+ * @param port_index Index in the port list.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ep_accept(struct ws_worker *w, int port_index)
+{
+	int new_sock; /* New opened connection. */
+	int idx;      /* Client index.          */
+
+	while (1)
+	{
+		new_sock = accept(w->listen_fd[port_index], NULL, NULL);
+		if (new_sock < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			/*
+			 * Nothing else pending or, e.g: out of fds; the listener
+			 * is level-triggered, so the latter is retried.
+			 */
+			return;
+		}
 
-	for (i = 0; i < idx_first_rData; i++)
-	{
-		response[i] = frame[i];
-		idx_response++;
-	}
+		if ((idx = new_client(new_sock, port_index, w)) == -1)
+		{
+			close_socket(new_sock);
+			continue;
+		}
 
-	/* Add data bytes. */
-	for (i = 0; i < length; i++)
-	{
-		response[idx_response] = msg[i];
-		idx_response++;
+		if (ep_add(w, idx) < 0)
+		{
+			close_client(idx);
+			continue;
+		}
+		shard_link(w, conn_at(idx));
 	}
+}
 
-	response[idx_response] = '\0';
-	output                 = SEND(fd, response, idx_response);
-
-	if (output != -1 && broadcast)
+/**
+ * @brief Event loop worker: waits for any of its clients
+ * to be readable, or to have room for its queued output, and
+ * handles them.
+ *
+ * @param p Worker.
+ *
+ * @return Never returns.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void *ep_worker(void *p)
+{
+	struct epoll_event events[EP_EVENTS]; /* Ready clients. */
+	struct ws_worker *w;                  /* This worker.   */
+	uint32_t tag;                         /* Event tag.     */
+	int n;                                /* Ready amount.  */
+	int i;                                /* Loop index.    */
+
+	w = p;
+	pthread_setspecific(ep_key, w);
+	while (1)
 	{
-		pthread_mutex_lock(&mutex);
-
-		cur_port_index = -1;
-		for (i = 0; i < MAX_CLIENTS; i++)
+		n = epoll_wait(w->epfd, events, EP_EVENTS, -1);
+		if (n < 0)
 		{
-			if (client_socks[i].client_sock == fd)
-			{
-				cur_port_index = client_socks[i].port_index;
-				break;
-			}
+			if (errno == EINTR)
+				continue;
+			panic("epoll_wait failed");
 		}
 
-		for (i = 0; i < MAX_CLIENTS; i++)
+		for (i = 0; i < n; i++)
 		{
-			sock = client_socks[i].client_sock;
-			if (
-				(sock > -1) && (sock != fd) &&
-				(client_socks[i].port_index == cur_port_index) &&
-				get_client_state(i) == WS_STATE_OPEN)
+			tag = events[i].data.u32;
+			if (tag == EP_WAKE)
+				ep_bcast_run(w);
+			else if (tag & EP_LISTEN)
+				ep_accept(w, (int)(tag & ~EP_LISTEN));
+			else
 			{
-				if ((send_ret = SEND(sock, response, idx_response)) != -1)
-					output += send_ret;
-				else
-				{
-					output = -1;
-					break;
-				}
+				/* Room first: reading may finish the client. */
+				if (events[i].events & EPOLLOUT)
+					ep_flush((int)tag);
+				if (events[i].events & ~EPOLLOUT)
+					ep_read(w, (int)tag);
 			}
 		}
-		pthread_mutex_unlock(&mutex);
 	}
-
-	free(response);
-	return ((int)output);
+	return (NULL);
 }
 
+#ifdef WS_HAVE_URING
 /**
- * @brief Sends a WebSocket text frame.
+ * @brief Returns a submission queue entry of the worker @p w.
  *
- * @param fd         Target to be send.
- * @param msg        Text message to be send.
- * @param broadcast  Enable/disable broadcast (0-disable/anything-enable).
+ * @param w Worker, the calling one.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-int ws_sendframe_txt(int fd, const char *msg, bool broadcast)
+static struct io_uring_sqe *ur_sqe(struct ws_worker *w)
 {
-	return ws_sendframe(fd, msg, (uint64_t)strlen(msg), broadcast, WS_FR_OP_TXT);
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = ws_uring_sqe(&w->ring)))
+		panic("io_uring submission failed");
+	return (sqe);
 }
 
 /**
- * @brief Sends a WebSocket binary frame.
+ * @brief Receives from the client @p fd, into the provided buffers,
+ * until it disconnects or the buffers run out.
  *
- * @param fd         Target to be send.
- * @param msg        Binary message to be send.
- * @param size       Message size (in bytes).
- * @param broadcast  Enable/disable broadcast (0-disable/anything-enable).
+ * @param w  Worker, the calling one.
+ * @param fd Client socket.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-int ws_sendframe_bin(int fd, const char *msg, uint64_t size, bool broadcast)
+static void ur_prep_recv(struct ws_worker *w, int fd)
 {
-	return ws_sendframe(fd, msg, size, broadcast, WS_FR_OP_BIN);
+	struct io_uring_sqe *sqe;
+
+	sqe            = ur_sqe(w);
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->fd        = fd;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = WS_URING_BGID;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->user_data = ((uint64_t)fd << UR_SHIFT) | UR_RECV;
 }
 
 /**
- * @brief For a given @p fd, gets the current state for
- * the connection, or -1 if invalid.
+ * @brief Accepts every client of the port @p port_index, from the
+ * listener of the worker @p w, until it fails.
  *
- * @param fd Client fd.
+ * @param w          Worker, the calling one.
+ * @param port_index Index in the port list.
  *
- * @return Returns the connection state or -1 if
- * invalid @p fd.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_prep_accept(struct ws_worker *w, int port_index)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe            = ur_sqe(w);
+	sqe->opcode    = IORING_OP_ACCEPT;
+	sqe->fd        = w->listen_fd[port_index];
+	sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = ((uint64_t)port_index << UR_SHIFT) | UR_ACCEPT;
+}
+
+/**
+ * @brief Accepts again on the port @p port_index, after
+ * @ref UR_BACKOFF_MS milliseconds.
  *
- * @see WS_STATE_CONNECTING
- * @see WS_STATE_OPEN
- * @see WS_STATE_CLOSING
- * @see WS_STATE_CLOSED
+ * @param w          Worker, the calling one.
+ * @param port_index Index in the port list.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-int ws_get_state(int fd)
+static void ur_prep_retry(struct ws_worker *w, int port_index)
 {
-	int idx;
+	struct io_uring_sqe *sqe;
 
-	if ((idx = get_client_index(fd)) == -1)
-		return (-1);
+	w->backoff.tv_sec  = 0;
+	w->backoff.tv_nsec = MS_TO_NS(UR_BACKOFF_MS);
 
-	return (get_client_state(idx));
+	sqe            = ur_sqe(w);
+	sqe->opcode    = IORING_OP_TIMEOUT;
+	sqe->addr      = (uint64_t)(uintptr_t)&w->backoff;
+	sqe->len       = 1;
+	sqe->user_data = ((uint64_t)port_index << UR_SHIFT) | UR_RETRY;
 }
 
 /**
- * @brief Close the client connection for the given @p fd
- * with normal close code (1000) and no reason string.
+ * @brief Waits for the eventfd of the worker @p w, see
+ * @ref ur_send and @ref ep_broadcast.
  *
- * @param fd Client fd.
+ * @param w Worker, the calling one.
  *
- * @return Returns 0 on success, -1 otherwise.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_prep_wake(struct ws_worker *w)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe            = ur_sqe(w);
+	sqe->opcode    = IORING_OP_READ;
+	sqe->fd        = w->evfd;
+	sqe->addr      = (uint64_t)(uintptr_t)&w->evbuf;
+	sqe->len       = sizeof(w->evbuf);
+	sqe->user_data = UR_WAKE;
+}
+
+/**
+ * @brief Adds @p conn to the dirty list of the worker @p w, to
+ * have its sends submitted, or to be finished, see @ref ur_flush.
  *
- * @note If the client did not send a close frame in
- * TIMEOUT_MS milliseconds, the server will close the
- * connection with error code (1002).
+ * @param w    Worker, the calling one.
+ * @param conn Client connection.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-int ws_close_client(int fd)
+static void ur_mark(struct ws_worker *w, struct ws_connection *conn)
 {
-	unsigned char clse_code[2];
-	int cc;
-	int i;
+	if (conn->ur_dirty)
+		return;
 
-	/* Check if fd belongs to a connected client. */
-	if ((i = get_client_index(fd)) == -1)
-		return (-1);
+	conn->ur_dirty = true;
+	conn->dirty    = w->dirty;
+	w->dirty       = conn;
+}
 
-	/*
-	 * Instead of using do_close(), we use this to avoid using
-	 * msg_ctrl buffer from wfd and avoid a race condition
-	 * if this is invoked asynchronously.
-	 */
-	cc           = WS_CLSE_NORMAL;
-	clse_code[0] = (cc >> 8);
-	clse_code[1] = (cc & 0xFF);
-	if (ws_sendframe(CLI_SOCK(fd), (const char *)clse_code, sizeof(char) * 2, false,
-			WS_FR_OP_CLSE) < 0)
+/**
+ * @brief Releases @p len bytes reserved by @ref ur_reserve in the
+ * queue of @p conn.
+ *
+ * @param conn Client connection.
+ * @param len  Amount of bytes.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_release(struct ws_connection *conn, size_t len)
+{
+	/* Room again, see @ref ur_wait_room. */
+	__atomic_sub_fetch(&conn->snd_bytes, len, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&conn->snd_waiters, __ATOMIC_SEQ_CST))
 	{
-		DEBUG("An error has occurred while sending closing frame!\n");
-		return (-1);
+		pthread_mutex_lock(&conn->mtx_snd);
+		pthread_cond_broadcast(&conn->cnd_snd);
+		pthread_mutex_unlock(&conn->mtx_snd);
 	}
+}
 
-	/*
-	 * Starts the timeout thread: if the client did not send
-	 * a close frame in TIMEOUT_MS milliseconds, the server
-	 * will close the connection with error code (1002).
-	 */
-	start_close_timeout(i);
-	return (0);
+/**
+ * @brief Releases the send @p req.
+ *
+ * @param req Send.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_send_free(struct ur_send *req)
+{
+	ur_release(conn_at(req->fd), req->len);
+	if (req->msg)
+		bcast_put(req->msg);
+	free(req);
 }
 
 /**
- * @brief Checks is a given opcode @p frame
- * belongs to a control frame or not.
+ * @brief Reserves @p len more bytes in the queue of @p conn, if
+ * they fit in @p max bytes. A single send always fits.
  *
- * @param frame Frame opcode to be checked.
+ * Checked and added at once: concurrent senders cannot both see
+ * the same room.
  *
- * @return Returns 1 if is a control frame, 0 otherwise.
+ * @return Returns whether the bytes were reserved.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static inline int is_control_frame(int frame)
+static bool ur_reserve(struct ws_connection *conn, size_t len, size_t max)
 {
-	return (
-		frame == WS_FR_OP_CLSE || frame == WS_FR_OP_PING || frame == WS_FR_OP_PONG);
+	size_t bytes; /* Queued bytes. */
+
+	bytes = __atomic_load_n(&conn->snd_bytes, __ATOMIC_SEQ_CST);
+	do
+	{
+		if (bytes && bytes + len > max)
+			return (false);
+	} while (!__atomic_compare_exchange_n(&conn->snd_bytes, &bytes,
+		bytes + len, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return (true);
 }
 
 /**
- * @brief Do the handshake process.
+ * @brief Waits until @p len more bytes fit in the queue of the
+ * client @p idx, see @ref UR_SEND_MAX, for at most
+ * @ref SEND_TIMEOUT_MS milliseconds, and reserves them.
  *
- * @param wfd Websocket Frame Data.
- * @param p_index Client port index.
+ * @param conn Client connection.
+ * @param idx  Client index.
+ * @param len  Amount of bytes.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @return Returns 0 if reserved, -1 if timed out or the client
+ * is gone.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int do_handshake(struct ws_frame_data *wfd, int p_index)
+static int ur_wait_room(struct ws_connection *conn, int idx, size_t len)
 {
-	char *response; /* Handshake response message. */
-	char *p;        /* Last request line pointer.  */
-	ssize_t n;      /* Read/Write bytes.           */
-
-	/* Read the very first client message. */
-	if ((n = RECV(wfd->sock, wfd->frm, sizeof(wfd->frm) - 1)) < 0)
-		return (-1);
+	struct timespec ts; /* Deadline.       */
+	bool reserved;      /* Bytes reserved. */
+	bool gone;          /* Client gone.    */
+	int ret;            /* Wait result.    */
 
-	/* Advance our pointers before the first next_byte(). */
-	p = strstr((const char *)wfd->frm, "\r\n\r\n");
-	if (p == NULL)
-	{
-		DEBUG("An empty line with \\r\\n was expected!\n");
-		return (-1);
-	}
-	wfd->amt_read = n;
-	wfd->cur_pos  = (size_t)((ptrdiff_t)(p - (char *)wfd->frm)) + 4;
+	if (ur_reserve(conn, len, UR_SEND_MAX))
+		return (0);
 
-	/* Get response. */
-	if (get_handshake_response((char *)wfd->frm, &response) < 0)
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += SEND_TIMEOUT_MS / 1000;
+	ts.tv_nsec += MS_TO_NS(SEND_TIMEOUT_MS % 1000);
+	while (ts.tv_nsec >= 1000000000)
 	{
-		DEBUG("Cannot get handshake response, request was: %s\n", wfd->frm);
-		return (-1);
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
 	}
 
-	/* Valid request. */
-	DEBUG("Handshaked, response: \n"
-		  "------------------------------------\n"
-		  "%s"
-		  "------------------------------------\n",
-		response);
-
-	/* Send handshake. */
-	if (SEND(wfd->sock, response, strlen(response)) < 0)
+	/* Waiters counted first: a release then sees them, or we see it. */
+	ret = 0;
+	pthread_mutex_lock(&conn->mtx_snd);
+	__atomic_add_fetch(&conn->snd_waiters, 1, __ATOMIC_SEQ_CST);
+	while (!(reserved = ur_reserve(conn, len, UR_SEND_MAX)) &&
+		__atomic_load_n(&conn->client_sock, __ATOMIC_RELAXED) == idx && !ret)
 	{
-		free(response);
-		DEBUG("As error has occurred while handshaking!\n");
-		return (-1);
+		ret = pthread_cond_timedwait(&conn->cnd_snd, &conn->mtx_snd, &ts);
 	}
-
-	/* Trigger events and clean up buffers. */
-	ports[p_index].events.onopen(CLI_SOCK(wfd->sock));
-	free(response);
-	return (0);
+	__atomic_sub_fetch(&conn->snd_waiters, 1, __ATOMIC_SEQ_CST);
+	gone = __atomic_load_n(&conn->client_sock, __ATOMIC_RELAXED) != idx;
+	pthread_mutex_unlock(&conn->mtx_snd);
+
+	/* Gone meanwhile: nothing will be sent. */
+	if (reserved && gone)
+		ur_release(conn, len);
+	return (reserved && !gone ? 0 : -1);
 }
 
 /**
- * @brief Sends a close frame, accordingly with the @p close_code
- * or the message inside @p wfd.
+ * @brief Queues the send @p req after the others of @p conn.
  *
- * @param wfd Websocket Frame Data.
- * @param close_code Websocket close code.
+ * @param w    Worker, the calling one.
+ * @param conn Client connection.
+ * @param req  Send.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_queue(
+	struct ws_worker *w, struct ws_connection *conn, struct ur_send *req)
+{
+	req->next = NULL;
+	if (conn->snd_tail)
+		conn->snd_tail->next = req;
+	else
+		conn->snd_head = req;
+	conn->snd_tail = req;
+	ur_mark(w, conn);
+}
+
+/**
+ * @brief Stops reading from @p conn, which is finished once its
+ * requests are over, and refuses any further send.
+ *
+ * @param w    Worker, the calling one.
+ * @param conn Client connection.
+ * @param drop Whether to drop the sends not yet submitted, e.g: as
+ *             a send failed. Otherwise they are still sent, a close
+ *             frame may be among them.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int do_close(struct ws_frame_data *wfd, int close_code)
+static void ur_close(struct ws_worker *w, struct ws_connection *conn, bool drop)
 {
-	int cc; /* Close code.           */
+	struct io_uring_sqe *sqe; /* Cancel request. */
+	struct ur_send *req;      /* Dropped send.   */
 
-	/* If custom close-code. */
-	if (close_code != -1)
+	if (!conn->ur_closing && !conn->ur_recv_done)
 	{
-		cc = close_code;
-		goto custom_close;
+		sqe            = ur_sqe(w);
+		sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+		sqe->addr      = ((uint64_t)conn->client_sock << UR_SHIFT) | UR_RECV;
+		sqe->user_data = UR_CANCEL;
 	}
+	conn->ur_closing = true;
 
-	/* If empty or have a close reason, just re-send. */
-	if (wfd->frame_size == 0 || wfd->frame_size > 2)
-		goto send;
-
-	/* Parse close code and check if valid, if not, we issue an protocol error. */
-	if (wfd->frame_size == 1)
-		cc = wfd->msg_ctrl[0];
-	else
-		cc = ((int)wfd->msg_ctrl[0]) << 8 | wfd->msg_ctrl[1];
+	while (drop && (req = conn->snd_head))
+	{
+		conn->snd_head = req->next;
+		ur_send_free(req);
+	}
+	if (!conn->snd_head)
+		conn->snd_tail = NULL;
+	ur_mark(w, conn);
+}
 
-	/* Check if it's not valid, if so, we send a protocol error (1002). */
-	if ((cc < 1000 || cc > 1003) && (cc < 1007 || cc > 1011) &&
-		(cc < 3000 || cc > 4999))
+/**
+ * @brief Submits the sends queued for the clients of the dirty
+ * list of the worker @p w, as a chain of linked requests per
+ * client: they are sent in order, each one once the previous is
+ * complete. Clients whose requests are all over are finished.
+ *
+ * @param w Worker, the calling one.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_flush(struct ws_worker *w)
+{
+	struct io_uring_sqe *sqe;   /* Send request.      */
+	struct ws_connection *conn; /* Client connection. */
+	struct ur_send *req;        /* Submitted send.    */
+	unsigned max;               /* Longest chain.     */
+	unsigned n;                 /* Chain length.      */
+	int idx;                    /* Client index.      */
+
+	while ((conn = w->dirty))
 	{
-		cc = WS_CLSE_PROTERR;
+		w->dirty       = conn->dirty;
+		conn->ur_dirty = false;
 
-	custom_close:
-		wfd->msg_ctrl[0] = (cc >> 8);
-		wfd->msg_ctrl[1] = (cc & 0xFF);
+		/* A chain at a time: resumed once it completes. */
+		if (conn->snd_inflight)
+			continue;
 
-		if (ws_sendframe(CLI_SOCK(wfd->sock), (const char *)wfd->msg_ctrl,
-				sizeof(char) * 2, false, WS_FR_OP_CLSE) < 0)
+		if (conn->snd_head)
 		{
-			DEBUG("An error has occurred while sending closing frame!\n");
-			return (-1);
+			/* A chain must be submitted at once. */
+			if (ws_uring_sq_space(&w->ring) < UR_CHAIN &&
+				ws_uring_submit(&w->ring, 0) < 0)
+				panic("io_uring submission failed");
+
+			/* Still full (kernel busy): after the next completions. */
+			if (!(max = ws_uring_sq_space(&w->ring)))
+			{
+				ur_mark(w, conn);
+				break;
+			}
+			if (max > UR_CHAIN)
+				max = UR_CHAIN;
+
+			for (n = 0; n < max && (req = conn->snd_head); n++)
+			{
+				conn->snd_head = req->next;
+
+				sqe            = ur_sqe(w);
+				sqe->opcode    = IORING_OP_SEND;
+				sqe->fd        = req->fd;
+				sqe->addr      = (uint64_t)(uintptr_t)req->data;
+				sqe->len       = (uint32_t)req->len;
+				sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+				sqe->user_data = (uint64_t)(uintptr_t)req | UR_SEND;
+				if (conn->snd_head && n + 1 < max)
+					sqe->flags = IOSQE_IO_LINK;
+			}
+			if (!conn->snd_head)
+				conn->snd_tail = NULL;
+			conn->snd_inflight = (int)n;
+			continue;
 		}
-		return (0);
-	}
 
-	/* Send the data inside wfd->msg_ctrl. */
-send:
-	if (ws_sendframe(CLI_SOCK(wfd->sock), (const char *)wfd->msg_ctrl,
-			wfd->frame_size, false, WS_FR_OP_CLSE) < 0)
-	{
-		DEBUG("An error has occurred while sending closing frame!\n");
-		return (-1);
+		if (!conn->ur_closing || !conn->ur_recv_done)
+			continue;
+
+		/* Over: out of the shard before its fd can be reused. */
+		idx = conn->client_sock;
+		free(conn->in);
+		conn->in     = NULL;
+		conn->in_len = 0;
+		shard_unlink(w, conn);
+		finish_connection(idx, get_client_state(idx) != WS_STATE_CONNECTING);
 	}
-	return (0);
 }
 
 /**
- * @brief Send a pong frame in response to a ping frame.
+ * @brief Sends @p len bytes to the client @p idx of the io_uring
+ * backend: queued to its worker, which submits the sends of each
+ * client in order, see @ref ur_flush.
  *
- * Accordingly to the RFC, a pong frame must have the same
- * data payload as the ping frame, so we just send a
- * ordinary frame with PONG opcode.
+ * @param idx Client connection index.
+ * @param buf Data to be sent, copied unless @p msg.
+ * @param len Amount of bytes.
+ * @param msg Broadcast that @p buf belongs to, if any.
  *
- * @param wfd Websocket frame data.
+ * @return Returns @p len if queued, -1 if the client is closing,
+ * out of memory, or not reading (errno set to EAGAIN).
  *
- * @return Returns 0 if success and a negative number
- * otherwise.
+ * @note From another thread, the send is handed to the worker
+ * through its inbox, and is dropped if the client is gone once
+ * the worker gets it. Sends are not queued without bounds: past
+ * @ref UR_SEND_MAX queued bytes, other threads wait for room, as a
+ * blocking send would; workers cannot, their sends fail past
+ * @ref UR_SEND_HARD bytes, and the owner drops the client then.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int do_pong(struct ws_frame_data *wfd, uint64_t frame_size)
+static ssize_t ur_send(int idx, const void *buf, size_t len,
+	struct ws_bcast *msg)
 {
-	if (ws_sendframe(CLI_SOCK(wfd->sock), (const char *)wfd->msg_ctrl, frame_size,
-			false, WS_FR_OP_PONG) < 0)
+	struct ws_connection *conn; /* Client connection. */
+	struct ur_send *head;       /* Inbox head.        */
+	struct ur_send *req;        /* Send.              */
+	struct ws_worker *self;     /* Calling worker.    */
+	struct ws_worker *w;        /* Owner worker.      */
+
+	conn = conn_at(idx);
+	if (!(w = conn->worker))
+		return (-1);
+
+	/* Not reading: wait for room, or give up. Reserved if not. */
+	self = pthread_getspecific(ep_key);
+	if (self ? !ur_reserve(conn, len, UR_SEND_HARD) :
+		ur_wait_room(conn, idx, len) < 0)
+	{
+		/* Shut down too: its sends in flight would never complete. */
+		if (self == w && !conn->ur_closing)
+		{
+			DEBUG("Client %d is not reading, dropping it\n", idx);
+			ur_close(w, conn, true);
+			shutdown(idx, SHUT_RDWR);
+		}
+		errno = EAGAIN;
+		return (-1);
+	}
+
+	if (!(req = malloc(sizeof(*req) + (msg ? 0 : len))))
+	{
+		ur_release(conn, len);
+		return (-1);
+	}
+
+	req->fd    = idx;
+	req->len   = len;
+	req->msg   = msg;
+	req->start = timing_cb ? now_ns() : 0;
+	req->data  = msg ? msg->frame : req->buf;
+	if (msg)
+		__atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+	else
+		memcpy(req->buf, buf, len);
+
+	if (self == w)
 	{
-		wfd->error = 1;
-		DEBUG("An error has occurred while ponging!\n");
-		return (-1);
+		if (conn->ur_closing)
+		{
+			ur_send_free(req);
+			return (-1);
+		}
+		ur_queue(w, conn, req);
+		return ((ssize_t)len);
 	}
-	return (0);
+
+	head = __atomic_load_n(&w->inbox, __ATOMIC_RELAXED);
+	do
+		req->next = head;
+	while (!__atomic_compare_exchange_n(&w->inbox, &head, req, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* Only an empty inbox needs a wake up, as for broadcasts. */
+	if (!head && ep_wake(w) < 0)
+	{
+		DEBUG("Cannot wake the worker up!\n");
+	}
+	return ((ssize_t)len);
 }
 
 /**
- * @brief Read a chunk of bytes and return the next byte
- * belonging to the frame.
- *
- * @param wfd Websocket Frame Data.
+ * @brief Handles a wake up of the worker @p w: arms the new
+ * listeners, and queues the sends of other threads and the
+ * broadcasts to the clients of its shard.
  *
- * @return Returns the byte read, or -1 if error.
+ * @param w Worker, the calling one.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static inline int next_byte(struct ws_frame_data *wfd)
+static void ur_wake(struct ws_worker *w)
 {
-	ssize_t n;
+	struct ws_bcast_link *link; /* Current broadcast. */
+	struct ws_bcast_link *next; /* Next broadcast.    */
+	struct ws_connection *conn; /* Client connection. */
+	struct ur_send *prev;       /* Previous send.     */
+	struct ur_send *req;        /* Current send.      */
+	struct ur_send *nreq;       /* Next send.         */
+	struct ws_bcast *msg;       /* Broadcast.         */
+	int i;                      /* Loop index.        */
+
+	/* Listeners opened meanwhile, see @ref ep_listen. */
+	for (i = 0; i < MAX_PORTS; i++)
+	{
+		if (!(w->armed & (1u << i)) &&
+			__atomic_load_n(&w->listen_fd[i], __ATOMIC_ACQUIRE) >= 0)
+		{
+			w->armed |= 1u << i;
+			ur_prep_accept(w, i);
+		}
+	}
+
+	/* Sends of other threads, in the order they were made. */
+	req = __atomic_exchange_n(&w->inbox, NULL, __ATOMIC_ACQUIRE);
+	for (prev = NULL; req; req = nreq)
+	{
+		nreq      = req->next;
+		req->next = prev;
+		prev      = req;
+	}
+	for (req = prev; req; req = nreq)
+	{
+		nreq = req->next;
+		conn = conn_at(req->fd);
+		if (get_client_index(req->fd) == -1 || conn->worker != w ||
+			conn->ur_closing)
+			ur_send_free(req);
+		else
+			ur_queue(w, conn, req);
+	}
 
-	/* If empty or full. */
-	if (wfd->cur_pos == 0 || wfd->cur_pos == wfd->amt_read)
+	for (link = bcast_take(w); link; link = next)
 	{
-		if ((n = RECV(wfd->sock, wfd->frm, sizeof(wfd->frm))) <= 0)
+		next = link->next;
+		msg  = link->msg;
+
+		for (conn = w->conns; conn; conn = conn->next)
 		{
-			wfd->error = 1;
-			DEBUG("An error has occurred while trying to read next byte\n");
-			return (-1);
+			if (conn->client_sock == msg->fd ||
+				conn->port_index != msg->port_index ||
+				get_client_state(conn->client_sock) != WS_STATE_OPEN)
+				continue;
+
+			ur_send(conn->client_sock, msg->frame, msg->len, msg);
 		}
-		wfd->amt_read = (size_t)n;
-		wfd->cur_pos  = 0;
+		bcast_put(msg);
 	}
-	return (wfd->frm[wfd->cur_pos++]);
+
+	ur_prep_wake(w);
 }
 
 /**
- * @brief Skips @p frame_size bytes of the current frame.
+ * @brief Handles the completion of a receive of the client @p fd.
  *
- * @param wfd Websocket Frame Data.
- * @param frame_size Amount of bytes to be skipped.
- *
- * @return Returns 0 if success, a negative number
- * otherwise.
+ * @param w     Worker, the calling one.
+ * @param fd    Client socket.
+ * @param res   Bytes received, or negated error.
+ * @param flags Completion flags.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int skip_frame(struct ws_frame_data *wfd, uint64_t frame_size)
+static void ur_recv(struct ws_worker *w, int fd, int res, uint32_t flags)
 {
-	uint64_t i;
-	for (i = 0; i < frame_size; i++)
+	struct ws_connection *conn; /* Client connection. */
+	unsigned bid;               /* Buffer id.         */
+	bool fail;                  /* Input is over.     */
+
+	conn = conn_at(fd);
+	fail = false;
+
+	if (res > 0 && (flags & IORING_CQE_F_BUFFER))
 	{
-		if (next_byte(wfd) == -1)
-		{
-			wfd->error = 1;
-			return (-1);
-		}
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!conn->ur_closing &&
+			conn_input(conn, ws_uring_buf(&w->ring, bid), (size_t)res) < 0)
+			fail = true;
+		ws_uring_buf_put(&w->ring, bid);
 	}
-	return (0);
+	else if (res != -ENOBUFS)
+		fail = true;
+
+	/* Ended: once out of buffers, it is only resumed. */
+	if (!(flags & IORING_CQE_F_MORE))
+	{
+		if (fail || conn->ur_closing)
+			conn->ur_recv_done = true;
+		else
+			ur_prep_recv(w, fd);
+	}
+
+	if (fail)
+		ur_close(w, conn, false);
+	else if (conn->ur_recv_done)
+		ur_mark(w, conn);
 }
 
 /**
- * @brief Reads the current frame isolating data from control frames.
- * The parameters are changed in order to reflect the current state.
- *
- * @param wfd Websocket Frame Data.
- * @param opcode Frame opcode.
- * @param buf Buffer to be written.
- * @param frame_length Length of the current frame.
- * @param frame_size Total size of the frame (considering CONT frames)
- *                   read until the moment.
- * @param msg_idx Message index, reflects the current buffer pointer state.
- * @param masks Masks vector.
- * @param is_fin Is FIN frame indicator.
+ * @brief Handles the completion of the send @p req.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @param w   Worker, the calling one.
+ * @param req Send.
+ * @param res Bytes sent, or negated error.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int read_frame(struct ws_frame_data *wfd,
-	int opcode,
-	unsigned char **buf,
-	uint64_t *frame_length,
-	uint64_t *frame_size,
-	uint64_t *msg_idx,
-	uint8_t *masks,
-	int is_fin)
+static void ur_sent(struct ws_worker *w, struct ur_send *req, int res)
 {
-	unsigned char *tmp; /* Tmp message.     */
-	unsigned char *msg; /* Current message. */
-	int cur_byte;       /* Curr byte read.  */
-	uint64_t i;         /* Loop index.      */
-
-	msg = *buf;
+	struct ws_connection *conn; /* Client connection. */
 
-	/* Decode masks and length for 16-bit messages. */
-	if (*frame_length == 126)
-		*frame_length = (((uint64_t)next_byte(wfd)) << 8) | next_byte(wfd);
+	conn = conn_at(req->fd);
 
-	/* 64-bit messages. */
-	else if (*frame_length == 127)
+	if (timing_cb && req->start)
 	{
-		*frame_length =
-			(((uint64_t)next_byte(wfd)) << 56) | /* frame[2]. */
-			(((uint64_t)next_byte(wfd)) << 48) | /* frame[3]. */
-			(((uint64_t)next_byte(wfd)) << 40) | (((uint64_t)next_byte(wfd)) << 32) |
-			(((uint64_t)next_byte(wfd)) << 24) | (((uint64_t)next_byte(wfd)) << 16) |
-			(((uint64_t)next_byte(wfd)) << 8) |
-			(((uint64_t)next_byte(wfd))); /* frame[9]. */
+		timing_cb(WS_TIMING_SEND, now_ns() - req->start,
+			res >= 0 ? (uint64_t)res : 0);
 	}
 
-	*frame_size += *frame_length;
-
-	/*
-	 * Check frame size
-	 *
-	 * We need to limit the amount supported here, since if
-	 * we follow strictly to the RFC, we have to allow 2^64
-	 * bytes. Also keep in mind that this is still true
-	 * for continuation frames.
-	 */
-	if (*frame_size > MAX_FRAME_LENGTH)
+	/* Failed, or cancelled as a previous one failed. */
+	if (res < 0 || (size_t)res != req->len)
 	{
-		DEBUG("Current frame from client %d, exceeds the maximum\n"
-			  "amount of bytes allowed (%" PRId64 "/%d)!",
-			wfd->sock, *frame_size + *frame_length, MAX_FRAME_LENGTH);
-
-		wfd->error = 1;
-		return (-1);
+		DEBUG("Cannot send to client %d\n", req->fd);
+		ur_close(w, conn, true);
 	}
 
-	/* Read masks. */
-	masks[0] = next_byte(wfd);
-	masks[1] = next_byte(wfd);
-	masks[2] = next_byte(wfd);
-	masks[3] = next_byte(wfd);
+	ur_send_free(req);
+	if (--conn->snd_inflight == 0)
+		ur_mark(w, conn);
+}
 
-	/*
-	 * Abort if error.
-	 *
-	 * This is tricky: we may have multiples error codes from the
-	 * previous next_bytes() calls, but, since we're only setting
-	 * variables and flags, there is no major issue in setting
-	 * them wrong _if_ we do not use their values, thing that
-	 * we do here.
-	 */
-	if (wfd->error)
-		return (-1);
+/**
+ * @brief Handles the completion of an accept on the port
+ * @p port_index: adds the client to the shard of the worker @p w.
+ *
+ * @param w          Worker, the calling one.
+ * @param port_index Index in the port list.
+ * @param res        Client socket, or negated error.
+ * @param flags      Completion flags.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ur_accept(struct ws_worker *w, int port_index, int res,
+	uint32_t flags)
+{
+	int idx; /* Client index. */
 
-	/*
-	 * Allocate memory.
-	 *
-	 * The statement below will allocate a new chunk of memory
-	 * if msg is NULL with size total_length. Otherwise, it will
-	 * resize the total memory accordingly with the message index
-	 * and if the current frame is a FIN frame or not, if so,
-	 * increment the size by 1 to accommodate the line ending \0.
-	 */
-	if (*frame_length > 0)
+	if (res >= 0)
 	{
-		if (!is_control_frame(opcode))
-		{
-			tmp = realloc(
-				msg, sizeof(unsigned char) * (*msg_idx + *frame_length + is_fin));
-			if (!tmp)
-			{
-				DEBUG("Cannot allocate memory, requested: % " PRId64 "\n",
-					(*msg_idx + *frame_length + is_fin));
-
-				wfd->error = 1;
-				return (-1);
-			}
-			msg  = tmp;
-			*buf = msg;
-		}
-
-		/* Copy to the proper location. */
-		for (i = 0; i < *frame_length; i++, (*msg_idx)++)
+		if ((idx = new_client(res, port_index, w)) == -1)
+			close_socket(res);
+		else
 		{
-			/* We were able to read? .*/
-			cur_byte = next_byte(wfd);
-			if (cur_byte == -1)
-				return (-1);
-
-			msg[*msg_idx] = cur_byte ^ masks[i % 4];
+			shard_link(w, conn_at(idx));
+			ur_prep_recv(w, idx);
 		}
 	}
 
-	/* If we're inside a FIN frame, lets... */
-	if (is_fin && *frame_size > 0)
+	/*
+	 * Ended: tried again. If it failed, e.g: out of fds, only after a
+	 * while, as it would fail right away again.
+	 */
+	if (!(flags & IORING_CQE_F_MORE))
 	{
-		/* Increase memory if our FIN frame is of length 0. */
-		if (!*frame_length && !is_control_frame(opcode))
+		if (res < 0)
 		{
-			tmp = realloc(msg, sizeof(unsigned char) * (*msg_idx + 1));
-			if (!tmp)
-			{
-				DEBUG("Cannot allocate memory, requested: %" PRId64 "\n",
-					(*msg_idx + 1));
-
-				wfd->error = 1;
-				return (-1);
-			}
-			msg  = tmp;
-			*buf = msg;
+			DEBUG("Cannot accept: %s, retrying in %d ms\n", strerror(-res),
+				UR_BACKOFF_MS);
+			ur_prep_retry(w, port_index);
 		}
-		msg[*msg_idx] = '\0';
+		else
+			ur_prep_accept(w, port_index);
 	}
-
-	return (0);
 }
 
 /**
- * @brief Reads the next frame, whether if a TXT/BIN/CLOSE
- * of arbitrary size.
+ * @brief io_uring worker: submits its requests and waits for their
+ * completions, both in a single system call, then handles them.
  *
- * @param wfd Websocket Frame Data.
- * @param idx Websocket connection index.
+ * @param p Worker.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @return Never returns.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int next_frame(struct ws_frame_data *wfd, int idx)
-{
-	unsigned char *msg_data; /* Data frame.                */
-	unsigned char *msg_ctrl; /* Control frame.             */
-	uint8_t masks_data[4];   /* Masks data frame array.    */
-	uint8_t masks_ctrl[4];   /* Masks control frame array. */
-	uint64_t msg_idx_data;   /* Current msg index.         */
-	uint64_t msg_idx_ctrl;   /* Current msg index.         */
-	uint64_t frame_length;   /* Frame length.              */
-	uint64_t frame_size;     /* Current frame size.        */
-	uint32_t utf8_state;     /* Current UTF-8 state.       */
-	uint8_t opcode;          /* Frame opcode.              */
-	uint8_t is_fin;          /* Is FIN frame flag.         */
-	uint8_t mask;            /* Mask.                      */
-	int cur_byte;            /* Current frame byte.        */
-
-	msg_data        = NULL;
-	msg_ctrl        = wfd->msg_ctrl;
-	is_fin          = 0;
-	frame_length    = 0;
-	frame_size      = 0;
-	msg_idx_data    = 0;
-	msg_idx_ctrl    = 0;
-	wfd->frame_size = 0;
-	wfd->frame_type = -1;
-	wfd->msg        = NULL;
-	utf8_state      = UTF8_ACCEPT;
-
-	/* Read until find a FIN or a unsupported frame. */
-	do
+static void *ur_worker(void *p)
+{
+	struct io_uring_cqe *cqe; /* Completion.        */
+	struct ws_worker *w;      /* This worker.       */
+	uint64_t data;            /* Completion data.   */
+	uint32_t flags;           /* Completion flags.  */
+	int res;                  /* Completion result. */
+
+	w = p;
+	pthread_setspecific(ep_key, w);
+	if (ws_uring_init(&w->ring, UR_ENTRIES, UR_BUFS, UR_BUF_SIZE) < 0)
+		panic("Could not set the io_uring up");
+
+	ur_prep_wake(w);
+	while (1)
 	{
-		/*
-		 * Obs: next_byte() can return error if not possible to read the
-		 * next frame byte, in this case, we return an error.
-		 *
-		 * However, please note that this check is only made here and in
-		 * the subsequent next_bytes() calls this also may occur too.
-		 * wsServer is assuming that the client only create right
-		 * frames and we will do not have disconnections while reading
-		 * the frame but just when waiting for a frame.
-		 */
-		cur_byte = next_byte(wfd);
-		if (cur_byte == -1)
-			return (-1);
-
-		is_fin = (cur_byte & 0xFF) >> WS_FIN_SHIFT;
-		opcode = (cur_byte & 0xF);
+		ur_flush(w);
+		if (ws_uring_submit(&w->ring, 1) < 0)
+			panic("io_uring_enter failed");
 
-		/*
-		 * Check for RSV field.
-		 *
-		 * Since wsServer do not negotiate extensions if we receive
-		 * a RSV field, we must drop the connection.
-		 */
-		if (cur_byte & 0x70)
-		{
-			DEBUG("RSV is set while wsServer do not negotiate extensions!\n");
-			wfd->error = 1;
-			break;
-		}
-
-		/*
-		 * Check if the current opcode makes sense:
-		 * a) If we're inside a cont frame but no previous data frame
-		 *
-		 * b) If we're handling a data-frame and receive another data
-		 *    frame. (it's expected to receive only CONT or control
-		 *    frames).
-		 *
-		 * It is worth to note that in a), we do not need to check
-		 * if the previous frame was FIN or not: if was FIN, an
-		 * on_message event was triggered and this function returned;
-		 * so the only possibility here is a previous non-FIN data
-		 * frame, ;-).
-		 */
-		if ((wfd->frame_type == -1 && opcode == WS_FR_OP_CONT) ||
-			(wfd->frame_type != -1 && !is_control_frame(opcode) &&
-				opcode != WS_FR_OP_CONT))
+		while ((cqe = ws_uring_cqe(&w->ring)))
 		{
-			DEBUG("Unexpected frame was received!, opcode: %d, previous: %d\n",
-				opcode, wfd->frame_type);
-			wfd->error = 1;
-			break;
-		}
+			data  = cqe->user_data;
+			res   = cqe->res;
+			flags = cqe->flags;
+			ws_uring_cqe_seen(&w->ring);
 
-		/* Check if one of the valid opcodes. */
-		if (opcode == WS_FR_OP_TXT || opcode == WS_FR_OP_BIN ||
-			opcode == WS_FR_OP_CONT || opcode == WS_FR_OP_PING ||
-			opcode == WS_FR_OP_PONG || opcode == WS_FR_OP_CLSE)
-		{
-			/*
-			 * Check our current state: if CLOSING, we only accept close
-			 * frames.
-			 *
-			 * Since the server may, at any time, asynchronously, asks
-			 * to close the client connection, we should terminate
-			 * immediately.
-			 */
-			if (get_client_state(idx) == WS_STATE_CLOSING && opcode != WS_FR_OP_CLSE)
+			switch (data & UR_TYPE)
 			{
-				DEBUG(
-					"Unexpected frame received, expected CLOSE (%d), received: (%d)",
-					WS_FR_OP_CLSE, opcode);
-				wfd->error = 1;
+			case UR_RECV:
+				ur_recv(w, (int)(data >> UR_SHIFT), res, flags);
 				break;
-			}
-
-			/* Only change frame type if not a CONT frame. */
-			if (opcode != WS_FR_OP_CONT && !is_control_frame(opcode))
-				wfd->frame_type = opcode;
-
-			mask         = next_byte(wfd);
-			frame_length = mask & 0x7F;
-			frame_size   = 0;
-			msg_idx_ctrl = 0;
-
-			/*
-			 * We should deny non-FIN control frames or that have
-			 * more than 125 octets.
-			 */
-			if (is_control_frame(opcode) && (!is_fin || frame_length > 125))
-			{
-				DEBUG("Control frame bigger than 125 octets or not a FIN frame!\n");
-				wfd->error = 1;
+			case UR_SEND:
+				ur_sent(w, (struct ur_send *)(uintptr_t)(data & ~(uint64_t)UR_TYPE),
+					res);
+				break;
+			case UR_ACCEPT:
+				ur_accept(w, (int)(data >> UR_SHIFT), res, flags);
+				break;
+			case UR_WAKE:
+				ur_wake(w);
+				break;
+			case UR_RETRY:
+				ur_prep_accept(w, (int)(data >> UR_SHIFT));
+				break;
+			default:
+				/* UR_CANCEL, its target completes as well. */
 				break;
 			}
-
-			/* Normal data frames. */
-			if (opcode == WS_FR_OP_TXT || opcode == WS_FR_OP_BIN ||
-				opcode == WS_FR_OP_CONT)
-			{
-				read_frame(wfd, opcode, &msg_data, &frame_length, &wfd->frame_size,
-					&msg_idx_data, masks_data, is_fin);
-
-#ifdef VALIDATE_UTF8
-				/* UTF-8 Validate partial (or not) frame. */
-				if (wfd->frame_type == WS_FR_OP_TXT)
-				{
-					if (is_fin)
-					{
-						if (is_utf8_len_state(
-								msg_data + (msg_idx_data - frame_length),
-								frame_length, utf8_state) != UTF8_ACCEPT)
-						{
-							DEBUG("Dropping invalid complete message!\n");
-							wfd->error = 1;
-							do_close(wfd, WS_CLSE_INVUTF8);
-						}
-					}
-
-					/* Check current state for a CONT or initial TXT frame. */
-					else
-					{
-						utf8_state = is_utf8_len_state(
-							msg_data + (msg_idx_data - frame_length), frame_length,
-							utf8_state);
-
-						/* We can be in any state, except reject. */
-						if (utf8_state == UTF8_REJECT)
-						{
-							DEBUG("Dropping invalid cont/initial frame!\n");
-							wfd->error = 1;
-							do_close(wfd, WS_CLSE_INVUTF8);
-						}
-					}
-				}
+		}
+	}
+	return (NULL);
+}
 #endif
-			}
 
-			/*
-			 * We _never_ send a PING frame, so it's not expected to receive a PONG
-			 * frame. However, the specs states that a client could send an
-			 * unsolicited PONG frame. The server just have to ignore the
-			 * frame.
-			 *
-			 * The skip amount will always be 4 (masks vector size) + frame size
-			 */
-			else if (opcode == WS_FR_OP_PONG)
-			{
-				skip_frame(wfd, 4 + frame_length);
-				is_fin = 0;
-				continue;
-			}
+/**
+ * @brief Starts the event loop workers, once.
+ *
+ * @note Must be called with the global mutex held.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ep_start(void)
+{
+	struct epoll_event ev; /* Watched events. */
+	int i;                 /* Loop index.     */
+	int p;                 /* Port index.     */
 
-			/* We should answer to a PING frame as soon as possible. */
-			else if (opcode == WS_FR_OP_PING)
-			{
-				if (read_frame(wfd, opcode, &msg_ctrl, &frame_length, &frame_size,
-						&msg_idx_ctrl, masks_ctrl, is_fin) < 0)
-					break;
+	if (ep_workers)
+		return;
 
-				if (do_pong(wfd, frame_size) < 0)
-					break;
+	ep_workers = calloc(ep_nworkers, sizeof(*ep_workers));
+	if (!ep_workers)
+		panic("Cannot allocate the workers, out of memory!\n");
 
-				/* Quick hack to keep our loop. */
-				is_fin = 0;
-			}
+	if (pthread_key_create(&ep_key, NULL))
+		panic("Could not create the worker key");
 
-			/* We interrupt the loop as soon as we find a CLOSE frame. */
-			else
-			{
-				if (read_frame(wfd, opcode, &msg_ctrl, &frame_length, &frame_size,
-						&msg_idx_ctrl, masks_ctrl, is_fin) < 0)
-					break;
-
-#ifdef VALIDATE_UTF8
-				/* If there is a close reason, check if it is UTF-8 valid. */
-				if (frame_size > 2 && !is_utf8_len(msg_ctrl + 2, frame_size - 2))
-				{
-					DEBUG("Invalid close frame payload reason! (not UTF-8)\n");
-					wfd->error = 1;
-					break;
-				}
-#endif
+	for (i = 0; i < ep_nworkers; i++)
+	{
+		for (p = 0; p < MAX_PORTS; p++)
+			ep_workers[i].listen_fd[p] = -1;
 
-				/* Since we're aborting, we can scratch the 'data'-related
-				 * vars here. */
-				wfd->frame_size = frame_size;
-				wfd->frame_type = WS_FR_OP_CLSE;
-				free(msg_data);
-				return (0);
-			}
+		/* Sharded: wakes the worker up to send broadcasts. */
+		if (io_backend != WS_BACKEND_EPOLL)
+		{
+			ep_workers[i].evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (ep_workers[i].evfd < 0)
+				panic("Could not create the worker eventfd");
 		}
 
-		/* Anything else (unsupported frames). */
-		else
+#ifdef WS_HAVE_URING
+		/* io_uring: no epoll, everything goes through the ring. */
+		if (io_backend == WS_BACKEND_URING)
 		{
-			DEBUG("Unsupported frame opcode: %d\n", opcode);
-			/* We should consider as error receive an unknown frame. */
-			wfd->frame_type = opcode;
-			wfd->error      = 1;
+			if (pthread_create(&ep_workers[i].thread, NULL, ur_worker, &ep_workers[i]))
+				panic("Could not create the worker thread!");
+			pthread_detach(ep_workers[i].thread);
+			continue;
 		}
+#endif
 
-	} while (!is_fin && !wfd->error);
+		if ((ep_workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			panic("Could not create the epoll instance");
 
-	/* Check for error. */
-	if (wfd->error)
-	{
-		free(msg_data);
-		wfd->msg = NULL;
-		return (-1);
+		if (io_backend == WS_BACKEND_SHARDED)
+		{
+			memset(&ev, 0, sizeof(ev));
+			ev.events   = EPOLLIN;
+			ev.data.u32 = EP_WAKE;
+			if (epoll_ctl(ep_workers[i].epfd, EPOLL_CTL_ADD, ep_workers[i].evfd, &ev))
+				panic("Could not watch the worker eventfd");
+		}
+		if (pthread_create(&ep_workers[i].thread, NULL, ep_worker, &ep_workers[i]))
+			panic("Could not create the worker thread!");
+		pthread_detach(ep_workers[i].thread);
 	}
-
-	wfd->msg = msg_data;
-	return (0);
 }
 
+#endif
 /**
- * @brief Establishes to connection with the client and trigger
- * events when occurs one.
- *
- * @param vsock Client connection index.
+ * @brief Creates a socket listening on the port @p port.
  *
- * @return Returns @p vsock.
+ * @param port      Server port.
+ * @param reuseport Whether other sockets may listen on the
+ *                  same port (SO_REUSEPORT).
  *
- * @note This will be run on a different thread.
+ * @return Returns the socket.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static void *ws_establishconnection(void *vsock)
+static int listen_socket(uint16_t port, bool reuseport)
 {
-	struct ws_frame_data wfd; /* WebSocket frame data.   */
-	int connection_index;     /* Client connect. index.  */
-	int clse_thrd;            /* Time-out close thread.  */
-	int p_index;              /* Port list index.        */
-	int sock;                 /* File descriptor.        */
-
-	connection_index = (int)(intptr_t)vsock;
-	sock             = client_socks[connection_index].client_sock;
-	p_index          = client_socks[connection_index].port_index;
+	struct sockaddr_in server; /* Server.        */
+	int reuse;                 /* Socket option. */
+	int sock;                  /* Socket.        */
 
-	/* Prepare frame data. */
-	memset(&wfd, 0, sizeof(wfd));
-	wfd.sock = sock;
-
-	/* Do handshake. */
-	if (do_handshake(&wfd, p_index) < 0)
-		goto closed;
-
-	/* Change state. */
-	set_client_state(connection_index, WS_STATE_OPEN);
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		panic("Could not create socket");
 
-	/* Read next frame until client disconnects or an error occur. */
-	while (next_frame(&wfd, connection_index) >= 0)
+	/* Reuse previous address. */
+	reuse = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse,
+			sizeof(reuse)) < 0)
 	{
-		/* Text/binary event. */
-		if ((wfd.frame_type == WS_FR_OP_TXT || wfd.frame_type == WS_FR_OP_BIN) &&
-			!wfd.error)
-		{
-			ports[p_index].events.onmessage(
-				sock, wfd.msg, wfd.frame_size, wfd.frame_type);
-		}
+		panic("setsockopt(SO_REUSEADDR) failed");
+	}
 
-		/* Close event. */
-		else if (wfd.frame_type == WS_FR_OP_CLSE && !wfd.error)
-		{
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+			(const char *)&reuse, sizeof(reuse)) < 0)
+	{
+		panic("setsockopt(SO_REUSEPORT) failed");
+	}
+#else
+	((void)reuseport);
+#endif
 
-			/*
-			 * We only send a CLOSE frame once, if we're already
-			 * in CLOSING state, there is no need to send.
-			 */
-			if (get_client_state(connection_index) != WS_STATE_CLOSING)
-			{
-				set_client_state(connection_index, WS_STATE_CLOSING);
+	/* Prepare the sockaddr_in structure. */
+	server.sin_family      = AF_INET;
+	server.sin_addr.s_addr = INADDR_ANY;
+	server.sin_port        = htons(port);
 
-				/* We only send a close frameSend close frame */
-				do_close(&wfd, -1);
-			}
+	/* Bind. */
+	if (bind(sock, (struct sockaddr *)&server, sizeof(server)) < 0)
+		panic("Bind failed");
 
-			free(wfd.msg);
-			break;
-		}
+	/* Listen. */
+	listen(sock, max_clients);
+	return (sock);
+}
 
-		free(wfd.msg);
-	}
+#ifdef __linux__
+/**
+ * @brief Opens a listener on @p port for each worker of the
+ * sharded backends, each one accepting into its own shard.
+ *
+ * @param port_index Index in the port list.
+ * @param port       Server port.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void ep_listen(int port_index, uint16_t port)
+{
+	struct epoll_event ev; /* Watched events. */
+	struct ws_worker *w;   /* Worker.         */
+	int flags;             /* Socket flags.   */
+	int fd;                /* Listener.       */
+	int i;                 /* Loop index.     */
 
-	/*
-	 * on_close events always occur, whether for client closure
-	 * or server closure, as the server is expected to
-	 * always know when the client disconnects.
-	 */
-	ports[p_index].events.onclose(sock);
+	for (i = 0; i < ep_nworkers; i++)
+	{
+		w  = &ep_workers[i];
+		fd = listen_socket(port, true);
 
-closed:
-	clse_thrd = client_socks[connection_index].close_thrd;
+		flags = fcntl(fd, F_GETFL);
+		if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+			panic("Could not set the listener non-blocking");
 
-	/* Wait for timeout thread if necessary. */
-	if (clse_thrd)
-	{
-		pthread_cond_signal(&client_socks[connection_index].cnd_state_close);
-		pthread_join(client_socks[connection_index].thrd_tout, NULL);
-	}
+		__atomic_store_n(&w->listen_fd[port_index], fd, __ATOMIC_RELEASE);
 
-	/* Close connectin properly. */
-	if (get_client_state(connection_index) != WS_STATE_CLOSED)
-		close_client(connection_index, sock);
+#ifdef WS_HAVE_URING
+		/* Armed by the worker itself, see @ref ur_wake. */
+		if (io_backend == WS_BACKEND_URING)
+		{
+			if (ep_wake(w) < 0)
+				panic("Could not wake the worker up");
+			continue;
+		}
+#endif
 
-	return (vsock);
+		/* Level-triggered: clients left pending are reported again. */
+		memset(&ev, 0, sizeof(ev));
+		ev.events   = EPOLLIN;
+		ev.data.u32 = EP_LISTEN | (uint32_t)port_index;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev))
+			panic("Could not watch the listener");
+	}
 }
+#endif
 
 /**
  * @brief Main loop that keeps accepting new connections.
@@ -1412,11 +3435,9 @@ static void *ws_accept(void *data)
 	int connection_index;          /* Free connection slot.  */
 	int new_sock;                  /* New opened connection. */
 	int len;                       /* Length of sockaddr.    */
-	int i;                         /* Loop index.            */
 
-	connection_index = 0;
-	accept_data      = data;
-	len              = sizeof(struct sockaddr_in);
+	accept_data = data;
+	len         = sizeof(struct sockaddr_in);
 
 	while (1)
 	{
@@ -1428,29 +3449,19 @@ static void *ws_accept(void *data)
 			panic("Error on accepting connections..");
 
 		/* Adds client socket to socks list. */
-		pthread_mutex_lock(&mutex);
-		for (i = 0; i < MAX_CLIENTS; i++)
-		{
-			if (client_socks[i].client_sock == -1)
-			{
-				client_socks[i].client_sock = new_sock;
-				client_socks[i].port_index  = accept_data->port_index;
-				client_socks[i].state       = WS_STATE_CONNECTING;
-				client_socks[i].close_thrd  = false;
-				connection_index            = i;
-
-				if (pthread_mutex_init(&client_socks[i].mtx_state, NULL))
-					panic("Error on allocating close mutex");
-				if (pthread_cond_init(&client_socks[i].cnd_state_close, NULL))
-					panic("Error on allocating condition var\n");
-				break;
-			}
-		}
-		pthread_mutex_unlock(&mutex);
+		connection_index = new_client(new_sock, accept_data->port_index, NULL);
 
 		/* Client socket added to socks list ? */
-		if (i != MAX_CLIENTS)
+		if (connection_index != -1)
 		{
+#ifdef __linux__
+			if (io_backend == WS_BACKEND_EPOLL)
+			{
+				if (ep_add(NULL, connection_index) < 0)
+					close_client(connection_index);
+				continue;
+			}
+#endif
 			if (pthread_create(&client_thread, NULL, ws_establishconnection,
 					(void *)(intptr_t)connection_index))
 				panic("Could not create the client thread!");
@@ -1485,9 +3496,7 @@ static void *ws_accept(void *data)
 int ws_socket(struct ws_events *evs, uint16_t port, int thread_loop)
 {
 	struct ws_accept *accept_data; /* Accept thread data.    */
-	struct sockaddr_in server;     /* Server.                */
 	pthread_t accept_thread;       /* Accept thread.         */
-	int reuse;                     /* Socket option.         */
 
 	/* Checks if the event list is a valid pointer. */
 	if (evs == NULL)
@@ -1530,34 +3539,33 @@ int ws_socket(struct ws_events *evs, uint16_t port, int thread_loop)
 	setvbuf(stdout, NULL, _IONBF, 0);
 #endif
 
-	/* Create socket. */
-	accept_data->sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (accept_data->sock < 0)
-		panic("Could not create socket");
-
-	/* Reuse previous address. */
-	reuse = 1;
-	if (setsockopt(accept_data->sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse,
-			sizeof(reuse)) < 0)
+#ifdef __linux__
+	if (io_backend != WS_BACKEND_THREADS)
 	{
-		panic("setsockopt(SO_REUSEADDR) failed");
+		pthread_mutex_lock(&mutex);
+		ep_start();
+		pthread_mutex_unlock(&mutex);
 	}
 
-	/* Prepare the sockaddr_in structure. */
-	server.sin_family      = AF_INET;
-	server.sin_addr.s_addr = INADDR_ANY;
-	server.sin_port        = htons(port);
+	/* A listener per worker, the kernel balances the clients. */
+	if (io_backend == WS_BACKEND_SHARDED || io_backend == WS_BACKEND_URING)
+	{
+		ep_listen(accept_data->port_index, port);
+		free(accept_data);
 
-	/* Bind. */
-	if (bind(accept_data->sock, (struct sockaddr *)&server, sizeof(server)) < 0)
-		panic("Bind failed");
+		printf("Waiting for incoming connections...\n");
+		if (!thread_loop)
+			while (1)
+				pause();
+		return (0);
+	}
+#endif
 
-	/* Listen. */
-	listen(accept_data->sock, MAX_CLIENTS);
+	/* Create socket. */
+	accept_data->sock = listen_socket(port, false);
 
 	/* Wait for incoming connections. */
 	printf("Waiting for incoming connections...\n");
-	memset(client_socks, -1, sizeof(client_socks));
 
 	/* Accept connections. */
 	if (!thread_loop)
@@ -1602,22 +3610,11 @@ int ws_file(struct ws_events *evs, const char *file)
 	memcpy(&ports[0].events, evs, sizeof(struct ws_events));
 	ports[0].port_number = 0;
 
-	/* Clear client socks list. */
-	memset(client_socks, -1, sizeof(client_socks));
-
 	/* Set client settings. */
-	client_socks[0].client_sock = sock;
-	client_socks[0].port_index  = 0;
-	client_socks[0].state       = WS_STATE_CONNECTING;
-	client_socks[0].close_thrd  = false;
-
-	/* Initialize mutexes. */
-	if (pthread_mutex_init(&client_socks[0].mtx_state, NULL))
-		panic("Error on allocating close mutex");
-	if (pthread_cond_init(&client_socks[0].cnd_state_close, NULL))
-		panic("Error on allocating condition var\n");
-
-	ws_establishconnection((void *)(intptr_t)0);
+	if (new_client(sock, 0, NULL) < 0)
+		panic("Cannot allocate the client slot\n");
+
+	ws_establishconnection((void *)(intptr_t)sock);
 	return (0);
 }
 #endif
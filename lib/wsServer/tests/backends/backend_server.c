@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ws.h>
+
+/**
+ * @dir tests/backends
+ * @brief wsServer I/O backends tests folder
+ *
+ * @file backend_server.c
+ * @brief Server driven by backend_test.py.
+ *
+ * Echoes every message back, with the same type, except for:
+ * - `close`: closes the connection (close handshake).
+ * - `bcast:<text>`: sent to every client, the sender included.
+ * - `tick`: makes the client the target of the sender threads,
+ *   which send it 64 KiB binary frames from outside the server
+ *   threads, as fast as they can. Each frame starts with the sender
+ *   index (1 byte) and its sequence number (4 bytes, big endian),
+ *   only incremented once a send succeeds.
+ * - `untick`: stops the sender threads.
+ * - `stats`: answers with the clients connected, and the sends of
+ *   the sender threads that succeeded, failed, and failed with
+ *   EAGAIN (the client was not reading).
+ */
+
+/**
+ * @brief Size of the frames sent by the sender threads.
+ */
+#define TICK_SIZE (64 * 1024)
+
+/**
+ * @brief Maximum amount of sender threads.
+ */
+#define MAX_SENDERS 16
+
+/**
+ * @brief Target of the sender threads, -1 if none.
+ */
+static int target = -1;
+
+/**
+ * @brief Clients connected, and sender thread results.
+ */
+static int nopen;
+static int sent;
+static int failed;
+static int eagain;
+
+/**
+ * @brief Called when a client connects to the server.
+ *
+ * @param fd Client file descriptor.
+ */
+void onopen(int fd)
+{
+	((void)fd);
+	__atomic_add_fetch(&nopen, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Called when a client disconnects from the server.
+ *
+ * @param fd Client file descriptor.
+ */
+void onclose(int fd)
+{
+	int cur;
+
+	cur = fd;
+	__atomic_compare_exchange_n(&target, &cur, -1, false, __ATOMIC_ACQ_REL,
+		__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&nopen, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Handles a message, see the file description.
+ *
+ * @param fd   Client file descriptor.
+ * @param msg  Received message.
+ * @param size Message size (in bytes).
+ * @param type Message type.
+ */
+void onmessage(int fd, const unsigned char *msg, uint64_t size, int type)
+{
+	char buf[128];
+
+	if (type != WS_FR_OP_TXT)
+		goto echo;
+
+	if (size == 5 && !memcmp(msg, "close", 5))
+		ws_close_client(fd);
+	else if (size >= 6 && !memcmp(msg, "bcast:", 6))
+		ws_sendframe(fd, (const char *)msg, size, true, type);
+	else if (size == 4 && !memcmp(msg, "tick", 4))
+		__atomic_store_n(&target, fd, __ATOMIC_RELEASE);
+	else if (size == 6 && !memcmp(msg, "untick", 6))
+		__atomic_store_n(&target, -1, __ATOMIC_RELEASE);
+	else if (size == 5 && !memcmp(msg, "stats", 5))
+	{
+		snprintf(buf, sizeof(buf), "open %d sent %d failed %d eagain %d",
+			__atomic_load_n(&nopen, __ATOMIC_RELAXED),
+			__atomic_load_n(&sent, __ATOMIC_RELAXED),
+			__atomic_load_n(&failed, __ATOMIC_RELAXED),
+			__atomic_load_n(&eagain, __ATOMIC_RELAXED));
+		ws_sendframe_txt(fd, buf, false);
+	}
+	else
+		goto echo;
+	return;
+
+echo:
+	ws_sendframe(fd, (const char *)msg, size, false, type);
+}
+
+/**
+ * @brief Sender thread: sends numbered frames to the target, if
+ * any, see the file description.
+ *
+ * @param arg Sender index.
+ *
+ * @return Never returns.
+ */
+static void *sender(void *arg)
+{
+	static const struct timespec idle = {0, 1000000};
+	unsigned char frame[TICK_SIZE];
+	uint32_t seq;
+	int fd;
+
+	memset(frame, 0, sizeof(frame));
+	frame[0] = (unsigned char)(uintptr_t)arg;
+	seq      = 0;
+
+	while (1)
+	{
+		fd = __atomic_load_n(&target, __ATOMIC_ACQUIRE);
+		if (fd < 0)
+		{
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		frame[1] = (unsigned char)(seq >> 24);
+		frame[2] = (unsigned char)(seq >> 16);
+		frame[3] = (unsigned char)(seq >> 8);
+		frame[4] = (unsigned char)seq;
+
+		errno = 0;
+		if (ws_sendframe_bin(fd, (const char *)frame, sizeof(frame), false) < 0)
+		{
+			__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+			if (errno == EAGAIN)
+				__atomic_add_fetch(&eagain, 1, __ATOMIC_RELAXED);
+
+			/* E.g: gone, do not spin on it. */
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		__atomic_add_fetch(&sent, 1, __ATOMIC_RELAXED);
+		seq++;
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Main routine.
+ */
+int main(int argc, char **argv)
+{
+	struct ws_events evs;
+	const char *backend;
+	pthread_t thread;
+	int senders;
+	int workers;
+	int clients;
+	int port;
+	int opt;
+	int i;
+
+	backend = "threads";
+	senders = 4;
+	workers = 2;
+	clients = 64;
+	port    = 8091;
+
+	while ((opt = getopt(argc, argv, "b:w:c:p:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			senders = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (senders < 0 || senders > MAX_SENDERS)
+		goto usage;
+
+	if (!strcmp(backend, "threads"))
+		ws_backend(WS_BACKEND_THREADS, 0);
+	else if (!strcmp(backend, "epoll"))
+	{
+		if (ws_backend(WS_BACKEND_EPOLL, workers) < 0)
+		{
+			fprintf(stderr, "epoll backend not available\n");
+			return (1);
+		}
+	}
+	else if (!strcmp(backend, "sharded"))
+	{
+		if (ws_backend(WS_BACKEND_SHARDED, workers) < 0)
+		{
+			fprintf(stderr, "sharded backend not available\n");
+			return (1);
+		}
+	}
+	else if (!strcmp(backend, "uring"))
+	{
+		/* No fallback: the sharded backend is tested on its own. */
+		if (ws_backend(WS_BACKEND_URING, workers) != 0)
+		{
+			fprintf(stderr, "io_uring backend not available\n");
+			return (1);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "Unknown backend: %s\n", backend);
+		return (1);
+	}
+
+	if (ws_max_clients(clients) < 0)
+	{
+		fprintf(stderr, "Invalid max clients: %d\n", clients);
+		return (1);
+	}
+
+	for (i = 0; i < senders; i++)
+	{
+		if (pthread_create(&thread, NULL, sender, (void *)(uintptr_t)i))
+		{
+			fprintf(stderr, "Could not create the sender threads\n");
+			return (1);
+		}
+		pthread_detach(thread);
+	}
+
+	evs.onopen    = &onopen;
+	evs.onclose   = &onclose;
+	evs.onmessage = &onmessage;
+	ws_socket(&evs, (uint16_t)port, 0);
+	return (0);
+
+usage:
+	fprintf(stderr,
+		"Usage: %s [-b threads|epoll|sharded|uring] [-w workers]"
+		" [-c max_clients] [-p port] [-s senders]\n",
+		argv[0]);
+	return (1);
+}
@@ -0,0 +1,357 @@
+#!/usr/bin/env python
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Tests one backend_server, see run-backends.sh.
+#
+# Usage: backend_test.py backend port max_clients
+#
+
+import base64
+import os
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+# Fancy colors =)
+RED="\033[0;31m"
+GREEN="\033[0;32m"
+NC="\033[0m"
+
+backend     = sys.argv[1]
+port        = int(sys.argv[2])
+max_clients = int(sys.argv[3])
+
+# Event loop backends: a client not reading must not hold up
+# anyone else.
+event_loop = backend != "threads"
+
+def frame(op, data, fin=True, masked=True):
+	if isinstance(data, str):
+		data = data.encode()
+
+	n  = len(data)
+	mb = 0x80 if masked else 0
+	h  = bytes([(0x80 if fin else 0) | op])
+	if n < 126:
+		h += bytes([mb | n])
+	elif n < 65536:
+		h += bytes([mb | 126]) + struct.pack(">H", n)
+	else:
+		h += bytes([mb | 127]) + struct.pack(">Q", n)
+
+	if not masked:
+		return h + data
+
+	m   = os.urandom(4)
+	key = int.from_bytes((m * (n // 4 + 1))[:n], "big")
+	return h + m + (int.from_bytes(data, "big") ^ key).to_bytes(n, "big")
+
+class Client:
+	def __init__(self, timeout=5):
+		self.s = socket.create_connection(("127.0.0.1", port))
+		self.s.settimeout(timeout)
+		self.buf = b""
+
+		key = base64.b64encode(os.urandom(16)).decode()
+		self.s.sendall(("GET / HTTP/1.1\r\nHost: localhost\r\n"
+			"Upgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: {}\r\n"
+			"Sec-WebSocket-Version: 13\r\n\r\n").format(key).encode())
+
+		while b"\r\n\r\n" not in self.buf:
+			self.fill()
+		hs, self.buf = self.buf.split(b"\r\n\r\n", 1)
+		if not hs.startswith(b"HTTP/1.1 101"):
+			raise EOFError
+
+	def fill(self):
+		d = self.s.recv(1 << 16)
+		if not d:
+			raise EOFError
+		self.buf += d
+
+	def need(self, n):
+		while len(self.buf) < n:
+			self.fill()
+		r = self.buf[:n]
+		self.buf = self.buf[n:]
+		return r
+
+	def send(self, data, op=1):
+		self.s.sendall(frame(op, data))
+
+	def recv(self):
+		h  = self.need(2)
+		op = h[0] & 15
+		n  = h[1] & 127
+		if n == 126:
+			n = struct.unpack(">H", self.need(2))[0]
+		elif n == 127:
+			n = struct.unpack(">Q", self.need(8))[0]
+		return (op, self.need(n))
+
+	# Next text message, skipping what the sender threads send.
+	def recv_text(self):
+		while True:
+			op, d = self.recv()
+			if op == 1:
+				return d.decode()
+
+	def close(self):
+		self.s.close()
+
+	# Closes with a RST, as if the client was gone.
+	def reset(self):
+		self.s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+			struct.pack("ii", 1, 0))
+		self.s.close()
+
+# Asked by c, or by a client of its own (not counted).
+def stats(c=None):
+	own = c is None
+	if own:
+		c = Client()
+	c.send("stats")
+	v = c.recv_text().split()
+	if own:
+		c.close()
+
+	v = dict(zip(v[::2], map(int, v[1::2])))
+	v["open"] -= own
+	return v
+
+# Waits for at most n clients connected.
+def wait_open(n, c=None, timeout=10):
+	t0 = time.time()
+	while time.time() - t0 < timeout:
+		if stats(c)["open"] <= n:
+			return True
+		time.sleep(0.1)
+	return False
+
+#
+# Tests, each one raising AssertionError on failure.
+#
+
+# The client past max_clients is refused, and its slot is
+# available again once another client leaves.
+def test_max_clients():
+	cs = [Client() for _ in range(max_clients)]
+	try:
+		Client(timeout=2)
+		raise AssertionError("client over the limit accepted")
+	except (EOFError, ConnectionError):
+		pass
+
+	cs.pop().close()
+	assert wait_open(max_clients - 1, cs[0]), "closed client still counted"
+	cs.append(Client())
+	for c in cs:
+		c.close()
+	assert wait_open(0), "clients still counted"
+
+# Fragmented messages with interleaved pings, written in chunks of
+# every size, are echoed back whole and in order.
+def test_fragments():
+	rnd = random.Random(1)
+	for it in range(30):
+		c = Client()
+		msgs  = []
+		raw   = b""
+		pings = 0
+		for k in range(rnd.randint(1, 6)):
+			text = ("é" * rnd.randint(0, 3) +
+				"x" * rnd.choice([0, 1, 125, 126, 65535, 65536, 200000]))
+			data = text.encode()
+			msgs.append(data)
+
+			cut = sorted(rnd.randint(0, len(data))
+				for _ in range(rnd.randint(0, 3)))
+			pieces = [data[a:b] for a, b in zip([0] + cut, cut + [len(data)])]
+			for j, pc in enumerate(pieces):
+				raw += frame(1 if j == 0 else 0, pc, fin=(j == len(pieces) - 1))
+				if rnd.random() < 0.3:
+					raw += frame(9, b"pp")
+					pings += 1
+
+		i = 0
+		while i < len(raw):
+			n = rnd.choice([1, 2, 3, 7, 100, 5000, 70000])
+			c.s.sendall(raw[i:i + n])
+			i += n
+
+		got   = []
+		pongs = 0
+		while len(got) < len(msgs) or pongs < pings:
+			op, d = c.recv()
+			if op == 10:
+				pongs += 1
+			else:
+				got.append(d)
+		assert got == msgs, "message {} echoed wrong".format(it)
+		c.close()
+
+# Protocol errors: invalid UTF-8 and close codes are answered with
+# a close frame, unmasked frames and stray continuations drop the
+# connection.
+def test_protocol_errors():
+	def close_code(raw):
+		c = Client()
+		c.s.sendall(raw)
+		op, d = c.recv()
+		c.close()
+		assert op == 8, "no close frame"
+		return struct.unpack(">H", d[:2])[0]
+
+	def dropped(raw):
+		c = Client()
+		c.s.sendall(raw)
+		try:
+			while c.recv()[0] != 8:
+				pass
+		except (EOFError, ConnectionError):
+			pass
+		c.close()
+
+	assert close_code(frame(1, b"\xce", fin=False) + frame(0, b"\xff")) == 1007, \
+		"invalid UTF-8 across frames"
+	assert close_code(frame(1, b"ab\xce")) == 1007, "truncated UTF-8"
+	assert close_code(frame(8, struct.pack(">H", 1000) + b"bye")) == 1000, \
+		"close handshake"
+	assert close_code(frame(8, struct.pack(">H", 999))) == 1002, \
+		"invalid close code"
+	dropped(frame(1, b"hi", masked=False))
+	dropped(frame(0, b"hi"))
+
+	# And the server is still there.
+	c = Client()
+	c.send("alive")
+	assert c.recv_text() == "alive", "server gone"
+	c.close()
+
+# A broadcast reaches every client, whichever worker owns it.
+def test_broadcast():
+	cs = [Client() for _ in range(8)]
+	for k, c in enumerate(cs):
+		c.send("bcast:{}".format(k))
+	for c in cs:
+		got = sorted(c.recv_text() for _ in cs)
+		assert got == sorted("bcast:{}".format(k) for k in range(len(cs))), \
+			"broadcast missing"
+	for c in cs:
+		c.close()
+
+# Sends from outside the server threads arrive whole and in order,
+# and, once the client stops reading for longer than
+# SEND_TIMEOUT_MS, fail (EAGAIN on the event loop backends) without
+# losing or reordering anything.
+def test_cross_thread():
+	def check(c, last, secs):
+		t0 = time.time()
+		n  = 0
+		while time.time() - t0 < secs:
+			op, d = c.recv()
+			assert op == 2 and len(d) == 64 * 1024, "bad frame"
+			t, seq = struct.unpack(">BI", d[:5])
+			assert last.get(t, -1) + 1 == seq, "sender {} skipped".format(t)
+			last[t] = seq
+			n += 1
+		return n
+
+	before = stats()
+	c = Client(timeout=10)
+	c.send("tick")
+	last = {}
+	assert check(c, last, 1) > 0, "nothing received"
+	time.sleep(7)
+	assert check(c, last, 1) > 0, "nothing received after the stall"
+	c.send("untick")
+	after = stats()
+	c.close()
+
+	if event_loop:
+		assert after["eagain"] > before["eagain"], "no send timed out"
+
+# Clients gone with large echoes in flight, and a client reading
+# late, do not upset the server.
+def test_disconnects():
+	for r in range(3):
+		cs = [Client() for _ in range(40)]
+		for c in cs:
+			c.send("y" * 300000)
+		for c in cs:
+			c.reset()
+
+	c = Client()
+	for k in range(300):
+		c.send("k{}:".format(k) + "z" * 20000)
+	time.sleep(0.5)
+	for k in range(300):
+		assert c.recv_text().startswith("k{}:".format(k)), "echo out of order"
+	c.close()
+
+	# Half-open handshakes.
+	for i in range(20):
+		s = socket.create_connection(("127.0.0.1", port))
+		s.sendall(b"GET / HTTP/1.1\r\n")
+		s.close()
+
+	assert wait_open(0), "clients still counted"
+
+# Clients not reading, flooded with broadcasts, neither hold up the
+# others nor make the server buffer without limit: past the hard
+# limit, they are dropped.
+def test_slow_readers():
+	slow = [Client() for _ in range(8)]
+	fast = Client()
+
+	worst = 0
+	for k in range(600):
+		t0 = time.time()
+		fast.send("bcast:" + "b" * 65536)
+		fast.recv_text()
+		worst = max(worst, time.time() - t0)
+	fast.close()
+
+	assert worst < 1, "round trip took {:.2f} s".format(worst)
+	assert wait_open(0), "slow readers not dropped"
+	for c in slow:
+		c.close()
+
+tests = [test_max_clients, test_fragments, test_protocol_errors,
+	test_broadcast, test_cross_thread, test_disconnects]
+if event_loop:
+	tests.append(test_slow_readers)
+
+ret = 0
+for test in tests:
+	name = test.__name__[5:]
+	try:
+		test()
+		print("{:<8} {:<16} {}passed{}".format(backend, name, GREEN, NC))
+	except Exception as e:
+		print("{:<8} {:<16} {}FAILED{}: {}".format(backend, name, RED, NC,
+			repr(e)))
+		ret = 1
+
+sys.exit(ret)
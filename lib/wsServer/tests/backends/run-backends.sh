@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Runs backend_test.py against every I/O backend: protocol,
+# broadcast, cross-thread sends, abrupt disconnects and slow
+# readers. The server is built with AddressSanitizer (see
+# Makefile), any report it prints fails the run.
+#
+# Environment: BACKENDS, WORKERS, CLIENTS, PORT.
+#
+
+cd "$(dirname "$0")"
+
+BACKENDS=${BACKENDS:-"threads epoll sharded uring"}
+WORKERS=${WORKERS:-2}
+CLIENTS=${CLIENTS:-48}
+PORT=${PORT:-8091}
+
+ret=0
+
+for backend in $BACKENDS; do
+	log=$(mktemp)
+	./backend_server -b "$backend" -w "$WORKERS" -c "$CLIENTS" -p "$PORT" \
+		> /dev/null 2> "$log" &
+	server=$!
+	sleep 0.5
+
+	# E.g: io_uring missing, or disabled by the kernel.
+	if ! kill -0 "$server" 2>/dev/null; then
+		printf "%-8s not available\n" "$backend"
+		rm -f "$log"
+		continue
+	fi
+
+	python3 backend_test.py "$backend" "$PORT" "$CLIENTS" || ret=1
+
+	kill "$server" 2>/dev/null
+	wait "$server" 2>/dev/null
+
+	if grep -q "Sanitizer" "$log"; then
+		printf "%-8s sanitizer report:\n" "$backend"
+		cat "$log"
+		ret=1
+	fi
+	rm -f "$log"
+done
+
+exit $ret
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @file bench_client.c
+ * @brief Load generator: opens N connections to a bench_server,
+ * then keeps one echo round trip in flight on each of them and
+ * reports the handshake time, the throughput and the latency.
+ */
+
+/**
+ * @brief Latency histogram resolution (us) and range.
+ */
+#define LAT_MAX 1000000
+
+/**
+ * @brief How long to wait for every handshake (ms).
+ */
+#define HANDSHAKE_TIMEOUT_MS 30000
+
+/**
+ * @brief Milliseconds to nanoseconds.
+ */
+#define MS_NS(x) ((uint64_t)(x)*1000000ULL)
+
+/**
+ * @brief Handshake request, the key is not checked by the client.
+ */
+#define REQUEST                                  \
+	"GET / HTTP/1.1\r\n"                         \
+	"Host: localhost\r\n"                        \
+	"Upgrade: websocket\r\n"                     \
+	"Connection: Upgrade\r\n"                    \
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n" \
+	"Sec-WebSocket-Version: 13\r\n\r\n"
+
+/**
+ * @brief Client connection.
+ */
+struct client
+{
+	int fd;           /**< Socket, -1 if failed.            */
+	int open;         /**< Handshake done.                  */
+	uint32_t tail;    /**< Last 4 handshake bytes.          */
+	size_t got;       /**< Bytes of the current echo.       */
+	uint64_t sent_at; /**< When the current message left.   */
+};
+
+static struct client *clients;
+static uint32_t latency[LAT_MAX];
+static unsigned char *frame;
+static size_t frame_len;
+static size_t echo_len;
+
+/**
+ * @brief Monotonic time, in ns.
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/**
+ * @brief Builds the (masked, with a zero key) text frame sent by
+ * every client, and the length of its echo.
+ *
+ * @param size Payload size.
+ */
+static void build_frame(size_t size)
+{
+	size_t hdr;
+
+	hdr   = size < 126 ? 2 : (size < 65536 ? 4 : 10);
+	frame = calloc(1, hdr + 4 + size);
+	if (!frame)
+	{
+		perror("calloc");
+		exit(1);
+	}
+
+	frame[0] = 0x81;
+	if (hdr == 2)
+		frame[1] = 0x80 | (unsigned char)size;
+	else if (hdr == 4)
+	{
+		frame[1] = 0x80 | 126;
+		frame[2] = (unsigned char)(size >> 8);
+		frame[3] = (unsigned char)size;
+	}
+	else
+	{
+		frame[1] = 0x80 | 127;
+		frame[6] = (unsigned char)(size >> 24);
+		frame[7] = (unsigned char)(size >> 16);
+		frame[8] = (unsigned char)(size >> 8);
+		frame[9] = (unsigned char)size;
+	}
+	memset(frame + hdr + 4, 'a', size);
+
+	frame_len = hdr + 4 + size;
+	echo_len  = hdr + size;
+}
+
+/**
+ * @brief Sends the whole @p len bytes, waiting for room if needed.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p;
+	struct pollfd pfd;
+	ssize_t n;
+
+	pfd.fd     = fd;
+	pfd.events = POLLOUT;
+	p          = buf;
+	while (len)
+	{
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+		{
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n <= 0)
+			return (-1);
+		p += n;
+		len -= (size_t)n;
+	}
+	return (0);
+}
+
+/**
+ * @brief Drops a client.
+ */
+static void drop(struct client *c, int *alive)
+{
+	close(c->fd);
+	c->fd = -1;
+	(*alive)--;
+}
+
+/**
+ * @brief Connects @p count clients to @p port and sends their
+ * handshake requests.
+ *
+ * @return Returns the amount of connected clients.
+ */
+static int connect_all(int epfd, int count, int port)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int connected;
+	int one;
+	int i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons((uint16_t)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	connected = 0;
+	one       = 1;
+	for (i = 0; i < count; i++)
+	{
+		clients[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (clients[i].fd < 0 ||
+			connect(clients[i].fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			if (clients[i].fd >= 0)
+				close(clients[i].fd);
+			clients[i].fd = -1;
+			continue;
+		}
+
+		setsockopt(clients[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(clients[i].fd, F_SETFL, fcntl(clients[i].fd, F_GETFL) | O_NONBLOCK);
+
+		ev.events   = EPOLLIN;
+		ev.data.u32 = (uint32_t)i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev) < 0 ||
+			send_all(clients[i].fd, REQUEST, sizeof(REQUEST) - 1) < 0)
+		{
+			close(clients[i].fd);
+			clients[i].fd = -1;
+			continue;
+		}
+		connected++;
+	}
+	return (connected);
+}
+
+/**
+ * @brief Reads what client @p c received: the handshake response
+ * or the echo of its message, in which case the round trip is
+ * accounted and the next message is sent.
+ *
+ * @return Returns 1 if a round trip ended, 0 if not, -1 if the
+ * client was lost.
+ */
+static int handle(struct client *c, int running)
+{
+	unsigned char buf[65536];
+	uint64_t us;
+	ssize_t n;
+	ssize_t i;
+	int done;
+
+	done = 0;
+	while ((n = recv(c->fd, buf, sizeof(buf), 0)) != 0)
+	{
+		if (n < 0)
+			return ((errno == EAGAIN || errno == EINTR) ? done : -1);
+
+		i = 0;
+		if (!c->open)
+		{
+			for (; i < n && !c->open; i++)
+			{
+				c->tail = (c->tail << 8) | buf[i];
+				c->open = (c->tail == 0x0D0A0D0A);
+			}
+			if (!c->open || i == n)
+				continue;
+		}
+
+		c->got += (size_t)(n - i);
+		if (c->got < echo_len)
+			continue;
+
+		/* One message in flight at a time: nothing else can follow. */
+		us = (now_ns() - c->sent_at) / 1000;
+		latency[us < LAT_MAX ? us : LAT_MAX - 1]++;
+		done   = 1;
+		c->got = 0;
+
+		if (running)
+		{
+			c->sent_at = now_ns();
+			if (send_all(c->fd, frame, frame_len) < 0)
+				return (-1);
+		}
+	}
+	return (-1);
+}
+
+/**
+ * @brief Returns the @p q quantile of the latency histogram, in us.
+ */
+static unsigned percentile(uint64_t total, double q)
+{
+	uint64_t seen;
+	uint64_t rank;
+	unsigned i;
+
+	rank = (uint64_t)((double)total * q);
+	seen = 0;
+	for (i = 0; i < LAT_MAX; i++)
+	{
+		seen += latency[i];
+		if (seen > rank)
+			return (i);
+	}
+	return (LAT_MAX);
+}
+
+/**
+ * @brief Main routine.
+ */
+int main(int argc, char **argv)
+{
+	struct epoll_event events[256];
+	struct client *c;
+	const char *label;
+	uint64_t deadline;
+	uint64_t start;
+	uint64_t trips;
+	double hs_ms;
+	size_t size;
+	int duration;
+	int alive;
+	int epfd;
+	int count;
+	int open;
+	int port;
+	int opt;
+	int n;
+	int i;
+
+	label    = "-";
+	count    = 10;
+	port     = 8090;
+	duration = 5;
+	size     = 32;
+
+	while ((opt = getopt(argc, argv, "l:c:p:d:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			label = optarg;
+			break;
+		case 'c':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			size = (size_t)atol(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-l label] [-c clients] [-p port] [-d seconds] [-s size]\n",
+				argv[0]);
+			return (1);
+		}
+	}
+
+	clients = calloc((size_t)count, sizeof(*clients));
+	if (!clients || count < 1)
+	{
+		fprintf(stderr, "Invalid amount of clients\n");
+		return (1);
+	}
+	build_frame(size);
+
+	if ((epfd = epoll_create1(0)) < 0)
+	{
+		perror("epoll_create1");
+		return (1);
+	}
+
+	/* Handshakes. */
+	start = now_ns();
+	alive = connect_all(epfd, count, port);
+	open  = 0;
+	while (open < alive && now_ns() - start < MS_NS(HANDSHAKE_TIMEOUT_MS))
+	{
+		n = epoll_wait(epfd, events, 256, 100);
+		for (i = 0; i < n; i++)
+		{
+			c = &clients[events[i].data.u32];
+			if (c->fd < 0 || c->open)
+				continue;
+			if (handle(c, 0) < 0)
+				drop(c, &alive);
+			else if (c->open)
+				open++;
+		}
+	}
+	hs_ms = (double)(now_ns() - start) / 1e6;
+
+	/* Echo round trips, one in flight per client. */
+	for (i = 0; i < count; i++)
+	{
+		if (clients[i].fd < 0 || !clients[i].open)
+			continue;
+		clients[i].sent_at = now_ns();
+		if (send_all(clients[i].fd, frame, frame_len) < 0)
+			drop(&clients[i], &alive);
+	}
+
+	start    = now_ns();
+	deadline = start + MS_NS((uint64_t)duration * 1000);
+	while (now_ns() < deadline && alive > 0)
+	{
+		n = epoll_wait(epfd, events, 256, 100);
+		for (i = 0; i < n; i++)
+		{
+			c = &clients[events[i].data.u32];
+			if (c->fd >= 0 && handle(c, 1) < 0)
+				drop(c, &alive);
+		}
+	}
+
+	trips = 0;
+	for (i = 0; i < LAT_MAX; i++)
+		trips += latency[i];
+
+	printf("%-8s %7d %7d %10.1f %10.0f %8u %8u\n", label, count, open, hs_ms,
+		(double)trips / ((double)(now_ns() - start) / 1e9), percentile(trips, 0.50),
+		percentile(trips, 0.99));
+	return (0);
+}
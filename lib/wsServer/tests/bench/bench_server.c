@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ws.h>
+
+/**
+ * @dir tests/bench
+ * @brief wsServer benchmarks folder
+ *
+ * @file bench_server.c
+ * @brief Echo server, measured by bench_client.
+ */
+
+/**
+ * @brief Called when a client connects to the server.
+ *
+ * @param fd Client file descriptor.
+ */
+void onopen(int fd)
+{
+	((void)fd);
+}
+
+/**
+ * @brief Called when a client disconnects from the server.
+ *
+ * @param fd Client file descriptor.
+ */
+void onclose(int fd)
+{
+	((void)fd);
+}
+
+/**
+ * @brief Echoes every message back to its client.
+ *
+ * @param fd   Client file descriptor.
+ * @param msg  Received message.
+ * @param size Message size (in bytes).
+ * @param type Message type.
+ */
+void onmessage(int fd, const unsigned char *msg, uint64_t size, int type)
+{
+	ws_sendframe(fd, (const char *)msg, size, false, type);
+}
+
+/**
+ * @brief Main routine.
+ */
+int main(int argc, char **argv)
+{
+	struct ws_events evs;
+	const char *backend;
+	int workers;
+	int clients;
+	int port;
+	int opt;
+
+	backend = "threads";
+	workers = 1;
+	clients = 16384;
+	port    = 8090;
+
+	while ((opt = getopt(argc, argv, "b:w:c:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-b threads|epoll|sharded|uring] [-w workers]"
+				" [-c max_clients] [-p port]\n",
+				argv[0]);
+			return (1);
+		}
+	}
+
+	if (!strcmp(backend, "threads"))
+		ws_backend(WS_BACKEND_THREADS, 0);
+	else if (!strcmp(backend, "epoll"))
+	{
+		if (ws_backend(WS_BACKEND_EPOLL, workers) < 0)
+		{
+			fprintf(stderr, "epoll backend not available\n");
+			return (1);
+		}
+	}
+	else if (!strcmp(backend, "sharded"))
+	{
+		if (ws_backend(WS_BACKEND_SHARDED, workers) < 0)
+		{
+			fprintf(stderr, "sharded backend not available\n");
+			return (1);
+		}
+	}
+	else if (!strcmp(backend, "uring"))
+	{
+		/* No fallback: the numbers would be the sharded ones. */
+		if (ws_backend(WS_BACKEND_URING, workers) != 0)
+		{
+			fprintf(stderr, "io_uring backend not available\n");
+			return (1);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "Unknown backend: %s\n", backend);
+		return (1);
+	}
+
+	if (ws_max_clients(clients) < 0)
+	{
+		fprintf(stderr, "Invalid max clients: %d\n", clients);
+		return (1);
+	}
+
+	evs.onopen    = &onopen;
+	evs.onclose   = &onclose;
+	evs.onmessage = &onmessage;
+	ws_socket(&evs, (uint16_t)port, 0);
+	return (0);
+}
@@ -0,0 +1,61 @@
+#!/usr/bin/env bash
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Compares the I/O backends on the same echo workload: every
+# client keeps one message in flight, for DURATION seconds.
+#
+# Environment: BACKENDS, CLIENTS, WORKERS, DURATION, SIZE, PORT.
+#
+
+cd "$(dirname "$0")"
+
+BACKENDS=${BACKENDS:-"threads epoll sharded uring"}
+CLIENTS=${CLIENTS:-"10 1000 10000"}
+WORKERS=${WORKERS:-$(nproc)}
+DURATION=${DURATION:-5}
+SIZE=${SIZE:-32}
+PORT=${PORT:-8090}
+
+# Both ends of every connection live on this machine.
+ulimit -n "$(ulimit -Hn)"
+
+printf "%-8s %7s %7s %10s %10s %8s %8s\n" backend clients open \
+	hs_ms msg/s p50_us p99_us
+
+for backend in $BACKENDS; do
+	for clients in $CLIENTS; do
+		./bench_server -b "$backend" -w "$WORKERS" -c "$clients" -p "$PORT" \
+			> /dev/null 2>&1 &
+		server=$!
+		sleep 0.5
+
+		# E.g: io_uring missing, or disabled by the kernel.
+		if ! kill -0 "$server" 2>/dev/null; then
+			printf "%-8s %7s  not available\n" "$backend" "$clients"
+			continue
+		fi
+
+		./bench_client -l "$backend" -c "$clients" -p "$PORT" \
+			-d "$DURATION" -s "$SIZE"
+
+		kill "$server" 2>/dev/null
+		wait "$server" 2>/dev/null || true
+	done
+done
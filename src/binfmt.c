@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binfmt.h"
+#include "crc32.h"
+
+/**
+ * @file binfmt.c
+ * @brief Fixed-record binary database.
+ *
+ * Layout: a @ref binfmt_header followed by `count` fixed-size
+ * @ref binfmt_record entries. The file is memory-mapped and walked
+ * record by record on load, there is nothing to parse. Databases
+ * are always written whole, to a new file, by @ref binfmt_write.
+ */
+
+/**
+ * @brief Offset of the record @p i.
+ */
+#define RECORD_OFF(i) \
+	((off_t)sizeof(struct binfmt_header) + \
+		(off_t)(i) * (off_t)sizeof(struct binfmt_record))
+
+/**
+ * @brief Converts the printer @p p into its on-disk record.
+ *
+ * @param p   Printer.
+ * @param rec Target record.
+ */
+void binfmt_pack(const struct PRINTER *p, struct binfmt_record *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->name, p->name, PRINTER_STRLEN);
+	memcpy(rec->ip, p->ip, PRINTER_STRLEN);
+	rec->state = (uint8_t)p->state;
+}
+
+/**
+ * @brief Converts the on-disk record @p rec into a printer.
+ *
+ * @param rec Record.
+ * @param p   Target printer.
+ */
+void binfmt_unpack(const struct binfmt_record *rec, struct PRINTER *p)
+{
+	memcpy(p->name, rec->name, PRINTER_STRLEN);
+	memcpy(p->ip, rec->ip, PRINTER_STRLEN);
+	p->name[PRINTER_STRLEN - 1] = '\0';
+	p->ip[PRINTER_STRLEN - 1]   = '\0';
+	p->state = rec->state <= NOK ? (enum PRINTER_STATE)rec->state : NOK;
+}
+
+/**
+ * @brief Fills @p hdr for an empty database.
+ *
+ * @param hdr Header.
+ */
+static void init_header(struct binfmt_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, BINFMT_MAGIC, sizeof(hdr->magic));
+	hdr->version     = BINFMT_VERSION;
+	hdr->record_size = sizeof(struct binfmt_record);
+}
+
+/**
+ * @brief Checks whether @p fd holds a binary database.
+ *
+ * @param fd Opened database.
+ *
+ * @return Returns true if the file starts with @ref BINFMT_MAGIC.
+ */
+bool binfmt_detect(int fd)
+{
+	char magic[4];
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return (false);
+	return (!memcmp(magic, BINFMT_MAGIC, sizeof(magic)));
+}
+
+/**
+ * @brief Maps the database @p fd and feeds every committed record
+ * to @p load.
+ *
+ * @param fd   Opened database.
+ * @param load Called once per record, in file order.
+ *
+ * @return Returns 0 if success, -1 if the file could not be mapped
+ * or is not a valid database (bad header or checksum).
+ */
+int binfmt_load(int fd, void (*load)(const struct PRINTER *))
+{
+	const struct binfmt_record *recs;
+	struct binfmt_header hdr;
+	const unsigned char *map;
+	struct PRINTER p;
+	struct stat st;
+	uint32_t i;
+	int ret;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr))
+		return (-1);
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	ret = -1;
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, BINFMT_MAGIC, sizeof(hdr.magic)) ||
+		hdr.version != BINFMT_VERSION ||
+		hdr.record_size != sizeof(struct binfmt_record) ||
+		RECORD_OFF(hdr.count) > st.st_size)
+		goto out;
+
+	recs = (const struct binfmt_record *)(map + sizeof(hdr));
+	if (crc32(0, recs, (size_t)hdr.count * sizeof(*recs)) != hdr.crc)
+		goto out;
+
+	for (i = 0; i < hdr.count; i++)
+	{
+		binfmt_unpack(&recs[i], &p);
+		load(&p);
+	}
+	ret = 0;
+out:
+	munmap((void *)map, (size_t)st.st_size);
+	return (ret);
+}
+
+/**
+ * @brief Writes a complete database with @p count printers to @p fd
+ * and syncs it.
+ *
+ * @param fd       Database, opened for writing.
+ * @param printers Printers to be written.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int binfmt_write(int fd, const struct PRINTER *printers, size_t count)
+{
+	struct binfmt_header *hdr;
+	struct binfmt_record *recs;
+	unsigned char *buf;
+	size_t size;
+	size_t i;
+	int ret;
+
+	size = (size_t)RECORD_OFF(count);
+	buf  = calloc(1, size);
+	if (!buf)
+		return (-1);
+
+	hdr  = (struct binfmt_header *)buf;
+	recs = (struct binfmt_record *)(buf + sizeof(*hdr));
+	init_header(hdr);
+	for (i = 0; i < count; i++)
+		binfmt_pack(&printers[i], &recs[i]);
+	hdr->count = (uint32_t)count;
+	hdr->crc   = crc32(0, recs, count * sizeof(*recs));
+
+	ret = -1;
+	if (pwrite(fd, buf, size, 0) != (ssize_t)size)
+		goto out;
+	if (ftruncate(fd, (off_t)size) < 0 || fsync(fd) < 0)
+		goto out;
+	ret = 0;
+out:
+	free(buf);
+	return (ret);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file binfmt.h
+ * @brief Fixed-record binary database format.
+ */
+#ifndef BINFMT_H
+#define BINFMT_H
+
+	#include <stdbool.h>
+	#include <stdint.h>
+	#include "printer.h"
+
+	/**
+	 * @brief File magic.
+	 */
+	#define BINFMT_MAGIC   "MKPR"
+
+	/**
+	 * @brief Current format version.
+	 */
+	#define BINFMT_VERSION 1
+
+	/**
+	 * @brief File header.
+	 *
+	 * All fields are stored in host byte order: the file is meant
+	 * to be read back by the very same server that wrote it.
+	 */
+	struct binfmt_header
+	{
+		char magic[4];        /**< BINFMT_MAGIC, no NUL.               */
+		uint16_t version;     /**< BINFMT_VERSION.                     */
+		uint16_t record_size; /**< sizeof(struct binfmt_record).       */
+		uint32_t count;       /**< Amount of committed records.        */
+		uint32_t crc;         /**< CRC-32 of the committed records.    */
+	};
+
+	/**
+	 * @brief On-disk printer, mirrors @ref PRINTER with fixed-width
+	 * fields.
+	 */
+	struct binfmt_record
+	{
+		char name[PRINTER_STRLEN]; /**< NUL-padded name.    */
+		char ip[PRINTER_STRLEN];   /**< NUL-padded address. */
+		uint8_t state;             /**< PRINTER_STATE.      */
+		uint8_t pad[3];            /**< Zero.               */
+		uint32_t reserved;         /**< Zero.               */
+	};
+
+	extern void binfmt_pack(const struct PRINTER *p, struct binfmt_record *rec);
+	extern void binfmt_unpack(const struct binfmt_record *rec,
+		struct PRINTER *p);
+	extern bool binfmt_detect(int fd);
+	extern int binfmt_load(int fd, void (*load)(const struct PRINTER *));
+	extern int binfmt_write(int fd, const struct PRINTER *printers, size_t count);
+
+#endif /* BINFMT_H */
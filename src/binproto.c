@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binproto.h"
+
+/**
+ * @file binproto.c
+ * @brief Binary registry protocol.
+ *
+ * Opt-in alternative to the text commands, for clients that
+ * negotiate @ref BINPROTO_NAME. Every message is a single binary
+ * frame: an opcode byte (enum binproto_op) followed by its fields.
+ * Integers are little-endian, strings are length-prefixed (u8),
+ * without terminator.
+ *
+ * A printer record is packed as:
+ *
+ *     [name_len u8][name][flags u8][address]
+ *
+ * where the low two bits of flags hold the state and the address
+ * is either an IPv4 address (4 bytes, network order), followed by
+ * a port (u16) if @ref REC_PORT is set, or, if @ref REC_TEXT is
+ * set, the address as registered, length-prefixed.
+ */
+
+/**
+ * @name Record flags
+ */
+/**@{*/
+#define REC_STATE 0x03 /**< State mask.                        */
+#define REC_PORT  0x40 /**< IPv4 address is followed by a port. */
+#define REC_TEXT  0x80 /**< Address is not IPv4, sent as text.  */
+/**@}*/
+
+/**
+ * @brief Writes @p v at @p buf, little-endian.
+ */
+void binproto_put_u32(unsigned char *buf, uint32_t v)
+{
+	buf[0] = (unsigned char)v;
+	buf[1] = (unsigned char)(v >> 8);
+	buf[2] = (unsigned char)(v >> 16);
+	buf[3] = (unsigned char)(v >> 24);
+}
+
+/**
+ * @brief Reads a little-endian u32 at @p buf.
+ */
+uint32_t binproto_get_u32(const unsigned char *buf)
+{
+	return ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+		(uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+}
+
+/**
+ * @brief Encodes the printer name @p name.
+ *
+ * @param name NUL-terminated name.
+ * @param buf  Target, at least PRINTER_STRLEN bytes.
+ *
+ * @return Returns the encoded length.
+ */
+size_t binproto_name(const char *name, unsigned char *buf)
+{
+	size_t len;
+
+	len    = strnlen(name, PRINTER_STRLEN - 1);
+	buf[0] = (unsigned char)len;
+	memcpy(buf + 1, name, len);
+	return (len + 1);
+}
+
+/**
+ * @brief Encodes the printer @p p.
+ *
+ * @param p   Printer.
+ * @param buf Target, at least @ref BINPROTO_RECORD_MAX bytes.
+ *
+ * @return Returns the encoded length.
+ */
+size_t binproto_record(const struct PRINTER *p, unsigned char *buf)
+{
+	char host[PRINTER_STRLEN];
+	struct in_addr addr;
+	unsigned char *flags;
+	char *colon;
+	char *end;
+	size_t off;
+	long port;
+
+	off    = binproto_name(p->name, buf);
+	flags  = &buf[off++];
+	*flags = (unsigned char)p->state & REC_STATE;
+
+	memcpy(host, p->ip, sizeof(host));
+	host[PRINTER_STRLEN - 1] = '\0';
+	colon = strchr(host, ':');
+	port  = 0;
+	if (colon)
+	{
+		*colon = '\0';
+		port   = strtol(colon + 1, &end, 10);
+
+		/*
+		 * Only the canonical spelling round-trips: anything else
+		 * ("80x", "080", "+80", " 80") is kept as text.
+		 */
+		if (*end != '\0' || colon[1] < '1' || colon[1] > '9')
+			port = 0;
+	}
+
+	if (inet_pton(AF_INET, host, &addr) == 1 && (!colon ||
+		(port > 0 && port < 65536)))
+	{
+		memcpy(buf + off, &addr, 4);
+		off += 4;
+		if (colon)
+		{
+			*flags     |= REC_PORT;
+			buf[off++]  = (unsigned char)port;
+			buf[off++]  = (unsigned char)(port >> 8);
+		}
+		return (off);
+	}
+
+	*flags |= REC_TEXT;
+	return (off + binproto_name(p->ip, buf + off));
+}
+
+/**
+ * @brief Decodes a printer name.
+ *
+ * @param buf  Encoded name.
+ * @param len  Available bytes.
+ * @param name Target, PRINTER_STRLEN bytes, NUL-padded.
+ *
+ * @return Returns the consumed length, 0 if invalid.
+ */
+size_t binproto_parse_name(const unsigned char *buf, size_t len, char *name)
+{
+	if (!len || !buf[0] || buf[0] >= PRINTER_STRLEN || (size_t)buf[0] + 1 > len)
+		return (0);
+	memset(name, 0, PRINTER_STRLEN);
+	memcpy(name, buf + 1, buf[0]);
+	return ((size_t)buf[0] + 1);
+}
+
+/**
+ * @brief Decodes a printer record.
+ *
+ * @param buf Encoded record.
+ * @param len Available bytes.
+ * @param p   Target printer.
+ *
+ * @return Returns the consumed length, 0 if invalid.
+ */
+size_t binproto_parse_record(const unsigned char *buf, size_t len,
+	struct PRINTER *p)
+{
+	unsigned char flags;
+	size_t off;
+	size_t ip;
+	size_t n;
+	int ret;
+
+	memset(p, 0, sizeof(*p));
+	off = binproto_parse_name(buf, len, p->name);
+	if (!off || off == len)
+		return (0);
+
+	flags = buf[off++];
+	if ((flags & REC_STATE) > NOK)
+		return (0);
+	p->state = (enum PRINTER_STATE)(flags & REC_STATE);
+
+	if (flags & REC_TEXT)
+	{
+		n = binproto_parse_name(buf + off, len - off, p->ip);
+		return (n ? off + n : 0);
+	}
+
+	n = flags & REC_PORT ? 6 : 4;
+	if (len - off < n)
+		return (0);
+	if (!inet_ntop(AF_INET, buf + off, p->ip, PRINTER_STRLEN))
+		return (0);
+
+	/* As add#, an address that does not fit is rejected, not cut. */
+	if (flags & REC_PORT)
+	{
+		ip  = strlen(p->ip);
+		ret = snprintf(p->ip + ip, PRINTER_STRLEN - ip, ":%u",
+			(unsigned)(buf[off + 4] | buf[off + 5] << 8));
+		if (ret < 0 || (size_t)ret >= PRINTER_STRLEN - ip)
+			return (0);
+	}
+	return (off + n);
+}
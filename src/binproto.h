@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file binproto.h
+ * @brief Binary registry protocol.
+ */
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+	#include "printer.h"
+
+	/**
+	 * @brief Subprotocol name, negotiated with Sec-WebSocket-Protocol.
+	 */
+	#define BINPROTO_NAME "makerspace.bin.v1"
+
+	/**
+	 * @brief Message formats a client may use.
+	 */
+	enum wire_format
+	{
+		WIRE_TEXT   = 0, /**< Text commands (the default). */
+		WIRE_BINARY = 1, /**< @ref BINPROTO_NAME.          */
+		WIRE_FORMATS
+	};
+
+	/**
+	 * @brief Longest encoded record: name, state and a textual address.
+	 */
+	#define BINPROTO_RECORD_MAX (2 * PRINTER_STRLEN + 2)
+
+	/**
+	 * @brief Size of the @ref BINPROTO_LIST header: opcode and count.
+	 */
+	#define BINPROTO_LIST_HDR 5
+
+	/**
+	 * @brief Opcodes, the first byte of every message.
+	 */
+	enum binproto_op
+	{
+		/* Requests. */
+		BINPROTO_GET     = 0x01, /**< [filter: state u8, offset u32,
+		                              limit u32]                     */
+		BINPROTO_ADD     = 0x02, /**< record                         */
+		BINPROTO_SET     = 0x03, /**< name, state u8                 */
+		BINPROTO_SUB     = 0x04, /**< -                              */
+		BINPROTO_ADDMANY = 0x05, /**< count u32, records             */
+		BINPROTO_CAM     = 0x06, /**< name, empty to unsubscribe     */
+		BINPROTO_CAMSTAT = 0x07, /**< -                              */
+		BINPROTO_SNAP    = 0x08, /**< name                           */
+
+		/* Responses and notifications. */
+		BINPROTO_STATUS  = 0x80, /**< u8: 0 success, 1 failure       */
+		BINPROTO_LIST    = 0x81, /**< count u32, records             */
+		BINPROTO_ADDED   = 0x82, /**< record                         */
+		BINPROTO_CHANGED = 0x83, /**< record                         */
+		BINPROTO_REMOVED = 0x84, /**< name                           */
+		BINPROTO_RESULTS = 0x85, /**< count u32, status u8 per record */
+		BINPROTO_FRAME   = 0x86, /**< name, JPEG image               */
+		BINPROTO_CAMSTAT_LIST = 0x87, /**< count u32, per webcam: name,
+		                                   sent u32, dropped u32     */
+		BINPROTO_SNAPSHOT     = 0x88  /**< name, JPEG image          */
+	};
+
+	/**
+	 * @brief State value of a @ref BINPROTO_GET filter that
+	 * matches every state.
+	 */
+	#define BINPROTO_ANY_STATE 0xFF
+
+	extern size_t binproto_name(const char *name, unsigned char *buf);
+	extern size_t binproto_record(const struct PRINTER *p, unsigned char *buf);
+	extern size_t binproto_parse_name(const unsigned char *buf, size_t len,
+		char *name);
+	extern size_t binproto_parse_record(const unsigned char *buf, size_t len,
+		struct PRINTER *p);
+	extern void binproto_put_u32(unsigned char *buf, uint32_t v);
+	extern uint32_t binproto_get_u32(const unsigned char *buf);
+
+#endif /* BINPROTO_H */
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ws.h>
+
+#include "binproto.h"
+#include "cache.h"
+#include "refbuf.h"
+#include "registry.h"
+
+/**
+ * @file cache.c
+ * @brief Pre-rendered `get#` responses.
+ *
+ * The whole printer list is serialized once per wire format, as a
+ * complete frame (header included), and tagged with the registry
+ * version it was built from. Every `get#` then just sends that
+ * shared buffer; only the first request after a registry mutation
+ * pays for rebuilding it.
+ */
+
+/**
+ * @brief Scratch buffer used while serializing the registry.
+ */
+struct render
+{
+	char *buf;       /**< Rendered printers. */
+	size_t len;      /**< Used length.       */
+	size_t capacity; /**< Allocated length.  */
+	uint32_t count;  /**< Rendered printers. */
+	int format;      /**< enum wire_format.  */
+	int error;       /**< Out of memory.     */
+};
+
+/**
+ * @brief Cached frames, per wire format, NULL if not built yet.
+ */
+static struct refbuf *cached[WIRE_FORMATS];
+
+/**
+ * @brief Registry version each of @ref cached was built from.
+ */
+static uint64_t cached_version[WIRE_FORMATS];
+
+/**
+ * @brief Protects @ref cached and @ref cached_version.
+ */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Appends the printer @p p to the scratch buffer, as a text
+ * line or a binary record.
+ *
+ * @param p    Printer.
+ * @param data Scratch buffer (struct render).
+ *
+ * @return Returns 0 to keep iterating, 1 if out of memory.
+ */
+static int render_printer(const struct PRINTER *p, void *data)
+{
+	struct render *r;
+	size_t capacity;
+	char *tmp;
+
+	r = data;
+	if (r->capacity - r->len < PRINTER_LINE_MAX + BINPROTO_RECORD_MAX)
+	{
+		capacity = r->capacity * 2;
+		tmp      = realloc(r->buf, capacity);
+		if (!tmp)
+		{
+			r->error = 1;
+			return (1);
+		}
+		r->buf      = tmp;
+		r->capacity = capacity;
+	}
+	if (r->format == WIRE_BINARY)
+		r->len += binproto_record(p, (unsigned char *)r->buf + r->len);
+	else
+		r->len += printer_format(p, r->buf + r->len, r->capacity - r->len);
+	r->count++;
+	return (0);
+}
+
+/**
+ * @brief Serializes the registry into a new cached frame.
+ *
+ * @param format Wire format (enum wire_format).
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note Must be called with @ref cache_mutex held.
+ */
+static int rebuild(int format)
+{
+	unsigned char hdr[WS_FRAME_HDR_MAX];
+	struct refbuf *frame;
+	struct render r;
+	uint64_t version;
+	int hlen;
+
+	memset(&r, 0, sizeof(r));
+	r.format   = format;
+	r.capacity = 64 * PRINTER_LINE_MAX;
+	r.buf      = malloc(r.capacity);
+	if (!r.buf)
+		return (-1);
+
+	/* Binary lists start with their opcode and count. */
+	if (format == WIRE_BINARY)
+		r.len = BINPROTO_LIST_HDR;
+
+	version = registry_foreach(render_printer, &r);
+	if (r.error)
+		goto err;
+
+	if (format == WIRE_BINARY)
+	{
+		r.buf[0] = (char)BINPROTO_LIST;
+		binproto_put_u32((unsigned char *)r.buf + 1, r.count);
+	}
+
+	hlen  = ws_frame_header(hdr, r.len,
+		format == WIRE_BINARY ? WS_FR_OP_BIN : WS_FR_OP_TXT);
+	frame = refbuf_new(hlen + r.len);
+	if (!frame)
+		goto err;
+
+	memcpy(frame->data, hdr, hlen);
+	if (r.len)
+		memcpy(frame->data + hlen, r.buf, r.len);
+	free(r.buf);
+
+	refbuf_put(cached[format]);
+	cached[format]         = frame;
+	cached_version[format] = version;
+	return (0);
+err:
+	free(r.buf);
+	return (-1);
+}
+
+/**
+ * @brief Renders a page of the printers in state @p state (see
+ * @ref registry_page) and sends it to the client @p fd.
+ *
+ * Pages are not cached: they are cheap to render, as only the
+ * printers in the page are visited.
+ *
+ * @param fd     Client fd.
+ * @param format Wire format (enum wire_format).
+ * @param state  Printer state, or -1 for all.
+ * @param offset Amount of printers to skip.
+ * @param limit  Maximum amount of printers.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int cache_send_page(int fd, int format, int state, size_t offset,
+	size_t limit)
+{
+	struct render r;
+	int ret;
+
+	memset(&r, 0, sizeof(r));
+	r.format   = format;
+	r.capacity = 64 * PRINTER_LINE_MAX;
+	r.buf      = malloc(r.capacity);
+	if (!r.buf)
+		return (-1);
+	if (format == WIRE_BINARY)
+		r.len = BINPROTO_LIST_HDR;
+
+	registry_page(state, offset, limit, render_printer, &r);
+	if (format == WIRE_BINARY)
+	{
+		r.buf[0] = (char)BINPROTO_LIST;
+		binproto_put_u32((unsigned char *)r.buf + 1, r.count);
+	}
+
+	ret = -1;
+	if (!r.error)
+		ret = ws_sendframe(fd, r.buf, r.len, false,
+			format == WIRE_BINARY ? WS_FR_OP_BIN : WS_FR_OP_TXT);
+	free(r.buf);
+	return (ret < 0 ? -1 : 0);
+}
+
+/**
+ * @brief Sends the printer list to the client @p fd.
+ *
+ * @param fd      Client fd.
+ * @param format  Wire format (enum wire_format).
+ * @param version If not NULL, where to store the registry version
+ *                the list was built from.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int cache_send_printers(int fd, int format, uint64_t *version)
+{
+	struct refbuf *frame;
+	int ret;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (!cached[format] || cached_version[format] != registry_version())
+	{
+		if (rebuild(format) < 0 && !cached[format])
+		{
+			pthread_mutex_unlock(&cache_mutex);
+			return (-1);
+		}
+	}
+	frame = refbuf_get(cached[format]);
+	if (version)
+		*version = cached_version[format];
+	pthread_mutex_unlock(&cache_mutex);
+
+	/* Send outside the lock, slow clients do not stall the others. */
+	ret = ws_sendframe_raw(fd, frame->data, frame->size);
+	refbuf_put(frame);
+	return (ret);
+}
+
+/**
+ * @brief Releases the cached frames.
+ */
+void cache_close(void)
+{
+	int i;
+
+	pthread_mutex_lock(&cache_mutex);
+	for (i = 0; i < WIRE_FORMATS; i++)
+	{
+		refbuf_put(cached[i]);
+		cached[i] = NULL;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
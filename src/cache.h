@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file cache.h
+ * @brief Pre-rendered `get#` responses.
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	extern int cache_send_printers(int fd, int format, uint64_t *version);
+	extern int cache_send_page(int fd, int format, int state, size_t offset,
+		size_t limit);
+	extern void cache_close(void);
+
+#endif /* CACHE_H */
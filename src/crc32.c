@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+
+#include "crc32.h"
+
+/**
+ * @file crc32.c
+ * @brief CRC-32 (IEEE 802.3, reflected 0xEDB88320), table driven.
+ */
+
+/**
+ * @brief Byte lookup table, built on first use.
+ */
+static uint32_t table[256];
+
+/**
+ * @brief Guards @ref table initialization.
+ */
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fills @ref table.
+ */
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i;
+	int k;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = (uint32_t)i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		table[i] = c;
+	}
+}
+
+/**
+ * @brief Updates the checksum @p crc with @p len bytes from @p buf.
+ *
+ * Just like zlib's crc32(), the initial value is 0 and the result
+ * of a call can be given to the next one to checksum data that
+ * arrives in pieces.
+ *
+ * @param crc Previous checksum, 0 for the first call.
+ * @param buf Data.
+ * @param len Data length.
+ *
+ * @return Returns the updated checksum.
+ */
+uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p;
+
+	pthread_once(&table_once, crc32_init);
+
+	p   = buf;
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return (~crc);
+}
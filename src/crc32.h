@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file crc32.h
+ * @brief CRC-32 (IEEE 802.3) checksum.
+ */
+#ifndef CRC32_H
+#define CRC32_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	extern uint32_t crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32_H */
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+/**
+ * @file epoch.c
+ * @brief Epoch-based memory reclamation.
+ *
+ * Lets lock-free readers dereference shared pointers while writers
+ * replace them. Readers bracket their accesses with @ref epoch_enter
+ * and @ref epoch_exit, which only announce, in a per-thread record,
+ * the global epoch they started in. Writers hand what they unlinked
+ * to @ref epoch_retire, which files it under the current epoch.
+ *
+ * The global epoch only advances once every active reader has
+ * announced it, so anything retired in epoch @c e can no longer be
+ * referenced once the global epoch reached @c e + 2: it is released
+ * then. Three limbo lists (for the epochs @c e, @c e - 1 and
+ * @c e - 2) are thus enough.
+ *
+ * Reader records are allocated the first time a thread enters, and
+ * recycled once it exits, as connection threads come and go.
+ */
+
+/**
+ * @brief Amount of limbo lists.
+ */
+#define EPOCH_LISTS 3
+
+/**
+ * @brief Per-thread reader record.
+ */
+struct epoch_reader
+{
+	struct epoch_reader *next; /**< Next record, list is append-only. */
+	uint64_t state;            /**< (epoch << 1) | 1 while inside,
+	                                0 otherwise.                      */
+	int in_use;                /**< Owned by a live thread.           */
+};
+
+/**
+ * @brief Retired object, waiting for readers to move on.
+ */
+struct epoch_garbage
+{
+	struct epoch_garbage *next;  /**< Next retired object.   */
+	void *ptr;                   /**< Object.                */
+	void (*release)(void *);     /**< Releases @ref ptr.     */
+};
+
+/**
+ * @brief Reclamation state.
+ */
+static struct
+{
+	uint64_t epoch;                            /**< Global epoch.   */
+	struct epoch_reader *readers;              /**< Reader records. */
+	struct epoch_garbage *limbo[EPOCH_LISTS];  /**< Per epoch % 3.  */
+} ep;
+
+/**
+ * @brief Serializes @ref epoch_retire (and epoch advances).
+ */
+static pthread_mutex_t ep_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Reader record of the calling thread.
+ */
+static pthread_key_t ep_key;
+
+/**
+ * @brief Creates @ref ep_key once.
+ */
+static pthread_once_t ep_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Thread exit hook: gives the reader record back.
+ *
+ * @param p Reader record.
+ */
+static void reader_release(void *p)
+{
+	struct epoch_reader *r;
+
+	r = p;
+	__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates the thread-specific key.
+ */
+static void key_init(void)
+{
+	pthread_key_create(&ep_key, reader_release);
+}
+
+/**
+ * @brief Returns the reader record of the calling thread, taking
+ * a free one, or allocating one, on first use.
+ *
+ * @return Returns the record, or NULL if out of memory.
+ */
+static struct epoch_reader *reader_self(void)
+{
+	struct epoch_reader *r;
+	int expected;
+
+	pthread_once(&ep_once, key_init);
+	r = pthread_getspecific(ep_key);
+	if (r)
+		return (r);
+
+	/* Recycle the record of a thread that is gone. */
+	for (r = __atomic_load_n(&ep.readers, __ATOMIC_ACQUIRE); r; r = r->next)
+	{
+		expected = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!r)
+	{
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return (NULL);
+		r->in_use = 1;
+		r->next   = __atomic_load_n(&ep.readers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&ep.readers, &r->next, r, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_setspecific(ep_key, r);
+	return (r);
+}
+
+/**
+ * @brief Enters a read-side critical section: pointers loaded from
+ * now on stay valid until @ref epoch_exit.
+ *
+ * @note Sections must not be nested.
+ */
+void epoch_enter(void)
+{
+	struct epoch_reader *r;
+	uint64_t e;
+
+	r = reader_self();
+	if (!r)
+		abort();
+
+	e = __atomic_load_n(&ep.epoch, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&r->state, (e << 1) | 1, __ATOMIC_RELAXED);
+
+	/* The announcement must be visible before any shared load. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Leaves the read-side critical section.
+ */
+void epoch_exit(void)
+{
+	struct epoch_reader *r;
+
+	r = pthread_getspecific(ep_key);
+	__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Releases every object of the limbo list @p i.
+ *
+ * @note Must be called with @ref ep_mutex held.
+ */
+static void release_list(int i)
+{
+	struct epoch_garbage *g;
+
+	while ((g = ep.limbo[i]))
+	{
+		ep.limbo[i] = g->next;
+		g->release(g->ptr);
+		free(g);
+	}
+}
+
+/**
+ * @brief Advances the global epoch if every active reader is in
+ * the current one, releasing what became unreachable.
+ *
+ * @note Must be called with @ref ep_mutex held.
+ */
+static void try_advance(void)
+{
+	struct epoch_reader *r;
+	uint64_t state;
+	uint64_t e;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	e = ep.epoch;
+	for (r = __atomic_load_n(&ep.readers, __ATOMIC_ACQUIRE); r; r = r->next)
+	{
+		state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+		if ((state & 1) && (state >> 1) != e)
+			return;
+	}
+
+	/* The list for e + 1 holds what was retired in e - 2. */
+	__atomic_store_n(&ep.epoch, e + 1, __ATOMIC_RELEASE);
+	release_list((int)((e + 1) % EPOCH_LISTS));
+}
+
+/**
+ * @brief Hands @p ptr over to be released, with @p release, once
+ * no reader can reference it anymore.
+ *
+ * @param ptr     Object, already unreachable for new readers.
+ * @param release Called once, later, on @p ptr.
+ *
+ * @note Must not be called from within a read-side section. If out
+ * of memory, waits for the readers and releases @p ptr right away.
+ */
+void epoch_retire(void *ptr, void (*release)(void *))
+{
+	struct epoch_garbage *g;
+	uint64_t e;
+
+	pthread_mutex_lock(&ep_mutex);
+	g = malloc(sizeof(*g));
+	if (g)
+	{
+		g->ptr      = ptr;
+		g->release  = release;
+		g->next     = ep.limbo[ep.epoch % EPOCH_LISTS];
+		ep.limbo[ep.epoch % EPOCH_LISTS] = g;
+		try_advance();
+	}
+	else
+	{
+		/* Two advances and nobody can see ptr anymore. */
+		e = ep.epoch;
+		while (ep.epoch < e + 2)
+		{
+			pthread_mutex_unlock(&ep_mutex);
+			sched_yield();
+			pthread_mutex_lock(&ep_mutex);
+			try_advance();
+		}
+		release(ptr);
+	}
+	pthread_mutex_unlock(&ep_mutex);
+}
+
+/**
+ * @brief Releases every retired object.
+ *
+ * @note Must only be called once no reader is left.
+ */
+void epoch_close(void)
+{
+	int i;
+
+	pthread_mutex_lock(&ep_mutex);
+	for (i = 0; i < EPOCH_LISTS; i++)
+		release_list(i);
+	pthread_mutex_unlock(&ep_mutex);
+}
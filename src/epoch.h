@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file epoch.h
+ * @brief Epoch-based memory reclamation.
+ */
+#ifndef EPOCH_H
+#define EPOCH_H
+
+	extern void epoch_enter(void);
+	extern void epoch_exit(void);
+	extern void epoch_retire(void *ptr, void (*release)(void *));
+	extern void epoch_close(void);
+
+#endif /* EPOCH_H */
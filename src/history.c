@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "registry.h"
+#include "store.h"
+
+/**
+ * @file history.c
+ * @brief Printer state history.
+ *
+ * Every state transition of every printer is timestamped and kept
+ * in a per printer ring buffer of the @ref HIST_LEN latest ones,
+ * laid out as two parallel arrays (times and states, 5 bytes per
+ * transition), so memory stays bounded however long the server
+ * runs. As transitions are chronological, a query for the ones
+ * since a given time is a binary search and a copy of the result.
+ *
+ * Transitions are appended to `<database>.hist`, one fixed-size
+ * record each, without syncing: the history is an aid, losing its
+ * last entries on a crash is fine. The file is replayed into the
+ * rings on startup and rewritten from them, on startup and once it
+ * holds too many records that no longer fit in the rings.
+ *
+ * The registry listener only updates the rings and queues the
+ * records: a writer thread appends them, and rewrites the file, so
+ * no file I/O happens under the registry writers lock. A rewrite
+ * goes to a temporary file, synced before it is renamed over the
+ * history, so a crash leaves either the old or the new one.
+ */
+
+/**
+ * @brief Transitions kept per printer, a power of two.
+ */
+#define HIST_LEN 256
+
+/**
+ * @brief Records the history file may hold beyond the rings
+ * contents, before being rewritten.
+ */
+#define HIST_SLACK 4096
+
+/**
+ * @brief Transitions of a printer, oldest first from
+ * `head - min(head, HIST_LEN)`.
+ */
+struct ring
+{
+	char name[PRINTER_STRLEN]; /**< Printer name.                   */
+	uint32_t head;             /**< Transitions ever recorded.      */
+	uint32_t times[HIST_LEN];  /**< Transition times (Unix time).   */
+	uint8_t states[HIST_LEN];  /**< States entered.                 */
+};
+
+/**
+ * @brief On-disk transition.
+ *
+ * All fields are stored in host byte order, as in the binary
+ * database.
+ */
+struct hist_record
+{
+	char name[PRINTER_STRLEN]; /**< NUL-padded name.         */
+	uint32_t time;             /**< Transition time.         */
+	uint8_t state;             /**< PRINTER_STATE entered.   */
+	uint8_t pad[3];            /**< Zero.                    */
+};
+
+/**
+ * @brief History state, guarded by @ref hist_mutex (except for the
+ * file, only used by the writer thread once started).
+ */
+static struct
+{
+	struct ring **rings;        /**< Rings, sorted by name.          */
+	size_t count;               /**< Amount of rings.                */
+	size_t capacity;            /**< Allocated rings.                */
+	size_t live;                /**< Transitions held by the rings.  */
+	size_t records;             /**< Records in the history file,
+	                                 queued ones included.           */
+	struct hist_record *queue;  /**< Records to be appended.         */
+	struct hist_record *spare;  /**< Records being appended.         */
+	size_t queued;              /**< Amount of queued records.       */
+	bool compact;               /**< File should be rewritten.       */
+	bool stop;                  /**< Writer should exit.             */
+	bool running;               /**< Writer thread was started.      */
+	pthread_t thread;           /**< Writer thread.                  */
+	int fd;                     /**< History file, -1 if closed.     */
+	char *path;                 /**< History file path.              */
+	char *tmp_path;             /**< Rewritten history file path.    */
+} hs = {.fd = -1};
+
+/**
+ * @brief Guards @ref hs.
+ */
+static pthread_mutex_t hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signals queued records, or a requested rewrite.
+ */
+static pthread_cond_t hist_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Finds the ring of the printer @p name.
+ *
+ * @param name Printer name.
+ * @param pos  Receives the ring position, or where it would be
+ *             inserted.
+ *
+ * @return Returns the ring, or NULL if there is none.
+ */
+static struct ring *find_ring(const char *name, size_t *pos)
+{
+	size_t lo;
+	size_t hi;
+	size_t mid;
+	int cmp;
+
+	lo = 0;
+	hi = hs.count;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		cmp = strncmp(name, hs.rings[mid]->name, PRINTER_STRLEN);
+		if (cmp == 0)
+		{
+			*pos = mid;
+			return (hs.rings[mid]);
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*pos = lo;
+	return (NULL);
+}
+
+/**
+ * @brief Finds the ring of the printer @p name, or adds it.
+ *
+ * @return Returns the ring, or NULL if out of memory.
+ */
+static struct ring *get_ring(const char *name)
+{
+	struct ring **rings;
+	struct ring *r;
+	size_t capacity;
+	size_t pos;
+
+	r = find_ring(name, &pos);
+	if (r)
+		return (r);
+
+	if (hs.count == hs.capacity)
+	{
+		capacity = hs.capacity ? hs.capacity * 2 : 16;
+		rings    = realloc(hs.rings, capacity * sizeof(*rings));
+		if (!rings)
+			return (NULL);
+		hs.rings    = rings;
+		hs.capacity = capacity;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return (NULL);
+	strncpy(r->name, name, PRINTER_STRLEN - 1);
+	memmove(&hs.rings[pos + 1], &hs.rings[pos],
+		(hs.count - pos) * sizeof(*hs.rings));
+	hs.rings[pos] = r;
+	hs.count++;
+	return (r);
+}
+
+/**
+ * @brief Drops the ring of the printer @p name, if any.
+ */
+static void drop_ring(const char *name)
+{
+	struct ring *r;
+	size_t pos;
+
+	r = find_ring(name, &pos);
+	if (!r)
+		return;
+
+	hs.live -= r->head < HIST_LEN ? r->head : HIST_LEN;
+	free(r);
+	memmove(&hs.rings[pos], &hs.rings[pos + 1],
+		(hs.count - pos - 1) * sizeof(*hs.rings));
+	hs.count--;
+}
+
+/**
+ * @brief Appends a transition to @p r, unless @p state is already
+ * the latest state.
+ *
+ * @return Returns true if the transition was added.
+ */
+static bool push(struct ring *r, uint32_t time, uint8_t state)
+{
+	uint32_t slot;
+
+	if (r->head && r->states[(r->head - 1) & (HIST_LEN - 1)] == state)
+		return (false);
+
+	if (r->head < HIST_LEN)
+		hs.live++;
+	slot            = r->head++ & (HIST_LEN - 1);
+	r->times[slot]  = time;
+	r->states[slot] = state;
+	return (true);
+}
+
+/**
+ * @brief Copies the rings contents, as history file records.
+ *
+ * @param count Receives the amount of records.
+ *
+ * @return Returns the records, or NULL if out of memory.
+ *
+ * @note Must be called with @ref hist_mutex held.
+ */
+static struct hist_record *snapshot(size_t *count)
+{
+	struct hist_record *recs;
+	struct ring *r;
+	size_t i;
+	uint32_t j;
+
+	*count = 0;
+	recs   = calloc(hs.live ? hs.live : 1, sizeof(*recs));
+	if (!recs)
+		return (NULL);
+
+	for (i = 0; i < hs.count; i++)
+	{
+		r = hs.rings[i];
+		for (j = r->head < HIST_LEN ? 0 : r->head - HIST_LEN; j < r->head; j++)
+		{
+			memcpy(recs[*count].name, r->name, PRINTER_STRLEN);
+			recs[*count].time  = r->times[j & (HIST_LEN - 1)];
+			recs[*count].state = r->states[j & (HIST_LEN - 1)];
+			(*count)++;
+		}
+	}
+	return (recs);
+}
+
+/**
+ * @brief Replaces the history file with the @p count records
+ * @p recs.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note Must only be called by the writer thread, or before it
+ * starts.
+ */
+static int rewrite(const struct hist_record *recs, size_t count)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(hs.tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return (-1);
+
+	/* Synced first: a crash must not leave an empty history. */
+	len = write(fd, recs, count * sizeof(*recs));
+	if (len < 0 || (size_t)len != count * sizeof(*recs) || fsync(fd) < 0 ||
+		rename(hs.tmp_path, hs.path) < 0)
+	{
+		close(fd);
+		unlink(hs.tmp_path);
+		return (-1);
+	}
+
+	/* The new file takes over, appends go to it. */
+	if (hs.fd >= 0)
+		close(hs.fd);
+	close(fd);
+	hs.fd = open(hs.path, O_WRONLY | O_APPEND);
+	return (hs.fd < 0 ? -1 : 0);
+}
+
+/**
+ * @brief Records that the printer @p name entered @p state now, and
+ * queues it for the writer thread.
+ *
+ * @note Must be called with @ref hist_mutex held.
+ */
+static void record(const char *name, enum PRINTER_STATE state)
+{
+	struct hist_record rec;
+	struct ring *r;
+
+	memset(&rec, 0, sizeof(rec));
+	strncpy(rec.name, name, PRINTER_STRLEN - 1);
+	rec.time  = (uint32_t)time(NULL);
+	rec.state = (uint8_t)state;
+
+	r = get_ring(name);
+	if (!r || !push(r, rec.time, rec.state))
+		return;
+
+	/* Writer behind: the rings hold it all, a rewrite will do. */
+	if (hs.queued == HIST_SLACK)
+	{
+		hs.queued  = 0;
+		hs.compact = true;
+	}
+	else
+		hs.queue[hs.queued++] = rec;
+
+	if (++hs.records > 2 * hs.live + HIST_SLACK)
+		hs.compact = true;
+	pthread_cond_signal(&hist_cond);
+}
+
+/**
+ * @brief Writer thread: appends the queued records, or rewrites the
+ * history file, whenever asked to.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *writer(void *arg)
+{
+	struct hist_record *recs;
+	size_t count;
+	ssize_t len;
+
+	(void)arg;
+	pthread_mutex_lock(&hist_mutex);
+	while (!hs.stop || hs.queued || hs.compact)
+	{
+		if (!hs.queued && !hs.compact)
+		{
+			pthread_cond_wait(&hist_cond, &hist_mutex);
+			continue;
+		}
+
+		/* A rewrite also covers the queued records. */
+		recs       = hs.compact ? snapshot(&count) : NULL;
+		hs.compact = false;
+		if (recs)
+		{
+			hs.queued  = 0;
+			hs.records = count;
+			pthread_mutex_unlock(&hist_mutex);
+			rewrite(recs, count);
+			free(recs);
+			pthread_mutex_lock(&hist_mutex);
+			continue;
+		}
+
+		recs      = hs.queue;
+		count     = hs.queued;
+		hs.queue  = hs.spare;
+		hs.spare  = recs;
+		hs.queued = 0;
+		pthread_mutex_unlock(&hist_mutex);
+
+		len = hs.fd >= 0 ? write(hs.fd, recs, count * sizeof(*recs)) : -1;
+		pthread_mutex_lock(&hist_mutex);
+
+		/* Torn or failed append: the next rewrite fixes the file. */
+		if (len < 0 || (size_t)len != count * sizeof(*recs))
+			hs.compact = true;
+	}
+	pthread_mutex_unlock(&hist_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Registry listener: records the state transitions.
+ *
+ * @param op      Operation (store_op).
+ * @param old     Previous printer contents, NULL for adds.
+ * @param cur     New printer contents, NULL for removes.
+ * @param version Version that published it.
+ */
+static void on_change(int op, const struct PRINTER *old,
+	const struct PRINTER *cur, uint64_t version)
+{
+	(void)version;
+	if (op == STORE_UPDATE && old->state == cur->state)
+		return;
+
+	pthread_mutex_lock(&hist_mutex);
+	if (op == STORE_REMOVE)
+		drop_ring(old->name);
+	else
+		record(cur->name, cur->state);
+	pthread_mutex_unlock(&hist_mutex);
+}
+
+/**
+ * @brief Replays the history file into the rings.
+ *
+ * @return Returns 0 if success (or no file), -1 otherwise.
+ */
+static int replay(void)
+{
+	struct hist_record recs[256];
+	struct ring *r;
+	ssize_t len;
+	ssize_t i;
+	int fd;
+
+	fd = open(hs.path, O_RDONLY);
+	if (fd < 0)
+		return (0);
+
+	while ((len = read(fd, recs, sizeof(recs))) > 0)
+	{
+		/* A torn last record is simply ignored. */
+		for (i = 0; i < len / (ssize_t)sizeof(*recs); i++)
+		{
+			if (recs[i].name[PRINTER_STRLEN - 1] || recs[i].state > NOK)
+				continue;
+			r = get_ring(recs[i].name);
+			if (!r)
+			{
+				close(fd);
+				return (-1);
+			}
+			push(r, recs[i].time, recs[i].state);
+		}
+	}
+	close(fd);
+	return (len < 0 ? -1 : 0);
+}
+
+/**
+ * @brief registry_foreach() callback: records the current state of
+ * a printer, unless it is already its latest state (it is not on
+ * first start, or if it changed while the server was down).
+ */
+static int seed(const struct PRINTER *p, void *data)
+{
+	(void)data;
+	record(p->name, p->state);
+	return (0);
+}
+
+/**
+ * @brief Loads the history of the printers in the registry from
+ * `<db_path>.hist` and starts recording their transitions.
+ *
+ * @param db_path Database path.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int history_open(const char *db_path)
+{
+	struct hist_record *recs;
+	struct PRINTER p;
+	size_t count;
+	size_t i;
+	int ret;
+
+	hs.path     = malloc(strlen(db_path) + sizeof(".hist"));
+	hs.tmp_path = malloc(strlen(db_path) + sizeof(".hist.tmp"));
+	if (!hs.path || !hs.tmp_path)
+		return (-1);
+	strcpy(hs.path, db_path);
+	strcat(hs.path, ".hist");
+	strcpy(hs.tmp_path, db_path);
+	strcat(hs.tmp_path, ".hist.tmp");
+
+	hs.queue = malloc(HIST_SLACK * sizeof(*hs.queue));
+	hs.spare = malloc(HIST_SLACK * sizeof(*hs.spare));
+	if (!hs.queue || !hs.spare)
+		return (-1);
+
+	pthread_mutex_lock(&hist_mutex);
+	ret = replay();
+
+	/* Forget the printers removed since. */
+	for (i = hs.count; ret == 0 && i-- > 0;)
+		if (!registry_find(hs.rings[i]->name, &p))
+			drop_ring(hs.rings[i]->name);
+
+	if (ret == 0)
+	{
+		recs = snapshot(&count);
+		ret  = recs ? rewrite(recs, count) : -1;
+		free(recs);
+		hs.records = count;
+	}
+	pthread_mutex_unlock(&hist_mutex);
+
+	if (ret < 0 || pthread_create(&hs.thread, NULL, writer, NULL))
+		return (-1);
+	hs.running = true;
+	if (registry_listen(on_change) < 0)
+		return (-1);
+
+	pthread_mutex_lock(&hist_mutex);
+	registry_foreach(seed, NULL);
+	pthread_mutex_unlock(&hist_mutex);
+	return (0);
+}
+
+/**
+ * @brief Reports the transitions of the printer @p name since
+ * @p since, preceded by the latest one before, if known: the
+ * state the printer was in at @p since.
+ *
+ * @param name  Printer name.
+ * @param since Unix time.
+ * @param cb    Called for each transition, oldest first, with the
+ *              history locked.
+ * @param data  Passed to @p cb.
+ *
+ * @return Returns the amount of reported transitions, or -1 if
+ * there is no history for @p name.
+ */
+long history_query(const char *name, uint32_t since,
+	void (*cb)(uint32_t time, enum PRINTER_STATE state, void *data),
+	void *data)
+{
+	struct ring *r;
+	uint32_t first;
+	uint32_t lo;
+	uint32_t hi;
+	uint32_t mid;
+	size_t pos;
+	long count;
+
+	pthread_mutex_lock(&hist_mutex);
+	r = find_ring(name, &pos);
+	if (!r)
+	{
+		pthread_mutex_unlock(&hist_mutex);
+		return (-1);
+	}
+
+	/* First transition after @p since, then one step back. */
+	first = r->head < HIST_LEN ? 0 : r->head - HIST_LEN;
+	lo    = first;
+	hi    = r->head;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (r->times[mid & (HIST_LEN - 1)] <= since)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > first)
+		lo--;
+
+	count = (long)(r->head - lo);
+	for (; cb && lo < r->head; lo++)
+		cb(r->times[lo & (HIST_LEN - 1)],
+			(enum PRINTER_STATE)r->states[lo & (HIST_LEN - 1)], data);
+	pthread_mutex_unlock(&hist_mutex);
+	return (count);
+}
+
+/**
+ * @brief Writes the queued records, closes the history file and
+ * releases the rings.
+ *
+ * @note Must only be called once the registry is not mutated
+ * anymore.
+ */
+void history_close(void)
+{
+	size_t i;
+
+	if (hs.running)
+	{
+		pthread_mutex_lock(&hist_mutex);
+		hs.stop = true;
+		pthread_cond_signal(&hist_cond);
+		pthread_mutex_unlock(&hist_mutex);
+		pthread_join(hs.thread, NULL);
+	}
+
+	pthread_mutex_lock(&hist_mutex);
+	for (i = 0; i < hs.count; i++)
+		free(hs.rings[i]);
+	free(hs.rings);
+	if (hs.fd >= 0)
+		close(hs.fd);
+	free(hs.queue);
+	free(hs.spare);
+	free(hs.path);
+	free(hs.tmp_path);
+	memset(&hs, 0, sizeof(hs));
+	hs.fd = -1;
+	pthread_mutex_unlock(&hist_mutex);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file history.h
+ * @brief Printer state history (`hist#`).
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+	#include "printer.h"
+
+	extern int history_open(const char *db_path);
+	extern long history_query(const char *name, uint32_t since,
+		void (*cb)(uint32_t time, enum PRINTER_STATE state, void *data),
+		void *data);
+	extern void history_close(void);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "printer.h"
+
+/**
+ * @file http.c
+ * @brief Minimal blocking HTTP client.
+ *
+ * Only what is needed to fetch resources from a printer web
+ * interface: a `GET`, a 200 status check and the response
+ * headers skipped, leaving the body to the caller.
+ */
+
+/**
+ * @brief Maximum size of the response headers.
+ */
+#define HTTP_HDR_MAX 4096
+
+/**
+ * @brief Parses the printer address @p ip, `a.b.c.d` (port 80)
+ * or `a.b.c.d:port`.
+ *
+ * @param ip   Printer address.
+ * @param addr Parsed address.
+ *
+ * @return Returns true if @p ip is a valid address.
+ */
+bool http_addr(const char *ip, struct sockaddr_in *addr)
+{
+	char host[PRINTER_STRLEN];
+	char *colon;
+	long port;
+
+	snprintf(host, sizeof(host), "%s", ip);
+	port  = 80;
+	colon = strchr(host, ':');
+	if (colon)
+	{
+		*colon = '\0';
+		port   = strtol(colon + 1, NULL, 10);
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port   = htons((uint16_t)port);
+	return (port > 0 && port < 65536 &&
+		inet_pton(AF_INET, host, &addr->sin_addr) == 1);
+}
+
+/**
+ * @brief Connects @p fd to @p addr, giving up after @p timeout_ms.
+ *
+ * @param fd         Socket.
+ * @param addr       Address.
+ * @param timeout_ms Timeout (ms).
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int connect_timeout(int fd, const struct sockaddr_in *addr,
+	int timeout_ms)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int flags;
+	int err;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return (-1);
+
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0)
+	{
+		if (errno != EINPROGRESS)
+			return (-1);
+
+		pfd.fd     = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, timeout_ms) != 1)
+			return (-1);
+
+		len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+			return (-1);
+	}
+
+	return (fcntl(fd, F_SETFL, flags));
+}
+
+/**
+ * @brief Reads the response headers from @p fd, one byte at a
+ * time, so that nothing past them is consumed.
+ *
+ * @param fd Connected socket.
+ *
+ * @return Returns true if the response status is 200.
+ */
+static bool read_headers(int fd)
+{
+	char hdr[HTTP_HDR_MAX + 1];
+	size_t len;
+
+	len = 0;
+	while (len < HTTP_HDR_MAX)
+	{
+		if (read(fd, hdr + len, 1) != 1)
+			return (false);
+		len++;
+
+		if (len >= 4 && !memcmp(hdr + len - 4, "\r\n\r\n", 4))
+		{
+			hdr[len] = '\0';
+			return (!strncmp(hdr, "HTTP/1.", 7) &&
+				!strncmp(hdr + 8, " 200", 4));
+		}
+	}
+	return (false);
+}
+
+/**
+ * @brief Requests @p path from the printer at @p ip.
+ *
+ * @param ip         Printer address, see @ref http_addr.
+ * @param path       Resource path, e.g: `/webcam/?action=stream`.
+ * @param timeout_ms Connect timeout, also applied to every
+ *                   subsequent read and write on the socket.
+ *
+ * @return Returns a socket positioned at the start of the
+ * response body, to be closed by the caller, or -1 if the
+ * request failed or did not return 200.
+ */
+int http_get(const char *ip, const char *path, int timeout_ms)
+{
+	struct sockaddr_in addr;
+	struct timeval tv;
+	char req[256];
+	int len;
+	int fd;
+
+	if (!http_addr(ip, &addr))
+		return (-1);
+
+	len = snprintf(req, sizeof(req),
+		"GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, ip);
+	if (len < 0 || (size_t)len >= sizeof(req))
+		return (-1);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+
+	tv.tv_sec  = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+		connect_timeout(fd, &addr, timeout_ms) < 0 ||
+		send(fd, req, (size_t)len, MSG_NOSIGNAL) != len ||
+		!read_headers(fd))
+	{
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
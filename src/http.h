@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file http.h
+ * @brief Minimal blocking HTTP client, used to talk to the
+ * printers web interfaces.
+ */
+#ifndef HTTP_H
+#define HTTP_H
+
+	#include <stdbool.h>
+	#include <netinet/in.h>
+
+	extern bool http_addr(const char *ip, struct sockaddr_in *addr);
+	extern int http_get(const char *ip, const char *path, int timeout_ms);
+
+#endif /* HTTP_H */
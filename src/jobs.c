@@ -0,0 +1,647 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "registry.h"
+#include "store.h"
+
+/**
+ * @file jobs.c
+ * @brief Print job queue.
+ *
+ * Submitted jobs wait in a priority queue (a binary max-heap, by
+ * priority, then submission order) until a printer is free for
+ * them. A dispatcher thread assigns the queued jobs, best first,
+ * to the free (OK) printers whose name starts with the job prefix,
+ * the printer with the fewest jobs so far first, and sets those
+ * printers BUSY. Names are the only printer capability the registry
+ * knows of, hence the prefix (e.g: `prusa` for `prusa-1`,
+ * `prusa-2`...).
+ *
+ * The dispatcher owns BUSY: it is the only one setting it (from OK,
+ * see registry_set_state_if()), and a printer keeps its job until
+ * explicitly set back to OK, which means the job is done and the
+ * printer free for the next one. A printer going NOK while printing
+ * keeps its job: it may just have missed a poll (the poller gives
+ * it back its BUSY state once it answers again). Only a removed
+ * printer gives its job back to the queue, ahead of the jobs
+ * submitted after it. Every change that may free a printer, or a new
+ * job, triggers a new dispatch, so a printer never idles while a job
+ * could run on it.
+ *
+ * Jobs only live in memory; the @ref JOB_HISTORY last finished
+ * jobs are kept for `job#status`.
+ */
+
+/**
+ * @brief Amount of finished jobs kept.
+ */
+#define JOB_HISTORY 256
+
+/**
+ * @brief Printer state change, queued by the registry listener.
+ */
+struct event
+{
+	struct event *next;        /**< Next event.                   */
+	char name[PRINTER_STRLEN]; /**< Printer name.                 */
+	int state;                 /**< New state, -1 if removed.     */
+};
+
+/**
+ * @brief Jobs assigned to a printer so far.
+ */
+struct load
+{
+	char name[PRINTER_STRLEN]; /**< Printer name.   */
+	unsigned jobs;             /**< Assigned jobs.  */
+};
+
+/**
+ * @brief Job queue state, guarded by @ref jobs_mutex.
+ */
+static struct
+{
+	struct job **jobs;   /**< Every job, sorted by id.     */
+	size_t count;        /**< Amount of jobs.              */
+	size_t capacity;     /**< Allocated jobs.              */
+	struct job **heap;   /**< Queued jobs, max-heap.       */
+	size_t queued;       /**< Amount of queued jobs.       */
+	struct load *loads;  /**< Per printer load.            */
+	size_t nloads;       /**< Amount of loads.             */
+	size_t done;         /**< Amount of finished jobs.     */
+	uint32_t next_id;    /**< Next job id.                 */
+	uint64_t next_seq;   /**< Next submission number.      */
+} jq;
+
+/**
+ * @brief Dispatcher state, guarded by @ref event_mutex.
+ */
+static struct
+{
+	struct event *head; /**< Oldest event.                */
+	struct event *tail; /**< Newest event.                */
+	bool pending;       /**< A dispatch was requested.    */
+	bool stop;          /**< Dispatcher should exit.      */
+	bool running;       /**< Dispatcher was started.      */
+	pthread_t thread;   /**< Dispatcher thread.           */
+} jd;
+
+/**
+ * @brief Guards @ref jq. Taken before the registry writers lock,
+ * as the dispatcher sets printers BUSY with it held.
+ */
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Guards @ref jd. Taken by the registry listener, so it
+ * must never be held while calling into the registry.
+ */
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signals events, or a requested dispatch.
+ */
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Job state names.
+ */
+static const char *const job_state_names[] = {"QUEUED", "PRINTING", "DONE"};
+
+/**
+ * @brief Returns the name of the job state @p state.
+ */
+const char *job_state_str(enum job_state state)
+{
+	if (state < JOB_QUEUED || state > JOB_DONE)
+		return (job_state_names[JOB_DONE]);
+	return (job_state_names[state]);
+}
+
+/**
+ * @name Priority queue
+ */
+/**@{*/
+/**
+ * @brief Whether @p a goes before @p b.
+ */
+static bool before(const struct job *a, const struct job *b)
+{
+	if (a->priority != b->priority)
+		return (a->priority > b->priority);
+	return (a->seq < b->seq);
+}
+
+/**
+ * @brief Queues @p j. There is always room: the heap is as large
+ * as the job list.
+ */
+static void heap_push(struct job *j)
+{
+	size_t i;
+
+	i = jq.queued++;
+	while (i > 0 && before(j, jq.heap[(i - 1) / 2]))
+	{
+		jq.heap[i] = jq.heap[(i - 1) / 2];
+		i          = (i - 1) / 2;
+	}
+	jq.heap[i] = j;
+}
+
+/**
+ * @brief Dequeues the first job.
+ */
+static struct job *heap_pop(void)
+{
+	struct job *top;
+	struct job *last;
+	size_t i;
+	size_t c;
+
+	top  = jq.heap[0];
+	last = jq.heap[--jq.queued];
+	i    = 0;
+	while ((c = 2 * i + 1) < jq.queued)
+	{
+		if (c + 1 < jq.queued && before(jq.heap[c + 1], jq.heap[c]))
+			c++;
+		if (!before(jq.heap[c], last))
+			break;
+		jq.heap[i] = jq.heap[c];
+		i          = c;
+	}
+	jq.heap[i] = last;
+	return (top);
+}
+/**@}*/
+
+/**
+ * @brief Returns the load entry of the printer @p name, creating
+ * it if needed.
+ *
+ * @return Returns the entry, or NULL if out of memory.
+ */
+static struct load *get_load(const char *name)
+{
+	struct load *loads;
+	size_t i;
+
+	for (i = 0; i < jq.nloads; i++)
+		if (!strcmp(jq.loads[i].name, name))
+			return (&jq.loads[i]);
+
+	loads = realloc(jq.loads, (jq.nloads + 1) * sizeof(*loads));
+	if (!loads)
+		return (NULL);
+	jq.loads = loads;
+	memset(&loads[i], 0, sizeof(*loads));
+	strcpy(loads[i].name, name);
+	jq.nloads++;
+	return (&loads[i]);
+}
+
+/**
+ * @brief Returns the job printing on @p name, or NULL if none.
+ */
+static struct job *printing_on(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < jq.count; i++)
+		if (jq.jobs[i]->state == JOB_PRINTING &&
+			!strcmp(jq.jobs[i]->printer, name))
+			return (jq.jobs[i]);
+	return (NULL);
+}
+
+/**
+ * @brief Marks @p j as done, forgetting the oldest finished job
+ * if there are too many of them.
+ */
+static void finish(struct job *j)
+{
+	size_t i;
+
+	j->state = JOB_DONE;
+	if (++jq.done <= JOB_HISTORY)
+		return;
+
+	for (i = 0; jq.jobs[i]->state != JOB_DONE; i++)
+		;
+	free(jq.jobs[i]);
+	memmove(&jq.jobs[i], &jq.jobs[i + 1],
+		(jq.count - i - 1) * sizeof(*jq.jobs));
+	jq.count--;
+	jq.done--;
+}
+
+/**
+ * @brief Applies the printer state change @p e to the job printing
+ * on it, if any.
+ */
+static void apply(const struct event *e)
+{
+	struct job *j;
+
+	j = printing_on(e->name);
+	if (!j || e->state == BUSY || e->state == NOK)
+		return;
+
+	if (e->state == OK)
+		finish(j);
+	else
+	{
+		/* Back in the queue, at its original place. */
+		j->state      = JOB_QUEUED;
+		j->printer[0] = '\0';
+		heap_push(j);
+	}
+}
+
+/**
+ * @brief Free printers collected for a dispatch.
+ */
+struct free_list
+{
+	struct PRINTER *printers; /**< Free printers.       */
+	size_t count;             /**< Amount of printers.  */
+	size_t capacity;          /**< Allocated printers.  */
+};
+
+/**
+ * @brief registry_page() callback: collects the free printers.
+ */
+static int collect(const struct PRINTER *p, void *data)
+{
+	struct free_list *fl;
+	struct PRINTER *printers;
+	size_t capacity;
+
+	fl = data;
+	if (fl->count == fl->capacity)
+	{
+		capacity = fl->capacity ? fl->capacity * 2 : 16;
+		printers = realloc(fl->printers, capacity * sizeof(*printers));
+		if (!printers)
+			return (1);
+		fl->printers = printers;
+		fl->capacity = capacity;
+	}
+	fl->printers[fl->count++] = *p;
+	return (0);
+}
+
+/**
+ * @brief Assigns the queued jobs, best first, to the free printers.
+ *
+ * A job goes to the matching free printer with the fewest jobs so
+ * far; jobs no free printer matches stay queued, without holding
+ * back the ones behind them.
+ */
+static void dispatch(void)
+{
+	struct free_list fl;
+	struct job **skipped;
+	struct load *load;
+	unsigned best_jobs;
+	unsigned jobs;
+	size_t nskipped;
+	struct job *j;
+	size_t best;
+	size_t len;
+	size_t i;
+
+	if (!jq.queued)
+		return;
+
+	memset(&fl, 0, sizeof(fl));
+	registry_page(OK, 0, SIZE_MAX, collect, &fl);
+	skipped  = malloc(jq.queued * sizeof(*skipped));
+	nskipped = 0;
+
+	while (skipped && jq.queued && fl.count)
+	{
+		j         = heap_pop();
+		len       = strlen(j->match);
+		best      = fl.count;
+		best_jobs = 0;
+		for (i = 0; i < fl.count; i++)
+		{
+			if (strncmp(fl.printers[i].name, j->match, len))
+				continue;
+			load = get_load(fl.printers[i].name);
+			jobs = load ? load->jobs : 0;
+			if (best == fl.count || jobs < best_jobs)
+			{
+				best      = i;
+				best_jobs = jobs;
+			}
+		}
+
+		if (best == fl.count)
+		{
+			skipped[nskipped++] = j;
+			continue;
+		}
+
+		/*
+		 * Registry first: the job only starts if the printer did, and
+		 * only if it is still free, it may have changed since listed.
+		 */
+		if (registry_set_state_if(fl.printers[best].name, OK, BUSY) == 0)
+		{
+			j->state = JOB_PRINTING;
+			strcpy(j->printer, fl.printers[best].name);
+			load = get_load(j->printer);
+			if (load)
+				load->jobs++;
+		}
+		else
+			heap_push(j);
+		fl.printers[best] = fl.printers[--fl.count];
+	}
+
+	for (i = 0; i < nskipped; i++)
+		heap_push(skipped[i]);
+	free(skipped);
+	free(fl.printers);
+}
+
+/**
+ * @brief Dispatcher thread: applies the printer state changes and
+ * dispatches the queued jobs, whenever something changed.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *dispatcher(void *arg)
+{
+	struct event *events;
+	struct event *e;
+
+	(void)arg;
+	pthread_mutex_lock(&event_mutex);
+	while (!jd.stop)
+	{
+		if (!jd.head && !jd.pending)
+		{
+			pthread_cond_wait(&event_cond, &event_mutex);
+			continue;
+		}
+
+		events     = jd.head;
+		jd.head    = NULL;
+		jd.tail    = NULL;
+		jd.pending = false;
+		pthread_mutex_unlock(&event_mutex);
+
+		pthread_mutex_lock(&jobs_mutex);
+		for (e = events; e; e = events)
+		{
+			events = e->next;
+			apply(e);
+			free(e);
+		}
+		dispatch();
+		pthread_mutex_unlock(&jobs_mutex);
+
+		pthread_mutex_lock(&event_mutex);
+	}
+	pthread_mutex_unlock(&event_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Requests a dispatch.
+ *
+ * @note Must be called with @ref event_mutex held.
+ */
+static void wake(void)
+{
+	jd.pending = true;
+	pthread_cond_signal(&event_cond);
+}
+
+/**
+ * @brief Registry listener: queues the printer state changes for
+ * the dispatcher.
+ *
+ * @param op      Operation (store_op).
+ * @param old     Previous printer contents, NULL for adds.
+ * @param cur     New printer contents, NULL for removes.
+ * @param version Version that published it.
+ */
+static void on_change(int op, const struct PRINTER *old,
+	const struct PRINTER *cur, uint64_t version)
+{
+	struct event *e;
+
+	(void)version;
+	if (op == STORE_UPDATE && old->state == cur->state)
+		return;
+
+	e = NULL;
+	if (op != STORE_ADD)
+	{
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return;
+		strcpy(e->name, old->name);
+		e->state = cur ? (int)cur->state : -1;
+	}
+
+	pthread_mutex_lock(&event_mutex);
+	if (e)
+	{
+		if (jd.tail)
+			jd.tail->next = e;
+		else
+			jd.head = e;
+		jd.tail = e;
+	}
+	wake();
+	pthread_mutex_unlock(&event_mutex);
+}
+
+/**
+ * @brief Registers the registry listener and starts the dispatcher.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int jobs_start(void)
+{
+	jq.next_id = 1;
+	if (registry_listen(on_change) < 0)
+		return (-1);
+	if (pthread_create(&jd.thread, NULL, dispatcher, NULL))
+		return (-1);
+	jd.running = true;
+	return (0);
+}
+
+/**
+ * @brief Queues a new job.
+ *
+ * @param file     File to print.
+ * @param priority Job priority, higher goes first.
+ * @param match    Name prefix of the printers that may print it,
+ *                 empty for any printer.
+ * @param id       Receives the job id.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int jobs_submit(const char *file, int priority, const char *match,
+	uint32_t *id)
+{
+	struct job **jobs;
+	struct job **heap;
+	size_t capacity;
+	struct job *j;
+
+	if (strlen(file) >= JOB_FILE_MAX || strlen(match) >= PRINTER_STRLEN)
+		return (-1);
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return (-1);
+	strcpy(j->file, file);
+	strcpy(j->match, match);
+	j->priority = priority;
+
+	pthread_mutex_lock(&jobs_mutex);
+	if (jq.count == jq.capacity)
+	{
+		capacity = jq.capacity ? jq.capacity * 2 : 64;
+		jobs     = realloc(jq.jobs, capacity * sizeof(*jobs));
+		if (jobs)
+			jq.jobs = jobs;
+		heap = jobs ? realloc(jq.heap, capacity * sizeof(*heap)) : NULL;
+		if (!heap)
+		{
+			pthread_mutex_unlock(&jobs_mutex);
+			free(j);
+			return (-1);
+		}
+		jq.heap     = heap;
+		jq.capacity = capacity;
+	}
+
+	j->id    = jq.next_id++;
+	j->seq   = jq.next_seq++;
+	j->state = JOB_QUEUED;
+	jq.jobs[jq.count++] = j;
+	heap_push(j);
+	*id = j->id;
+	pthread_mutex_unlock(&jobs_mutex);
+
+	pthread_mutex_lock(&event_mutex);
+	wake();
+	pthread_mutex_unlock(&event_mutex);
+	return (0);
+}
+
+/**
+ * @brief Compares a job id with a job, for bsearch().
+ */
+static int cmp_job(const void *id, const void *j)
+{
+	uint32_t a;
+	uint32_t b;
+
+	a = *(const uint32_t *)id;
+	b = (*(struct job *const *)j)->id;
+	return ((a > b) - (a < b));
+}
+
+/**
+ * @brief Reports the job @p id, or every job.
+ *
+ * @param id   Job id, 0 for every job.
+ * @param cb   Called for each job, with the queue locked.
+ * @param data Passed to @p cb.
+ *
+ * @return Returns the amount of reported jobs.
+ */
+size_t jobs_status(uint32_t id, void (*cb)(const struct job *, void *),
+	void *data)
+{
+	struct job **j;
+	size_t count;
+	size_t i;
+
+	count = 0;
+	pthread_mutex_lock(&jobs_mutex);
+	if (id)
+	{
+		j = bsearch(&id, jq.jobs, jq.count, sizeof(*jq.jobs), cmp_job);
+		if (j)
+		{
+			if (cb)
+				cb(*j, data);
+			count = 1;
+		}
+	}
+	else
+	{
+		for (i = 0; cb && i < jq.count; i++)
+			cb(jq.jobs[i], data);
+		count = jq.count;
+	}
+	pthread_mutex_unlock(&jobs_mutex);
+	return (count);
+}
+
+/**
+ * @brief Stops the dispatcher and releases the jobs.
+ */
+void jobs_stop(void)
+{
+	struct event *e;
+	size_t i;
+
+	if (!jd.running)
+		return;
+
+	pthread_mutex_lock(&event_mutex);
+	jd.stop = true;
+	pthread_cond_signal(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
+	pthread_join(jd.thread, NULL);
+
+	while ((e = jd.head))
+	{
+		jd.head = e->next;
+		free(e);
+	}
+	for (i = 0; i < jq.count; i++)
+		free(jq.jobs[i]);
+	free(jq.jobs);
+	free(jq.heap);
+	free(jq.loads);
+	memset(&jq, 0, sizeof(jq));
+	jd.running = false;
+}
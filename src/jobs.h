@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file jobs.h
+ * @brief Print job queue (`job#`).
+ */
+#ifndef JOBS_H
+#define JOBS_H
+
+	#include <stdint.h>
+	#include "printer.h"
+
+	/**
+	 * @brief Longest job file name, including the NUL terminator.
+	 */
+	#define JOB_FILE_MAX 64
+
+	/**
+	 * @brief Job states.
+	 */
+	enum job_state
+	{
+		JOB_QUEUED   = 0, /**< Waiting for a printer.       */
+		JOB_PRINTING = 1, /**< Assigned to a (BUSY) printer. */
+		JOB_DONE     = 2  /**< Printer went back to OK.      */
+	};
+
+	/**
+	 * @brief A print job.
+	 */
+	struct job
+	{
+		uint32_t id;                  /**< Job id, from 1.            */
+		int priority;                 /**< Higher goes first.         */
+		uint64_t seq;                 /**< Submission order.          */
+		enum job_state state;         /**< Current state.             */
+		char file[JOB_FILE_MAX];      /**< File to print.             */
+		char match[PRINTER_STRLEN];   /**< Printer name prefix, empty
+		                                   for any printer.           */
+		char printer[PRINTER_STRLEN]; /**< Assigned printer, if any.  */
+	};
+
+	extern int jobs_start(void);
+	extern int jobs_submit(const char *file, int priority, const char *match,
+		uint32_t *id);
+	extern size_t jobs_status(uint32_t id,
+		void (*cb)(const struct job *, void *), void *data);
+	extern const char *job_state_str(enum job_state state);
+	extern void jobs_stop(void);
+
+#endif /* JOBS_H */
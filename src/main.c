@@ -16,7 +16,9 @@
  */
 
 #define DISABLE_VERBOSE
+#define _POSIX_C_SOURCE 200809L
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,158 +27,629 @@
 #include <string.h>
 #include <ws.h>
 
+#include "binproto.h"
+#include "cache.h"
+#include "history.h"
+#include "jobs.h"
+#include "notify.h"
+#include "poller.h"
+#include "registry.h"
+#include "relay.h"
+#include "reload.h"
+#include "snap.h"
+#include "stats.h"
+#include "store.h"
+#include "writer.h"
+
 /* Global variables */
 const char *db_name = "printers.db";
-FILE *f_printers;
+const char *const protocols[] = {BINPROTO_NAME, NULL};
 char* cwd = "";
 size_t cwd_size;
-enum PRINTER_STATE {OK = 0, BUSY = 1, NOK = 2};
-struct PRINTER {
-	char name[16];
-	char ip[16];
-	enum PRINTER_STATE state;
-};
-
-bool open_printer_file(const char *file_name, char *cwd, size_t cwd_size, FILE **ptr) {
-	/* Create path for the database */
-	char *file_path = malloc(cwd_size + sizeof(file_name));
+char *get_file_path(const char *file_name) {
+	/* Create path for the file, relative to the working directory */
+	char *file_path;
+	if (file_name[0] == '/')
+		return strdup(file_name);
+	file_path = malloc(strlen(cwd) + strlen(file_name) + 2);
+	if (file_path == NULL)
+		return NULL;
 	strcpy(file_path, cwd);
-	strcpy(file_path + strlen(cwd), "/");
-	strcpy(file_path + strlen(cwd) + 1, file_name);
+	strcat(file_path, "/");
+	strcat(file_path, file_name);
+	return file_path;
+}
+bool parse_state(struct view v, enum PRINTER_STATE *state) {
+	/* Strict: only the exact state names are accepted */
+	*state = printer_state_parse(v.ptr, v.len);
+	return v.len == strlen(printer_state_str(*state)) &&
+		memcmp(v.ptr, printer_state_str(*state), v.len) == 0;
+}
+bool add_printer(struct view txt) {
+	struct PRINTER printer;
 	#ifndef DISABLE_VERBOSE
-		printf("Database path is: %s\n", file_path);
+		printf("Adding %.*s \n", (int)txt.len, txt.ptr);
 	#endif
-	
-	/* Actually open the file now */
-	*ptr = fopen(file_path, "r+");
-	
-	free(file_path);
-	if (*ptr == NULL) {
+	/* Straight from the frame into the record, no intermediate copy */
+	if (!split_line(txt.ptr, txt.len, &printer))
+		return false;
+
+	/* The registry index makes the duplicate check O(1), no file scan */
+	if (registry_add(&printer) != 0) {
+		#ifndef DISABLE_VERBOSE
+			printf("\nPrinter already exists\n");
+		#endif
 		return false;
 	}
 	return true;
 }
-bool reopen_db(FILE **f) {
-	if (f_printers != NULL)
-		fclose(*f);
-	if (open_printer_file(db_name, cwd, cwd_size, f)) {
-		#ifndef DISABLE_VERBOSE
-			printf("File successfully re-opened\n");
-		#endif
+bool set_printer_state(struct view txt) {
+	char name[PRINTER_STRLEN] = {0};
+	const char *sep = memchr(txt.ptr, '&', txt.len);
+	enum PRINTER_STATE state;
+	struct view state_txt;
+
+	/* Expects "name&STATE", with a valid state name */
+	if (sep == NULL || sep == txt.ptr || (size_t)(sep - txt.ptr) >= PRINTER_STRLEN)
+		return false;
+	memcpy(name, txt.ptr, sep - txt.ptr);
+	state_txt.ptr = sep + 1;
+	state_txt.len = txt.len - (sep - txt.ptr) - 1;
+	if (!parse_state(state_txt, &state))
+		return false;
+
+	/* Updated in place, persisted with a single log append */
+	return registry_set_state(name, state) == 0;
+}
+bool parse_size(struct view v, size_t *value) {
+	size_t i;
+
+	if (v.len == 0 || v.len > 9)
+		return false;
+	for (*value = 0, i = 0; i < v.len; i++) {
+		if (v.ptr[i] < '0' || v.ptr[i] > '9')
+			return false;
+		*value = *value * 10 + (v.ptr[i] - '0');
+	}
+	return true;
+}
+bool get_printers_page(int fd, struct view query) {
+	const char *end = query.ptr + query.len;
+	const char *key, *next;
+	enum PRINTER_STATE parsed;
+	size_t offset = 0, limit = SIZE_MAX;
+	struct view val;
+	int state = -1;
+
+	/* Expects "key=value" pairs separated by '&': state, offset, limit */
+	for (key = query.ptr; key < end; key = next + 1) {
+		next = memchr(key, '&', end - key);
+		if (next == NULL)
+			next = end;
+		val.ptr = memchr(key, '=', next - key);
+		if (val.ptr == NULL)
+			return false;
+		val.ptr++;
+		val.len = next - val.ptr;
+		if (val.ptr - key == 6 && memcmp(key, "state=", 6) == 0) {
+			if (!parse_state(val, &parsed))
+				return false;
+			state = parsed;
+		} else if (val.ptr - key == 7 && memcmp(key, "offset=", 7) == 0) {
+			if (!parse_size(val, &offset))
+				return false;
+		} else if (val.ptr - key == 6 && memcmp(key, "limit=", 6) == 0) {
+			if (!parse_size(val, &limit))
+				return false;
+		} else {
+			return false;
+		}
+	}
+
+	/* Served from the state index: costs as much as the page */
+	cache_send_page(fd, WIRE_TEXT, state, offset, limit);
+	return true;
+}
+void reply(int fd, bool ok) {
+	if (ok)
+		ws_sendframe(fd, "OK\n", 3, false, WS_FR_OP_TXT);
+	else
+		ws_sendframe(fd, "NOK\n", 4, false, WS_FR_OP_TXT);
+}
+void cmd_add(int fd, struct view args) {
+	reply(fd, add_printer(args));
+}
+void cmd_addmany(int fd, struct view args) {
+	const char *end = args.ptr + args.len;
+	const char *line, *eol;
+	struct PRINTER *printers;
+	size_t count = 0, valid = 0, len = 0, i;
+	int *results = NULL;
+	char *answer = NULL;
+	bool *parsed;
+
+	/* One "name&ip&STATE" record per line, answered with one line each */
+	for (line = args.ptr; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+		count += eol > line;
+	}
+	printers = malloc((count ? count : 1) * sizeof(*printers));
+	parsed = malloc((count ? count : 1) * sizeof(*parsed));
+	if (printers == NULL || parsed == NULL)
+		goto out;
+	for (line = args.ptr, i = 0; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+		if (eol == line)
+			continue;
+		parsed[i] = split_line(line, eol - line, &printers[valid]);
+		valid += parsed[i++];
+	}
+
+	/* Checked against the index in one pass, logged with one write and sync */
+	results = malloc((valid ? valid : 1) * sizeof(*results));
+	answer = malloc(count * 4 + 1);
+	if (results == NULL || answer == NULL)
+		goto out;
+	if (valid > 0)
+		registry_add_many(printers, valid, results);
+	for (i = 0, valid = 0; i < count; i++) {
+		if (parsed[i] && results[valid++] == 0) {
+			memcpy(answer + len, "OK\n", 3);
+			len += 3;
+		} else {
+			memcpy(answer + len, "NOK\n", 4);
+			len += 4;
+		}
+	}
+	ws_sendframe(fd, answer, len, false, WS_FR_OP_TXT);
+out:
+	if (answer == NULL)
+		reply(fd, false);
+	free(answer);
+	free(results);
+	free(parsed);
+	free(printers);
+}
+void cmd_set(int fd, struct view args) {
+	reply(fd, set_printer_state(args));
+}
+void cmd_sub(int fd, struct view args) {
+	(void)args;
+	/* Full list first, then deltas: both sent by the notifier, in order */
+	if (notify_subscribe(fd, WIRE_TEXT) != 0)
+		reply(fd, false);
+}
+void cmd_get(int fd, struct view args) {
+	/* Shared, pre-rendered frame: no allocation nor disk access */
+	if (args.len == 0)
+		cache_send_printers(fd, WIRE_TEXT, NULL);
+	else if (!get_printers_page(fd, args))
+		reply(fd, false);
+}
+bool copy_text(struct view v, char *buf, size_t size) {
+	if (v.len == 0 || v.len >= size || memchr(v.ptr, '\n', v.len) != NULL)
+		return false;
+	memcpy(buf, v.ptr, v.len);
+	buf[v.len] = '\0';
+	return true;
+}
+bool copy_name(struct view v, char *name) {
+	return copy_text(v, name, PRINTER_STRLEN);
+}
+bool watch_webcam(int fd, struct view name) {
+	char buf[PRINTER_STRLEN];
+
+	/* An empty name stops every webcam the client watches */
+	if (name.len == 0) {
+		relay_unsubscribe(fd);
 		return true;
+	}
+	return copy_name(name, buf) && relay_subscribe(fd, buf) == 0;
+}
+bool send_snapshot(int fd, struct view name) {
+	char buf[PRINTER_STRLEN];
+	struct refbuf *frame;
+	bool ok;
+
+	/* Shared frame, refreshed in the background every few seconds */
+	if (!copy_name(name, buf) || (frame = snap_get(buf)) == NULL)
+		return false;
+	ok = ws_sendframe_raw(fd, frame->data, frame->size) >= 0;
+	refbuf_put(frame);
+	return ok;
+}
+void cmd_snap(int fd, struct view args) {
+	if (!send_snapshot(fd, args))
+		reply(fd, false);
+}
+void cmd_cam(int fd, struct view args) {
+	reply(fd, watch_webcam(fd, args));
+}
+struct cam_stats {
+	char *buf;
+	size_t len;
+	bool binary;
+};
+void add_cam_stats(const char *name, uint64_t sent, uint64_t dropped, void *data) {
+	struct cam_stats *st = data;
+
+	/* Room was made for every watched webcam beforehand */
+	if (st->binary) {
+		st->len += binproto_name(name, (unsigned char *)st->buf + st->len);
+		binproto_put_u32((unsigned char *)st->buf + st->len, (uint32_t)sent);
+		binproto_put_u32((unsigned char *)st->buf + st->len + 4, (uint32_t)dropped);
+		st->len += 8;
 	} else {
-		#ifndef DISABLE_VERBOSE
-			printf("Could not open file for read or write\n");
-		#endif
+		st->len += sprintf(st->buf + st->len, "%s&%" PRIu64 "&%" PRIu64 "\n",
+			name, sent, dropped);
+	}
+}
+bool send_cam_stats(int fd, bool binary) {
+	struct cam_stats st = {NULL, 0, binary};
+	size_t count;
+	bool ok;
+
+	/* Only this client changes its own webcams, the count holds */
+	count = relay_stats(fd, NULL, NULL);
+	st.buf = malloc(BINPROTO_LIST_HDR + count * (PRINTER_STRLEN + 2 * 21) + 1);
+	if (st.buf == NULL)
 		return false;
+	if (binary)
+		st.len = BINPROTO_LIST_HDR;
+	count = relay_stats(fd, add_cam_stats, &st);
+	if (binary) {
+		((unsigned char *)st.buf)[0] = BINPROTO_CAMSTAT_LIST;
+		binproto_put_u32((unsigned char *)st.buf + 1, (uint32_t)count);
 	}
+	ok = ws_sendframe(fd, st.buf, st.len, false,
+		binary ? WS_FR_OP_BIN : WS_FR_OP_TXT) >= 0;
+	free(st.buf);
+	return ok;
 }
-struct PRINTER split_line(char *line, long unsigned int size) {
-	long unsigned int i = 0;
-	long unsigned int j = 0;
-	struct PRINTER printer;
-	long unsigned int printer_strlen = sizeof(printer.ip);
-	char name[printer_strlen];
-	char ip[printer_strlen];
-	enum PRINTER_STATE state = NOK;
-	char buffer[printer_strlen];
-	uint8_t stage = 0;
-	char c; 
-
-	for (i = 0; i < size; i++) { // size is the size of the array, since one char is one byte, it is also the length of the array
-		c = *(line + i);
-		if (c == '&' || j >= printer_strlen) {
-			if (j > printer_strlen) // since we add one to j after pushing to the buffer, we want to decrease j with one to prevent stack smashing
-				j--;
-			buffer[j] = '\0';
-			if (stage == 0) {
-				memcpy(name, buffer, printer_strlen);
-			} else if (stage == 1) {
-				memcpy(ip, buffer, printer_strlen);
-			} else
-				break;
-			stage++;
-			j = 0;
-		} else { // we'll jump over the '&' sign so therefor not add to buffer when c is '&'
-			buffer[j] = c;
-			j++;
+void cmd_camstat(int fd, struct view args) {
+	if (args.len != 0 || !send_cam_stats(fd, false))
+		reply(fd, false);
+}
+bool submit_job(int fd, struct view query) {
+	const char *end = query.ptr + query.len;
+	const char *key, *next;
+	char file[JOB_FILE_MAX] = "", match[PRINTER_STRLEN] = "";
+	size_t priority = 0;
+	char answer[16];
+	struct view val;
+	uint32_t id;
+	int len;
+
+	/* "key=value" pairs, as for get#: file (required), priority, printer */
+	for (key = query.ptr; key < end; key = next + 1) {
+		next = memchr(key, '&', end - key);
+		if (next == NULL)
+			next = end;
+		val.ptr = memchr(key, '=', next - key);
+		if (val.ptr == NULL)
+			return false;
+		val.ptr++;
+		val.len = next - val.ptr;
+		if (val.ptr - key == 5 && memcmp(key, "file=", 5) == 0) {
+			if (!copy_text(val, file, sizeof(file)))
+				return false;
+		} else if (val.ptr - key == 9 && memcmp(key, "priority=", 9) == 0) {
+			if (!parse_size(val, &priority))
+				return false;
+		} else if (val.ptr - key == 8 && memcmp(key, "printer=", 8) == 0) {
+			if (!copy_name(val, match))
+				return false;
+		} else {
+			return false;
 		}
 	}
-	/* Check if we have filled both the name and the ip */
-	if (stage == 2) {
-		/* Then add the state as well */
-		if (strncmp("OK", buffer, 2) == 0)
-			state = OK;
-		else if (strncmp("BUSY", buffer, 4) == 0)
-			state = BUSY;
-		else
-			state = NOK;
-	}
-	/* Now fill the struct with above data */
-	memcpy(printer.name, name, printer_strlen);
-	memcpy(printer.ip, ip, printer_strlen);
-	printer.state = state;
-	return printer;
-}
-bool add_printer(char *printer_txt_old, size_t size) {
-	size++; /* we add one since we need to add null char */
-	char *printer_txt = calloc(size, sizeof(char));
-	memcpy(printer_txt, printer_txt_old, size - 1); /* Old buffer doesn't have room for the null character */
-	*(printer_txt + size - 1) = '\0';
-	#ifndef DISABLE_VERBOSE
-		printf("Adding %s \n", printer_txt);
-	#endif
-	reopen_db(&f_printers);
-	/* First check so it doesn't already exist */
-	struct PRINTER line_printer;
-	struct PRINTER new_printer = split_line(printer_txt, size);
-	const unsigned MAX_LENGTH = 256;
-	char line[MAX_LENGTH];
-	int i = 0;
-	fseek(f_printers, 0L, SEEK_SET);
-	while(fgets(line, MAX_LENGTH, f_printers)) {
-		i++;
-		line_printer = split_line(line, MAX_LENGTH);
-		if (strncmp(new_printer.name, line_printer.name, size) == 0) {
-			#ifndef DISABLE_VERBOSE
-				printf("\nPrinter already exists\n");
-			#endif
-			free(printer_txt);
+	if (file[0] == '\0' || jobs_submit(file, (int)priority, match, &id) != 0)
+		return false;
+	len = sprintf(answer, "%" PRIu32 "\n", id);
+	return ws_sendframe(fd, answer, len, false, WS_FR_OP_TXT) >= 0;
+}
+#define JOB_LINE_MAX (JOB_FILE_MAX + 2 * PRINTER_STRLEN + 16)
+struct job_list {
+	char *buf;
+	size_t len, size;
+};
+void add_job_line(const struct job *j, void *data) {
+	struct job_list *list = data;
+
+	/* Jobs submitted since the buffer was sized are left out */
+	if (list->size - list->len < JOB_LINE_MAX)
+		return;
+	list->len += sprintf(list->buf + list->len, "%" PRIu32 "&%s&%s&%s\n",
+		j->id, j->file, job_state_str(j->state), j->printer);
+}
+bool send_jobs(int fd, struct view query) {
+	struct job_list list = {NULL, 0, 0};
+	size_t count, id = 0;
+	bool ok;
+
+	/* Every job, or "id=N" */
+	if (query.len != 0) {
+		if (query.len < 3 || memcmp(query.ptr, "id=", 3) != 0)
+			return false;
+		query.ptr += 3;
+		query.len -= 3;
+		if (!parse_size(query, &id) || id == 0)
 			return false;
+	}
+	count = jobs_status(id, NULL, NULL);
+	if (count == 0 && id != 0)
+		return false;
+	list.size = count * JOB_LINE_MAX + 1;
+	list.buf = malloc(list.size);
+	if (list.buf == NULL)
+		return false;
+	jobs_status(id, add_job_line, &list);
+	ok = ws_sendframe(fd, list.buf, list.len, false, WS_FR_OP_TXT) >= 0;
+	free(list.buf);
+	return ok;
+}
+void cmd_job(int fd, struct view args) {
+	struct view query = {args.ptr + 6, args.len - 6};
+	bool ok = false;
+
+	/* "submit" or "status", then an optional "&query" */
+	if (args.len >= 6 && (args.len == 6 || args.ptr[6] == '&')) {
+		if (args.len > 6) {
+			query.ptr++;
+			query.len--;
 		}
+		if (memcmp(args.ptr, "submit", 6) == 0)
+			ok = submit_job(fd, query);
+		else if (memcmp(args.ptr, "status", 6) == 0)
+			ok = send_jobs(fd, query);
 	}
+	if (!ok)
+		reply(fd, false);
+}
+struct hist_list {
+	char *buf;
+	size_t len, size;
+};
+#define HIST_LINE_MAX 20
+void add_hist_line(uint32_t time, enum PRINTER_STATE state, void *data) {
+	struct hist_list *list = data;
 
-	fseek(f_printers, 0L, SEEK_END);
-	fprintf(f_printers, printer_txt);
-	fprintf(f_printers, "\n");
-	fflush(f_printers);
-	free(printer_txt);
-	return true;
+	/* Transitions recorded since the buffer was sized are left out */
+	if (list->size - list->len < HIST_LINE_MAX)
+		return;
+	list->len += sprintf(list->buf + list->len, "%" PRIu32 "&%s\n", time,
+		printer_state_str(state));
+}
+bool send_history(int fd, struct view args) {
+	struct hist_list list = {NULL, 0, 0};
+	const char *amp = memchr(args.ptr, '&', args.len);
+	char name[PRINTER_STRLEN];
+	struct view name_v = args;
+	uint64_t since = 0;
+	long count;
+	size_t i;
+	bool ok;
+
+	/* "name" or "name&since=T", T in seconds since the epoch */
+	if (amp != NULL) {
+		name_v.len = amp - args.ptr;
+		if (args.ptr + args.len - amp < 8 || memcmp(amp + 1, "since=", 6) != 0)
+			return false;
+		for (i = 7; i < (size_t)(args.ptr + args.len - amp); i++) {
+			if (amp[i] < '0' || amp[i] > '9')
+				return false;
+			since = since * 10 + (amp[i] - '0');
+			if (since > UINT32_MAX)
+				return false;
+		}
+	}
+	if (!copy_name(name_v, name))
+		return false;
+	count = history_query(name, (uint32_t)since, NULL, NULL);
+	if (count < 0)
+		return false;
+	list.size = count * HIST_LINE_MAX + 1;
+	list.buf = malloc(list.size);
+	if (list.buf == NULL)
+		return false;
+	history_query(name, (uint32_t)since, add_hist_line, &list);
+	ok = ws_sendframe(fd, list.buf, list.len, false, WS_FR_OP_TXT) >= 0;
+	free(list.buf);
+	return ok;
+}
+void cmd_hist(int fd, struct view args) {
+	if (!send_history(fd, args))
+		reply(fd, false);
 }
-void get_printers(char **response, size_t *response_size) {
-	long unsigned int i = 0;
-	char c;
-	reopen_db(&f_printers);
-	fseek(f_printers, 0L, SEEK_END);
-	*response_size = ftell(f_printers);
-	fseek(f_printers, 0L, SEEK_SET);
+void cmd_stats(int fd, struct view args) {
+	char *text;
+
+	if (args.len != 0 || (text = malloc(STATS_TEXT_MAX)) == NULL) {
+		reply(fd, false);
+		return;
+	}
+	ws_sendframe(fd, text, stats_format(text, STATS_TEXT_MAX), false,
+		WS_FR_OP_TXT);
+	free(text);
+}
+/* Text commands, keyed on their 4-byte prefix (plus a rare longer tail) */
+struct command {
+	char op[4];
+	const char *tail;
+	void (*run)(int fd, struct view args);
+	enum stat_metric metric;
+	bool syncs; /* Syncs the log: run by the writer thread with -w */
+};
+const struct command commands[] = {
+	{{'g', 'e', 't', '#'}, "", cmd_get, STAT_GET, false},
+	{{'s', 'e', 't', '#'}, "", cmd_set, STAT_SET, true},
+	{{'a', 'd', 'd', '#'}, "", cmd_add, STAT_ADD, true},
+	{{'s', 'u', 'b', '#'}, "", cmd_sub, STAT_SUB, false},
+	{{'a', 'd', 'd', 'm'}, "any#", cmd_addmany, STAT_ADDMANY, true},
+	{{'c', 'a', 'm', '#'}, "", cmd_cam, STAT_CAM, false},
+	{{'c', 'a', 'm', 's'}, "tat#", cmd_camstat, STAT_CAMSTAT, false},
+	{{'s', 'n', 'a', 'p'}, "#", cmd_snap, STAT_SNAP, false},
+	{{'j', 'o', 'b', '#'}, "", cmd_job, STAT_JOB, false},
+	{{'h', 'i', 's', 't'}, "#", cmd_hist, STAT_HIST, false},
+	{{'s', 't', 'a', 't'}, "s#", cmd_stats, STAT_STATS, false},
+};
+/* The command a text message is, and its arguments: NULL if none */
+const struct command *find_command(const unsigned char *msg, size_t size,
+	struct view *args) {
+	size_t i, tail;
 
-	*response = calloc(*response_size + 1, sizeof(char));
-	while(1) {
-		c = fgetc(f_printers);
-		if (c == EOF)
-			break;
-		*(*response + i) = c;
-		i++;
+	for (i = 0; size >= 4 && i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if (memcmp(msg, commands[i].op, 4) == 0) {
+			args->ptr = (const char *)msg + 4;
+			args->len = size - 4;
+			tail = strlen(commands[i].tail);
+			if (args->len < tail || memcmp(args->ptr, commands[i].tail, tail) != 0)
+				return NULL;
+			args->ptr += tail;
+			args->len -= tail;
+			return &commands[i];
+		}
+	}
+	return NULL;
+}
+void send_status(int fd, bool ok) {
+	unsigned char status[2] = {BINPROTO_STATUS, ok ? 0 : 1};
+	ws_sendframe_bin(fd, (const char *)status, sizeof(status), false);
+}
+bool binary_addmany(int fd, const unsigned char *msg, size_t size) {
+	struct PRINTER *printers;
+	unsigned char *answer;
+	uint32_t count, i;
+	size_t off, n;
+	int *results;
+	bool ok = false;
 
-		printf("%c", c);
+	/* [count u32][records], answered with [count u32][status u8...] */
+	if (size < 5)
+		return false;
+	count = binproto_get_u32(msg + 1);
+	if (count > (size - 5) / 4)
+		return false;
+	printers = malloc((count ? count : 1) * sizeof(*printers));
+	results = malloc((count ? count : 1) * sizeof(*results));
+	answer = malloc(count + BINPROTO_LIST_HDR);
+	if (printers == NULL || results == NULL || answer == NULL)
+		goto out;
+	for (i = 0, off = 5; i < count; i++, off += n) {
+		n = binproto_parse_record(msg + off, size - off, &printers[i]);
+		if (n == 0)
+			goto out;
 	}
-	*(response + *response_size) = '\0';
+	if (off != size)
+		goto out;
+
+	if (count > 0)
+		registry_add_many(printers, count, results);
+	answer[0] = BINPROTO_RESULTS;
+	binproto_put_u32(answer + 1, count);
+	for (i = 0; i < count; i++)
+		answer[BINPROTO_LIST_HDR + i] = results[i] == 0 ? 0 : 1;
+	ok = ws_sendframe_bin(fd, (const char *)answer, count + BINPROTO_LIST_HDR,
+		false) >= 0;
+out:
+	free(answer);
+	free(results);
+	free(printers);
+	return ok;
 }
-	
+bool binary_message(int fd, const unsigned char *msg, size_t size) {
+	char name[PRINTER_STRLEN];
+	struct PRINTER printer;
+	size_t n;
+
+	/* Opcode byte, then fixed or length-prefixed fields, see binproto.c */
+	switch (msg[0]) {
+		case BINPROTO_GET:
+			if (size == 1)
+				return cache_send_printers(fd, WIRE_BINARY, NULL) == 0;
+			if (size != 10 || (msg[1] > NOK && msg[1] != BINPROTO_ANY_STATE))
+				return false;
+			return cache_send_page(fd, WIRE_BINARY,
+				msg[1] == BINPROTO_ANY_STATE ? -1 : msg[1],
+				binproto_get_u32(msg + 2), binproto_get_u32(msg + 6)) == 0;
+		case BINPROTO_ADD:
+			n = binproto_parse_record(msg + 1, size - 1, &printer);
+			send_status(fd, n && n == size - 1 && registry_add(&printer) == 0);
+			return true;
+		case BINPROTO_SET:
+			n = binproto_parse_name(msg + 1, size - 1, name);
+			send_status(fd, n && size == n + 2 && msg[n + 1] <= NOK &&
+				registry_set_state(name, msg[n + 1]) == 0);
+			return true;
+		case BINPROTO_ADDMANY:
+			return binary_addmany(fd, msg, size);
+		case BINPROTO_CAM:
+			if (size < 2 || size != (size_t)msg[1] + 2)
+				return false;
+			send_status(fd, watch_webcam(fd, (struct view){
+				(const char *)msg + 2, msg[1]}));
+			return true;
+		case BINPROTO_CAMSTAT:
+			return size == 1 && send_cam_stats(fd, true);
+		case BINPROTO_SNAP:
+			return size >= 2 && size == (size_t)msg[1] + 2 &&
+				send_snapshot(fd, (struct view){(const char *)msg + 2, msg[1]});
+		case BINPROTO_SUB:
+			return size == 1 && notify_subscribe(fd, WIRE_BINARY) == 0;
+	}
+	return false;
+}
+/* Registry mutations wait for their log entry to be synced */
+bool syncs_log(const unsigned char *msg, size_t size, bool binary) {
+	const struct command *cmd;
+	struct view args;
+
+	if (binary)
+		return size > 0 && (msg[0] == BINPROTO_ADD || msg[0] == BINPROTO_SET ||
+			msg[0] == BINPROTO_ADDMANY);
+	cmd = find_command(msg, size, &args);
+	return cmd != NULL && cmd->syncs;
+}
+/* Runs a message: binary ones are from clients that negotiated binproto */
+void handle_message(int fd, const unsigned char *msg, size_t size, bool binary) {
+	const struct command *cmd;
+	struct view args;
+	uint64_t start;
 
+	if (size == 0) {
+		ws_sendframe_txt(fd, "PING", false);
+		return;
+	}
 
+	/* Binary protocol, for the clients that negotiated it */
+	start = stats_now();
+	if (binary) {
+		if (!binary_message(fd, msg, size))
+			send_status(fd, false);
+		stats_record(STAT_BINARY, stats_now() - start);
+		return;
+	}
 
+	/* Handlers get a view of the arguments, within the frame itself */
+	cmd = find_command(msg, size, &args);
+	if (cmd != NULL) {
+		cmd->run(fd, args);
+		stats_record(cmd->metric, stats_now() - start);
+		return;
+	}
+	ws_sendframe_txt(fd, "Invalid command\n", false);
+	stats_record(STAT_INVALID, stats_now() - start);
+}
+/* Runs a message queued for the writer thread */
+void run_queued(int fd, const unsigned char *msg, size_t size, int binary) {
+	/* Client gone meanwhile: its mutations still apply, nothing else */
+	if (fd >= 0 || syncs_log(msg, size, binary))
+		handle_message(fd, msg, size, binary);
+}
 /**
  * @brief Called when a client connects to the server.
  *
@@ -192,6 +665,7 @@ void onopen(int fd)
 	printf("Connection opened, client: %d | addr: %s\n", fd, cli);
 #endif
 	free(cli);
+	stats_count(STAT_OPENED, 1);
 }
 
 /**
@@ -209,6 +683,10 @@ void onclose(int fd)
 	printf("Connection closed, client: %d | addr: %s\n", fd, cli);
 #endif
 	free(cli);
+	stats_count(STAT_CLOSED, 1);
+	writer_forget(fd);
+	notify_unsubscribe(fd);
+	relay_unsubscribe(fd);
 }
 
 /**
@@ -229,38 +707,27 @@ void onclose(int fd)
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 void onmessage(int fd, const unsigned char *msg, uint64_t size, int type)
 {
+	bool binary;
+#ifndef DISABLE_VERBOSE
 	char *cli;
-	char *response;
-	size_t response_size = 0;
 	cli = ws_getaddress(fd);
-#ifndef DISABLE_VERBOSE
 	printf("I receive a message: %s (size: %" PRId64 ", type: %d), from: %s/%d\n",
 		msg, size, type, cli, fd);
-#endif
 	free(cli);
+#endif
 
-	if (size == 0) {
-		ws_sendframe_txt(fd, "PING", false);
-		return;
-	}
+	stats_count(STAT_FRAMES_IN, 1);
+	binary = type == WS_FR_OP_BIN && ws_get_protocol(fd) == 0;
 
-	if (strncmp((char*)msg, "add#", 4) == 0) {
-		size_t p_txtsize = size - 4; /* size minus "add#" */
-		char *printer_txt = calloc(p_txtsize, sizeof(char)); 
-		memcpy(printer_txt, msg + 4, p_txtsize);
-		if (add_printer(printer_txt, p_txtsize))
-			ws_sendframe_txt(fd, "OK\n", false);
-		else
-			ws_sendframe_txt(fd, "NOK\n", false);
-		free(printer_txt);
-	} else if (strncmp((char*)msg, "get#", 4) == 0) {
-		get_printers(&response, &response_size);
-		ws_sendframe_txt(fd, response, false);
-		free(response);
-	} else {
-		ws_sendframe_txt(fd, "Invalid command\n", false);
+	/*
+	 * With -w, a worker serves many clients: log syncs are left to the
+	 * writer thread, and so is what a client sends after them, so that
+	 * its replies keep their order. Run here if the writer cannot.
+	 */
+	if ((writer_busy(fd) || syncs_log(msg, size, binary)) &&
+		writer_submit(fd, msg, size, binary) == 0)
 		return;
-	}
+	handle_message(fd, msg, size, binary);
 
 	/**
 	 * Mimicks the same frame type received and re-send it again
@@ -274,6 +741,17 @@ void onmessage(int fd, const unsigned char *msg, uint64_t size, int type)
 }
 #pragma GCC diagnostic pop
 
+/* Sends and handshakes, as timed by wsServer */
+void on_ws_timing(int event, uint64_t ns, uint64_t bytes) {
+	if (event == WS_TIMING_HANDSHAKE) {
+		stats_record(STAT_HANDSHAKE, ns);
+		return;
+	}
+	stats_record(STAT_SEND, ns);
+	stats_count(STAT_FRAMES_OUT, 1);
+	stats_count(STAT_BYTES_OUT, bytes);
+}
+
 bool get_cwd(char **cwd, size_t *cwd_size) {
 	long path_max;
 	char *ptr;
@@ -309,15 +787,91 @@ bool get_cwd(char **cwd, size_t *cwd_size) {
 	return false;
 }
 
+/**
+ * @brief Prints the command line usage.
+ *
+ * @return Always -1, the exit status.
+ */
+int usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-d database] [-c binary_database] [-p]"
+		" [-s seconds] [-w workers [-r|-u]] [-m clients]\n"
+		"  -d  database to be served (default: printers.db)\n"
+		"  -c  convert the (text) database into the binary format\n"
+		"      and exit\n"
+		"  -p  poll the printers and update their state\n"
+		"  -s  take a webcam snapshot of every printer every\n"
+		"      given seconds\n"
+		"  -w  serve the clients from the given amount of epoll\n"
+		"      worker threads, instead of a thread per client\n"
+		"  -r  with -w, each worker accepts its own clients from\n"
+		"      its own SO_REUSEPORT listener\n"
+		"  -u  as -r, but the workers drive io_uring instead of\n"
+		"      epoll (falls back to -r if not available)\n"
+		"  -m  max clients connected at once (default: %d)\n",
+		prog, MAX_CLIENTS);
+	return -1;
+}
+
 /**
  * @brief Main routine.
  *
  * @note After invoking @ref ws_socket, this routine never returns,
  * unless if invoked from a different thread.
  */
-int main(void)
+int main(int argc, char **argv)
 {
 	struct ws_events evs;
+	char *db_path;
+	char *convert_to = NULL;
+	long converted;
+	bool poll = false;
+	long snap_interval = 0;
+	long workers = 0;
+	bool sharded = false;
+	bool uring = false;
+	long max_clients = 0;
+	int backend;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:c:ps:w:rum:")) != -1) {
+		switch (opt) {
+			case 'd':
+				db_name = optarg;
+				break;
+			case 'c':
+				convert_to = optarg;
+				break;
+			case 'p':
+				poll = true;
+				break;
+			case 'r':
+				sharded = true;
+				break;
+			case 'u':
+				uring = true;
+				break;
+			case 's':
+				snap_interval = strtol(optarg, NULL, 10);
+				if (snap_interval <= 0)
+					return usage(argv[0]);
+				break;
+			case 'w':
+				workers = strtol(optarg, NULL, 10);
+				if (workers <= 0)
+					return usage(argv[0]);
+				break;
+			case 'm':
+				max_clients = strtol(optarg, NULL, 10);
+				if (max_clients <= 0)
+					return usage(argv[0]);
+				break;
+			default:
+				return usage(argv[0]);
+		}
+	}
+	/* -r and -u pick how the workers run: meaningless without -w */
+	if ((sharded || uring) && (workers == 0 || (sharded && uring)))
+		return usage(argv[0]);
 	
 	/* Get the current working directory */
 	if (!get_cwd(&cwd, &cwd_size)) {
@@ -326,13 +880,78 @@ int main(void)
 	}
 	/* Open the working files */
 	printf("Current working dir: %s\nOpening printers file...\n", cwd);
-	if (open_printer_file(db_name, cwd, cwd_size, &f_printers)) {
-		printf("File successfully opened\n");
-	} else {
-		printf("Could not open file for read or write\n");
+	db_path = get_file_path(db_name);
+	if (db_path != NULL && convert_to != NULL) {
+		converted = store_convert(db_path, convert_to);
+		free(db_path);
+		if (converted < 0) {
+			perror("Could not convert database");
+			return -1;
+		}
+		printf("Converted %ld printers into %s\n", converted, convert_to);
+		return 0;
+	}
+	if (db_path == NULL || registry_init(db_path) != 0) {
+		printf("Could not load printers database\n");
+		return -1;
+	}
+	if (history_open(db_path) != 0) {
+		printf("Could not load the printers history\n");
+		return -1;
+	}
+	if (reload_start(db_path) != 0) {
+		printf("Could not watch the printers database\n");
+		return -1;
+	}
+	free(db_path);
+	printf("Loaded %zu printers\n", registry_count());
+	if (notify_init() != 0) {
+		printf("Could not start the change notifier\n");
+		return -1;
+	}
+	if (jobs_start() != 0) {
+		printf("Could not start the job queue\n");
+		return -1;
+	}
+	if (poll && poller_start() != 0) {
+		printf("Could not start the printer poller\n");
+		return -1;
+	}
+
+	if (snap_interval > 0 && snap_start((unsigned)snap_interval) != 0) {
+		printf("Could not start the snapshot cache\n");
+		return -1;
+	}
+
+	if (workers > 0) {
+		backend = uring ? WS_BACKEND_URING :
+			sharded ? WS_BACKEND_SHARDED : WS_BACKEND_EPOLL;
+
+		/* With -u, 1 means io_uring was not available: sharded epoll */
+		switch (ws_backend(backend, (int)workers)) {
+			case 0:
+				break;
+			case 1:
+				printf("io_uring not available, using sharded epoll (-r)\n");
+				break;
+			default:
+				printf("Could not select the %s backend\n",
+					uring ? "io_uring" : sharded ? "sharded epoll" : "epoll");
+				return -1;
+		}
+	}
+	if (workers > 0 && writer_start(run_queued) != 0) {
+		printf("Could not start the writer thread\n");
+		return -1;
+	}
+	if (max_clients > 0 && ws_max_clients((int)max_clients) != 0) {
+		printf("Could not set the max clients\n");
 		return -1;
 	}
 
+	stats_init();
+	ws_timing(on_ws_timing);
+	ws_subprotocols(protocols);
 	evs.onopen    = &onopen;
 	evs.onclose   = &onclose;
 	evs.onmessage = &onmessage;
@@ -343,6 +962,15 @@ int main(void)
 	 *   ws_socket(&evs, 8080, 1)
 	 */
 
-	fclose(f_printers);
+	writer_stop();
+	relay_close();
+	reload_stop();
+	snap_stop();
+	poller_stop();
+	jobs_stop();
+	notify_close();
+	cache_close();
+	registry_close();
+	history_close();
 	return (0);
 }
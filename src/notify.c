@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ws.h>
+
+#include "binproto.h"
+#include "cache.h"
+#include "notify.h"
+#include "refbuf.h"
+#include "registry.h"
+#include "store.h"
+
+/**
+ * @file notify.c
+ * @brief Pushes registry changes to subscribed clients.
+ *
+ * Every registry mutation is turned into a small delta, in the same
+ * syntax as the commands that would produce it:
+ *
+ * - `add#name&ip&STATE` for a new printer,
+ * - `set#name&ip&STATE` for a changed printer,
+ * - `del#name` for a removed printer.
+ *
+ * or, for clients using the binary protocol, its binproto
+ * equivalent (@ref BINPROTO_ADDED, @ref BINPROTO_CHANGED,
+ * @ref BINPROTO_REMOVED).
+ *
+ * The registry listener only encodes the delta frame and queues it;
+ * a dispatcher thread hands it to every subscriber, and each
+ * subscriber has its own sender thread, as webcam viewers do, so a
+ * slow client never holds the registry lock nor delays the others.
+ *
+ * The printer list a subscriber gets first is sent by its sender
+ * thread too, in order with the deltas, and deltas are stamped with
+ * the registry version they belong to: those already covered by the
+ * list are skipped. Queues are bounded: a subscriber that falls
+ * @ref NOTIFY_QUEUE_MAX deltas behind gets a fresh list instead.
+ */
+
+/**
+ * @brief Deltas queued per subscriber, and overall, before they are
+ * dropped in favour of a fresh printer list.
+ */
+#define NOTIFY_QUEUE_MAX 256
+
+/**
+ * @brief Queued delta.
+ */
+struct delta
+{
+	struct delta *next;                  /**< Next delta, in mutation
+	                                          order.                  */
+	uint64_t version;                    /**< Registry version.       */
+	struct refbuf *frames[WIRE_FORMATS]; /**< Frame, per format.      */
+};
+
+/**
+ * @brief Delta queued for a subscriber.
+ */
+struct pending
+{
+	struct refbuf *frame; /**< Frame, in the subscriber format. */
+	uint64_t version;     /**< Registry version.                */
+};
+
+/**
+ * @brief A subscribed client.
+ */
+struct subscriber
+{
+	struct subscriber *next;                 /**< Next subscriber.     */
+	int fd;                                  /**< Client fd.           */
+	int format;                              /**< Format (enum
+	                                              wire_format).        */
+	struct pending queue[NOTIFY_QUEUE_MAX];  /**< Deltas to be sent.   */
+	size_t head;                             /**< Oldest queued delta. */
+	size_t count;                            /**< Queued deltas.       */
+	bool resync;                             /**< Printer list to be
+	                                              sent (again).        */
+	bool stop;                               /**< Sender thread should
+	                                              exit.                */
+	pthread_mutex_t lock;                    /**< Guards the fields
+	                                              above.               */
+	pthread_cond_t cond;                     /**< Signals work.        */
+	pthread_t thread;                        /**< Sender thread.       */
+};
+
+/**
+ * @brief Notifier state.
+ */
+static struct
+{
+	struct subscriber *subs; /**< Subscribed clients.          */
+	size_t count;            /**< Amount of subscribers.       */
+	struct delta *head;      /**< Oldest queued delta.         */
+	struct delta *tail;      /**< Newest queued delta.         */
+	size_t queued;           /**< Amount of queued deltas.     */
+	bool overflow;           /**< Deltas were dropped.         */
+	bool stop;               /**< Dispatcher should exit.      */
+	bool running;            /**< Dispatcher was started.      */
+	pthread_t thread;        /**< Dispatcher thread.           */
+} nt;
+
+/**
+ * @brief Guards the delta queue.
+ */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signals queued deltas.
+ */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Guards the subscribers list. Never held while sending.
+ */
+static pthread_mutex_t subs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Builds a complete frame holding @p len bytes of @p payload.
+ *
+ * @param payload Frame payload.
+ * @param len     Payload length.
+ * @param type    Frame type.
+ *
+ * @return Returns the frame, or NULL if out of memory.
+ */
+static struct refbuf *new_frame(const void *payload, size_t len, int type)
+{
+	struct refbuf *frame;
+	int hlen;
+
+	frame = refbuf_new(WS_FRAME_HDR_MAX + len);
+	if (!frame)
+		return (NULL);
+	hlen = ws_frame_header(frame->data, len, type);
+	memcpy(frame->data + hlen, payload, len);
+	frame->size = hlen + len;
+	return (frame);
+}
+
+/**
+ * @brief Frees the delta @p d.
+ */
+static void free_delta(struct delta *d)
+{
+	int i;
+
+	for (i = 0; i < WIRE_FORMATS; i++)
+		refbuf_put(d->frames[i]);
+	free(d);
+}
+
+/**
+ * @brief Registry listener: encodes and queues the delta for
+ * the operation @p op.
+ *
+ * @param op      Operation (store_op).
+ * @param old     Previous printer contents, NULL for adds.
+ * @param cur     New printer contents, NULL for removes.
+ * @param version Version that published it.
+ */
+static void on_change(int op, const struct PRINTER *old,
+	const struct PRINTER *cur, uint64_t version)
+{
+	unsigned char bin[BINPROTO_RECORD_MAX + 1];
+	char text[PRINTER_LINE_MAX + 4];
+	struct delta *d;
+	size_t blen;
+	size_t len;
+
+	/* Nobody to tell. */
+	if (!__atomic_load_n(&nt.count, __ATOMIC_RELAXED))
+		return;
+
+	if (op == STORE_REMOVE)
+	{
+		strcpy(text, "del#");
+		strcat(text, old->name);
+		strcat(text, "\n");
+		len    = strlen(text);
+		bin[0] = BINPROTO_REMOVED;
+		blen   = 1 + binproto_name(old->name, bin + 1);
+	}
+	else
+	{
+		memcpy(text, op == STORE_ADD ? "add#" : "set#", 4);
+		len    = 4 + printer_format(cur, text + 4, sizeof(text) - 4);
+		bin[0] = op == STORE_ADD ? BINPROTO_ADDED : BINPROTO_CHANGED;
+		blen   = 1 + binproto_record(cur, bin + 1);
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return;
+
+	/* The version that has it: older snapshots still need it. */
+	d->version             = version;
+	d->frames[WIRE_TEXT]   = new_frame(text, len, WS_FR_OP_TXT);
+	d->frames[WIRE_BINARY] = new_frame(bin, blen, WS_FR_OP_BIN);
+	if (!d->frames[WIRE_TEXT] || !d->frames[WIRE_BINARY])
+	{
+		free_delta(d);
+		return;
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	if (nt.queued == NOTIFY_QUEUE_MAX)
+	{
+		/* The dispatcher is behind: everybody gets a fresh list. */
+		while (nt.head)
+		{
+			d       = nt.head;
+			nt.head = d->next;
+			free_delta(d);
+		}
+		nt.tail     = NULL;
+		nt.queued   = 0;
+		nt.overflow = true;
+	}
+	else
+	{
+		if (nt.tail)
+			nt.tail->next = d;
+		else
+			nt.head = d;
+		nt.tail = d;
+		nt.queued++;
+	}
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * @brief Drops the deltas queued for @p s, which gets a fresh
+ * printer list instead.
+ *
+ * @param s Subscriber, its lock held.
+ */
+static void resync_locked(struct subscriber *s)
+{
+	for (; s->count; s->count--)
+	{
+		refbuf_put(s->queue[s->head].frame);
+		s->head = (s->head + 1) % NOTIFY_QUEUE_MAX;
+	}
+	s->resync = true;
+}
+
+/**
+ * @brief Queues the delta @p d for @p s, or drops its queue if
+ * full, see @ref resync_locked.
+ *
+ * @param s Subscriber, its lock held.
+ * @param d Delta.
+ */
+static void push_locked(struct subscriber *s, const struct delta *d)
+{
+	struct pending *p;
+
+	if (s->count == NOTIFY_QUEUE_MAX)
+	{
+		resync_locked(s);
+		return;
+	}
+
+	p          = &s->queue[(s->head + s->count) % NOTIFY_QUEUE_MAX];
+	p->frame   = refbuf_get(d->frames[s->format]);
+	p->version = d->version;
+	s->count++;
+}
+
+/**
+ * @brief Dispatcher thread: hands every queued delta to every
+ * subscriber, never blocking on a client.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *dispatch(void *arg)
+{
+	struct subscriber *s;
+	struct delta *d;
+	bool overflow;
+
+	(void)arg;
+	pthread_mutex_lock(&queue_mutex);
+	while (!nt.stop)
+	{
+		if (!nt.head && !nt.overflow)
+		{
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+			continue;
+		}
+
+		d           = nt.head;
+		overflow    = nt.overflow;
+		nt.overflow = false;
+		if (d)
+		{
+			nt.head = d->next;
+			if (!nt.head)
+				nt.tail = NULL;
+			nt.queued--;
+		}
+		pthread_mutex_unlock(&queue_mutex);
+
+		pthread_mutex_lock(&subs_mutex);
+		for (s = nt.subs; s; s = s->next)
+		{
+			pthread_mutex_lock(&s->lock);
+			if (overflow)
+				resync_locked(s);
+			if (d)
+				push_locked(s, d);
+			pthread_cond_signal(&s->cond);
+			pthread_mutex_unlock(&s->lock);
+		}
+		pthread_mutex_unlock(&subs_mutex);
+
+		if (d)
+			free_delta(d);
+		pthread_mutex_lock(&queue_mutex);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Sender thread of a subscriber: sends the printer list when
+ * asked to, then the deltas that are newer than it, in order.
+ *
+ * @param arg Subscriber.
+ *
+ * @return Always NULL.
+ */
+static void *deliver(void *arg)
+{
+	struct subscriber *s;
+	struct pending p;
+	uint64_t listed;
+
+	s      = arg;
+	listed = 0;
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop)
+	{
+		if (s->resync)
+		{
+			s->resync = false;
+			pthread_mutex_unlock(&s->lock);
+			cache_send_printers(s->fd, s->format, &listed);
+			pthread_mutex_lock(&s->lock);
+			continue;
+		}
+		if (!s->count)
+		{
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+
+		p       = s->queue[s->head];
+		s->head = (s->head + 1) % NOTIFY_QUEUE_MAX;
+		s->count--;
+		pthread_mutex_unlock(&s->lock);
+
+		/* Already in the list it got. */
+		if (p.version > listed)
+			ws_sendframe_raw(s->fd, p.frame->data, p.frame->size);
+		refbuf_put(p.frame);
+		pthread_mutex_lock(&s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return (NULL);
+}
+
+/**
+ * @brief Stops the sender thread of @p s and releases it.
+ *
+ * @param s Subscriber, no longer reachable.
+ */
+static void free_subscriber(struct subscriber *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+
+	resync_locked(s);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/**
+ * @brief Registers the registry listener and starts the dispatcher
+ * thread.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int notify_init(void)
+{
+	if (registry_listen(on_change) < 0)
+		return (-1);
+	if (pthread_create(&nt.thread, NULL, dispatch, NULL))
+		return (-1);
+	nt.running = true;
+	return (0);
+}
+
+/**
+ * @brief Subscribes the client @p fd to registry changes: it gets
+ * the printer list, then the deltas.
+ *
+ * @param fd     Client fd.
+ * @param format Format of the list and deltas (enum wire_format).
+ *
+ * @return Returns 0 if success, -1 otherwise. If already
+ * subscribed, the list is sent again.
+ */
+int notify_subscribe(int fd, int format)
+{
+	struct subscriber *s;
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&subs_mutex);
+	for (s = nt.subs; s && s->fd != fd; s = s->next)
+		;
+	if (s)
+	{
+		pthread_mutex_lock(&s->lock);
+		resync_locked(s);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		goto out;
+	}
+
+	ret = -1;
+	s   = calloc(1, sizeof(*s));
+	if (!s)
+		goto out;
+	s->fd     = fd;
+	s->format = format;
+	s->resync = true;
+	if (pthread_mutex_init(&s->lock, NULL))
+		goto out0;
+	if (pthread_cond_init(&s->cond, NULL))
+		goto out1;
+	if (pthread_create(&s->thread, NULL, deliver, s))
+		goto out2;
+
+	s->next = nt.subs;
+	nt.subs = s;
+	__atomic_store_n(&nt.count, nt.count + 1, __ATOMIC_RELAXED);
+	ret = 0;
+	goto out;
+
+out2:
+	pthread_cond_destroy(&s->cond);
+out1:
+	pthread_mutex_destroy(&s->lock);
+out0:
+	free(s);
+out:
+	pthread_mutex_unlock(&subs_mutex);
+	return (ret);
+}
+
+/**
+ * @brief Unsubscribes the client @p fd, if subscribed.
+ *
+ * @param fd Client fd.
+ */
+void notify_unsubscribe(int fd)
+{
+	struct subscriber **pp;
+	struct subscriber *s;
+
+	pthread_mutex_lock(&subs_mutex);
+	for (pp = &nt.subs; *pp && (*pp)->fd != fd; pp = &(*pp)->next)
+		;
+	s = *pp;
+	if (s)
+	{
+		*pp = s->next;
+		__atomic_store_n(&nt.count, nt.count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&subs_mutex);
+
+	/* Not reachable anymore, its last send (if any) ends here. */
+	if (s)
+		free_subscriber(s);
+}
+
+/**
+ * @brief Stops the dispatcher and sender threads and drops pending
+ * deltas.
+ */
+void notify_close(void)
+{
+	struct subscriber *s;
+	struct delta *d;
+
+	if (nt.running)
+	{
+		pthread_mutex_lock(&queue_mutex);
+		nt.stop = true;
+		pthread_cond_signal(&queue_cond);
+		pthread_mutex_unlock(&queue_mutex);
+		pthread_join(nt.thread, NULL);
+		nt.running = false;
+	}
+
+	while ((s = nt.subs))
+	{
+		nt.subs = s->next;
+		free_subscriber(s);
+	}
+	while ((d = nt.head))
+	{
+		nt.head = d->next;
+		free_delta(d);
+	}
+	memset(&nt, 0, sizeof(nt));
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file notify.h
+ * @brief Registry change subscriptions (`sub#`).
+ */
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+	extern int notify_init(void);
+	extern int notify_subscribe(int fd, int format);
+	extern void notify_unsubscribe(int fd);
+	extern void notify_close(void);
+
+#endif /* NOTIFY_H */
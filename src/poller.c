@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "poller.h"
+#include "registry.h"
+#include "store.h"
+
+/**
+ * @file poller.c
+ * @brief Printer health poller.
+ *
+ * A single thread probes every printer web interface with an HTTP
+ * request, multiplexing all the probes with epoll and non-blocking
+ * sockets. A printer that does not answer within
+ * @ref POLL_TIMEOUT_MS, or answers with a server error, is set to
+ * NOK; a NOK printer that answers again gets back the state it had
+ * before, OK or BUSY. The poller only owns NOK: BUSY belongs to the
+ * job dispatcher (see jobs.c), so a printer that was printing when
+ * it stopped answering is still reserved for its job once it does.
+ *
+ * Probe deadlines are kept in a binary min-heap: each printer is
+ * either waiting for its next probe or for its probe to time out.
+ * Printers whose health does not change are probed less and less
+ * often, up to @ref POLL_MAX_INTERVAL_MS; any change brings them
+ * back to @ref POLL_MIN_INTERVAL_MS.
+ *
+ * Printer addresses are `a.b.c.d` (port 80) or `a.b.c.d:port`.
+ */
+
+/**
+ * @name Poller configuration
+ */
+/**@{*/
+/**
+ * @brief Probe timeout (connect to status line), in milliseconds.
+ */
+#define POLL_TIMEOUT_MS      2000
+/**
+ * @brief Shortest interval between probes, in milliseconds.
+ */
+#define POLL_MIN_INTERVAL_MS 5000
+/**
+ * @brief Longest interval between probes, in milliseconds.
+ */
+#define POLL_MAX_INTERVAL_MS 60000
+/**
+ * @brief Maximum amount of probes in flight.
+ */
+#define POLL_MAX_INFLIGHT    256
+/**
+ * @brief Delay applied to a probe that found no free in-flight slot.
+ */
+#define POLL_RETRY_MS        100
+/**@}*/
+
+/**
+ * @brief Probe phases.
+ */
+enum probe_phase
+{
+	PROBE_IDLE,       /**< Waiting for the next probe. */
+	PROBE_CONNECTING, /**< Non-blocking connect.       */
+	PROBE_READING     /**< Request sent.               */
+};
+
+/**
+ * @brief A polled printer.
+ */
+struct target
+{
+	char name[PRINTER_STRLEN];  /**< Printer name.                       */
+	char ip[PRINTER_STRLEN];    /**< Printer address, as registered.     */
+	struct sockaddr_in addr;    /**< Parsed address.                     */
+	bool valid;                 /**< Address could be parsed.            */
+	enum probe_phase phase;     /**< Current phase.                      */
+	int fd;                     /**< Probe socket, -1 if idle.           */
+	uint64_t deadline;          /**< Next probe or probe timeout (ms).   */
+	uint32_t interval;          /**< Current probe interval (ms).        */
+	int last;                   /**< Last result: 1 up, 0 down, -1 none. */
+	enum PRINTER_STATE restore; /**< State to restore once up again.     */
+	char buf[16];               /**< Start of the response.              */
+	size_t len;                 /**< Bytes in @ref buf.                  */
+	size_t heap_idx;            /**< Position in the deadline heap.      */
+};
+
+/**
+ * @brief Poller state, only touched by the poller thread (except
+ * for the flags).
+ */
+static struct
+{
+	struct target **targets; /**< Targets, sorted by name.           */
+	size_t count;            /**< Amount of targets.                 */
+	struct target **heap;    /**< Deadline min-heap.                 */
+	size_t inflight;         /**< Probes in flight.                  */
+	int epfd;                /**< Epoll instance.                    */
+	int evfd;                /**< Wakes the poller up.               */
+	int dirty;               /**< Targets must be re-synced.         */
+	int stop;                /**< Poller should exit.                */
+	bool running;            /**< Poller thread was started.         */
+	pthread_t thread;        /**< Poller thread.                     */
+} pl = {NULL, 0, NULL, 0, -1, -1, 1, 0, false, 0};
+
+/**
+ * @brief Returns the monotonic clock, in milliseconds.
+ */
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+/**
+ * @name Deadline heap
+ */
+/**@{*/
+/**
+ * @brief Swaps the heap entries @p i and @p j.
+ */
+static void heap_swap(size_t i, size_t j)
+{
+	struct target *t;
+
+	t           = pl.heap[i];
+	pl.heap[i]  = pl.heap[j];
+	pl.heap[j]  = t;
+	pl.heap[i]->heap_idx = i;
+	pl.heap[j]->heap_idx = j;
+}
+
+/**
+ * @brief Restores the heap property around entry @p i.
+ */
+static void heap_fix(size_t i)
+{
+	size_t c;
+
+	while (i > 0 && pl.heap[(i - 1) / 2]->deadline > pl.heap[i]->deadline)
+	{
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	for (;;)
+	{
+		c = 2 * i + 1;
+		if (c >= pl.count)
+			break;
+		if (c + 1 < pl.count && pl.heap[c + 1]->deadline < pl.heap[c]->deadline)
+			c++;
+		if (pl.heap[i]->deadline <= pl.heap[c]->deadline)
+			break;
+		heap_swap(i, c);
+		i = c;
+	}
+}
+/**@}*/
+
+/**
+ * @brief Ends the current probe of @p t with result @p up, updates
+ * the registry if needed and schedules the next probe.
+ *
+ * @param t   Target.
+ * @param up  Whether the printer answered.
+ * @param now Current time (ms).
+ */
+static void finish(struct target *t, bool up, uint64_t now)
+{
+	struct PRINTER p;
+
+	if (t->fd >= 0)
+	{
+		close(t->fd);
+		t->fd = -1;
+		pl.inflight--;
+	}
+	t->phase = PROBE_IDLE;
+	t->len   = 0;
+
+	/* Stable health: back off. Any change: probe often again. */
+	if (t->last == (int)up)
+	{
+		t->interval *= 2;
+		if (t->interval > POLL_MAX_INTERVAL_MS)
+			t->interval = POLL_MAX_INTERVAL_MS;
+	}
+	else
+		t->interval = POLL_MIN_INTERVAL_MS;
+	t->last = up;
+
+	/* Only if nobody else changed the state meanwhile. */
+	if (registry_find(t->name, &p))
+	{
+		if (!up && p.state != NOK &&
+			registry_set_state_if(t->name, p.state, NOK) == 0)
+		{
+			t->restore = p.state;
+		}
+		else if (up && p.state == NOK)
+		{
+			registry_set_state_if(t->name, NOK, t->restore);
+			t->restore = OK;
+		}
+	}
+
+	t->deadline = now + t->interval;
+	heap_fix(t->heap_idx);
+}
+
+/**
+ * @brief Starts a probe: non-blocking connect to @p t.
+ *
+ * @param t   Target.
+ * @param now Current time (ms).
+ */
+static void start_probe(struct target *t, uint64_t now)
+{
+	struct epoll_event ev;
+
+	if (!t->valid)
+	{
+		finish(t, false, now);
+		return;
+	}
+	if (pl.inflight >= POLL_MAX_INFLIGHT)
+	{
+		t->deadline = now + POLL_RETRY_MS;
+		heap_fix(t->heap_idx);
+		return;
+	}
+
+	t->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (t->fd < 0)
+	{
+		t->deadline = now + POLL_RETRY_MS;
+		heap_fix(t->heap_idx);
+		return;
+	}
+	pl.inflight++;
+
+	if (connect(t->fd, (struct sockaddr *)&t->addr, sizeof(t->addr)) < 0 &&
+		errno != EINPROGRESS)
+	{
+		finish(t, false, now);
+		return;
+	}
+
+	ev.events   = EPOLLOUT;
+	ev.data.ptr = t;
+	if (epoll_ctl(pl.epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0)
+	{
+		finish(t, false, now);
+		return;
+	}
+
+	t->phase    = PROBE_CONNECTING;
+	t->deadline = now + POLL_TIMEOUT_MS;
+	heap_fix(t->heap_idx);
+}
+
+/**
+ * @brief Handles I/O readiness on the probe of @p t.
+ *
+ * @param t      Target.
+ * @param events Epoll events.
+ * @param now    Current time (ms).
+ */
+static void handle_io(struct target *t, uint32_t events, uint64_t now)
+{
+	char req[64 + PRINTER_STRLEN];
+	struct epoll_event ev;
+	socklen_t len;
+	ssize_t n;
+	int code;
+	int err;
+	int r;
+
+	if (t->phase == PROBE_CONNECTING)
+	{
+		err = 0;
+		len = sizeof(err);
+		if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err ||
+			(events & EPOLLERR))
+		{
+			finish(t, false, now);
+			return;
+		}
+
+		r = snprintf(req, sizeof(req),
+			"GET / HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", t->ip);
+		if (send(t->fd, req, (size_t)r, MSG_NOSIGNAL) != r)
+		{
+			finish(t, false, now);
+			return;
+		}
+
+		ev.events   = EPOLLIN;
+		ev.data.ptr = t;
+		epoll_ctl(pl.epfd, EPOLL_CTL_MOD, t->fd, &ev);
+		t->phase = PROBE_READING;
+		return;
+	}
+
+	/* Reading: we only need "HTTP/1.x NNN". */
+	n = recv(t->fd, t->buf + t->len, sizeof(t->buf) - 1 - t->len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0)
+		t->len += (size_t)n;
+	t->buf[t->len] = '\0';
+
+	if (t->len >= 12 || n <= 0)
+	{
+		code = 0;
+		if (strncmp(t->buf, "HTTP/", 5) == 0 && strchr(t->buf, ' '))
+			code = atoi(strchr(t->buf, ' ') + 1);
+		finish(t, code >= 100 && code < 500, now);
+	}
+}
+
+/**
+ * @brief Compares two printers by name, for qsort().
+ */
+static int cmp_printer(const void *a, const void *b)
+{
+	return (strncmp(((const struct PRINTER *)a)->name,
+		((const struct PRINTER *)b)->name, PRINTER_STRLEN));
+}
+
+/**
+ * @brief Re-syncs the targets with the registry.
+ *
+ * Both lists are sorted by name and merged: targets that are still
+ * registered with the same address keep their schedule, new ones
+ * get a first probe spread over the minimum interval.
+ *
+ * @param now Current time (ms).
+ */
+static void sync_targets(uint64_t now)
+{
+	struct PRINTER *printers;
+	struct target **targets;
+	struct target **heap;
+	struct target *t;
+	size_t count;
+	size_t i;
+	size_t j;
+	size_t n;
+	int c;
+
+	printers = registry_snapshot(&count, NULL);
+	if (!printers)
+		return;
+
+	targets = malloc((count ? count : 1) * sizeof(*targets));
+	heap    = malloc((count ? count : 1) * sizeof(*heap));
+	if (!targets || !heap)
+	{
+		free(targets);
+		free(heap);
+		free(printers);
+		return;
+	}
+
+	qsort(printers, count, sizeof(*printers), cmp_printer);
+	for (i = 0, j = 0, n = 0; i < count || j < pl.count;)
+	{
+		if (i == count)
+			c = 1;
+		else if (j == pl.count)
+			c = -1;
+		else
+			c = strncmp(printers[i].name, pl.targets[j]->name, PRINTER_STRLEN);
+
+		/* Still there, with the same address. */
+		if (c == 0 && !strcmp(printers[i].ip, pl.targets[j]->ip))
+		{
+			targets[n++] = pl.targets[j];
+			i++;
+			j++;
+			continue;
+		}
+
+		/* Gone (or changed address). */
+		if (c >= 0)
+		{
+			t = pl.targets[j++];
+			if (t->fd >= 0)
+			{
+				close(t->fd);
+				pl.inflight--;
+			}
+			free(t);
+			if (c > 0)
+				continue;
+		}
+
+		/* New (or changed address). */
+		t = calloc(1, sizeof(*t));
+		if (t)
+		{
+			memcpy(t->name, printers[i].name, PRINTER_STRLEN);
+			memcpy(t->ip, printers[i].ip, PRINTER_STRLEN);
+			t->valid = http_addr(t->ip, &t->addr);
+			t->fd       = -1;
+			t->last     = -1;
+			t->restore  = OK;
+			t->interval = POLL_MIN_INTERVAL_MS;
+			t->deadline = now + (uint64_t)(rand() % POLL_MIN_INTERVAL_MS);
+			targets[n++] = t;
+		}
+		i++;
+	}
+
+	free(pl.targets);
+	free(pl.heap);
+	free(printers);
+	pl.targets = targets;
+	pl.heap    = heap;
+	pl.count   = n;
+
+	/* Rebuild the heap. */
+	for (i = 0; i < n; i++)
+	{
+		heap[i]           = targets[i];
+		heap[i]->heap_idx = i;
+	}
+	for (i = n / 2; i-- > 0;)
+		heap_fix(i);
+}
+
+/**
+ * @brief Registry listener: re-syncs the targets when printers are
+ * added, removed or change address.
+ *
+ * @param op      Operation (store_op).
+ * @param old     Previous printer contents, NULL for adds.
+ * @param cur     New printer contents, NULL for removes.
+ * @param version Version that published it.
+ */
+static void on_change(int op, const struct PRINTER *old,
+	const struct PRINTER *cur, uint64_t version)
+{
+	uint64_t one;
+
+	(void)version;
+	if (op == STORE_UPDATE && !strcmp(old->ip, cur->ip))
+		return;
+
+	one = 1;
+	__atomic_store_n(&pl.dirty, 1, __ATOMIC_RELEASE);
+	if (write(pl.evfd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/**
+ * @brief Poller thread.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *poller(void *arg)
+{
+	struct epoll_event events[64];
+	struct target *t;
+	uint64_t now;
+	uint64_t val;
+	int timeout;
+	int n;
+	int i;
+
+	(void)arg;
+	while (!__atomic_load_n(&pl.stop, __ATOMIC_ACQUIRE))
+	{
+		now = now_ms();
+		if (__atomic_exchange_n(&pl.dirty, 0, __ATOMIC_ACQ_REL))
+			sync_targets(now);
+
+		/* Due probes and expired timeouts. */
+		while (pl.count && pl.heap[0]->deadline <= now)
+		{
+			t = pl.heap[0];
+			if (t->phase == PROBE_IDLE)
+				start_probe(t, now);
+			else
+				finish(t, false, now);
+		}
+
+		timeout = -1;
+		if (pl.count)
+			timeout = (int)(pl.heap[0]->deadline - now);
+
+		n = epoll_wait(pl.epfd, events, 64, timeout);
+		now = now_ms();
+		for (i = 0; i < n; i++)
+		{
+			if (!events[i].data.ptr)
+			{
+				if (read(pl.evfd, &val, sizeof(val)) < 0)
+					continue;
+				continue;
+			}
+			handle_io(events[i].data.ptr, events[i].events, now);
+		}
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Starts the poller thread.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int poller_start(void)
+{
+	struct epoll_event ev;
+
+	pl.epfd = epoll_create1(EPOLL_CLOEXEC);
+	pl.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pl.epfd < 0 || pl.evfd < 0)
+		return (-1);
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(pl.epfd, EPOLL_CTL_ADD, pl.evfd, &ev) < 0)
+		return (-1);
+
+	srand((unsigned)now_ms());
+	if (registry_listen(on_change) < 0)
+		return (-1);
+	if (pthread_create(&pl.thread, NULL, poller, NULL))
+		return (-1);
+	pl.running = true;
+	return (0);
+}
+
+/**
+ * @brief Stops the poller thread and releases its targets.
+ */
+void poller_stop(void)
+{
+	uint64_t one;
+	size_t i;
+
+	if (pl.running)
+	{
+		one = 1;
+		__atomic_store_n(&pl.stop, 1, __ATOMIC_RELEASE);
+		if (write(pl.evfd, &one, sizeof(one)) == sizeof(one))
+			pthread_join(pl.thread, NULL);
+		pl.running = false;
+	}
+	for (i = 0; i < pl.count; i++)
+	{
+		if (pl.targets[i]->fd >= 0)
+			close(pl.targets[i]->fd);
+		free(pl.targets[i]);
+	}
+	free(pl.targets);
+	free(pl.heap);
+	pl.targets = NULL;
+	pl.heap    = NULL;
+	pl.count   = 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "printer.h"
+
+/**
+ * @file printer.c
+ * @brief Conversion between printer records and the
+ * `name&ip&STATE` text lines used by printers.db and the
+ * WebSocket commands.
+ */
+
+/**
+ * @brief State names, indexed by @ref PRINTER_STATE.
+ */
+static const char *const state_names[] = {"OK", "BUSY", "NOK"};
+
+/**
+ * @brief Returns the textual name of the state @p state.
+ *
+ * @param state Printer state.
+ *
+ * @return Returns a static string, "NOK" if unknown.
+ */
+const char *printer_state_str(enum PRINTER_STATE state)
+{
+	if (state < OK || state > NOK)
+		return (state_names[NOK]);
+	return (state_names[state]);
+}
+
+/**
+ * @brief Parses the state name @p s of @p len bytes.
+ *
+ * @param s   State text, not necessarily NUL-terminated.
+ * @param len Text length.
+ *
+ * @return Returns the parsed state, NOK if not recognized.
+ */
+enum PRINTER_STATE printer_state_parse(const char *s, size_t len)
+{
+	if (len >= 2 && strncmp("OK", s, 2) == 0)
+		return (OK);
+	if (len >= 4 && strncmp("BUSY", s, 4) == 0)
+		return (BUSY);
+	return (NOK);
+}
+
+/**
+ * @brief Splits a `name&ip&STATE` line into views of its fields,
+ * without copying anything.
+ *
+ * Parsing stops at the end of @p size, at a NUL byte or at a
+ * line break, so whole lines read from printers.db can be given
+ * as is.
+ *
+ * @param line Text to be parsed, not necessarily NUL-terminated.
+ * @param size Maximum amount of bytes to be read from @p line.
+ * @param v    Parsed fields, pointing into @p line.
+ *
+ * @return Returns true if both name and address were found,
+ * false otherwise.
+ */
+bool printer_split(const char *line, size_t size, struct printer_view *v)
+{
+	struct view *fields[3]; /* Fields, in line order. */
+	const char *field;      /* Current field start.   */
+	size_t stage;           /* Current field index.   */
+	size_t i;               /* Loop index.            */
+
+	memset(v, 0, sizeof(*v));
+	fields[0] = &v->name;
+	fields[1] = &v->ip;
+	fields[2] = &v->state;
+	field     = line;
+	stage     = 0;
+
+	for (i = 0; i <= size; i++)
+	{
+		if (i < size && line[i] != '&' && line[i] != '\n' && line[i] != '\r' &&
+			line[i] != '\0')
+			continue;
+
+		fields[stage]->ptr = field;
+		fields[stage]->len = (size_t)(line + i - field);
+
+		stage++;
+		if (stage == 3 || i == size || line[i] != '&')
+			break;
+		field = line + i + 1;
+	}
+	return (v->name.len != 0 && v->ip.len != 0);
+}
+
+/**
+ * @brief Fills @p p from the fields @p v, which should fit the
+ * record fields (longer ones are cut). A missing state is parsed
+ * as NOK.
+ *
+ * @param v Fields, as split by @ref printer_split.
+ * @param p Target printer.
+ */
+void printer_from_view(const struct printer_view *v, struct PRINTER *p)
+{
+	memset(p, 0, sizeof(*p));
+	memcpy(p->name, v->name.ptr,
+		v->name.len < PRINTER_STRLEN ? v->name.len : PRINTER_STRLEN - 1);
+	memcpy(p->ip, v->ip.ptr,
+		v->ip.len < PRINTER_STRLEN ? v->ip.len : PRINTER_STRLEN - 1);
+	p->state = printer_state_parse(v->state.ptr, v->state.len);
+}
+
+/**
+ * @brief Splits a `name&ip&STATE` line into a printer record.
+ *
+ * Same rules as @ref printer_split; a missing state is parsed as
+ * NOK. Names and addresses longer than the record fields are
+ * rejected rather than truncated, so that two long names sharing a
+ * prefix never end up as the same printer.
+ *
+ * @param line Text to be parsed, not necessarily NUL-terminated.
+ * @param size Maximum amount of bytes to be read from @p line.
+ * @param p    Parsed printer.
+ *
+ * @return Returns true if both name and address were found and
+ * fit, false otherwise.
+ */
+bool split_line(const char *line, size_t size, struct PRINTER *p)
+{
+	struct printer_view v;
+
+	memset(p, 0, sizeof(*p));
+	if (!printer_split(line, size, &v))
+		return (false);
+	if (v.name.len >= PRINTER_STRLEN || v.ip.len >= PRINTER_STRLEN)
+		return (false);
+
+	printer_from_view(&v, p);
+	return (true);
+}
+
+/**
+ * @brief Formats @p p as a `name&ip&STATE\n` line.
+ *
+ * @param p   Printer to be formatted.
+ * @param buf Target buffer.
+ * @param len Buffer length, @ref PRINTER_LINE_MAX is always enough.
+ *
+ * @return Returns the line length, without the NUL terminator.
+ */
+size_t printer_format(const struct PRINTER *p, char *buf, size_t len)
+{
+	int n;
+	n = snprintf(buf, len, "%s&%s&%s\n", p->name, p->ip,
+		printer_state_str(p->state));
+	if (n < 0)
+		return (0);
+	return ((size_t)n < len ? (size_t)n : len - 1);
+}
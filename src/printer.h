@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file printer.h
+ * @brief Printer record and its text representation.
+ */
+#ifndef PRINTER_H
+#define PRINTER_H
+
+	#include <stdbool.h>
+	#include <stddef.h>
+
+	/**
+	 * @brief Size of the fixed name/ip fields, including the
+	 * NUL terminator.
+	 */
+	#define PRINTER_STRLEN 16
+
+	/**
+	 * @brief Longest text line produced by @ref printer_format,
+	 * including the trailing newline and NUL terminator.
+	 */
+	#define PRINTER_LINE_MAX (2 * PRINTER_STRLEN + 8)
+
+	/**
+	 * @brief Printer states, as stored on printers.db.
+	 */
+	enum PRINTER_STATE {OK = 0, BUSY = 1, NOK = 2};
+
+	/**
+	 * @brief Amount of printer states.
+	 */
+	#define PRINTER_NSTATES 3
+
+	/**
+	 * @brief A single printer entry.
+	 */
+	struct PRINTER
+	{
+		char name[PRINTER_STRLEN]; /**< Printer name, NUL-terminated. */
+		char ip[PRINTER_STRLEN];   /**< Printer address.              */
+		enum PRINTER_STATE state;  /**< Last known state.             */
+	};
+
+	/**
+	 * @brief Non-owning view of @ref len bytes at @ref ptr, not
+	 * necessarily NUL-terminated.
+	 */
+	struct view
+	{
+		const char *ptr; /**< First byte. */
+		size_t len;      /**< Length.     */
+	};
+
+	/**
+	 * @brief Fields of a `name&ip&STATE` line, as views into it.
+	 */
+	struct printer_view
+	{
+		struct view name;  /**< Name, untruncated.       */
+		struct view ip;    /**< Address, untruncated.    */
+		struct view state; /**< State, empty if missing. */
+	};
+
+	extern const char *printer_state_str(enum PRINTER_STATE state);
+	extern enum PRINTER_STATE printer_state_parse(const char *s, size_t len);
+	extern bool printer_split(const char *line, size_t size,
+		struct printer_view *v);
+	extern void printer_from_view(const struct printer_view *v,
+		struct PRINTER *p);
+	extern bool split_line(const char *line, size_t size, struct PRINTER *p);
+	extern size_t printer_format(const struct PRINTER *p, char *buf, size_t len);
+
+#endif /* PRINTER_H */
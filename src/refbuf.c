@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+
+#include "refbuf.h"
+
+/**
+ * @file refbuf.c
+ * @brief Reference counted buffers.
+ */
+
+/**
+ * @brief Allocates a new buffer of @p size bytes, with a single
+ * reference, owned by the caller.
+ *
+ * @param size Buffer size.
+ *
+ * @return Returns the new buffer, or NULL if out of memory.
+ */
+struct refbuf *refbuf_new(size_t size)
+{
+	struct refbuf *buf;
+
+	buf = malloc(sizeof(*buf) + size);
+	if (!buf)
+		return (NULL);
+
+	buf->refs = 1;
+	buf->size = size;
+	return (buf);
+}
+
+/**
+ * @brief Takes a new reference to @p buf.
+ *
+ * @param buf Buffer, may be NULL.
+ *
+ * @return Returns @p buf.
+ */
+struct refbuf *refbuf_get(struct refbuf *buf)
+{
+	if (buf)
+		__atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+	return (buf);
+}
+
+/**
+ * @brief Drops a reference to @p buf, releasing it if it
+ * was the last one.
+ *
+ * @param buf Buffer, may be NULL.
+ */
+void refbuf_put(struct refbuf *buf)
+{
+	if (buf && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(buf);
+}
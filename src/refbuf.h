@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file refbuf.h
+ * @brief Reference counted, immutable, byte buffers.
+ */
+#ifndef REFBUF_H
+#define REFBUF_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/**
+	 * @brief Shared buffer: filled once by its creator and then
+	 * only read, by as many holders as needed. The last
+	 * @ref refbuf_put releases it.
+	 */
+	struct refbuf
+	{
+		uint32_t refs;         /**< Reference count.   */
+		size_t size;           /**< Data size.         */
+		unsigned char data[];  /**< Buffer contents.   */
+	};
+
+	extern struct refbuf *refbuf_new(size_t size);
+	extern struct refbuf *refbuf_get(struct refbuf *buf);
+	extern void refbuf_put(struct refbuf *buf);
+
+#endif /* REFBUF_H */
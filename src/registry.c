@@ -0,0 +1,1630 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "registry.h"
+#include "store.h"
+#include "strtab.h"
+
+/**
+ * @file registry.c
+ * @brief In-memory printer registry.
+ *
+ * Printers are kept in an array, in insertion order until one is
+ * removed (the last one then takes its place), and indexed by name
+ * through an open-addressing (linear probing) hash table that
+ * stores array positions. Each state also has a secondary
+ * index, an unordered array of the positions of the printers in
+ * that state, so listing the printers in a given state costs only
+ * as much as the result. The database file is read once by
+ * @ref registry_init and afterwards only used for persistence:
+ * every mutation is logged by the store before being published.
+ * Hand edits of the file are picked up by reload.c, as a batch
+ * (see @ref registry_apply_batch).
+ *
+ * Records are compact (12 bytes instead of a 36-byte struct
+ * PRINTER): names are interned in the string arena (strtab.c) and
+ * referred to by offset, and addresses are packed as a numeric
+ * IPv4 address and port, an interned IPv6 address, or, for anything
+ * else (host names...), interned text. Packing is exact: an address
+ * that would not format back to the very same text is kept as text.
+ * A mutation that is not published (rejected, or failed to be
+ * logged) gives back what it interned, see @ref strtab_rollback.
+ * Printers are unpacked into struct PRINTER copies whenever they
+ * leave the registry.
+ *
+ * The registry is read-copy-update: all of the above forms an
+ * immutable version, and readers just load the current version
+ * pointer, inside an epoch section (see epoch.c), without taking
+ * any lock. Writers, serialized by @ref reg_write_lock, copy the
+ * current version, change the copy, log the change and then
+ * publish the copy with a single atomic store; the previous version
+ * is released once no reader can still be looking at it.
+ *
+ * Copies are by path: the arrays above are split in pages of
+ * @ref REG_PAGE entries, shared (and reference counted) by the
+ * versions, so a copy only takes the page pointers, and then the
+ * pages it writes to. A state change costs a handful of pages, plus
+ * one pointer per page, instead of the whole registry.
+ */
+
+/**
+ * @brief Initial amount of hash slots, must be a power of two.
+ */
+#define REG_INITIAL_SLOTS 64
+
+/**
+ * @brief Maximum amount of change listeners.
+ */
+#define REG_MAX_LISTENERS 8
+
+/**
+ * @brief Entries per page (records, hash slots or state index
+ * positions), as a power of two.
+ */
+#define REG_PAGE_BITS 10
+#define REG_PAGE      (1u << REG_PAGE_BITS)
+#define REG_PAGE_MASK (REG_PAGE - 1)
+
+/**
+ * @brief Address kinds of a @ref reg_record.
+ */
+enum addr_family
+{
+	ADDR_TEXT = 0, /**< Interned text.            */
+	ADDR_V4   = 1, /**< IPv4 address, inline.     */
+	ADDR_V6   = 2  /**< Interned 16-byte address. */
+};
+
+/**
+ * @brief A printer, as stored by the registry.
+ */
+struct reg_record
+{
+	uint32_t name;  /**< Interned name.                             */
+	uint32_t addr;  /**< IPv4 address (network order), or interned
+	                     IPv6 address or text, see @ref family.     */
+	uint16_t port;  /**< Port, 0 if none.                           */
+	uint8_t family; /**< Address kind, an @ref addr_family.         */
+	uint8_t state;  /**< PRINTER_STATE.                             */
+};
+
+/**
+ * @brief A record, with its position in the index of its state.
+ */
+struct reg_entry
+{
+	struct reg_record rec; /**< Printer.                   */
+	uint32_t state_pos;    /**< Position in its state index. */
+};
+
+/**
+ * @brief A page of @ref REG_PAGE entries, shared by every version
+ * that did not change it.
+ */
+struct reg_page
+{
+	size_t refs;          /**< Versions using it. */
+	unsigned char data[]; /**< Entries.           */
+};
+
+/**
+ * @brief An array split in pages: a version copies the page
+ * pointers, and a page only when it writes to it.
+ */
+struct page_table
+{
+	struct reg_page **pages; /**< Pages, in order.  */
+	size_t npages;           /**< Amount of pages.  */
+	size_t elem;             /**< Entry size.       */
+};
+
+/**
+ * @brief Secondary index: positions of the printers in one state.
+ */
+struct state_index
+{
+	struct page_table pos; /**< Record positions (uint32_t),
+	                            unordered, room for every record. */
+	size_t count;          /**< Amount of positions.              */
+};
+
+/**
+ * @brief A registry version, immutable once published.
+ */
+struct reg_version
+{
+	struct page_table records; /**< Printers (struct reg_entry).     */
+	size_t count;              /**< Amount of printers.              */
+	struct page_table slots;   /**< Hash slots (uint32_t): record
+	                                index + 1, or 0.                 */
+	size_t nslots;             /**< Amount of slots (power of two).  */
+	uint64_t version;          /**< Bumped on every mutation.        */
+	struct state_index states[PRINTER_NSTATES]; /**< By state.       */
+};
+
+/**
+ * @brief Current version, loaded by readers with acquire semantics.
+ */
+static struct reg_version *reg;
+
+/**
+ * @brief Version number of @ref reg, readable without an epoch
+ * section.
+ */
+static uint64_t reg_version_number;
+
+/**
+ * @brief Writers lock: serializes mutations (and snapshots that
+ * must not miss one), never taken by readers.
+ */
+static pthread_mutex_t reg_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Change listeners, see @ref registry_listen.
+ */
+static void (*reg_listeners[REG_MAX_LISTENERS])(int, const struct PRINTER *,
+	const struct PRINTER *, uint64_t);
+
+/**
+ * @brief Amount of change listeners.
+ */
+static size_t reg_nlisteners;
+
+/**
+ * @brief Load or replay error, see @ref apply.
+ */
+static int reg_load_error;
+
+/**
+ * @brief Allocates a page of @p elem bytes entries, used by no
+ * version yet but the caller's, contents undefined.
+ */
+static struct reg_page *page_new(size_t elem)
+{
+	struct reg_page *pg;
+
+	pg = malloc(sizeof(*pg) + REG_PAGE * elem);
+	if (pg)
+		pg->refs = 1;
+	return (pg);
+}
+
+/**
+ * @brief Drops the reference of a version to the page @p pg,
+ * releasing it if that was the last one.
+ */
+static void page_put(struct reg_page *pg)
+{
+	if (!__atomic_sub_fetch(&pg->refs, 1, __ATOMIC_ACQ_REL))
+		free(pg);
+}
+
+/**
+ * @brief Returns the entry @p i of @p t, for reading.
+ */
+static const void *table_at(const struct page_table *t, size_t i)
+{
+	return (t->pages[i >> REG_PAGE_BITS]->data + (i & REG_PAGE_MASK) * t->elem);
+}
+
+/**
+ * @brief Returns the entry @p i of @p t, for writing: its page is
+ * copied first if another version uses it too.
+ *
+ * @return Returns the entry, or NULL if out of memory.
+ */
+static void *table_rw(struct page_table *t, size_t i)
+{
+	struct reg_page **pg;
+	struct reg_page *copy;
+
+	pg = &t->pages[i >> REG_PAGE_BITS];
+	if (__atomic_load_n(&(*pg)->refs, __ATOMIC_ACQUIRE) > 1)
+	{
+		copy = page_new(t->elem);
+		if (!copy)
+			return (NULL);
+		memcpy(copy->data, (*pg)->data, REG_PAGE * t->elem);
+		page_put(*pg);
+		*pg = copy;
+	}
+	return ((*pg)->data + (i & REG_PAGE_MASK) * t->elem);
+}
+
+/**
+ * @brief Grows @p t to @p npages pages, the new ones with undefined
+ * contents.
+ *
+ * @return Returns 0 if success, -1 otherwise (@p t may have grown
+ * partially).
+ */
+static int table_grow(struct page_table *t, size_t npages)
+{
+	struct reg_page **pages;
+
+	if (npages <= t->npages)
+		return (0);
+	pages = realloc(t->pages, npages * sizeof(*pages));
+	if (!pages)
+		return (-1);
+	t->pages = pages;
+	while (t->npages < npages)
+	{
+		if (!(t->pages[t->npages] = page_new(t->elem)))
+			return (-1);
+		t->npages++;
+	}
+	return (0);
+}
+
+/**
+ * @brief Makes @p c a table with the very same pages as @p t.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int table_share(struct page_table *c, const struct page_table *t)
+{
+	size_t i;
+
+	c->elem  = t->elem;
+	c->pages = malloc((t->npages ? t->npages : 1) * sizeof(*c->pages));
+	if (!c->pages)
+		return (-1);
+	for (i = 0; i < t->npages; i++)
+	{
+		__atomic_add_fetch(&t->pages[i]->refs, 1, __ATOMIC_RELAXED);
+		c->pages[i] = t->pages[i];
+	}
+	c->npages = t->npages;
+	return (0);
+}
+
+/**
+ * @brief Releases the table @p t, and the pages no other version
+ * uses.
+ */
+static void table_free(struct page_table *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->npages; i++)
+		page_put(t->pages[i]);
+	free(t->pages);
+}
+
+/**
+ * @brief Returns the record @p i of @p v.
+ */
+static const struct reg_entry *entry(const struct reg_version *v, size_t i)
+{
+	return (table_at(&v->records, i));
+}
+
+/**
+ * @brief Returns the hash slot @p i of @p v.
+ */
+static uint32_t slot_at(const struct reg_version *v, size_t i)
+{
+	return (*(const uint32_t *)table_at(&v->slots, i));
+}
+
+/**
+ * @brief Sets the hash slot @p i of @p v to @p val.
+ *
+ * @return Returns 0 if success, -1 if out of memory.
+ */
+static int set_slot(struct reg_version *v, size_t i, uint32_t val)
+{
+	uint32_t *s;
+
+	if (!(s = table_rw(&v->slots, i)))
+		return (-1);
+	*s = val;
+	return (0);
+}
+
+/**
+ * @brief FNV-1a hash of the printer name @p name.
+ *
+ * @param name Name, not necessarily NUL-terminated.
+ * @param len  Name length.
+ *
+ * @return Returns the name hash.
+ */
+static uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261u;
+	for (i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/**
+ * @brief Returns the hash of the interned name @p ref.
+ */
+static uint32_t ref_hash(uint32_t ref)
+{
+	const unsigned char *s;
+
+	s = strtab_get(ref);
+	return (name_hash(STRTAB_STR(s), STRTAB_LEN(s)));
+}
+
+/**
+ * @brief Longest address text produced by @ref format_addr,
+ * including the NUL terminator.
+ */
+#define ADDR_TEXT_MAX (INET6_ADDRSTRLEN + 8)
+
+/**
+ * @brief Formats the numeric address @p a.
+ *
+ * @param family ADDR_V4 or ADDR_V6.
+ * @param a      Address, 4 or 16 bytes.
+ * @param port   Port, 0 if none.
+ * @param ip     Target, @ref ADDR_TEXT_MAX bytes.
+ *
+ * @return Returns the text length.
+ */
+static size_t format_numeric(int family, const void *a, uint16_t port,
+	char *ip)
+{
+	char host[INET6_ADDRSTRLEN];
+	int n;
+
+	inet_ntop(family == ADDR_V4 ? AF_INET : AF_INET6, a, host, sizeof(host));
+	if (!port)
+		n = snprintf(ip, ADDR_TEXT_MAX, "%s", host);
+	else if (family == ADDR_V4)
+		n = snprintf(ip, ADDR_TEXT_MAX, "%s:%u", host, port);
+	else
+		n = snprintf(ip, ADDR_TEXT_MAX, "[%s]:%u", host, port);
+	return (n > 0 ? (size_t)n : 0);
+}
+
+/**
+ * @brief Formats the address of @p r.
+ *
+ * @param r  Record.
+ * @param ip Target, @ref ADDR_TEXT_MAX bytes.
+ *
+ * @return Returns the text length.
+ */
+static size_t format_addr(const struct reg_record *r, char *ip)
+{
+	const unsigned char *s;
+
+	switch (r->family)
+	{
+		case ADDR_V4:
+			return (format_numeric(ADDR_V4, &r->addr, r->port, ip));
+		case ADDR_V6:
+			return (format_numeric(ADDR_V6, STRTAB_STR(strtab_get(r->addr)),
+				r->port, ip));
+		default:
+			s = strtab_get(r->addr);
+			memcpy(ip, STRTAB_STR(s), STRTAB_LEN(s) + 1);
+			return (STRTAB_LEN(s));
+	}
+}
+
+/**
+ * @brief Packs @p ip as a numeric address (`a.b.c.d`, `a.b.c.d:port`,
+ * IPv6 or `[IPv6]:port`) into @p r.
+ *
+ * @return Returns true if @p ip is numeric and formats back to the
+ * very same text, false otherwise (nothing is interned then).
+ */
+static bool pack_addr(const char *ip, struct reg_record *r)
+{
+	unsigned char a6[16];
+	char host[PRINTER_STRLEN];
+	char back[ADDR_TEXT_MAX];
+	char *port;
+	char *end;
+	long n;
+
+	snprintf(host, sizeof(host), "%s", ip);
+	port = NULL;
+	if (host[0] == '[')
+	{
+		end = strchr(host, ']');
+		if (!end || end[1] != ':')
+			return (false);
+		*end = '\0';
+		port = end + 2;
+		memmove(host, host + 1, strlen(host + 1) + 1);
+	}
+	else if ((port = strchr(host, ':')) && !strchr(port + 1, ':'))
+		*port++ = '\0';
+	else
+		port = NULL;
+
+	r->port = 0;
+	if (port)
+	{
+		n = strtol(port, &end, 10);
+		if (*end || n <= 0 || n > 65535)
+			return (false);
+		r->port = (uint16_t)n;
+	}
+
+	if (inet_pton(AF_INET, host, &r->addr) == 1)
+	{
+		r->family = ADDR_V4;
+		format_numeric(ADDR_V4, &r->addr, r->port, back);
+		return (!strcmp(back, ip));
+	}
+	if (inet_pton(AF_INET6, host, a6) != 1)
+		return (false);
+
+	/* Checked first: a mismatch would leave it interned for nothing. */
+	format_numeric(ADDR_V6, a6, r->port, back);
+	if (strcmp(back, ip))
+		return (false);
+	r->family = ADDR_V6;
+	r->addr   = strtab_intern(a6, sizeof(a6));
+	return (r->addr != STRTAB_NONE);
+}
+
+/**
+ * @brief Packs @p p into @p r, interning its strings.
+ *
+ * @return Returns 0 if success, -1 if out of memory.
+ */
+static int pack(const struct PRINTER *p, struct reg_record *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->state = (uint8_t)p->state;
+	r->name  = strtab_intern(p->name, strnlen(p->name, PRINTER_STRLEN));
+	if (r->name == STRTAB_NONE)
+		return (-1);
+	if (pack_addr(p->ip, r))
+		return (0);
+
+	r->family = ADDR_TEXT;
+	r->port   = 0;
+	r->addr   = strtab_intern(p->ip, strnlen(p->ip, PRINTER_STRLEN));
+	return (r->addr == STRTAB_NONE ? -1 : 0);
+}
+
+/**
+ * @brief Unpacks @p r into @p p.
+ */
+static void unpack(const struct reg_record *r, struct PRINTER *p)
+{
+	const unsigned char *s;
+	char ip[ADDR_TEXT_MAX];
+	size_t len;
+
+	/* Strings came from a struct PRINTER, they fit. */
+	memset(p, 0, sizeof(*p));
+	s = strtab_get(r->name);
+	memcpy(p->name, STRTAB_STR(s), STRTAB_LEN(s));
+	len = format_addr(r, ip);
+	memcpy(p->ip, ip, len < PRINTER_STRLEN ? len : PRINTER_STRLEN - 1);
+	p->state = (enum PRINTER_STATE)r->state;
+}
+
+/**
+ * @brief Returns whether @p a and @p b hold the same printer: with
+ * interned strings, this is only integer comparisons.
+ */
+static bool same_record(const struct reg_record *a, const struct reg_record *b)
+{
+	return (a->name == b->name && a->addr == b->addr && a->port == b->port &&
+		a->family == b->family && a->state == b->state);
+}
+
+/**
+ * @brief Finds the slot of @p v that holds, or would hold, @p name.
+ *
+ * @param v    Registry version.
+ * @param name Printer name.
+ *
+ * @return Returns the slot index.
+ */
+static size_t find_slot(const struct reg_version *v, const char *name)
+{
+	const unsigned char *s;
+	size_t mask;
+	size_t len;
+	size_t i;
+
+	len  = strnlen(name, PRINTER_STRLEN);
+	mask = v->nslots - 1;
+	for (i = name_hash(name, len) & mask; slot_at(v, i); i = (i + 1) & mask)
+	{
+		s = strtab_get(entry(v, slot_at(v, i) - 1)->rec.name);
+		if (STRTAB_LEN(s) == len && !memcmp(STRTAB_STR(s), name, len))
+			break;
+	}
+	return (i);
+}
+
+/**
+ * @brief Finds the slot of @p v that holds, or would hold, the
+ * interned name @p ref: a reference comparison per probe.
+ *
+ * @param v   Registry version.
+ * @param ref Interned printer name.
+ *
+ * @return Returns the slot index.
+ */
+static size_t find_ref(const struct reg_version *v, uint32_t ref)
+{
+	size_t mask;
+	size_t i;
+
+	mask = v->nslots - 1;
+	for (i = ref_hash(ref) & mask; slot_at(v, i); i = (i + 1) & mask)
+		if (entry(v, slot_at(v, i) - 1)->rec.name == ref)
+			break;
+	return (i);
+}
+
+/**
+ * @brief Releases the version @p p (a struct reg_version), and the
+ * pages no other version uses.
+ */
+static void free_version(void *p)
+{
+	struct reg_version *v;
+	int i;
+
+	v = p;
+	if (!v)
+		return;
+	for (i = 0; i < PRINTER_NSTATES; i++)
+		table_free(&v->states[i].pos);
+	table_free(&v->records);
+	table_free(&v->slots);
+	free(v);
+}
+
+/**
+ * @brief Grows the records (and state indexes) of @p v by a page.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int grow_records(struct reg_version *v)
+{
+	size_t npages;
+	int i;
+
+	/* State indexes always have room for every record. */
+	npages = v->records.npages + 1;
+	for (i = 0; i < PRINTER_NSTATES; i++)
+		if (table_grow(&v->states[i].pos, npages) < 0)
+			return (-1);
+	return (table_grow(&v->records, npages));
+}
+
+/**
+ * @brief Sets @p v up, empty, with @p nslots hash slots.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int alloc_version(struct reg_version *v, size_t nslots)
+{
+	size_t i;
+	int j;
+
+	v->records.elem = sizeof(struct reg_entry);
+	v->slots.elem   = sizeof(uint32_t);
+	for (j = 0; j < PRINTER_NSTATES; j++)
+		v->states[j].pos.elem = sizeof(uint32_t);
+
+	v->nslots = nslots;
+	if (table_grow(&v->slots, (nslots + REG_PAGE - 1) >> REG_PAGE_BITS) < 0 ||
+		grow_records(v) < 0)
+	{
+		return (-1);
+	}
+	for (i = 0; i < v->slots.npages; i++)
+		memset(v->slots.pages[i]->data, 0, REG_PAGE * sizeof(uint32_t));
+	return (0);
+}
+
+/**
+ * @brief Creates a private, mutable, copy of the version @p v, with
+ * room for at least @p extra more records.
+ *
+ * Only the page pointers are copied: pages are shared, and each
+ * one is copied the first time the new version writes to it (see
+ * @ref table_rw), so a mutation costs the pages it touches.
+ *
+ * @param v     Version to be copied.
+ * @param extra Records about to be inserted.
+ *
+ * @return Returns the copy, or NULL if out of memory.
+ */
+static struct reg_version *clone_version(const struct reg_version *v,
+	size_t extra)
+{
+	struct reg_version *c;
+	int i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return (NULL);
+
+	if (table_share(&c->records, &v->records) < 0 ||
+		table_share(&c->slots, &v->slots) < 0)
+	{
+		goto fail;
+	}
+	for (i = 0; i < PRINTER_NSTATES; i++)
+	{
+		if (table_share(&c->states[i].pos, &v->states[i].pos) < 0)
+			goto fail;
+		c->states[i].count = v->states[i].count;
+	}
+	c->count   = v->count;
+	c->nslots  = v->nslots;
+	c->version = v->version;
+
+	while ((c->records.npages << REG_PAGE_BITS) < c->count + extra)
+		if (grow_records(c) < 0)
+			goto fail;
+	return (c);
+fail:
+	free_version(c);
+	return (NULL);
+}
+
+/**
+ * @brief Doubles the hash table of @p v, re-inserting every record.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int grow_slots(struct reg_version *v)
+{
+	struct page_table old;
+	size_t nslots;
+	size_t i;
+
+	old       = v->slots;
+	nslots    = v->nslots * 2;
+	v->slots.pages  = NULL;
+	v->slots.npages = 0;
+	if (table_grow(&v->slots, (nslots + REG_PAGE - 1) >> REG_PAGE_BITS) < 0)
+	{
+		table_free(&v->slots);
+		v->slots = old;
+		return (-1);
+	}
+	for (i = 0; i < v->slots.npages; i++)
+		memset(v->slots.pages[i]->data, 0, REG_PAGE * sizeof(uint32_t));
+	table_free(&old);
+	v->nslots = nslots;
+
+	/* Pages of its own: writing them cannot fail. */
+	for (i = 0; i < v->count; i++)
+		set_slot(v, find_ref(v, entry(v, i)->rec.name), (uint32_t)i + 1);
+	return (0);
+}
+
+/**
+ * @brief Adds the record @p idx of @p v to the index of its state.
+ *
+ * @return Returns 0 if success, -1 if out of memory.
+ */
+static int state_link(struct reg_version *v, size_t idx)
+{
+	struct state_index *si;
+	struct reg_entry *e;
+	uint32_t *pos;
+
+	si = &v->states[entry(v, idx)->rec.state];
+	if (!(e = table_rw(&v->records, idx)) ||
+		!(pos = table_rw(&si->pos, si->count)))
+	{
+		return (-1);
+	}
+	e->state_pos = (uint32_t)si->count++;
+	*pos         = (uint32_t)idx;
+	return (0);
+}
+
+/**
+ * @brief Removes the record @p idx of @p v from the index of its
+ * state, by moving the last entry of that index into its place.
+ *
+ * @return Returns 0 if success, -1 if out of memory.
+ */
+static int state_unlink(struct reg_version *v, size_t idx)
+{
+	struct state_index *si;
+	struct reg_entry *e;
+	uint32_t *slot;
+	uint32_t last;
+	uint32_t pos;
+
+	si  = &v->states[entry(v, idx)->rec.state];
+	pos = entry(v, idx)->state_pos;
+	si->count--;
+	if (pos == si->count)
+		return (0);
+
+	last = *(const uint32_t *)table_at(&si->pos, si->count);
+	if (!(slot = table_rw(&si->pos, pos)) ||
+		!(e = table_rw(&v->records, last)))
+	{
+		return (-1);
+	}
+	*slot        = last;
+	e->state_pos = pos;
+	return (0);
+}
+
+/**
+ * @brief Replaces the record @p idx of @p v with @p r, moving it to
+ * another state index if needed.
+ *
+ * @return Returns 0 if success, -1 if out of memory.
+ */
+static int replace(struct reg_version *v, size_t idx,
+	const struct reg_record *r)
+{
+	struct reg_entry *e;
+	bool moved;
+
+	moved = entry(v, idx)->rec.state != r->state;
+	if (moved && state_unlink(v, idx) < 0)
+		return (-1);
+	if (!(e = table_rw(&v->records, idx)))
+		return (-1);
+	e->rec = *r;
+	return (moved ? state_link(v, idx) : 0);
+}
+
+/**
+ * @brief Inserts @p r in @p v, without any duplicate check.
+ *
+ * @param v    Private (unpublished) version.
+ * @param r    Printer to be inserted, packed.
+ * @param slot Free slot for @p r, as returned by @ref find_slot.
+ *
+ * @return Returns 0 if success, -1 otherwise (@p v is untouched).
+ */
+static int insert(struct reg_version *v, const struct reg_record *r,
+	size_t slot)
+{
+	struct state_index *si;
+	struct reg_entry *e;
+	uint32_t *pos;
+
+	if (v->count == v->records.npages << REG_PAGE_BITS &&
+		grow_records(v) < 0)
+	{
+		return (-1);
+	}
+
+	/*
+	 * Keep the load factor below 3/4. Grow first, so a failure
+	 * leaves the registry untouched.
+	 */
+	if ((v->count + 1) * 4 >= v->nslots * 3)
+	{
+		if (grow_slots(v) < 0)
+			return (-1);
+		slot = find_ref(v, r->name);
+	}
+
+	/* Pages copied first, for the same reason. */
+	si = &v->states[r->state];
+	if (!(e = table_rw(&v->records, v->count)) ||
+		!(pos = table_rw(&si->pos, si->count)) ||
+		set_slot(v, slot, slot_at(v, slot)) < 0)
+	{
+		return (-1);
+	}
+
+	e->rec       = *r;
+	e->state_pos = (uint32_t)si->count++;
+	*pos         = (uint32_t)v->count;
+	set_slot(v, slot, (uint32_t)++v->count);
+	return (0);
+}
+
+/**
+ * @brief Removes the printer in hash slot @p slot from @p v.
+ *
+ * The slot is freed with backward-shift deletion, so no tombstones
+ * are needed, and the last record is moved into the hole left in
+ * the records array.
+ *
+ * @param v    Private (unpublished) version.
+ * @param slot Slot of the printer to be removed.
+ *
+ * @return Returns 0 if success, -1 if out of memory (@p v is then
+ * only good to be released).
+ */
+static int erase(struct reg_version *v, size_t slot)
+{
+	struct reg_entry *e;
+	uint32_t *pos;
+	size_t mask;
+	size_t home;
+	size_t idx;
+	size_t i;
+	size_t j;
+
+	idx  = slot_at(v, slot) - 1;
+	mask = v->nslots - 1;
+
+	/* Shift back every entry that would become unreachable. */
+	for (i = slot, j = (slot + 1) & mask; slot_at(v, j); j = (j + 1) & mask)
+	{
+		home = ref_hash(entry(v, slot_at(v, j) - 1)->rec.name) & mask;
+		if ((j > i && (home <= i || home > j)) ||
+			(j < i && (home <= i && home > j)))
+		{
+			if (set_slot(v, i, slot_at(v, j)) < 0)
+				return (-1);
+			i = j;
+		}
+	}
+	if (set_slot(v, i, 0) < 0 || state_unlink(v, idx) < 0)
+		return (-1);
+
+	/* Fill the hole with the last record. */
+	v->count--;
+	if (idx == v->count)
+		return (0);
+
+	if (set_slot(v, find_ref(v, entry(v, v->count)->rec.name),
+		(uint32_t)idx + 1) < 0 || !(e = table_rw(&v->records, idx)))
+	{
+		return (-1);
+	}
+	*e  = *entry(v, v->count);
+	pos = table_rw(&v->states[e->rec.state].pos, e->state_pos);
+	if (!pos)
+		return (-1);
+	*pos = (uint32_t)idx;
+	return (0);
+}
+
+/**
+ * @brief Applies the operation @p op to memory only.
+ *
+ * Used while loading the database and replaying its log, where
+ * adds and updates are both treated as upserts, so replaying an
+ * operation twice is harmless. The registry is not shared yet,
+ * so the current version is changed in place.
+ *
+ * @param op Operation.
+ * @param p  Printer.
+ */
+static void apply(int op, const struct PRINTER *p)
+{
+	struct reg_record r;
+	size_t slot;
+
+	slot = find_slot(reg, p->name);
+	if (op == STORE_REMOVE)
+	{
+		if (slot_at(reg, slot) && erase(reg, slot) < 0)
+			reg_load_error = 1;
+	}
+	else if (pack(p, &r) < 0)
+		reg_load_error = 1;
+	else if (slot_at(reg, slot))
+	{
+		if (replace(reg, slot_at(reg, slot) - 1, &r) < 0)
+			reg_load_error = 1;
+	}
+	else if (insert(reg, &r, slot) < 0)
+		reg_load_error = 1;
+}
+
+/**
+ * @brief Loads the database at @p db_path into memory.
+ *
+ * @param db_path Database path.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int registry_init(const char *db_path)
+{
+	reg = calloc(1, sizeof(*reg));
+	if (!reg)
+		return (REG_ERROR);
+	if (alloc_version(reg, REG_INITIAL_SLOTS) < 0)
+		return (REG_ERROR);
+
+	if (store_open(db_path, apply) < 0 || reg_load_error)
+		return (REG_ERROR);
+	return (0);
+}
+
+/**
+ * @brief Publishes the private version @p v in place of the current
+ * one, which is retired.
+ *
+ * @note Must be called with @ref reg_write_lock held.
+ */
+static void publish(struct reg_version *v)
+{
+	struct reg_version *old;
+
+	old        = reg;
+	v->version = old->version + 1;
+	__atomic_store_n(&reg, v, __ATOMIC_RELEASE);
+	__atomic_store_n(&reg_version_number, v->version, __ATOMIC_RELEASE);
+	epoch_retire(old, free_version);
+}
+
+/**
+ * @brief Notifies the listeners of a change, published as the
+ * current version.
+ *
+ * @param op  Operation applied.
+ * @param old Printer contents before the operation, NULL for adds.
+ * @param cur Printer contents after the operation, NULL for removes.
+ *
+ * @note Must be called with @ref reg_write_lock held.
+ */
+static void changed(int op, const struct PRINTER *old, const struct PRINTER *cur)
+{
+	size_t i;
+
+	for (i = 0; i < reg_nlisteners; i++)
+		reg_listeners[i](op, old, cur, reg->version);
+}
+
+/**
+ * @brief Registers @p cb to be called on every registry mutation.
+ *
+ * Listeners are called in mutation order, with the registry writers
+ * lock held: they must be quick and must not call back into the
+ * registry for a mutation (reads are fine).
+ *
+ * @param cb Listener, receives the operation (a store_op), the
+ *           printer contents before (NULL for adds) and after (NULL
+ *           for removes) the operation, and the version that
+ *           published it (shared by the operations of a batch).
+ *
+ * @return Returns 0 if success, -1 if there are too many listeners.
+ */
+int registry_listen(void (*cb)(int op, const struct PRINTER *old,
+	const struct PRINTER *cur, uint64_t version))
+{
+	int ret;
+
+	ret = -1;
+	pthread_mutex_lock(&reg_write_lock);
+	if (reg_nlisteners < REG_MAX_LISTENERS)
+	{
+		reg_listeners[reg_nlisteners++] = cb;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&reg_write_lock);
+	return (ret);
+}
+
+/**
+ * @brief Adds the printer @p p, persisting it.
+ *
+ * @param p Printer to be added.
+ *
+ * @return Returns 0 if success, @ref REG_EXISTS if there is
+ * already a printer with the same name, or @ref REG_ERROR.
+ */
+int registry_add(const struct PRINTER *p)
+{
+	struct strtab_mark mark;
+	struct reg_version *v;
+	struct reg_record r;
+	int ret;
+
+	v = NULL;
+	pthread_mutex_lock(&reg_write_lock);
+	mark = strtab_mark();
+	ret  = REG_EXISTS;
+	if (slot_at(reg, find_slot(reg, p->name)))
+		goto out;
+
+	ret = REG_ERROR;
+	v   = clone_version(reg, 1);
+	if (!v || pack(p, &r) < 0 || insert(v, &r, find_ref(v, r.name)) < 0)
+		goto out;
+	if (store_log(STORE_ADD, p) < 0)
+		goto out;
+
+	publish(v);
+	v = NULL;
+	changed(STORE_ADD, NULL, p);
+	ret = 0;
+out:
+	if (ret < 0)
+		strtab_rollback(mark);
+	pthread_mutex_unlock(&reg_write_lock);
+	free_version(v);
+	return (ret);
+}
+
+/**
+ * @brief Adds every printer of @p printers, persisting them with
+ * a single log append.
+ *
+ * Printers are checked against the index (and against the ones
+ * before them in @p printers) in a single pass, inserting them
+ * into a new version as they go. The accepted ones are then logged
+ * together and the version is published only if that succeeds.
+ *
+ * @param printers Printers to be added.
+ * @param count    Amount of printers.
+ * @param results  Receives, per printer, 0 if added, @ref REG_EXISTS
+ *                 if the name was already taken, or @ref REG_ERROR.
+ *
+ * @return Returns the amount of added printers, or @ref REG_ERROR
+ * if none could be persisted.
+ */
+int registry_add_many(const struct PRINTER *printers, size_t count,
+	int *results)
+{
+	struct strtab_mark mark;
+	struct reg_version *v;
+	struct PRINTER *added;
+	struct reg_record r;
+	size_t slot;
+	size_t n;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < count; i++)
+		results[i] = REG_ERROR;
+
+	added = malloc((count ? count : 1) * sizeof(*added));
+	if (!added)
+		return (REG_ERROR);
+
+	pthread_mutex_lock(&reg_write_lock);
+	mark = strtab_mark();
+	ret  = REG_ERROR;
+	v    = clone_version(reg, count);
+	if (!v)
+		goto out;
+
+	for (i = 0, n = 0; i < count; i++)
+	{
+		slot = find_slot(v, printers[i].name);
+		if (slot_at(v, slot))
+			results[i] = REG_EXISTS;
+		else if (pack(&printers[i], &r) == 0 && insert(v, &r, slot) == 0)
+		{
+			results[i] = 0;
+			added[n++] = printers[i];
+		}
+	}
+
+	if (n && store_log_many(STORE_ADD, added, n) < 0)
+	{
+		for (i = 0; i < count; i++)
+			if (!results[i])
+				results[i] = REG_ERROR;
+		goto out;
+	}
+
+	ret = (int)n;
+	if (n)
+	{
+		publish(v);
+		v = NULL;
+		for (i = 0; i < n; i++)
+			changed(STORE_ADD, NULL, &added[i]);
+	}
+out:
+	if (ret <= 0)
+		strtab_rollback(mark);
+	pthread_mutex_unlock(&reg_write_lock);
+	free_version(v);
+	free(added);
+	return (ret);
+}
+
+/**
+ * @brief Replaces the record @p idx with @p p in a new version and
+ * publishes it once logged.
+ *
+ * @param idx Record index, in the current version.
+ * @param p   New printer contents.
+ *
+ * @return Returns 0 if success, @ref REG_ERROR otherwise.
+ *
+ * @note Must be called with @ref reg_write_lock held.
+ */
+static int update_locked(size_t idx, const struct PRINTER *p)
+{
+	struct strtab_mark mark;
+	struct reg_version *v;
+	struct reg_record r;
+	struct PRINTER old;
+
+	mark = strtab_mark();
+	v    = NULL;
+	if (pack(p, &r) < 0 || !(v = clone_version(reg, 0)))
+	{
+		strtab_rollback(mark);
+		return (REG_ERROR);
+	}
+	if (replace(v, idx, &r) < 0 || store_log(STORE_UPDATE, p) < 0)
+	{
+		strtab_rollback(mark);
+		free_version(v);
+		return (REG_ERROR);
+	}
+
+	unpack(&entry(reg, idx)->rec, &old);
+	publish(v);
+	changed(STORE_UPDATE, &old, p);
+	return (0);
+}
+
+/**
+ * @brief Replaces the printer named after @p p, persisting it.
+ *
+ * @param p New printer contents.
+ *
+ * @return Returns 0 if success, @ref REG_NOTFOUND if there is no
+ * printer with that name, or @ref REG_ERROR.
+ */
+int registry_update(const struct PRINTER *p)
+{
+	size_t slot;
+	int ret;
+
+	pthread_mutex_lock(&reg_write_lock);
+	slot = find_slot(reg, p->name);
+	ret  = REG_NOTFOUND;
+	if (slot_at(reg, slot))
+		ret = update_locked(slot_at(reg, slot) - 1, p);
+	pthread_mutex_unlock(&reg_write_lock);
+	return (ret);
+}
+
+/**
+ * @brief Sets the state of printer @p name, persisting it, if it is
+ * @p expected (or whatever it is, if @p expected is -1).
+ *
+ * @param name     Printer name.
+ * @param expected Expected state, -1 for any.
+ * @param state    New state.
+ *
+ * @return Returns 0 if success, @ref REG_NOTFOUND, @ref REG_STATE
+ * or @ref REG_ERROR.
+ */
+static int set_state(const char *name, int expected,
+	enum PRINTER_STATE state)
+{
+	struct PRINTER p;
+	size_t slot;
+	int ret;
+
+	pthread_mutex_lock(&reg_write_lock);
+	slot = find_slot(reg, name);
+	ret  = REG_NOTFOUND;
+	if (!slot_at(reg, slot))
+		goto out;
+
+	ret = REG_STATE;
+	if (expected >= 0 && entry(reg, slot_at(reg, slot) - 1)->rec.state != expected)
+		goto out;
+
+	ret = 0;
+	if (entry(reg, slot_at(reg, slot) - 1)->rec.state == state)
+		goto out;
+
+	unpack(&entry(reg, slot_at(reg, slot) - 1)->rec, &p);
+	p.state = state;
+	ret     = update_locked(slot_at(reg, slot) - 1, &p);
+out:
+	pthread_mutex_unlock(&reg_write_lock);
+	return (ret);
+}
+
+/**
+ * @brief Sets the state of printer @p name, persisting it.
+ *
+ * Only the log is written (a single append), setting the state
+ * a printer already has does not touch the disk at all.
+ *
+ * @param name  Printer name.
+ * @param state New state.
+ *
+ * @return Returns 0 if success, @ref REG_NOTFOUND if there is no
+ * printer with that name, or @ref REG_ERROR.
+ */
+int registry_set_state(const char *name, enum PRINTER_STATE state)
+{
+	return (set_state(name, -1, state));
+}
+
+/**
+ * @brief Sets the state of printer @p name to @p state, persisting
+ * it, only if it currently is @p expected: as a single step, no
+ * other writer can change it in between.
+ *
+ * @param name     Printer name.
+ * @param expected Expected state.
+ * @param state    New state.
+ *
+ * @return Returns 0 if success, @ref REG_NOTFOUND if there is no
+ * printer with that name, @ref REG_STATE if it is not in the
+ * @p expected state, or @ref REG_ERROR.
+ */
+int registry_set_state_if(const char *name, enum PRINTER_STATE expected,
+	enum PRINTER_STATE state)
+{
+	return (set_state(name, (int)expected, state));
+}
+
+/**
+ * @brief Removes the printer @p name, persisting it.
+ *
+ * @param name Printer name.
+ *
+ * @return Returns 0 if success, @ref REG_NOTFOUND if there is no
+ * printer with that name, or @ref REG_ERROR.
+ */
+int registry_remove(const char *name)
+{
+	struct reg_version *v;
+	struct PRINTER p;
+	size_t slot;
+	int ret;
+
+	v = NULL;
+	pthread_mutex_lock(&reg_write_lock);
+	slot = find_slot(reg, name);
+	ret  = REG_NOTFOUND;
+	if (!slot_at(reg, slot))
+		goto out;
+
+	ret = REG_ERROR;
+	unpack(&entry(reg, slot_at(reg, slot) - 1)->rec, &p);
+	v = clone_version(reg, 0);
+	if (!v || erase(v, slot) < 0 || store_log(STORE_REMOVE, &p) < 0)
+		goto out;
+
+	publish(v);
+	v = NULL;
+	changed(STORE_REMOVE, &p, NULL);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&reg_write_lock);
+	free_version(v);
+	return (ret);
+}
+
+/**
+ * @brief Applies a batch of operations as a single version, logged
+ * with a single append: readers see either none or all of them.
+ *
+ * Adds and updates are both treated as upserts, and operations that
+ * would not change anything (removing a missing printer, setting
+ * the contents a printer already has) are skipped, so listeners
+ * only hear about actual changes.
+ *
+ * @param ops      Operations (store_op).
+ * @param printers Printers, for removes only the name matters.
+ * @param count    Amount of operations.
+ *
+ * @return Returns the amount of applied operations, or @ref REG_ERROR
+ * if they could not be persisted (none is applied).
+ */
+int registry_apply_batch(const int *ops, const struct PRINTER *printers,
+	size_t count)
+{
+	struct strtab_mark mark;
+	struct reg_version *v;
+	struct reg_record r;
+	struct PRINTER *olds;
+	struct PRINTER *curs;
+	int *done;
+	size_t slot;
+	size_t idx;
+	size_t n;
+	size_t i;
+	int ret;
+
+	/* Per applied operation: its kind and contents before and after. */
+	done = malloc((count ? count : 1) * sizeof(*done));
+	olds = malloc((count ? count : 1) * 2 * sizeof(*olds));
+	if (!done || !olds)
+	{
+		free(done);
+		free(olds);
+		return (REG_ERROR);
+	}
+	curs = olds + count;
+
+	pthread_mutex_lock(&reg_write_lock);
+	mark = strtab_mark();
+	ret  = REG_ERROR;
+	v    = clone_version(reg, count);
+	if (!v)
+		goto out;
+
+	for (i = 0, n = 0; i < count; i++)
+	{
+		slot = find_slot(v, printers[i].name);
+		if (ops[i] == STORE_REMOVE)
+		{
+			if (!slot_at(v, slot))
+				continue;
+			done[n] = STORE_REMOVE;
+			unpack(&entry(v, slot_at(v, slot) - 1)->rec, &olds[n]);
+			curs[n] = olds[n];
+			if (erase(v, slot) < 0)
+				goto out;
+			n++;
+			continue;
+		}
+
+		if (pack(&printers[i], &r) < 0)
+			goto out;
+		if (slot_at(v, slot))
+		{
+			idx = slot_at(v, slot) - 1;
+			if (same_record(&entry(v, idx)->rec, &r))
+				continue;
+			done[n] = STORE_UPDATE;
+			unpack(&entry(v, idx)->rec, &olds[n]);
+			curs[n] = printers[i];
+			if (replace(v, idx, &r) < 0)
+				goto out;
+		}
+		else
+		{
+			if (insert(v, &r, slot) < 0)
+				goto out;
+			done[n] = STORE_ADD;
+			curs[n] = printers[i];
+		}
+		n++;
+	}
+
+	if (n && store_log_ops(done, curs, n) < 0)
+		goto out;
+
+	ret = (int)n;
+	if (n)
+	{
+		publish(v);
+		v = NULL;
+		for (i = 0; i < n; i++)
+			changed(done[i], done[i] == STORE_ADD ? NULL : &olds[i],
+				done[i] == STORE_REMOVE ? NULL : &curs[i]);
+	}
+out:
+	if (ret <= 0)
+		strtab_rollback(mark);
+	pthread_mutex_unlock(&reg_write_lock);
+	free_version(v);
+	free(olds);
+	free(done);
+	return (ret);
+}
+
+/**
+ * @brief Enters a read-side section and returns the current version.
+ */
+static const struct reg_version *read_begin(void)
+{
+	epoch_enter();
+	return (__atomic_load_n(&reg, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * @brief Leaves the read-side section.
+ */
+static void read_end(void)
+{
+	epoch_exit();
+}
+
+/**
+ * @brief Looks up a printer by name.
+ *
+ * @param name Printer name.
+ * @param p    If found, receives a copy of the printer.
+ *
+ * @return Returns true if found, false otherwise.
+ */
+bool registry_find(const char *name, struct PRINTER *p)
+{
+	const struct reg_version *v;
+	size_t slot;
+	bool found;
+
+	v     = read_begin();
+	slot  = find_slot(v, name);
+	found = slot_at(v, slot) != 0;
+	if (found)
+		unpack(&entry(v, slot_at(v, slot) - 1)->rec, p);
+	read_end();
+	return (found);
+}
+
+/**
+ * @brief Returns the amount of registered printers.
+ */
+size_t registry_count(void)
+{
+	size_t count;
+	count = read_begin()->count;
+	read_end();
+	return (count);
+}
+
+/**
+ * @brief Returns the registry version.
+ *
+ * The version changes on every mutation, so anything derived
+ * from the registry contents can be cached alongside the
+ * version it was built from and checked for staleness without
+ * touching the registry itself.
+ */
+uint64_t registry_version(void)
+{
+	return (__atomic_load_n(&reg_version_number, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * @brief Calls @p cb for every printer of the current version, in
+ * array order.
+ *
+ * That is the insertion order as long as no printer is removed: a
+ * removal moves the last printer into the freed position (see
+ * @ref erase), so callers must not rely on any particular order.
+ *
+ * @param cb   Callback, iteration stops if it returns non-zero.
+ * @param data Opaque pointer given to @p cb.
+ *
+ * @return Returns the registry version the iteration saw.
+ *
+ * @note @p cb runs inside a read-side section: it must not mutate
+ * the registry.
+ */
+uint64_t registry_foreach(int (*cb)(const struct PRINTER *, void *), void *data)
+{
+	const struct reg_version *v;
+	struct PRINTER p;
+	uint64_t version;
+	size_t i;
+
+	v       = read_begin();
+	version = v->version;
+	for (i = 0; i < v->count; i++)
+	{
+		unpack(&entry(v, i)->rec, &p);
+		if (cb(&p, data))
+			break;
+	}
+	read_end();
+	return (version);
+}
+
+/**
+ * @brief Calls @p cb for a page of the printers in state @p state,
+ * or of every printer (in the order of @ref registry_foreach) if
+ * @p state is negative, as of the current version.
+ *
+ * Pages are taken from the state index, so this costs as much as
+ * the page, not the registry. Within a state, printers are not in
+ * any particular order, and the order changes as printers leave
+ * the state: pages are only consistent for a given version.
+ *
+ * @param state  Printer state (enum PRINTER_STATE), or -1 for all.
+ * @param offset Amount of printers to skip.
+ * @param limit  Maximum amount of printers.
+ * @param cb     Callback, iteration stops if it returns non-zero.
+ * @param data   Opaque pointer given to @p cb.
+ *
+ * @return Returns the total amount of printers in @p state.
+ *
+ * @note @p cb runs inside a read-side section: it must not mutate
+ * the registry.
+ */
+size_t registry_page(int state, size_t offset, size_t limit,
+	int (*cb)(const struct PRINTER *, void *), void *data)
+{
+	const struct reg_version *v;
+	const struct state_index *si;
+	struct PRINTER p;
+	size_t total;
+	size_t i;
+
+	v     = read_begin();
+	si    = state >= 0 && state < PRINTER_NSTATES ? &v->states[state] : NULL;
+	total = si ? si->count : v->count;
+	for (i = offset; i < total && i - offset < limit; i++)
+	{
+		unpack(&entry(v, si ? *(const uint32_t *)table_at(&si->pos, i) :
+			i)->rec, &p);
+		if (cb(&p, data))
+			break;
+	}
+	read_end();
+	return (total);
+}
+
+/**
+ * @brief Copies every printer with the writers lock held, so no
+ * mutation can happen in between, and calls @p locked before
+ * releasing it.
+ *
+ * @param count  Receives the amount of printers.
+ * @param locked Called with the lock still held, may be NULL.
+ *
+ * @return Returns the copy, to be freed by the caller, or NULL if
+ * out of memory.
+ */
+struct PRINTER *registry_snapshot(size_t *count, void (*locked)(void))
+{
+	struct PRINTER *copy;
+	size_t i;
+
+	pthread_mutex_lock(&reg_write_lock);
+	copy = malloc((reg->count ? reg->count : 1) * sizeof(*copy));
+	if (copy)
+	{
+		for (i = 0; i < reg->count; i++)
+			unpack(&entry(reg, i)->rec, &copy[i]);
+		*count = reg->count;
+		if (locked)
+			locked();
+	}
+	pthread_mutex_unlock(&reg_write_lock);
+	return (copy);
+}
+
+/**
+ * @brief Closes the database and releases the registry.
+ *
+ * @note Must only be called once no other thread uses the registry.
+ */
+void registry_close(void)
+{
+	/* The store may still need the registry to finish a compaction. */
+	store_close();
+
+	pthread_mutex_lock(&reg_write_lock);
+	free_version(reg);
+	reg = NULL;
+	epoch_close();
+	strtab_close();
+	pthread_mutex_unlock(&reg_write_lock);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file registry.h
+ * @brief In-memory printer registry, indexed by name.
+ */
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+	#include <stdbool.h>
+	#include <stddef.h>
+	#include <stdint.h>
+	#include "printer.h"
+
+	/**
+	 * @name Registry error codes
+	 */
+	/**@{*/
+	/**
+	 * @brief Generic (I/O or out of memory) error.
+	 */
+	#define REG_ERROR    (-1)
+	/**
+	 * @brief A printer with the same name already exists.
+	 */
+	#define REG_EXISTS   (-2)
+	/**
+	 * @brief No printer with the given name.
+	 */
+	#define REG_NOTFOUND (-3)
+	/**
+	 * @brief The printer is not in the expected state.
+	 */
+	#define REG_STATE    (-4)
+	/**@}*/
+
+	extern int registry_init(const char *db_path);
+	extern int registry_listen(void (*cb)(int op, const struct PRINTER *old,
+		const struct PRINTER *cur, uint64_t version));
+	extern int registry_add(const struct PRINTER *p);
+	extern int registry_add_many(const struct PRINTER *printers, size_t count,
+		int *results);
+	extern int registry_update(const struct PRINTER *p);
+	extern int registry_set_state(const char *name, enum PRINTER_STATE state);
+	extern int registry_set_state_if(const char *name,
+		enum PRINTER_STATE expected, enum PRINTER_STATE state);
+	extern int registry_remove(const char *name);
+	extern int registry_apply_batch(const int *ops,
+		const struct PRINTER *printers, size_t count);
+	extern bool registry_find(const char *name, struct PRINTER *p);
+	extern size_t registry_count(void);
+	extern uint64_t registry_version(void);
+	extern uint64_t registry_foreach(
+		int (*cb)(const struct PRINTER *, void *), void *data);
+	extern size_t registry_page(int state, size_t offset, size_t limit,
+		int (*cb)(const struct PRINTER *, void *), void *data);
+	extern struct PRINTER *registry_snapshot(size_t *count,
+		void (*locked)(void));
+	extern void registry_close(void);
+
+#endif /* REGISTRY_H */
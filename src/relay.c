@@ -0,0 +1,818 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <ws.h>
+
+#include "binproto.h"
+#include "http.h"
+#include "refbuf.h"
+#include "registry.h"
+#include "relay.h"
+
+/**
+ * @file relay.c
+ * @brief Printer webcam relay.
+ *
+ * Browsers used to pull the MJPEG stream of every printer webcam
+ * straight from the printer, so each viewer added a full stream to
+ * the (small) printer board. Instead, the server pulls a single
+ * stream per watched printer and fans its frames out to every
+ * subscribed client.
+ *
+ * Each watched printer has a puller thread, started by its first
+ * subscriber and ended once it has none left. The thread splits
+ * the multipart stream into JPEG images, on their SOI/EOI
+ * markers, and encodes each of them once, as a complete
+ * WebSocket frame shared by every subscriber:
+ * `[BINPROTO_FRAME][name_len][name][jpeg]`.
+ *
+ * Frames are never sent by the puller itself: each client watching
+ * webcams (a viewer) has a sender thread, and one delivery slot per
+ * watched webcam. A new frame replaces the unsent one in the slot,
+ * if any, instead of queueing behind it, so a slow client drops
+ * frames, counted per slot, but never delays the other clients nor
+ * makes the server buffer more than one frame per slot.
+ */
+
+/**
+ * @name Relay configuration
+ */
+/**@{*/
+/**
+ * @brief Webcam stream path, on the printer web interface.
+ */
+#define RELAY_PATH "/webcam/?action=stream"
+/**
+ * @brief Connect and read timeout (ms).
+ */
+#define RELAY_TIMEOUT_MS 2000
+/**
+ * @brief Delay before reconnecting to a failed stream (ms).
+ */
+#define RELAY_RETRY_MS 1000
+/**
+ * @brief Read size.
+ */
+#define RELAY_CHUNK 16384
+/**
+ * @brief Largest accepted image; bigger ones are dropped.
+ */
+#define RELAY_FRAME_MAX (4 << 20)
+/**@}*/
+
+/**
+ * @brief Delivery slot, for a webcam watched by a viewer.
+ */
+struct slot
+{
+	char name[PRINTER_STRLEN]; /**< Printer name.                   */
+	struct refbuf *frame;      /**< Latest unsent frame, if any.    */
+	uint64_t sent;             /**< Frames sent.                    */
+	uint64_t dropped;          /**< Frames replaced before sending. */
+};
+
+/**
+ * @brief A client watching webcams.
+ */
+struct viewer
+{
+	struct viewer *next;  /**< Next viewer.                   */
+	int fd;               /**< Client fd.                     */
+	struct slot *slots;   /**< Watched webcams.               */
+	size_t count;         /**< Amount of slots.               */
+	size_t capacity;      /**< Allocated slots.               */
+	size_t cursor;        /**< Next slot to look at, so every
+	                           webcam gets its turn.          */
+	bool stop;            /**< Sender thread should exit.     */
+	pthread_mutex_t lock; /**< Guards the fields above.       */
+	pthread_cond_t cond;  /**< Signals filled slots.          */
+	pthread_t thread;     /**< Sender thread.                 */
+};
+
+/**
+ * @brief A relayed webcam stream.
+ */
+struct stream
+{
+	struct stream *next;       /**< Next stream.                 */
+	char name[PRINTER_STRLEN]; /**< Printer name.                */
+	struct viewer **viewers;   /**< Subscribed viewers.          */
+	size_t count;              /**< Amount of subscribers.       */
+	size_t capacity;           /**< Allocated subscribers.       */
+	int upstream;              /**< Printer socket, -1 if none.  */
+	pthread_mutex_t lock;      /**< Guards the fields above.     */
+};
+
+/**
+ * @brief Relay state.
+ */
+static struct
+{
+	struct stream *head;    /**< Relayed streams.        */
+	struct viewer *viewers; /**< Viewers.                */
+	size_t threads;         /**< Running puller threads. */
+	bool stop;              /**< Threads should exit.    */
+} rl;
+
+/**
+ * @brief Guards the stream and viewer lists and @ref rl. Taken
+ * before any stream lock, itself taken before any viewer lock.
+ */
+static pthread_mutex_t relay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signals @ref relay_close, and wakes up threads waiting
+ * to reconnect.
+ */
+static pthread_cond_t relay_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Finds the slot of the webcam @p name in @p v.
+ *
+ * @param v    Viewer, locked.
+ * @param name Printer name.
+ *
+ * @return Returns the slot, or NULL if @p v does not watch @p name.
+ */
+static struct slot *find_slot(struct viewer *v, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < v->count; i++)
+		if (!strcmp(v->slots[i].name, name))
+			return (&v->slots[i]);
+	return (NULL);
+}
+
+/**
+ * @brief Hands @p frame to the slot of the webcam @p name in @p v,
+ * replacing the unsent frame, if any.
+ *
+ * @param v     Viewer.
+ * @param name  Printer name.
+ * @param frame Frame, a new reference is taken.
+ */
+static void offer(struct viewer *v, const char *name, struct refbuf *frame)
+{
+	struct slot *slot;
+
+	pthread_mutex_lock(&v->lock);
+	slot = find_slot(v, name);
+	if (slot)
+	{
+		if (slot->frame)
+		{
+			refbuf_put(slot->frame);
+			slot->dropped++;
+		}
+		slot->frame = refbuf_get(frame);
+		pthread_cond_signal(&v->cond);
+	}
+	pthread_mutex_unlock(&v->lock);
+}
+
+/**
+ * @brief Sender thread: sends the frames of the filled slots of
+ * a viewer, visiting the slots in turn.
+ *
+ * @param arg Viewer.
+ *
+ * @return Always NULL.
+ */
+static void *deliver(void *arg)
+{
+	struct refbuf *frame;
+	struct viewer *v;
+	size_t slot;
+	size_t i;
+	bool ok;
+
+	v = arg;
+	pthread_mutex_lock(&v->lock);
+	while (!v->stop)
+	{
+		frame = NULL;
+		for (i = 0; i < v->count && !frame; i++)
+		{
+			slot  = (v->cursor + i) % v->count;
+			frame = v->slots[slot].frame;
+		}
+		if (!frame)
+		{
+			pthread_cond_wait(&v->cond, &v->lock);
+			continue;
+		}
+
+		v->slots[slot].frame = NULL;
+		v->cursor            = slot + 1;
+		pthread_mutex_unlock(&v->lock);
+
+		ok = ws_sendframe_raw(v->fd, frame->data, frame->size) >= 0;
+		refbuf_put(frame);
+
+		/* Slots are only ever appended, @p slot is still valid. */
+		pthread_mutex_lock(&v->lock);
+		if (ok)
+			v->slots[slot].sent++;
+	}
+	pthread_mutex_unlock(&v->lock);
+	return (NULL);
+}
+
+/**
+ * @brief Stops the sender thread of @p v and releases it.
+ *
+ * @param v Viewer, no longer reachable from any stream.
+ */
+static void free_viewer(struct viewer *v)
+{
+	size_t i;
+
+	pthread_mutex_lock(&v->lock);
+	v->stop = true;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	pthread_join(v->thread, NULL);
+
+	for (i = 0; i < v->count; i++)
+		refbuf_put(v->slots[i].frame);
+	pthread_cond_destroy(&v->cond);
+	pthread_mutex_destroy(&v->lock);
+	free(v->slots);
+	free(v);
+}
+
+/**
+ * @brief Finds the viewer of the client @p fd, or creates it.
+ *
+ * @param fd Client fd.
+ *
+ * @return Returns the viewer, or NULL if out of resources.
+ *
+ * @note Must be called with @ref relay_mutex held.
+ */
+static struct viewer *get_viewer(int fd)
+{
+	struct viewer *v;
+
+	for (v = rl.viewers; v; v = v->next)
+		if (v->fd == fd)
+			return (v);
+
+	v = calloc(1, sizeof(*v));
+	if (!v)
+		return (NULL);
+	v->fd = fd;
+	if (pthread_mutex_init(&v->lock, NULL))
+		goto out0;
+	if (pthread_cond_init(&v->cond, NULL))
+		goto out1;
+	if (pthread_create(&v->thread, NULL, deliver, v))
+		goto out2;
+
+	v->next    = rl.viewers;
+	rl.viewers = v;
+	return (v);
+out2:
+	pthread_cond_destroy(&v->cond);
+out1:
+	pthread_mutex_destroy(&v->lock);
+out0:
+	free(v);
+	return (NULL);
+}
+
+/**
+ * @brief Adds a slot for the webcam @p name to @p v, if not
+ * there yet.
+ *
+ * @param v    Viewer.
+ * @param name Printer name.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int add_slot(struct viewer *v, const char *name)
+{
+	struct slot *slots;
+	size_t capacity;
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&v->lock);
+	if (find_slot(v, name))
+		goto out;
+
+	if (v->count == v->capacity)
+	{
+		capacity = v->capacity ? v->capacity * 2 : 4;
+		slots    = realloc(v->slots, capacity * sizeof(*slots));
+		if (!slots)
+		{
+			ret = -1;
+			goto out;
+		}
+		v->slots    = slots;
+		v->capacity = capacity;
+	}
+	memset(&v->slots[v->count], 0, sizeof(*slots));
+	strcpy(v->slots[v->count++].name, name);
+out:
+	pthread_mutex_unlock(&v->lock);
+	return (ret);
+}
+
+/**
+ * @brief Hands the image @p jpeg, of @p len bytes, to every
+ * subscriber of @p s.
+ *
+ * @param s    Stream.
+ * @param jpeg Image.
+ * @param len  Image size.
+ */
+static void publish(struct stream *s, const unsigned char *jpeg, size_t len)
+{
+	struct refbuf *frame;
+	unsigned char *p;
+	size_t payload;
+	size_t nlen;
+	size_t i;
+	int hlen;
+
+	nlen    = strlen(s->name);
+	payload = 2 + nlen + len;
+	frame   = refbuf_new(WS_FRAME_HDR_MAX + payload);
+	if (!frame)
+		return;
+
+	hlen = ws_frame_header(frame->data, payload, WS_FR_OP_BIN);
+	p    = frame->data + hlen;
+	*p++ = BINPROTO_FRAME;
+	p   += binproto_name(s->name, p);
+	memcpy(p, jpeg, len);
+	frame->size = hlen + payload;
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < s->count; i++)
+		offer(s->viewers[i], s->name, frame);
+	pthread_mutex_unlock(&s->lock);
+
+	refbuf_put(frame);
+}
+
+/**
+ * @brief Relays the images read from @p fd until the stream
+ * fails, or has no subscribers left.
+ *
+ * @param s  Stream.
+ * @param fd Printer socket, positioned at the response body.
+ */
+static void pump(struct stream *s, int fd)
+{
+	unsigned char *buf;
+	unsigned char *ff;
+	unsigned char *tmp;
+	size_t start;
+	size_t scan;
+	size_t cap;
+	size_t len;
+	ssize_t n;
+	bool in_image;
+	bool idle;
+
+	cap = 4 * RELAY_CHUNK;
+	buf = malloc(cap);
+	if (!buf)
+		return;
+
+	len      = 0;
+	scan     = 0;
+	in_image = false;
+	for (;;)
+	{
+		if (cap - len < RELAY_CHUNK)
+		{
+			/* Oversized image: drop it and wait for the next one. */
+			if (cap >= RELAY_FRAME_MAX)
+			{
+				len      = 0;
+				scan     = 0;
+				in_image = false;
+			}
+			else
+			{
+				tmp = realloc(buf, cap * 2);
+				if (!tmp)
+					break;
+				buf  = tmp;
+				cap *= 2;
+			}
+		}
+
+		n = read(fd, buf + len, cap - len);
+		if (n <= 0)
+			break;
+		len += (size_t)n;
+
+		/*
+		 * Markers are 0xFF followed by a code; an 0xFF in the
+		 * entropy coded data is always followed by 0x00.
+		 */
+		start = 0;
+		while (scan + 1 < len &&
+			(ff = memchr(buf + scan, 0xFF, len - scan - 1)) != NULL)
+		{
+			scan = (size_t)(ff - buf);
+			if (!in_image && ff[1] == 0xD8)
+			{
+				start    = scan;
+				in_image = true;
+			}
+			else if (in_image && ff[1] == 0xD9)
+			{
+				publish(s, buf + start, scan + 2 - start);
+				start    = scan + 2;
+				in_image = false;
+			}
+			scan++;
+		}
+		if (scan + 1 < len)
+			scan = len - 1;
+
+		/* Keep only the current image, or the last byte. */
+		if (!in_image)
+			start = scan;
+		memmove(buf, buf + start, len - start);
+		len  -= start;
+		scan -= start;
+
+		pthread_mutex_lock(&s->lock);
+		idle = s->count == 0;
+		pthread_mutex_unlock(&s->lock);
+		if (idle)
+			break;
+	}
+	free(buf);
+}
+
+/**
+ * @brief Checks whether the puller of @p s should keep running;
+ * if not, @p s is unlinked from the stream list.
+ *
+ * @param s Stream.
+ *
+ * @return Returns true if the thread should keep running.
+ */
+static bool keep_running(struct stream *s)
+{
+	struct stream **pp;
+	bool run;
+
+	pthread_mutex_lock(&relay_mutex);
+	pthread_mutex_lock(&s->lock);
+	run = !rl.stop && s->count > 0;
+	pthread_mutex_unlock(&s->lock);
+
+	if (!run)
+	{
+		for (pp = &rl.head; *pp != s; pp = &(*pp)->next)
+			;
+		*pp = s->next;
+	}
+	pthread_mutex_unlock(&relay_mutex);
+	return (run);
+}
+
+/**
+ * @brief Waits @ref RELAY_RETRY_MS, or less if the relay is
+ * being closed.
+ */
+static void wait_retry(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += RELAY_RETRY_MS / 1000;
+	ts.tv_nsec += (RELAY_RETRY_MS % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&relay_mutex);
+	if (!rl.stop)
+		pthread_cond_timedwait(&relay_cond, &relay_mutex, &ts);
+	pthread_mutex_unlock(&relay_mutex);
+}
+
+/**
+ * @brief Puller thread: relays the webcam of a printer while it
+ * has subscribers. The printer address is looked up on every
+ * (re)connection, so address changes are picked up.
+ *
+ * @param arg Stream.
+ *
+ * @return Always NULL.
+ */
+static void *puller(void *arg)
+{
+	struct stream *s;
+	struct PRINTER p;
+	int fd;
+
+	s = arg;
+	while (keep_running(s))
+	{
+		/* Printer removed: so is its webcam. */
+		if (!registry_find(s->name, &p))
+		{
+			pthread_mutex_lock(&s->lock);
+			s->count = 0;
+			pthread_mutex_unlock(&s->lock);
+			continue;
+		}
+
+		fd = http_get(p.ip, RELAY_PATH, RELAY_TIMEOUT_MS);
+
+		if (fd >= 0)
+		{
+			pthread_mutex_lock(&s->lock);
+			s->upstream = fd;
+			pthread_mutex_unlock(&s->lock);
+
+			pump(s, fd);
+
+			pthread_mutex_lock(&s->lock);
+			s->upstream = -1;
+			pthread_mutex_unlock(&s->lock);
+			close(fd);
+		}
+
+		if (keep_running(s))
+			wait_retry();
+		else
+			break;
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	free(s->viewers);
+	free(s);
+
+	pthread_mutex_lock(&relay_mutex);
+	rl.threads--;
+	pthread_cond_broadcast(&relay_cond);
+	pthread_mutex_unlock(&relay_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Adds @p v to the subscribers of @p s, if not there yet.
+ *
+ * @param s Stream.
+ * @param v Viewer.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int add_viewer(struct stream *s, struct viewer *v)
+{
+	struct viewer **viewers;
+	size_t capacity;
+	size_t i;
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < s->count && s->viewers[i] != v; i++)
+		;
+	if (i < s->count)
+		goto out;
+
+	if (s->count == s->capacity)
+	{
+		capacity = s->capacity ? s->capacity * 2 : 4;
+		viewers  = realloc(s->viewers, capacity * sizeof(*viewers));
+		if (!viewers)
+		{
+			ret = -1;
+			goto out;
+		}
+		s->viewers  = viewers;
+		s->capacity = capacity;
+	}
+	s->viewers[s->count++] = v;
+out:
+	pthread_mutex_unlock(&s->lock);
+	return (ret);
+}
+
+/**
+ * @brief Subscribes the client @p fd to the webcam of the printer
+ * @p name, starting its relay if needed.
+ *
+ * @param fd   Client fd.
+ * @param name Printer name.
+ *
+ * @return Returns 0 if success, @ref REG_NOTFOUND if there is no
+ * such printer, or @ref REG_ERROR otherwise.
+ */
+int relay_subscribe(int fd, const char *name)
+{
+	struct PRINTER p;
+	pthread_t thread;
+	struct viewer *v;
+	struct stream *s;
+	int ret;
+
+	if (!registry_find(name, &p))
+		return (REG_NOTFOUND);
+
+	ret = REG_ERROR;
+	pthread_mutex_lock(&relay_mutex);
+	if (rl.stop)
+		goto out;
+
+	v = get_viewer(fd);
+	if (!v || add_slot(v, p.name) < 0)
+		goto out;
+
+	for (s = rl.head; s; s = s->next)
+		if (!strcmp(s->name, p.name))
+			break;
+
+	if (!s)
+	{
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			goto out;
+		strcpy(s->name, p.name);
+		s->upstream = -1;
+		if (pthread_mutex_init(&s->lock, NULL) || add_viewer(s, v) < 0)
+		{
+			free(s);
+			goto out;
+		}
+		if (pthread_create(&thread, NULL, puller, s))
+		{
+			pthread_mutex_destroy(&s->lock);
+			free(s->viewers);
+			free(s);
+			goto out;
+		}
+		pthread_detach(thread);
+		s->next = rl.head;
+		rl.head = s;
+		rl.threads++;
+		ret = 0;
+	}
+	else if (add_viewer(s, v) == 0)
+		ret = 0;
+out:
+	pthread_mutex_unlock(&relay_mutex);
+	return (ret);
+}
+
+/**
+ * @brief Unlinks the viewer @p v from every stream.
+ *
+ * @param v Viewer.
+ *
+ * @note Must be called with @ref relay_mutex held.
+ */
+static void unlink_viewer(struct viewer *v)
+{
+	struct stream *s;
+	size_t i;
+
+	for (s = rl.head; s; s = s->next)
+	{
+		pthread_mutex_lock(&s->lock);
+		for (i = 0; i < s->count; i++)
+		{
+			if (s->viewers[i] == v)
+			{
+				s->viewers[i] = s->viewers[--s->count];
+				break;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/**
+ * @brief Unsubscribes the client @p fd from every webcam. Puller
+ * threads left without subscribers end on their own.
+ *
+ * @param fd Client fd.
+ */
+void relay_unsubscribe(int fd)
+{
+	struct viewer **pp;
+	struct viewer *v;
+
+	pthread_mutex_lock(&relay_mutex);
+	for (pp = &rl.viewers; *pp && (*pp)->fd != fd; pp = &(*pp)->next)
+		;
+	v = *pp;
+	if (v)
+	{
+		*pp = v->next;
+		unlink_viewer(v);
+	}
+	pthread_mutex_unlock(&relay_mutex);
+
+	/* Not reachable anymore, its last send (if any) ends here. */
+	if (v)
+		free_viewer(v);
+}
+
+/**
+ * @brief Reports the delivery counters of every webcam watched
+ * by the client @p fd.
+ *
+ * @param fd   Client fd.
+ * @param cb   Called for each webcam, with the printer name and
+ *             the amount of frames sent and dropped; may be NULL
+ *             to only count them.
+ * @param data Passed to @p cb.
+ *
+ * @return Returns the amount of watched webcams.
+ */
+size_t relay_stats(int fd, void (*cb)(const char *name, uint64_t sent,
+	uint64_t dropped, void *data), void *data)
+{
+	struct viewer *v;
+	size_t count;
+	size_t i;
+
+	count = 0;
+	pthread_mutex_lock(&relay_mutex);
+	for (v = rl.viewers; v && v->fd != fd; v = v->next)
+		;
+	if (v)
+	{
+		pthread_mutex_lock(&v->lock);
+		count = v->count;
+		for (i = 0; cb && i < count; i++)
+			cb(v->slots[i].name, v->slots[i].sent, v->slots[i].dropped, data);
+		pthread_mutex_unlock(&v->lock);
+	}
+	pthread_mutex_unlock(&relay_mutex);
+	return (count);
+}
+
+/**
+ * @brief Stops every relay and waits for the puller and sender
+ * threads.
+ */
+void relay_close(void)
+{
+	struct viewer *next;
+	struct viewer *v;
+	struct stream *s;
+
+	pthread_mutex_lock(&relay_mutex);
+	rl.stop = true;
+	for (s = rl.head; s; s = s->next)
+	{
+		pthread_mutex_lock(&s->lock);
+		if (s->upstream >= 0)
+			shutdown(s->upstream, SHUT_RDWR);
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_cond_broadcast(&relay_cond);
+	while (rl.threads > 0)
+		pthread_cond_wait(&relay_cond, &relay_mutex);
+
+	v          = rl.viewers;
+	rl.viewers = NULL;
+	pthread_mutex_unlock(&relay_mutex);
+
+	for (; v; v = next)
+	{
+		next = v->next;
+		free_viewer(v);
+	}
+}
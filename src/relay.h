@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file relay.h
+ * @brief Printer webcam relay (`cam#`).
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	extern int relay_subscribe(int fd, const char *name);
+	extern void relay_unsubscribe(int fd);
+	extern size_t relay_stats(int fd, void (*cb)(const char *name,
+		uint64_t sent, uint64_t dropped, void *data), void *data);
+	extern void relay_close(void);
+
+#endif /* RELAY_H */
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "registry.h"
+#include "reload.h"
+#include "store.h"
+
+/**
+ * @file reload.c
+ * @brief Hot reload of a hand-edited database.
+ *
+ * The directory holding the database is watched with inotify (the
+ * file itself would not do: editors, and the store compactor, replace
+ * it by renaming a new file over it). Once the database has been
+ * written and closed, or renamed into place, and then left alone for
+ * @ref RELOAD_SETTLE_MS, the store re-reads it and the registry
+ * applies what changed as a single batch, which subscribed clients
+ * receive as usual, one change at a time. Rewrites by the compactor
+ * are recognized by the store and cost a single fstat().
+ */
+
+/**
+ * @brief Quiet time (ms) before a changed database is re-read, so
+ * that a burst of writes is read once.
+ */
+#define RELOAD_SETTLE_MS 200
+
+/**
+ * @brief Reloader state.
+ */
+static struct
+{
+	int ifd;          /**< inotify instance.                    */
+	int evfd;         /**< Wakes the reloader up to stop.       */
+	char *name;       /**< Database file name, in its directory. */
+	bool running;     /**< Reloader thread was started.         */
+	pthread_t thread; /**< Reloader thread.                     */
+} rl = {-1, -1, NULL, false, 0};
+
+/**
+ * @brief Reads the pending inotify events.
+ *
+ * @return Returns whether one of them is about the database, or
+ * may have been (the event queue overflowed).
+ */
+static bool read_events(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool hit;
+	ssize_t n;
+	char *p;
+
+	hit = false;
+	while ((n = read(rl.ifd, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len)
+		{
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW)
+				hit = true;
+			else if (ev->len && !strcmp(ev->name, rl.name))
+				hit = true;
+		}
+	}
+	return (hit);
+}
+
+/**
+ * @brief Reloader thread.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *reloader(void *arg)
+{
+	struct pollfd fds[2];
+	bool pending;
+	long n;
+
+	(void)arg;
+	fds[0].fd     = rl.ifd;
+	fds[0].events = POLLIN;
+	fds[1].fd     = rl.evfd;
+	fds[1].events = POLLIN;
+
+	pending = false;
+	for (;;)
+	{
+		if (poll(fds, 2, pending ? RELOAD_SETTLE_MS : -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (fds[0].revents)
+		{
+			pending |= read_events();
+			continue;
+		}
+		if (!pending)
+			continue;
+
+		/* Settled. */
+		pending = false;
+		n = store_reload(registry_apply_batch);
+		if (n < 0)
+			fprintf(stderr, "Could not reload the printers database\n");
+		else if (n > 0)
+			printf("Reloaded the printers database: %ld changes\n", n);
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Starts watching the database @p db_path for changes.
+ *
+ * @param db_path Database path.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int reload_start(const char *db_path)
+{
+	const char *slash;
+	char *dir;
+	int ret;
+
+	rl.ifd  = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	rl.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rl.ifd < 0 || rl.evfd < 0)
+		return (-1);
+
+	slash = strrchr(db_path, '/');
+	rl.name = strdup(slash ? slash + 1 : db_path);
+	dir     = strdup(db_path);
+	if (!rl.name || !dir)
+	{
+		free(dir);
+		return (-1);
+	}
+	if (!slash)
+		strcpy(dir, ".");
+	else
+		dir[slash == db_path ? 1 : slash - db_path] = '\0';
+
+	ret = inotify_add_watch(rl.ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	free(dir);
+	if (ret < 0)
+		return (-1);
+
+	if (pthread_create(&rl.thread, NULL, reloader, NULL))
+		return (-1);
+	rl.running = true;
+	return (0);
+}
+
+/**
+ * @brief Stops watching the database.
+ */
+void reload_stop(void)
+{
+	uint64_t one;
+
+	if (rl.running)
+	{
+		one = 1;
+		if (write(rl.evfd, &one, sizeof(one)) == sizeof(one))
+			pthread_join(rl.thread, NULL);
+		rl.running = false;
+	}
+	if (rl.ifd >= 0)
+		close(rl.ifd);
+	if (rl.evfd >= 0)
+		close(rl.evfd);
+	free(rl.name);
+	rl.ifd  = -1;
+	rl.evfd = -1;
+	rl.name = NULL;
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ws.h>
+
+#include "binproto.h"
+#include "crc32.h"
+#include "http.h"
+#include "registry.h"
+#include "snap.h"
+
+/**
+ * @file snap.c
+ * @brief Printer webcam snapshot cache.
+ *
+ * Overview pages only need a still image of every printer, every
+ * few seconds. Rather than having each viewer fetch them from the
+ * printers, the server grabs one snapshot per printer and interval
+ * (`/webcam/?action=snapshot`) and keeps the latest one, encoded as
+ * a complete WebSocket frame, `[BINPROTO_SNAPSHOT][name_len][name]
+ * [jpeg]`, shared by every client asking for it.
+ *
+ * Images are fetched by a few worker threads, in rounds driven by
+ * a scheduler thread. An image whose content (CRC-32 and size) did
+ * not change since the last round is not stored again. Printers in
+ * the NOK state are skipped and keep their last snapshot, and so
+ * are, for a growing amount of rounds, printers that failed to
+ * answer: a dead printer costs a worker a whole timeout.
+ */
+
+/**
+ * @name Snapshot configuration
+ */
+/**@{*/
+/**
+ * @brief Snapshot path, on the printer web interface.
+ */
+#define SNAP_PATH "/webcam/?action=snapshot"
+/**
+ * @brief Connect and read timeout (ms).
+ */
+#define SNAP_TIMEOUT_MS 2000
+/**
+ * @brief Largest accepted image; bigger ones are dropped.
+ */
+#define SNAP_MAX (2 << 20)
+/**
+ * @brief Amount of fetching threads.
+ */
+#define SNAP_WORKERS 8
+/**
+ * @brief Most rounds skipped after failed fetches.
+ */
+#define SNAP_MAX_BACKOFF 32
+/**@}*/
+
+/**
+ * @brief Cached snapshot of a printer.
+ */
+struct snapshot
+{
+	char name[PRINTER_STRLEN]; /**< Printer name.                      */
+	char ip[PRINTER_STRLEN];   /**< Printer address, for this round.   */
+	bool skip;                 /**< Not fetched this round.            */
+	struct refbuf *frame;      /**< Latest image frame, NULL if none.  */
+	uint32_t hash;             /**< CRC-32 of the image.               */
+	size_t len;                /**< Image size.                        */
+	unsigned backoff;          /**< Rounds to skip after a failure.    */
+	unsigned wait;             /**< Rounds left to skip.               */
+};
+
+/**
+ * @brief Snapshot cache state.
+ */
+static struct
+{
+	struct snapshot *snaps;  /**< Snapshots, sorted by name.   */
+	size_t count;            /**< Amount of snapshots.         */
+	size_t next;             /**< Next snapshot to fetch.      */
+	size_t done;             /**< Snapshots fetched this round. */
+	unsigned interval;       /**< Seconds between rounds.      */
+	bool stop;               /**< Threads should exit.         */
+	bool running;            /**< Threads were started.        */
+	pthread_t thread;        /**< Scheduler thread.            */
+	pthread_t workers[SNAP_WORKERS]; /**< Fetching threads.    */
+} sc;
+
+/**
+ * @brief Guards @ref sc.
+ */
+static pthread_mutex_t snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signals the workers a new round (or exit).
+ */
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Signals the scheduler the end of a round (or exit).
+ */
+static pthread_cond_t round_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Compares two printers by name, for qsort().
+ */
+static int cmp_printer(const void *a, const void *b)
+{
+	return (strncmp(((const struct PRINTER *)a)->name,
+		((const struct PRINTER *)b)->name, PRINTER_STRLEN));
+}
+
+/**
+ * @brief Compares a name with a snapshot, for bsearch().
+ */
+static int cmp_snapshot(const void *name, const void *snap)
+{
+	return (strncmp(name, ((const struct snapshot *)snap)->name,
+		PRINTER_STRLEN));
+}
+
+/**
+ * @brief Fetches a snapshot from the printer at @p ip.
+ *
+ * @param ip  Printer address.
+ * @param len Receives the image size.
+ *
+ * @return Returns the image, to be freed by the caller, or NULL
+ * if it could not be fetched or is not a JPEG image.
+ */
+static unsigned char *fetch(const char *ip, size_t *len)
+{
+	unsigned char *buf;
+	unsigned char *tmp;
+	size_t cap;
+	ssize_t n;
+	int fd;
+
+	fd = http_get(ip, SNAP_PATH, SNAP_TIMEOUT_MS);
+	if (fd < 0)
+		return (NULL);
+
+	cap  = 64 << 10;
+	*len = 0;
+	buf  = malloc(cap);
+	while (buf)
+	{
+		if (*len == cap)
+		{
+			tmp = cap < SNAP_MAX ? realloc(buf, cap * 2) : NULL;
+			if (!tmp)
+			{
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf  = tmp;
+			cap *= 2;
+		}
+
+		n = read(fd, buf + *len, cap - *len);
+		if (n <= 0)
+			break;
+		*len += (size_t)n;
+	}
+	close(fd);
+
+	/* HTTP/1.0: the body ends with the connection, and must be a JPEG. */
+	if (buf && (n < 0 || *len < 4 || buf[0] != 0xFF || buf[1] != 0xD8))
+	{
+		free(buf);
+		buf = NULL;
+	}
+	return (buf);
+}
+
+/**
+ * @brief Encodes the image @p jpeg of the printer @p name as a
+ * snapshot frame.
+ *
+ * @param name Printer name.
+ * @param jpeg Image.
+ * @param len  Image size.
+ *
+ * @return Returns the frame, or NULL if out of memory.
+ */
+static struct refbuf *new_frame(const char *name, const unsigned char *jpeg,
+	size_t len)
+{
+	struct refbuf *frame;
+	unsigned char *p;
+	size_t payload;
+	int hlen;
+
+	payload = 2 + strlen(name) + len;
+	frame   = refbuf_new(WS_FRAME_HDR_MAX + payload);
+	if (!frame)
+		return (NULL);
+
+	hlen = ws_frame_header(frame->data, payload, WS_FR_OP_BIN);
+	p    = frame->data + hlen;
+	*p++ = BINPROTO_SNAPSHOT;
+	p   += binproto_name(name, p);
+	memcpy(p, jpeg, len);
+	frame->size = hlen + payload;
+	return (frame);
+}
+
+/**
+ * @brief Fetches the snapshot @p i of the current round and stores
+ * it, unless it did not change.
+ *
+ * @param i Snapshot index.
+ *
+ * @note Called with @ref snap_mutex held, which is released while
+ * fetching. The snapshot array is only replaced between rounds, so
+ * @p i stays valid.
+ */
+static void update(size_t i)
+{
+	char name[PRINTER_STRLEN];
+	char ip[PRINTER_STRLEN];
+	struct refbuf *frame;
+	unsigned char *jpeg;
+	uint32_t hash;
+	bool fetched;
+	size_t len;
+	bool same;
+
+	if (sc.snaps[i].skip)
+		return;
+	memcpy(name, sc.snaps[i].name, sizeof(name));
+	memcpy(ip, sc.snaps[i].ip, sizeof(ip));
+	pthread_mutex_unlock(&snap_mutex);
+
+	frame   = NULL;
+	jpeg    = fetch(ip, &len);
+	fetched = jpeg != NULL;
+	if (fetched)
+	{
+		hash = crc32(0, jpeg, len);
+		pthread_mutex_lock(&snap_mutex);
+		same = sc.snaps[i].frame && sc.snaps[i].hash == hash &&
+			sc.snaps[i].len == len;
+		pthread_mutex_unlock(&snap_mutex);
+
+		if (!same)
+			frame = new_frame(name, jpeg, len);
+		free(jpeg);
+	}
+
+	pthread_mutex_lock(&snap_mutex);
+	if (frame)
+	{
+		refbuf_put(sc.snaps[i].frame);
+		sc.snaps[i].frame = frame;
+		sc.snaps[i].hash  = hash;
+		sc.snaps[i].len   = len;
+	}
+
+	if (fetched)
+		sc.snaps[i].backoff = 0;
+	else
+	{
+		sc.snaps[i].backoff = sc.snaps[i].backoff ?
+			sc.snaps[i].backoff * 2 : 1;
+		if (sc.snaps[i].backoff > SNAP_MAX_BACKOFF)
+			sc.snaps[i].backoff = SNAP_MAX_BACKOFF;
+		sc.snaps[i].wait = sc.snaps[i].backoff;
+	}
+}
+
+/**
+ * @brief Worker thread: fetches the snapshots of every round.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&snap_mutex);
+	while (!sc.stop)
+	{
+		if (sc.next >= sc.count)
+		{
+			pthread_cond_wait(&work_cond, &snap_mutex);
+			continue;
+		}
+
+		update(sc.next++);
+		if (++sc.done == sc.count)
+			pthread_cond_signal(&round_cond);
+	}
+	pthread_mutex_unlock(&snap_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Starts a new round: re-syncs the snapshots with the
+ * registry, keeping the images of the remaining printers, and
+ * wakes up the workers.
+ *
+ * @note Called with @ref snap_mutex held, between rounds.
+ */
+static void new_round(void)
+{
+	struct PRINTER *printers;
+	struct snapshot *snaps;
+	struct snapshot *old;
+	size_t count;
+	size_t i;
+	size_t j;
+	int cmp;
+
+	pthread_mutex_unlock(&snap_mutex);
+	printers = registry_snapshot(&count, NULL);
+	if (printers)
+		qsort(printers, count, sizeof(*printers), cmp_printer);
+	snaps = printers ? calloc(count ? count : 1, sizeof(*snaps)) : NULL;
+	pthread_mutex_lock(&snap_mutex);
+
+	if (!snaps)
+	{
+		free(printers);
+		return;
+	}
+
+	/* Both lists are sorted by name: merge them. */
+	old = sc.snaps;
+	for (i = 0, j = 0; i < count; i++)
+	{
+		memcpy(snaps[i].name, printers[i].name, PRINTER_STRLEN);
+		memcpy(snaps[i].ip, printers[i].ip, PRINTER_STRLEN);
+
+		while (j < sc.count &&
+			(cmp = strncmp(old[j].name, snaps[i].name, PRINTER_STRLEN)) < 0)
+			refbuf_put(old[j++].frame);
+
+		if (j < sc.count && cmp == 0)
+		{
+			snaps[i].frame   = old[j].frame;
+			snaps[i].hash    = old[j].hash;
+			snaps[i].len     = old[j].len;
+			snaps[i].backoff = old[j].backoff;
+			snaps[i].wait    = old[j].wait;
+			j++;
+		}
+
+		snaps[i].skip = printers[i].state == NOK || snaps[i].wait > 0;
+		if (snaps[i].wait > 0)
+			snaps[i].wait--;
+	}
+	while (j < sc.count)
+		refbuf_put(old[j++].frame);
+
+	free(old);
+	free(printers);
+	sc.snaps = snaps;
+	sc.count = count;
+	sc.next  = 0;
+	sc.done  = 0;
+	pthread_cond_broadcast(&work_cond);
+}
+
+/**
+ * @brief Scheduler thread: starts a round every @ref sc.interval
+ * seconds, once the previous one is over.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *scheduler(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	pthread_mutex_lock(&snap_mutex);
+	while (!sc.stop)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += sc.interval;
+
+		new_round();
+		while (!sc.stop && sc.done < sc.count)
+			pthread_cond_wait(&round_cond, &snap_mutex);
+		while (!sc.stop &&
+			pthread_cond_timedwait(&round_cond, &snap_mutex, &ts) == 0)
+			;
+	}
+	pthread_mutex_unlock(&snap_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Starts taking a snapshot of every printer every
+ * @p interval seconds.
+ *
+ * @param interval Seconds between snapshots, at least 1.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int snap_start(unsigned interval)
+{
+	int i;
+
+	if (interval == 0)
+		return (-1);
+
+	sc.interval = interval;
+	for (i = 0; i < SNAP_WORKERS; i++)
+		if (pthread_create(&sc.workers[i], NULL, worker, NULL))
+			return (-1);
+	if (pthread_create(&sc.thread, NULL, scheduler, NULL))
+		return (-1);
+	sc.running = true;
+	return (0);
+}
+
+/**
+ * @brief Gets the latest snapshot of the printer @p name.
+ *
+ * @param name Printer name.
+ *
+ * @return Returns a reference to the snapshot frame, to be
+ * released with @ref refbuf_put, or NULL if there is none.
+ */
+struct refbuf *snap_get(const char *name)
+{
+	struct snapshot *snap;
+	struct refbuf *frame;
+
+	frame = NULL;
+	pthread_mutex_lock(&snap_mutex);
+	snap = bsearch(name, sc.snaps, sc.count, sizeof(*snap), cmp_snapshot);
+	if (snap)
+		frame = refbuf_get(snap->frame);
+	pthread_mutex_unlock(&snap_mutex);
+	return (frame);
+}
+
+/**
+ * @brief Stops the snapshot threads and releases the snapshots.
+ */
+void snap_stop(void)
+{
+	size_t i;
+
+	if (!sc.running)
+		return;
+
+	pthread_mutex_lock(&snap_mutex);
+	sc.stop = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_cond_broadcast(&round_cond);
+	pthread_mutex_unlock(&snap_mutex);
+
+	pthread_join(sc.thread, NULL);
+	for (i = 0; i < SNAP_WORKERS; i++)
+		pthread_join(sc.workers[i], NULL);
+
+	for (i = 0; i < sc.count; i++)
+		refbuf_put(sc.snaps[i].frame);
+	free(sc.snaps);
+	sc.snaps   = NULL;
+	sc.count   = 0;
+	sc.running = false;
+}
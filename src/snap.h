@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file snap.h
+ * @brief Printer webcam snapshot cache (`snap#`).
+ */
+#ifndef SNAP_H
+#define SNAP_H
+
+	#include "refbuf.h"
+
+	extern int snap_start(unsigned interval);
+	extern struct refbuf *snap_get(const char *name);
+	extern void snap_stop(void);
+
+#endif /* SNAP_H */
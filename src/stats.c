@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/**
+ * @file stats.c
+ * @brief Latency and throughput statistics.
+ *
+ * Every thread records into its own shard, so recording is a couple
+ * of plain (relaxed atomic) increments: no lock, no shared cache
+ * line. Shards are merged when reported, which is the rare path.
+ *
+ * Latencies go into log-linear histograms: values below
+ * @ref STATS_SUB get a bucket each, larger ones a bucket per
+ * 1/@ref STATS_SUB of their power of two, so every bucket is within
+ * ~12% of the values it holds, from nanoseconds to minutes, in a
+ * few hundred buckets.
+ *
+ * As for the epoch reader records, shards are allocated the first
+ * time a thread records, and recycled once it exits, as connection
+ * threads come and go; counts of exited threads are kept.
+ */
+
+/**
+ * @name Histogram layout
+ */
+/**@{*/
+/**
+ * @brief Bits of sub-bucket per power of two.
+ */
+#define STATS_SUB_BITS 3
+/**
+ * @brief Sub-buckets per power of two.
+ */
+#define STATS_SUB (1 << STATS_SUB_BITS)
+/**
+ * @brief Largest power of two tracked, larger values are clamped
+ * (2^40 ns, about 18 minutes).
+ */
+#define STATS_MAX_EXP 39
+/**
+ * @brief Amount of buckets.
+ */
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB)
+/**@}*/
+
+/**
+ * @brief Per-thread statistics.
+ */
+struct stats_shard
+{
+	struct stats_shard *next;                 /**< Next shard, list is
+	                                               append-only.        */
+	int in_use;                               /**< Owned by a live
+	                                               thread.             */
+	uint64_t counters[STAT_COUNTERS];         /**< Event counters.     */
+	uint64_t hist[STAT_METRICS][STATS_BUCKETS]; /**< Latencies.        */
+};
+
+/**
+ * @brief Every shard.
+ */
+static struct stats_shard *shards;
+
+/**
+ * @brief Startup time (ns).
+ */
+static uint64_t started;
+
+/**
+ * @brief Shard of the calling thread.
+ */
+static pthread_key_t stats_key;
+
+/**
+ * @brief Creates @ref stats_key once.
+ */
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Metric names, as reported.
+ */
+static const char *const metric_names[STAT_METRICS] = {
+	"get", "set", "add", "addmany", "sub", "cam", "camstat", "snap", "job",
+	"hist", "stats", "binary", "invalid", "send", "handshake", "store"
+};
+
+/**
+ * @brief Thread exit hook: gives the shard back.
+ *
+ * @param p Shard.
+ */
+static void shard_release(void *p)
+{
+	struct stats_shard *s;
+
+	s = p;
+	__atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates the thread-specific key.
+ */
+static void key_init(void)
+{
+	pthread_key_create(&stats_key, shard_release);
+}
+
+/**
+ * @brief Returns the shard of the calling thread, taking a free
+ * one, or allocating one, on first use.
+ *
+ * @return Returns the shard, or NULL if out of memory.
+ */
+static struct stats_shard *shard_self(void)
+{
+	struct stats_shard *s;
+	int expected;
+
+	pthread_once(&stats_once, key_init);
+	s = pthread_getspecific(stats_key);
+	if (s)
+		return (s);
+
+	/* Recycle the shard of a thread that is gone. */
+	for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next)
+	{
+		expected = 0;
+		if (__atomic_compare_exchange_n(&s->in_use, &expected, 1, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!s)
+	{
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			return (NULL);
+		s->in_use = 1;
+		s->next   = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&shards, &s->next, s, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_setspecific(stats_key, s);
+	return (s);
+}
+
+/**
+ * @brief Adds @p n to @p v. Only the owner thread writes a shard,
+ * a relaxed load and store is enough (and no locked instruction).
+ */
+static inline void add(uint64_t *v, uint64_t n)
+{
+	__atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n,
+		__ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the histogram bucket of @p ns.
+ */
+static unsigned bucket(uint64_t ns)
+{
+	unsigned e;
+
+	if (ns < STATS_SUB)
+		return ((unsigned)ns);
+
+	e = 63 - (unsigned)__builtin_clzll(ns);
+	if (e > STATS_MAX_EXP)
+		return (STATS_BUCKETS - 1);
+	return ((e - STATS_SUB_BITS + 1) * STATS_SUB +
+		(unsigned)((ns >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1)));
+}
+
+/**
+ * @brief Returns the middle of the values of bucket @p b.
+ */
+static uint64_t bucket_value(unsigned b)
+{
+	unsigned e;
+	uint64_t low;
+
+	if (b < STATS_SUB)
+		return (b);
+
+	e   = b / STATS_SUB + STATS_SUB_BITS - 1;
+	low = (uint64_t)(STATS_SUB + b % STATS_SUB) << (e - STATS_SUB_BITS);
+	return (low + ((1ULL << (e - STATS_SUB_BITS)) >> 1));
+}
+
+/**
+ * @brief Returns the monotonic time, in ns.
+ */
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/**
+ * @brief Starts the uptime clock.
+ */
+void stats_init(void)
+{
+	started = stats_now();
+}
+
+/**
+ * @brief Records that an operation of type @p metric took @p ns.
+ */
+void stats_record(enum stat_metric metric, uint64_t ns)
+{
+	struct stats_shard *s;
+
+	s = shard_self();
+	if (s)
+		add(&s->hist[metric][bucket(ns)], 1);
+}
+
+/**
+ * @brief Adds @p n to the counter @p counter.
+ */
+void stats_count(enum stat_counter counter, uint64_t n)
+{
+	struct stats_shard *s;
+
+	s = shard_self();
+	if (s)
+		add(&s->counters[counter], n);
+}
+
+/**
+ * @brief Returns the value below which @p q of the @p total
+ * values of histogram @p hist are.
+ */
+static uint64_t quantile(const uint64_t *hist, uint64_t total, double q)
+{
+	uint64_t rank;
+	uint64_t seen;
+	unsigned b;
+
+	rank = (uint64_t)(q * (double)(total - 1)) + 1;
+	seen = 0;
+	for (b = 0; b < STATS_BUCKETS; b++)
+	{
+		seen += hist[b];
+		if (seen >= rank)
+			return (bucket_value(b));
+	}
+	return (bucket_value(STATS_BUCKETS - 1));
+}
+
+/**
+ * @brief Formats the merged statistics as text.
+ *
+ * - `uptime&S`: seconds since startup,
+ * - `connections&OPEN&TOTAL`,
+ * - `frames&IN&OUT&BYTES_OUT`,
+ * - then `metric&COUNT&P50&P99&P999` per metric, latencies in ns.
+ *
+ * @param buf  Target buffer.
+ * @param size Buffer size, @ref STATS_TEXT_MAX is always enough.
+ *
+ * @return Returns the text length.
+ */
+size_t stats_format(char *buf, size_t size)
+{
+	static uint64_t hist[STAT_METRICS][STATS_BUCKETS];
+	static pthread_mutex_t format_mutex = PTHREAD_MUTEX_INITIALIZER;
+	uint64_t counters[STAT_COUNTERS];
+	struct stats_shard *s;
+	uint64_t total;
+	size_t len;
+	int m;
+	int i;
+	unsigned b;
+
+	/* Merged into static storage, too large for a stack. */
+	pthread_mutex_lock(&format_mutex);
+	memset(counters, 0, sizeof(counters));
+	memset(hist, 0, sizeof(hist));
+	for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next)
+	{
+		for (i = 0; i < STAT_COUNTERS; i++)
+			counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+		for (m = 0; m < STAT_METRICS; m++)
+			for (b = 0; b < STATS_BUCKETS; b++)
+				hist[m][b] += __atomic_load_n(&s->hist[m][b], __ATOMIC_RELAXED);
+	}
+
+	len = (size_t)snprintf(buf, size,
+		"uptime&%" PRIu64 "\n"
+		"connections&%" PRIu64 "&%" PRIu64 "\n"
+		"frames&%" PRIu64 "&%" PRIu64 "&%" PRIu64 "\n",
+		(uint64_t)((stats_now() - started) / 1000000000ULL),
+		counters[STAT_OPENED] - counters[STAT_CLOSED], counters[STAT_OPENED],
+		counters[STAT_FRAMES_IN], counters[STAT_FRAMES_OUT],
+		counters[STAT_BYTES_OUT]);
+
+	for (m = 0; m < STAT_METRICS && len < size; m++)
+	{
+		for (total = 0, b = 0; b < STATS_BUCKETS; b++)
+			total += hist[m][b];
+		if (!total)
+			continue;
+		len += (size_t)snprintf(buf + len, size - len,
+			"%s&%" PRIu64 "&%" PRIu64 "&%" PRIu64 "&%" PRIu64 "\n",
+			metric_names[m], total, quantile(hist[m], total, 0.5),
+			quantile(hist[m], total, 0.99), quantile(hist[m], total, 0.999));
+	}
+	pthread_mutex_unlock(&format_mutex);
+	return (len < size ? len : size - 1);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file stats.h
+ * @brief Latency and throughput statistics (`stats#`).
+ */
+#ifndef STATS_H
+#define STATS_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/**
+	 * @brief Timed operations.
+	 */
+	enum stat_metric
+	{
+		STAT_GET,       /**< get# (and get# queries).     */
+		STAT_SET,       /**< set#.                        */
+		STAT_ADD,       /**< add#.                        */
+		STAT_ADDMANY,   /**< addmany#.                    */
+		STAT_SUB,       /**< sub#.                        */
+		STAT_CAM,       /**< cam#.                        */
+		STAT_CAMSTAT,   /**< camstat#.                    */
+		STAT_SNAP,      /**< snap#.                       */
+		STAT_JOB,       /**< job#.                        */
+		STAT_HIST,      /**< hist#.                       */
+		STAT_STATS,     /**< stats#.                      */
+		STAT_BINARY,    /**< Binary protocol messages.    */
+		STAT_INVALID,   /**< Unknown commands.            */
+		STAT_SEND,      /**< Frame sends.                 */
+		STAT_HANDSHAKE, /**< WebSocket handshakes.        */
+		STAT_STORE,     /**< Synced log appends.          */
+		STAT_METRICS    /**< Amount of metrics.           */
+	};
+
+	/**
+	 * @brief Event counters.
+	 */
+	enum stat_counter
+	{
+		STAT_FRAMES_IN,  /**< Frames received.           */
+		STAT_FRAMES_OUT, /**< Frames sent.               */
+		STAT_BYTES_OUT,  /**< Bytes sent.                */
+		STAT_OPENED,     /**< Connections opened.        */
+		STAT_CLOSED,     /**< Connections closed.        */
+		STAT_COUNTERS    /**< Amount of counters.        */
+	};
+
+	/**
+	 * @brief Longest text produced by @ref stats_format.
+	 */
+	#define STATS_TEXT_MAX 4096
+
+	extern void stats_init(void);
+	extern uint64_t stats_now(void);
+	extern void stats_record(enum stat_metric metric, uint64_t ns);
+	extern void stats_count(enum stat_counter counter, uint64_t n);
+	extern size_t stats_format(char *buf, size_t size);
+
+#endif /* STATS_H */
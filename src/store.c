@@ -0,0 +1,1027 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binfmt.h"
+#include "registry.h"
+#include "stats.h"
+#include "store.h"
+#include "wal.h"
+
+/**
+ * @file store.c
+ * @brief printers.db persistence.
+ *
+ * The database is only read once, at startup, everything else
+ * is served by the in-memory registry. Mutations are then logged
+ * to a write-ahead log (`<database>.wal`), one synced append per
+ * mutation. A background thread periodically compacts the log:
+ * it rotates the log to `<database>.wal.old`, writes a fresh
+ * database from a consistent registry snapshot, atomically
+ * renames it over the old one and drops the rotated log.
+ *
+ * On startup, the database is loaded and then both logs (if
+ * present) are replayed on top of it. Every entry holds the whole
+ * printer, so replaying entries already reflected by the database
+ * is harmless.
+ *
+ * Two database formats are supported, picked by looking at the
+ * file itself: the original `name&ip&STATE` text lines, and the
+ * fixed-record binary format from binfmt.c, which can be
+ * produced from a text database with @ref store_convert.
+ * Compaction keeps whatever format the database already has.
+ * Text lines whose name or address do not fit a printer record are
+ * not loaded, but kept as they are: compactions write them back.
+ *
+ * The database may also be edited by hand while the server runs:
+ * @ref store_reload re-reads it and turns what changed since it
+ * was last read or written into a batch of registry operations.
+ * The contents of the file as last seen are kept (sorted by name)
+ * for that, along with its identity (inode, size and modification
+ * time), so the database rewrites done by the compactor itself are
+ * told apart from edits. The compactor merges pending edits the
+ * same way before taking its snapshot, and never renames over a
+ * database edited meanwhile.
+ */
+
+/**
+ * @brief Log entries that trigger a compaction.
+ */
+#define STORE_COMPACT_ENTRIES 1024
+
+/**
+ * @brief Compaction period (in seconds) for a non-empty log.
+ */
+#define STORE_COMPACT_PERIOD 60
+
+/**
+ * @brief Identity of a database file, changes whenever the file
+ * is written or replaced.
+ */
+struct disk_id
+{
+	dev_t dev;             /**< Device.                   */
+	ino_t ino;             /**< Inode.                    */
+	off_t size;            /**< Size.                     */
+	struct timespec mtime; /**< Last modification time.   */
+};
+
+/**
+ * @brief Printers read from a file.
+ */
+struct collection
+{
+	struct PRINTER *printers; /**< Printers read.       */
+	size_t count;             /**< Amount read.         */
+	size_t capacity;          /**< Allocated printers.  */
+	char *kept;               /**< Lines kept as is.    */
+	size_t kept_len;          /**< Length of @ref kept. */
+	size_t nkept;             /**< Amount of lines kept. */
+	int error;                /**< Out of memory.       */
+};
+
+/**
+ * @brief Store state.
+ */
+static struct
+{
+	char *db_path;          /**< Database path.                      */
+	char *wal_path;         /**< Current log path.                   */
+	char *old_path;         /**< Rotated log path.                   */
+	bool binary;            /**< Database uses the binary format.    */
+	bool old_pending;       /**< A rotated log was left behind.      */
+	bool stop;              /**< Compactor should exit.              */
+	bool running;           /**< Compactor thread was started.       */
+	pthread_t thread;       /**< Compactor thread.                   */
+	struct PRINTER *disk;   /**< Database contents, by name.         */
+	size_t ndisk;           /**< Amount of printers in @ref disk.    */
+	char *kept;             /**< Database lines kept as is.          */
+	size_t kept_len;        /**< Length of @ref kept.                */
+	struct disk_id disk_id; /**< Database identity.                  */
+} st;
+
+/**
+ * @brief Serializes log appends and rotation, and guards the
+ * compactor flags.
+ */
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Wakes the compactor up.
+ */
+static pthread_cond_t store_cond;
+
+/**
+ * @brief Serializes database writes (compactions) and reloads, and
+ * guards the last seen database contents and identity.
+ */
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Operation applier given to @ref store_open.
+ */
+static void (*store_apply)(int op, const struct PRINTER *);
+
+/**
+ * @brief Records read by @ref store_open and @ref store_reload.
+ */
+static struct collection loaded;
+
+/**
+ * @brief Records collected by @ref store_convert.
+ */
+static struct collection convert;
+
+/**
+ * @brief Appends @p p to the collection @p c.
+ *
+ * @param c Collection.
+ * @param p Printer read.
+ */
+static void collect(struct collection *c, const struct PRINTER *p)
+{
+	struct PRINTER *tmp;
+	size_t capacity;
+
+	if (c->count == c->capacity)
+	{
+		capacity = c->capacity ? c->capacity * 2 : 64;
+		tmp = realloc(c->printers, capacity * sizeof(*tmp));
+		if (!tmp)
+		{
+			c->error = 1;
+			return;
+		}
+		c->printers = tmp;
+		c->capacity = capacity;
+	}
+	c->printers[c->count++] = *p;
+}
+
+/**
+ * @brief Appends the text database line @p line, of @p len bytes,
+ * to the lines kept by the collection @p c.
+ */
+static void keep(struct collection *c, const char *line, size_t len)
+{
+	char *tmp;
+	bool nl;
+
+	nl  = !len || line[len - 1] != '\n';
+	tmp = realloc(c->kept, c->kept_len + len + nl);
+	if (!tmp)
+	{
+		c->error = 1;
+		return;
+	}
+	c->kept = tmp;
+	memcpy(c->kept + c->kept_len, line, len);
+	c->kept_len += len;
+	if (nl)
+		c->kept[c->kept_len++] = '\n';
+	c->nkept++;
+}
+
+/**
+ * @brief Reads every record of the text database @p f.
+ *
+ * @param f    Opened database.
+ * @param load Called once per record, in file order.
+ * @param c    Collection that keeps the records too long to be
+ *             loaded.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int load_text(FILE *f, void (*load)(const struct PRINTER *),
+	struct collection *c)
+{
+	struct printer_view v;
+	struct PRINTER p;
+	size_t size;
+	ssize_t len;
+	char *line;
+
+	rewind(f);
+	line = NULL;
+	size = 0;
+	while ((len = getline(&line, &size, f)) > 0)
+	{
+		if (!printer_split(line, (size_t)len, &v))
+			continue;
+
+		/* Neither cut (names would collide) nor dropped by compactions. */
+		if (v.name.len >= PRINTER_STRLEN || v.ip.len >= PRINTER_STRLEN)
+		{
+			fprintf(stderr, "Skipping printer, name or address too long "
+				"(kept in the database): %.*s\n", (int)v.name.len, v.name.ptr);
+			keep(c, line, (size_t)len);
+			continue;
+		}
+		printer_from_view(&v, &p);
+		load(&p);
+	}
+
+	free(line);
+	return (ferror(f) ? -1 : 0);
+}
+
+/**
+ * @brief Feeds a database record to @ref store_apply, while
+ * loading, and collects it into @ref loaded.
+ *
+ * @param p Printer read.
+ */
+static void load_record(const struct PRINTER *p)
+{
+	if (store_apply)
+		store_apply(STORE_ADD, p);
+	collect(&loaded, p);
+}
+
+/**
+ * @brief Orders printers by name.
+ */
+static int cmp_name(const void *a, const void *b)
+{
+	return (strncmp(((const struct PRINTER *)a)->name,
+		((const struct PRINTER *)b)->name, PRINTER_STRLEN));
+}
+
+/**
+ * @brief Sorts the @ref loaded printers by name, keeping only the
+ * last one of each name, as loading the database does.
+ *
+ * The names are sorted as they were read, so a stable merge sort
+ * keeps duplicates in file order.
+ */
+static int sort_loaded(void)
+{
+	struct PRINTER *tmp;
+	struct PRINTER *src;
+	struct PRINTER *dst;
+	size_t width;
+	size_t lo, mid, hi;
+	size_t i, j, k;
+	size_t n;
+
+	n   = loaded.count;
+	tmp = malloc((n ? n : 1) * sizeof(*tmp));
+	if (!tmp)
+		return (-1);
+
+	/* Bottom-up merge sort, stable. */
+	src = loaded.printers;
+	dst = tmp;
+	for (width = 1; width < n; width *= 2)
+	{
+		for (lo = 0; lo < n; lo += 2 * width)
+		{
+			mid = lo + width < n ? lo + width : n;
+			hi  = lo + 2 * width < n ? lo + 2 * width : n;
+			for (i = lo, j = mid, k = lo; k < hi; k++)
+			{
+				if (i < mid && (j >= hi || cmp_name(&src[i], &src[j]) <= 0))
+					dst[k] = src[i++];
+				else
+					dst[k] = src[j++];
+			}
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* Last of each name wins. */
+	for (i = 0, k = 0; i < n; i++)
+	{
+		if (k && !cmp_name(&src[k - 1], &src[i]))
+			k--;
+		src[k++] = src[i];
+	}
+
+	free(dst);
+	loaded.printers = src;
+	loaded.count    = k;
+	return (0);
+}
+
+/**
+ * @brief Reads the identity of the opened file @p fd.
+ */
+static int read_id(int fd, struct disk_id *id)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0)
+		return (-1);
+
+	memset(id, 0, sizeof(*id));
+	id->dev   = sb.st_dev;
+	id->ino   = sb.st_ino;
+	id->size  = sb.st_size;
+	id->mtime = sb.st_mtim;
+	return (0);
+}
+
+/**
+ * @brief Returns whether @p a and @p b identify the same contents.
+ */
+static bool same_id(const struct disk_id *a, const struct disk_id *b)
+{
+	return (a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime.tv_sec == b->mtime.tv_sec &&
+		a->mtime.tv_nsec == b->mtime.tv_nsec);
+}
+
+/**
+ * @brief Returns whether the database was edited since it was last
+ * read or written, i.e: it is not the file @ref st.disk_id
+ * identifies anymore. A missing database has nothing to lose.
+ *
+ * @note Must be called with @ref disk_mutex held.
+ */
+static bool edited_locked(void)
+{
+	struct disk_id id;
+	bool ret;
+	int fd;
+
+	fd = open(st.db_path, O_RDONLY);
+	if (fd < 0)
+		return (false);
+	ret = read_id(fd, &id) < 0 || !same_id(&id, &st.disk_id);
+	close(fd);
+	return (ret);
+}
+
+/**
+ * @brief Reads every record of the database @p fd, whichever its
+ * format, into @ref loaded.
+ *
+ * @param fd     Opened database, closed on return.
+ * @param binary Receives whether the database uses the binary
+ *               format.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int read_database(int fd, bool *binary)
+{
+	FILE *f;
+	int ret;
+
+	*binary = binfmt_detect(fd);
+	if (*binary)
+	{
+		ret = binfmt_load(fd, load_record);
+		close(fd);
+	}
+	else
+	{
+		f = fdopen(fd, "r");
+		if (!f)
+		{
+			close(fd);
+			return (-1);
+		}
+		ret = load_text(f, load_record, &loaded);
+		fclose(f);
+	}
+	return (ret < 0 || loaded.error ? -1 : 0);
+}
+
+/**
+ * @brief Returns a newly allocated @p path followed by @p suffix.
+ */
+static char *path_with(const char *path, const char *suffix)
+{
+	char *s;
+
+	s = malloc(strlen(path) + strlen(suffix) + 1);
+	if (!s)
+		return (NULL);
+	strcpy(s, path);
+	strcat(s, suffix);
+	return (s);
+}
+
+/**
+ * @brief Syncs the directory holding @p path, so a rename
+ * into it is durable.
+ *
+ * @param path File path.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int sync_dir(const char *path)
+{
+	char *dir;
+	char *slash;
+	int ret;
+	int fd;
+
+	dir = path_with(path, "");
+	if (!dir)
+		return (-1);
+
+	slash = strrchr(dir, '/');
+	if (slash)
+		*(slash == dir ? slash + 1 : slash) = '\0';
+	else
+		strcpy(dir, ".");
+
+	ret = -1;
+	fd  = open(dir, O_RDONLY);
+	if (fd >= 0)
+	{
+		ret = fsync(fd);
+		close(fd);
+	}
+	free(dir);
+	return (ret);
+}
+
+/**
+ * @brief Writes @p count printers as a text database to @p fd,
+ * followed by the lines kept as is (@ref st.kept), and syncs it.
+ *
+ * @param fd       Database, opened for writing.
+ * @param printers Printers to be written.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note Must be called with @ref disk_mutex held.
+ */
+static int write_text(int fd, const struct PRINTER *printers, size_t count)
+{
+	char *buf;
+	size_t len;
+	size_t i;
+	int ret;
+
+	buf = malloc(count * PRINTER_LINE_MAX + st.kept_len + 1);
+	if (!buf)
+		return (-1);
+
+	len = 0;
+	for (i = 0; i < count; i++)
+		len += printer_format(&printers[i], buf + len, PRINTER_LINE_MAX);
+	if (st.kept_len)
+		memcpy(buf + len, st.kept, st.kept_len);
+	len += st.kept_len;
+
+	ret = -1;
+	if (write(fd, buf, len) == (ssize_t)len && fsync(fd) == 0)
+		ret = 0;
+	free(buf);
+	return (ret);
+}
+
+/**
+ * @brief Atomically replaces the database with @p count printers,
+ * unless it was edited meanwhile.
+ *
+ * @param printers Printers to be written.
+ * @param count    Amount of printers.
+ * @param id       Receives the identity of the new database.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note Must be called with @ref disk_mutex held.
+ */
+static int write_database(const struct PRINTER *printers, size_t count,
+	struct disk_id *id)
+{
+	char *tmp_path;
+	int ret;
+	int fd;
+
+	tmp_path = path_with(st.db_path, ".tmp");
+	if (!tmp_path)
+		return (-1);
+
+	ret = -1;
+	fd  = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+
+	if (st.binary)
+		ret = binfmt_write(fd, printers, count);
+	else
+		ret = write_text(fd, printers, count);
+	if (ret == 0)
+		ret = read_id(fd, id);
+	close(fd);
+
+	/* Edits still only on disk are left for the next reload. */
+	if (ret == 0 && edited_locked())
+		ret = -1;
+	if (ret == 0)
+		ret = rename(tmp_path, st.db_path);
+	if (ret == 0)
+		ret = sync_dir(st.db_path);
+	else
+		unlink(tmp_path);
+out:
+	free(tmp_path);
+	return (ret);
+}
+
+/**
+ * @brief Rotates the log, called by @ref registry_snapshot while
+ * no mutation can happen.
+ *
+ * If a previous rotated log is still around (its compaction
+ * failed), the current log is kept instead: the new database
+ * will cover both anyway.
+ */
+static void rotate_locked(void)
+{
+	pthread_mutex_lock(&store_mutex);
+	if (!st.old_pending && wal_rotate(st.old_path) == 0)
+		st.old_pending = true;
+	pthread_mutex_unlock(&store_mutex);
+}
+
+/**
+ * @brief Returns whether @p a and @p b have the same contents.
+ */
+static bool same_printer(const struct PRINTER *a, const struct PRINTER *b)
+{
+	return (!strncmp(a->name, b->name, PRINTER_STRLEN) &&
+		!strncmp(a->ip, b->ip, PRINTER_STRLEN) && a->state == b->state);
+}
+
+/**
+ * @brief @ref store_reload, with @ref disk_mutex held.
+ */
+static long reload_locked(int (*apply)(const int *ops,
+	const struct PRINTER *printers, size_t count))
+{
+	struct PRINTER *changes;
+	struct disk_id id;
+	size_t i, j, n;
+	bool binary;
+	long ret;
+	int *ops;
+	int cmp;
+	int fd;
+
+	ops     = NULL;
+	changes = NULL;
+	ret     = -1;
+	fd      = open(st.db_path, O_RDONLY);
+	if (fd < 0)
+		goto out;
+	if (read_id(fd, &id) < 0)
+	{
+		close(fd);
+		goto out;
+	}
+	if (same_id(&id, &st.disk_id))
+	{
+		close(fd);
+		ret = 0;
+		goto out;
+	}
+	if (read_database(fd, &binary) < 0 || sort_loaded() < 0)
+		goto out;
+
+	/* Both sides are sorted by name, merge them. */
+	ops     = malloc((st.ndisk + loaded.count + 1) * sizeof(*ops));
+	changes = malloc((st.ndisk + loaded.count + 1) * sizeof(*changes));
+	if (!ops || !changes)
+		goto out;
+	for (i = 0, j = 0, n = 0; i < st.ndisk || j < loaded.count;)
+	{
+		if (i == st.ndisk)
+			cmp = 1;
+		else if (j == loaded.count)
+			cmp = -1;
+		else
+			cmp = cmp_name(&st.disk[i], &loaded.printers[j]);
+
+		if (cmp < 0)
+		{
+			ops[n]       = STORE_REMOVE;
+			changes[n++] = st.disk[i++];
+		}
+		else if (cmp > 0)
+		{
+			ops[n]       = STORE_ADD;
+			changes[n++] = loaded.printers[j++];
+		}
+		else
+		{
+			if (!same_printer(&st.disk[i], &loaded.printers[j]))
+			{
+				ops[n]       = STORE_UPDATE;
+				changes[n++] = loaded.printers[j];
+			}
+			i++;
+			j++;
+		}
+	}
+	if (n && apply(ops, changes, n) < 0)
+		goto out;
+
+	free(st.disk);
+	free(st.kept);
+	st.disk     = loaded.printers;
+	st.ndisk    = loaded.count;
+	st.kept     = loaded.kept;
+	st.kept_len = loaded.kept_len;
+	st.disk_id  = id;
+	st.binary   = binary;
+	loaded.printers = NULL;
+	loaded.kept     = NULL;
+	ret = (long)n;
+out:
+	free(loaded.printers);
+	free(loaded.kept);
+	memset(&loaded, 0, sizeof(loaded));
+	free(changes);
+	free(ops);
+	return (ret);
+}
+
+/**
+ * @brief Compacts the log into a fresh database.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int compact(void)
+{
+	struct PRINTER *printers;
+	struct disk_id id;
+	size_t count;
+	int ret;
+
+	pthread_mutex_lock(&disk_mutex);
+
+	/* Merge the hand edits first, the new database would drop them. */
+	if (edited_locked() && reload_locked(registry_apply_batch) < 0)
+	{
+		pthread_mutex_unlock(&disk_mutex);
+		return (-1);
+	}
+
+	printers = registry_snapshot(&count, rotate_locked);
+	ret      = -1;
+	if (printers)
+		ret = write_database(printers, count, &id);
+	if (ret == 0)
+	{
+		/* The database now holds the snapshot, names are unique. */
+		qsort(printers, count, sizeof(*printers), cmp_name);
+		free(st.disk);
+		st.disk    = printers;
+		st.ndisk   = count;
+		st.disk_id = id;
+		printers   = NULL;
+	}
+	pthread_mutex_unlock(&disk_mutex);
+	free(printers);
+	if (ret < 0)
+		return (-1);
+
+	/* Everything in the rotated log is now in the database. */
+	pthread_mutex_lock(&store_mutex);
+	if (st.old_pending && (unlink(st.old_path) == 0 || errno == ENOENT))
+		st.old_pending = false;
+	pthread_mutex_unlock(&store_mutex);
+	return (0);
+}
+
+/**
+ * @brief Compactor thread: compacts whenever the log grows past
+ * @ref STORE_COMPACT_ENTRIES, and every @ref STORE_COMPACT_PERIOD
+ * seconds if it is not empty.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *compactor(void *arg)
+{
+	struct timespec ts;
+	bool due;
+
+	(void)arg;
+	pthread_mutex_lock(&store_mutex);
+	while (!st.stop)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += STORE_COMPACT_PERIOD;
+
+		due = false;
+		while (!st.stop && !due)
+		{
+			due = wal_entries() >= STORE_COMPACT_ENTRIES;
+			if (!due && pthread_cond_timedwait(&store_cond, &store_mutex, &ts) ==
+				ETIMEDOUT)
+				due = wal_entries() > 0 || st.old_pending;
+		}
+		if (st.stop)
+			break;
+
+		pthread_mutex_unlock(&store_mutex);
+		compact();
+		pthread_mutex_lock(&store_mutex);
+	}
+	pthread_mutex_unlock(&store_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Opens the database at @p path, creating it (as a text
+ * database) if needed, replays its logs and starts the compactor.
+ *
+ * @param path  Database path.
+ * @param apply Called once per database record (as a STORE_ADD)
+ *              and once per log entry, in order.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int store_open(const char *path, void (*apply)(int op, const struct PRINTER *))
+{
+	pthread_condattr_t attr;
+	int fd;
+
+	store_apply = apply;
+	st.db_path  = path_with(path, "");
+	st.wal_path = path_with(path, ".wal");
+	st.old_path = path_with(path, ".wal.old");
+	if (!st.db_path || !st.wal_path || !st.old_path)
+		return (-1);
+
+	/* Database. */
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return (-1);
+
+	if (read_id(fd, &st.disk_id) < 0)
+	{
+		close(fd);
+		return (-1);
+	}
+	if (read_database(fd, &st.binary) < 0 || sort_loaded() < 0)
+		return (-1);
+	st.disk     = loaded.printers;
+	st.ndisk    = loaded.count;
+	st.kept     = loaded.kept;
+	st.kept_len = loaded.kept_len;
+	memset(&loaded, 0, sizeof(loaded));
+	store_apply = NULL;
+
+	/* Logs, oldest first. */
+	st.old_pending = access(st.old_path, F_OK) == 0;
+	if (wal_replay(st.old_path, apply) < 0 || wal_replay(st.wal_path, apply) < 0)
+		return (-1);
+	if (wal_open(st.wal_path) < 0)
+		return (-1);
+
+	/* Compactor. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&store_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	st.stop = false;
+	if (pthread_create(&st.thread, NULL, compactor, NULL))
+		return (-1);
+	st.running = true;
+	return (0);
+}
+
+/**
+ * @brief Durably logs the operation @p op on printer @p p.
+ *
+ * @param op Operation.
+ * @param p  Printer (for STORE_REMOVE only the name matters).
+ *
+ * @return Returns 0 once logged, -1 otherwise.
+ */
+int store_log(int op, const struct PRINTER *p)
+{
+	uint64_t start;
+	int ret;
+
+	pthread_mutex_lock(&store_mutex);
+	start = stats_now();
+	ret = wal_append(op, p);
+	stats_record(STAT_STORE, stats_now() - start);
+	if (wal_entries() >= STORE_COMPACT_ENTRIES)
+		pthread_cond_signal(&store_cond);
+	pthread_mutex_unlock(&store_mutex);
+	return (ret);
+}
+
+/**
+ * @brief Durably logs the operation @p op on every printer of
+ * @p printers, as a single append.
+ *
+ * @param op       Operation.
+ * @param printers Printers.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 once logged, -1 otherwise (nothing is logged).
+ */
+int store_log_many(int op, const struct PRINTER *printers, size_t count)
+{
+	uint64_t start;
+	int ret;
+
+	pthread_mutex_lock(&store_mutex);
+	start = stats_now();
+	ret = wal_append_many(op, printers, count);
+	stats_record(STAT_STORE, stats_now() - start);
+	if (wal_entries() >= STORE_COMPACT_ENTRIES)
+		pthread_cond_signal(&store_cond);
+	pthread_mutex_unlock(&store_mutex);
+	return (ret);
+}
+
+/**
+ * @brief Durably logs the operation @p ops[i] on printer
+ * @p printers[i], for every printer, as a single append.
+ *
+ * @param ops      Operations.
+ * @param printers Printers.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 once logged, -1 otherwise (nothing is logged).
+ */
+int store_log_ops(const int *ops, const struct PRINTER *printers, size_t count)
+{
+	uint64_t start;
+	int ret;
+
+	pthread_mutex_lock(&store_mutex);
+	start = stats_now();
+	ret = wal_append_ops(ops, printers, count);
+	stats_record(STAT_STORE, stats_now() - start);
+	if (wal_entries() >= STORE_COMPACT_ENTRIES)
+		pthread_cond_signal(&store_cond);
+	pthread_mutex_unlock(&store_mutex);
+	return (ret);
+}
+
+/**
+ * @brief Re-reads the database, if it changed since it was last
+ * read or written, and hands what changed to @p apply.
+ *
+ * The new contents are compared with the ones last seen, not with
+ * the registry: only the edits are applied, mutations done since
+ * the last compaction (only in the log so far) are kept. A printer
+ * gone from the file is removed, a new or changed one is added or
+ * updated (as a whole).
+ *
+ * @param apply Applies a batch of operations (see
+ *              @ref registry_apply_batch), returns a negative value
+ *              if it failed.
+ *
+ * @return Returns the amount of operations handed to @p apply (0 if
+ * the database did not change), or -1 on error, in which case the
+ * next reload will try again.
+ */
+long store_reload(int (*apply)(const int *ops, const struct PRINTER *printers,
+	size_t count))
+{
+	long ret;
+
+	pthread_mutex_lock(&disk_mutex);
+	ret = reload_locked(apply);
+	pthread_mutex_unlock(&disk_mutex);
+	return (ret);
+}
+
+/**
+ * @brief Collects a printer read by @ref store_convert.
+ *
+ * @param p Printer read.
+ */
+static void convert_record(const struct PRINTER *p)
+{
+	collect(&convert, p);
+}
+
+/**
+ * @brief One-shot conversion of the text database @p text_path
+ * into the binary database @p bin_path.
+ *
+ * The binary database is written to a temporary file and renamed
+ * over @p bin_path once complete, so @p bin_path may be the very
+ * same file as @p text_path.
+ *
+ * @param text_path Source, text, database.
+ * @param bin_path  Target, binary, database.
+ *
+ * @return Returns the amount of converted records, or -1 on error.
+ */
+long store_convert(const char *text_path, const char *bin_path)
+{
+	char *tmp_path;
+	FILE *f;
+	long ret;
+	int fd;
+	int saved;
+
+	ret = -1;
+	fd  = -1;
+	f   = fopen(text_path, "r");
+	if (!f)
+		return (-1);
+
+	tmp_path = malloc(strlen(bin_path) + sizeof(".tmp"));
+	if (!tmp_path)
+		goto out;
+	strcpy(tmp_path, bin_path);
+	strcat(tmp_path, ".tmp");
+
+	if (load_text(f, convert_record, &convert) < 0 || convert.error)
+		goto out;
+
+	/* The binary format could not keep them. */
+	if (convert.nkept)
+	{
+		fprintf(stderr, "%zu printers do not fit the binary format\n",
+			convert.nkept);
+		errno = ENAMETOOLONG;
+		goto out;
+	}
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	if (binfmt_write(fd, convert.printers, convert.count) < 0)
+		goto out;
+	if (rename(tmp_path, bin_path) < 0)
+		goto out;
+
+	/* As @ref write_database: bin_path may be the live database. */
+	if (sync_dir(bin_path) < 0)
+		goto out;
+	ret = (long)convert.count;
+out:
+	saved = errno;
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0 && tmp_path)
+		unlink(tmp_path);
+	free(tmp_path);
+	free(convert.printers);
+	free(convert.kept);
+	memset(&convert, 0, sizeof(convert));
+	fclose(f);
+	errno = saved;
+	return (ret);
+}
+
+/**
+ * @brief Stops the compactor and closes the log.
+ */
+void store_close(void)
+{
+	if (st.running)
+	{
+		pthread_mutex_lock(&store_mutex);
+		st.stop = true;
+		pthread_cond_signal(&store_cond);
+		pthread_mutex_unlock(&store_mutex);
+		pthread_join(st.thread, NULL);
+		pthread_cond_destroy(&store_cond);
+		st.running = false;
+	}
+	wal_close();
+	free(st.disk);
+	free(st.kept);
+	free(st.db_path);
+	free(st.wal_path);
+	free(st.old_path);
+	memset(&st, 0, sizeof(st));
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file store.h
+ * @brief On-disk persistence of the printer registry.
+ */
+#ifndef STORE_H
+#define STORE_H
+
+	#include "printer.h"
+
+	/**
+	 * @brief Logged operations, values are part of the log format.
+	 */
+	enum store_op
+	{
+		STORE_ADD    = 1, /**< New printer.              */
+		STORE_UPDATE = 2, /**< Printer contents changed. */
+		STORE_REMOVE = 3  /**< Printer removed.          */
+	};
+
+	extern int store_open(const char *path,
+		void (*apply)(int op, const struct PRINTER *));
+	extern int store_log(int op, const struct PRINTER *p);
+	extern int store_log_many(int op, const struct PRINTER *printers,
+		size_t count);
+	extern int store_log_ops(const int *ops, const struct PRINTER *printers,
+		size_t count);
+	extern long store_reload(int (*apply)(const int *ops,
+		const struct PRINTER *printers, size_t count));
+	extern long store_convert(const char *text_path, const char *bin_path);
+	extern void store_close(void);
+
+#endif /* STORE_H */
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strtab.h"
+
+/**
+ * @file strtab.c
+ * @brief Interned-string arena.
+ *
+ * Strings are stored once each, length-prefixed and NUL-terminated,
+ * in fixed-size chunks that are never moved nor freed, and are
+ * referred to by a 32-bit reference (chunk and offset): a record
+ * holding a reference is 4 bytes instead of a fixed-width buffer,
+ * and two interned strings are equal exactly when their references
+ * are.
+ *
+ * Interning is serialized by a mutex and goes through a hash index
+ * of every string. Resolving a reference takes no lock at all: a
+ * chunk is filled before any reference to it is handed out, and
+ * references are only shared through structures published with
+ * release semantics (such as registry versions).
+ *
+ * Strings are never freed, the arena grows with the distinct
+ * strings ever interned (not with the ones in use), which for
+ * printer names and addresses stays small. The only exception are
+ * the strings of a change that is given up before any reference to
+ * them was shared, see @ref strtab_rollback.
+ */
+
+/**
+ * @brief Bits of a reference used for the offset within a chunk.
+ */
+#define STRTAB_CHUNK_BITS 16
+
+/**
+ * @brief Chunk size.
+ */
+#define STRTAB_CHUNK (1u << STRTAB_CHUNK_BITS)
+
+/**
+ * @brief Maximum amount of chunks (references are 32-bit).
+ */
+#define STRTAB_MAX_CHUNKS (1u << (32 - STRTAB_CHUNK_BITS))
+
+/**
+ * @brief Initial amount of index slots, must be a power of two.
+ */
+#define STRTAB_INITIAL_SLOTS 256
+
+/**
+ * @brief Arena state.
+ */
+static struct
+{
+	unsigned char *chunks[STRTAB_MAX_CHUNKS]; /**< Chunks, in order.       */
+	uint32_t nchunks;                         /**< Allocated chunks.       */
+	uint32_t used;                            /**< Bytes used in the last
+	                                               chunk.                  */
+	uint32_t *slots;                          /**< Index: references, or
+	                                               STRTAB_NONE.            */
+	size_t nslots;                            /**< Index size (power of
+	                                               two).                   */
+	size_t count;                             /**< Interned strings.       */
+} tab;
+
+/**
+ * @brief Serializes interning.
+ */
+static pthread_mutex_t strtab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief FNV-1a hash of @p len bytes at @p s.
+ */
+static uint32_t hash(const unsigned char *s, size_t len)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261u;
+	for (i = 0; i < len; i++)
+	{
+		h ^= s[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/**
+ * @brief Resolves the reference @p ref.
+ *
+ * @param ref String reference, as returned by @ref strtab_intern.
+ *
+ * @return Returns the length byte of the string, followed by its
+ * bytes and a NUL terminator, see @ref STRTAB_LEN and
+ * @ref STRTAB_STR.
+ */
+const unsigned char *strtab_get(uint32_t ref)
+{
+	return (tab.chunks[ref >> STRTAB_CHUNK_BITS] +
+		(ref & (STRTAB_CHUNK - 1)));
+}
+
+/**
+ * @brief Finds the index slot that holds, or would hold, @p len
+ * bytes at @p s.
+ *
+ * @note Must be called with @ref strtab_mutex held.
+ */
+static size_t find_slot(const unsigned char *s, size_t len, uint32_t h)
+{
+	const unsigned char *str;
+	size_t mask;
+	size_t i;
+
+	mask = tab.nslots - 1;
+	for (i = h & mask; tab.slots[i]; i = (i + 1) & mask)
+	{
+		str = strtab_get(tab.slots[i]);
+		if (STRTAB_LEN(str) == len && !memcmp(str + 1, s, len))
+			break;
+	}
+	return (i);
+}
+
+/**
+ * @brief Doubles the index.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @note Must be called with @ref strtab_mutex held.
+ */
+static int grow_slots(void)
+{
+	const unsigned char *str;
+	uint32_t *old;
+	size_t nold;
+	size_t i;
+
+	old  = tab.slots;
+	nold = tab.nslots;
+	tab.nslots = nold ? nold * 2 : STRTAB_INITIAL_SLOTS;
+	tab.slots  = calloc(tab.nslots, sizeof(*tab.slots));
+	if (!tab.slots)
+	{
+		tab.slots  = old;
+		tab.nslots = nold;
+		return (-1);
+	}
+
+	for (i = 0; i < nold; i++)
+	{
+		if (!old[i])
+			continue;
+		str = strtab_get(old[i]);
+		tab.slots[find_slot(str + 1, STRTAB_LEN(str),
+			hash(str + 1, STRTAB_LEN(str)))] = old[i];
+	}
+	free(old);
+	return (0);
+}
+
+/**
+ * @brief Reserves @p size bytes in the arena.
+ *
+ * @return Returns the reference of the reserved bytes, or
+ * STRTAB_NONE if out of memory.
+ *
+ * @note Must be called with @ref strtab_mutex held.
+ */
+static uint32_t reserve(size_t size)
+{
+	uint32_t ref;
+
+	if (!tab.nchunks || tab.used + size > STRTAB_CHUNK)
+	{
+		if (tab.nchunks == STRTAB_MAX_CHUNKS)
+			return (STRTAB_NONE);
+		tab.chunks[tab.nchunks] = malloc(STRTAB_CHUNK);
+		if (!tab.chunks[tab.nchunks])
+			return (STRTAB_NONE);
+		tab.nchunks++;
+
+		/* Offset 0 of the first chunk would be STRTAB_NONE. */
+		tab.used = tab.nchunks == 1 ? 1 : 0;
+	}
+
+	ref = (tab.nchunks - 1) << STRTAB_CHUNK_BITS | tab.used;
+	tab.used += (uint32_t)size;
+	return (ref);
+}
+
+/**
+ * @brief Interns @p len bytes at @p s.
+ *
+ * @param s   String, not necessarily NUL-terminated (and may hold
+ *            NUL bytes).
+ * @param len String length, at most @ref STRTAB_MAXLEN.
+ *
+ * @return Returns the reference of the string, the same for every
+ * call with the same bytes, or STRTAB_NONE if too long or out of
+ * memory.
+ */
+uint32_t strtab_intern(const void *s, size_t len)
+{
+	unsigned char *str;
+	uint32_t ref;
+	uint32_t h;
+	size_t slot;
+
+	if (len > STRTAB_MAXLEN)
+		return (STRTAB_NONE);
+
+	h = hash(s, len);
+	pthread_mutex_lock(&strtab_mutex);
+	ref = STRTAB_NONE;
+
+	/* Keep the load factor below 1/2. */
+	if ((tab.count + 1) * 2 > tab.nslots && grow_slots() < 0)
+		goto out;
+
+	slot = find_slot(s, len, h);
+	if (tab.slots[slot])
+	{
+		ref = tab.slots[slot];
+		goto out;
+	}
+
+	ref = reserve(len + 2);
+	if (ref == STRTAB_NONE)
+		goto out;
+	str          = (unsigned char *)strtab_get(ref);
+	str[0]       = (unsigned char)len;
+	str[len + 1] = '\0';
+	memcpy(str + 1, s, len);
+
+	tab.slots[slot] = ref;
+	tab.count++;
+out:
+	pthread_mutex_unlock(&strtab_mutex);
+	return (ref);
+}
+
+/**
+ * @brief Returns the current end of the arena, to give up the
+ * strings interned from then on, see @ref strtab_rollback.
+ */
+struct strtab_mark strtab_mark(void)
+{
+	struct strtab_mark mark;
+
+	pthread_mutex_lock(&strtab_mutex);
+	mark.nchunks = tab.nchunks;
+	mark.used    = tab.used;
+	pthread_mutex_unlock(&strtab_mutex);
+	return (mark);
+}
+
+/**
+ * @brief Releases every string interned since @p mark was taken.
+ *
+ * References grow with the arena, so those are exactly the ones
+ * past the mark: they are taken out of the index, the index
+ * clusters they were in are re-placed, and the arena is cut back.
+ *
+ * @param mark Arena position, as returned by @ref strtab_mark.
+ *
+ * @note The caller must ensure that no other thread interned
+ * meanwhile and that no reference past @p mark was shared.
+ */
+void strtab_rollback(struct strtab_mark mark)
+{
+	const unsigned char *str;
+	uint64_t end;
+	uint32_t ref;
+	size_t mask;
+	size_t i;
+	size_t j;
+
+	pthread_mutex_lock(&strtab_mutex);
+	if (tab.nchunks == mark.nchunks && tab.used == mark.used)
+		goto out;
+
+	/* References below end were interned before the mark. */
+	end  = mark.nchunks ?
+		((uint64_t)(mark.nchunks - 1) << STRTAB_CHUNK_BITS) + mark.used : 0;
+	mask = tab.nslots - 1;
+	for (i = 0; i < tab.nslots; i++)
+	{
+		if (tab.slots[i] && tab.slots[i] >= end)
+		{
+			tab.slots[i] = STRTAB_NONE;
+			tab.count--;
+		}
+	}
+
+	/*
+	 * Re-place what follows a freed slot, starting past a free slot
+	 * so that no cluster wraps around unseen: each entry moves, if
+	 * anywhere, into the first free slot of its probe sequence.
+	 */
+	for (j = 0; tab.slots[j]; j++)
+		;
+	for (i = 1; i <= tab.nslots; i++)
+	{
+		ref = tab.slots[(j + i) & mask];
+		if (!ref)
+			continue;
+		tab.slots[(j + i) & mask] = STRTAB_NONE;
+		str = strtab_get(ref);
+		tab.slots[find_slot(str + 1, STRTAB_LEN(str),
+			hash(str + 1, STRTAB_LEN(str)))] = ref;
+	}
+
+	while (tab.nchunks > mark.nchunks)
+		free(tab.chunks[--tab.nchunks]);
+	tab.used = mark.used;
+out:
+	pthread_mutex_unlock(&strtab_mutex);
+}
+
+/**
+ * @brief Releases every string.
+ *
+ * @note Must only be called once no reference is used anymore.
+ */
+void strtab_close(void)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&strtab_mutex);
+	for (i = 0; i < tab.nchunks; i++)
+		free(tab.chunks[i]);
+	free(tab.slots);
+	memset(&tab, 0, sizeof(tab));
+	pthread_mutex_unlock(&strtab_mutex);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file strtab.h
+ * @brief Interned-string arena.
+ */
+#ifndef STRTAB_H
+#define STRTAB_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/**
+	 * @brief Reference to no string, returned on errors.
+	 */
+	#define STRTAB_NONE 0
+
+	/**
+	 * @brief Longest string that can be interned.
+	 */
+	#define STRTAB_MAXLEN 255
+
+	/**
+	 * @brief Length of the interned string @p s, as returned by
+	 * @ref strtab_get.
+	 */
+	#define STRTAB_LEN(s) ((size_t)(s)[0])
+
+	/**
+	 * @brief Bytes of the interned string @p s, as returned by
+	 * @ref strtab_get, followed by a NUL terminator.
+	 */
+	#define STRTAB_STR(s) ((const char *)(s) + 1)
+
+	/**
+	 * @brief Arena position, see @ref strtab_mark.
+	 */
+	struct strtab_mark
+	{
+		uint32_t nchunks; /**< Allocated chunks.             */
+		uint32_t used;    /**< Bytes used in the last chunk. */
+	};
+
+	extern uint32_t strtab_intern(const void *s, size_t len);
+	extern const unsigned char *strtab_get(uint32_t ref);
+	extern struct strtab_mark strtab_mark(void);
+	extern void strtab_rollback(struct strtab_mark mark);
+	extern void strtab_close(void);
+
+#endif /* STRTAB_H */
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "wal.h"
+
+/**
+ * @file wal.c
+ * @brief Append-only log of registry mutations.
+ *
+ * Each entry carries its payload length and a CRC-32 of the
+ * payload. Entries are only ever appended, with a single write()
+ * followed by fdatasync(), so a crash can at most leave a torn
+ * entry at the very end, which is detected by its length or
+ * checksum and discarded on replay.
+ */
+
+/**
+ * @brief Payload length of a log entry.
+ */
+#define WAL_PAYLOAD_LEN \
+	(sizeof(struct wal_entry) - offsetof(struct wal_entry, op))
+
+/**
+ * @brief Opened log.
+ */
+static struct
+{
+	int fd;           /**< Log file descriptor, -1 if closed. */
+	char *path;       /**< Log path.                          */
+	uint64_t entries; /**< Entries in the current log.        */
+} wal = {-1, NULL, 0};
+
+/**
+ * @brief Replays the log at @p path, calling @p apply for every
+ * valid entry, and truncates a torn tail, if any.
+ *
+ * @param path  Log path, a missing log is an empty log.
+ * @param apply Called once per entry, in log order.
+ *
+ * @return Returns the amount of entries replayed, or -1 on error.
+ */
+long wal_replay(const char *path, void (*apply)(int op, const struct PRINTER *))
+{
+	struct wal_entry e;
+	struct PRINTER p;
+	ssize_t n;
+	off_t off;
+	long count;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return (errno == ENOENT ? 0 : -1);
+
+	count = 0;
+	off   = 0;
+	while ((n = pread(fd, &e, sizeof(e), off)) == sizeof(e))
+	{
+		if (e.len != WAL_PAYLOAD_LEN || crc32(0, &e.op, e.len) != e.crc)
+			break;
+
+		binfmt_unpack(&e.rec, &p);
+		apply(e.op, &p);
+		off += sizeof(e);
+		count++;
+	}
+
+	/* Drop whatever follows the last valid entry. */
+	if (n != 0 && ftruncate(fd, off) < 0)
+		count = -1;
+
+	close(fd);
+	return (count);
+}
+
+/**
+ * @brief Opens (creating if needed) the log at @p path for
+ * appending.
+ *
+ * @param path Log path.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int wal_open(const char *path)
+{
+	off_t size;
+
+	wal.path = strdup(path);
+	if (!wal.path)
+		return (-1);
+
+	wal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (wal.fd < 0)
+		return (-1);
+
+	size = lseek(wal.fd, 0, SEEK_END);
+	wal.entries = size > 0 ? (uint64_t)size / sizeof(struct wal_entry) : 0;
+	return (0);
+}
+
+/**
+ * @brief Fills the log entry @p e for the operation @p op on
+ * printer @p p.
+ */
+static void make_entry(struct wal_entry *e, int op, const struct PRINTER *p)
+{
+	memset(e, 0, sizeof(*e));
+	e->len = WAL_PAYLOAD_LEN;
+	e->op  = (uint8_t)op;
+	binfmt_pack(p, &e->rec);
+	e->crc = crc32(0, &e->op, e->len);
+}
+
+/**
+ * @brief Durably appends the operation @p op on printer @p p.
+ *
+ * @param op Operation (store_op).
+ * @param p  Printer.
+ *
+ * @return Returns 0 once the entry is on stable storage, -1
+ * otherwise.
+ */
+int wal_append(int op, const struct PRINTER *p)
+{
+	struct wal_entry e;
+
+	make_entry(&e, op, p);
+	if (write(wal.fd, &e, sizeof(e)) != sizeof(e))
+		return (-1);
+	if (fdatasync(wal.fd) < 0)
+		return (-1);
+
+	wal.entries++;
+	return (0);
+}
+
+/**
+ * @brief Durably appends one entry per printer of @p printers, with
+ * a single write and a single sync.
+ *
+ * If the append fails, the log is truncated back to its previous
+ * size, so none of the entries is replayed later. A crash in the
+ * middle of the write may still leave a prefix of the batch in the
+ * log: entries are independent, and replay drops a torn one.
+ *
+ * @param op       Operation (store_op) of every entry, if @p ops is
+ *                 NULL.
+ * @param ops      Operation of each entry, or NULL.
+ * @param printers Printers.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 once every entry is on stable storage, -1
+ * otherwise.
+ */
+static int append_entries(int op, const int *ops,
+	const struct PRINTER *printers, size_t count)
+{
+	struct wal_entry *entries;
+	size_t size;
+	off_t end;
+	size_t i;
+	int ret;
+
+	if (!count)
+		return (0);
+
+	size    = count * sizeof(*entries);
+	entries = malloc(size);
+	if (!entries)
+		return (-1);
+	for (i = 0; i < count; i++)
+		make_entry(&entries[i], ops ? ops[i] : op, &printers[i]);
+
+	ret = -1;
+	end = lseek(wal.fd, 0, SEEK_END);
+	if (end >= 0 && write(wal.fd, entries, size) == (ssize_t)size &&
+		fdatasync(wal.fd) == 0)
+	{
+		wal.entries += count;
+		ret = 0;
+	}
+	else if (end >= 0 && ftruncate(wal.fd, end) == 0)
+		fdatasync(wal.fd);
+
+	free(entries);
+	return (ret);
+}
+
+/**
+ * @brief Durably appends the operation @p op on every printer of
+ * @p printers, as a single append (see @ref append_entries).
+ *
+ * @param op       Operation (store_op).
+ * @param printers Printers.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 once every entry is on stable storage, -1
+ * otherwise.
+ */
+int wal_append_many(int op, const struct PRINTER *printers, size_t count)
+{
+	return (append_entries(op, NULL, printers, count));
+}
+
+/**
+ * @brief Durably appends the operation @p ops[i] on printer
+ * @p printers[i], for every printer, as a single append (see
+ * @ref append_entries).
+ *
+ * @param ops      Operations (store_op).
+ * @param printers Printers.
+ * @param count    Amount of printers.
+ *
+ * @return Returns 0 once every entry is on stable storage, -1
+ * otherwise.
+ */
+int wal_append_ops(const int *ops, const struct PRINTER *printers, size_t count)
+{
+	return (append_entries(0, ops, printers, count));
+}
+
+/**
+ * @brief Returns the amount of entries in the current log.
+ */
+uint64_t wal_entries(void)
+{
+	return (wal.entries);
+}
+
+/**
+ * @brief Moves the current log to @p old_path and starts a new,
+ * empty, one.
+ *
+ * @param old_path Path the current log is renamed to.
+ *
+ * @return Returns 0 if success, -1 otherwise (the current log is
+ * kept in that case).
+ */
+int wal_rotate(const char *old_path)
+{
+	int fd;
+
+	if (rename(wal.path, old_path) < 0)
+		return (-1);
+
+	fd = open(wal.path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+	{
+		rename(old_path, wal.path);
+		return (-1);
+	}
+
+	close(wal.fd);
+	wal.fd      = fd;
+	wal.entries = 0;
+	return (0);
+}
+
+/**
+ * @brief Closes the log.
+ */
+void wal_close(void)
+{
+	if (wal.fd >= 0)
+		close(wal.fd);
+	free(wal.path);
+	wal.fd   = -1;
+	wal.path = NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file wal.h
+ * @brief Registry write-ahead log.
+ */
+#ifndef WAL_H
+#define WAL_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+	#include "binfmt.h"
+
+	/**
+	 * @brief Log entry, as written to disk.
+	 */
+	struct wal_entry
+	{
+		uint32_t len;               /**< Payload length (op..rec).   */
+		uint32_t crc;               /**< CRC-32 of the payload.      */
+		uint8_t op;                 /**< Operation, a store_op.      */
+		uint8_t pad[3];             /**< Zero.                       */
+		struct binfmt_record rec;   /**< Printer the op applies to.  */
+	};
+
+	extern long wal_replay(const char *path,
+		void (*apply)(int op, const struct PRINTER *));
+	extern int wal_open(const char *path);
+	extern int wal_append(int op, const struct PRINTER *p);
+	extern int wal_append_many(int op, const struct PRINTER *printers,
+		size_t count);
+	extern int wal_append_ops(const int *ops, const struct PRINTER *printers,
+		size_t count);
+	extern uint64_t wal_entries(void);
+	extern int wal_rotate(const char *old_path);
+	extern void wal_close(void);
+
+#endif /* WAL_H */
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "writer.h"
+
+/**
+ * @file writer.c
+ * @brief Writer thread.
+ *
+ * With the event loop backends, a worker serves many clients, and a
+ * message that blocks it delays all of them: registry mutations do,
+ * as they wait for their log entry to be synced. Such messages are
+ * queued instead, and run one after the other by the writer thread;
+ * the registry writers lock serialized them anyway.
+ *
+ * A client with messages queued gets its next ones queued too, so
+ * that its replies keep the order of its requests. Once a client is
+ * gone, its queued messages still run, a mutation it sent is not
+ * lost, but answer nobody: the fd may belong to another client by
+ * then.
+ */
+
+/**
+ * @brief Queued message.
+ */
+struct request
+{
+	struct request *next; /**< Next request, in arrival order.   */
+	int fd;               /**< Client, -1 once gone.             */
+	int tag;              /**< Passed back to the runner.        */
+	size_t size;          /**< Message size.                     */
+	unsigned char msg[];  /**< Message, NUL terminated.          */
+};
+
+/**
+ * @brief Writer state, guarded by @ref writer_mutex.
+ */
+static struct
+{
+	struct request *head; /**< Oldest request.                    */
+	struct request *tail; /**< Newest request.                    */
+	size_t pending;       /**< Requests not yet over, the running
+	                           one included. Also read without the
+	                           lock, see @ref writer_busy.         */
+	int current;          /**< Client of the running request.     */
+	void (*run)(int fd, const unsigned char *msg, size_t size,
+		int tag);         /**< Runs a request.                    */
+	bool stop;            /**< Writer should exit.                */
+	bool running;         /**< Writer was started.                */
+	pthread_t thread;     /**< Writer thread.                     */
+} wr;
+
+/**
+ * @brief Guards @ref wr.
+ */
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signals queued requests.
+ */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Signals the end of a request.
+ */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Writer thread: runs the queued requests, in order, until
+ * stopped and none is left.
+ *
+ * @param arg Unused.
+ *
+ * @return Always NULL.
+ */
+static void *writer(void *arg)
+{
+	struct request *r;
+
+	(void)arg;
+	pthread_mutex_lock(&writer_mutex);
+	while (1)
+	{
+		if (!wr.head)
+		{
+			if (wr.stop)
+				break;
+			pthread_cond_wait(&queue_cond, &writer_mutex);
+			continue;
+		}
+
+		r       = wr.head;
+		wr.head = r->next;
+		if (!wr.head)
+			wr.tail = NULL;
+		wr.current = r->fd;
+		pthread_mutex_unlock(&writer_mutex);
+
+		wr.run(r->fd, r->msg, r->size, r->tag);
+
+		pthread_mutex_lock(&writer_mutex);
+		wr.current = -1;
+		__atomic_sub_fetch(&wr.pending, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&done_cond);
+		free(r);
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return (NULL);
+}
+
+/**
+ * @brief Starts the writer thread.
+ *
+ * @param run Runs a request, from the writer thread: gets the
+ *            client fd (-1 if gone meanwhile), the message and the
+ *            tag it was submitted with.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int writer_start(void (*run)(int fd, const unsigned char *msg,
+	size_t size, int tag))
+{
+	wr.run     = run;
+	wr.current = -1;
+	if (pthread_create(&wr.thread, NULL, writer, NULL))
+		return (-1);
+	wr.running = true;
+	return (0);
+}
+
+/**
+ * @brief Whether the client @p fd has requests not yet over, so
+ * that its next messages must be queued after them.
+ *
+ * @param fd Client fd.
+ *
+ * @note Only takes the lock while some request is pending.
+ */
+bool writer_busy(int fd)
+{
+	struct request *r;
+	bool busy;
+
+	if (!__atomic_load_n(&wr.pending, __ATOMIC_ACQUIRE))
+		return (false);
+
+	pthread_mutex_lock(&writer_mutex);
+	busy = wr.current == fd;
+	for (r = wr.head; r && !busy; r = r->next)
+		busy = r->fd == fd;
+	pthread_mutex_unlock(&writer_mutex);
+	return (busy);
+}
+
+/**
+ * @brief Queues the message @p msg of the client @p fd, to be run
+ * by the writer thread.
+ *
+ * @param fd   Client fd.
+ * @param msg  Message, copied.
+ * @param size Message size.
+ * @param tag  Passed back to the runner, as is.
+ *
+ * @return Returns 0 if queued, -1 if the writer is not running or
+ * out of memory: the caller runs it then.
+ */
+int writer_submit(int fd, const unsigned char *msg, size_t size, int tag)
+{
+	struct request *r;
+
+	if (!wr.running)
+		return (-1);
+
+	r = malloc(sizeof(*r) + size + 1);
+	if (!r)
+		return (-1);
+	r->next = NULL;
+	r->fd   = fd;
+	r->tag  = tag;
+	r->size = size;
+	memcpy(r->msg, msg, size);
+	r->msg[size] = '\0';
+
+	pthread_mutex_lock(&writer_mutex);
+	if (wr.tail)
+		wr.tail->next = r;
+	else
+		wr.head = r;
+	wr.tail = r;
+	__atomic_add_fetch(&wr.pending, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&writer_mutex);
+	return (0);
+}
+
+/**
+ * @brief Forgets the client @p fd, which is going away: its queued
+ * requests still run, with no client.
+ *
+ * Waits for its running request, if any (a single one): once this
+ * returns, nothing is sent to @p fd anymore, and it may be reused.
+ *
+ * @param fd Client fd.
+ */
+void writer_forget(int fd)
+{
+	struct request *r;
+
+	if (!__atomic_load_n(&wr.pending, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&writer_mutex);
+	for (r = wr.head; r; r = r->next)
+		if (r->fd == fd)
+			r->fd = -1;
+	while (wr.current == fd)
+		pthread_cond_wait(&done_cond, &writer_mutex);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+/**
+ * @brief Runs what is left queued and stops the writer thread.
+ */
+void writer_stop(void)
+{
+	if (!wr.running)
+		return;
+
+	pthread_mutex_lock(&writer_mutex);
+	wr.stop = true;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&writer_mutex);
+	pthread_join(wr.thread, NULL);
+	wr.running = false;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2022 Snakehater
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * @file writer.h
+ * @brief Writer thread, runs the messages that would block an
+ * event loop worker.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+	#include <stdbool.h>
+	#include <stddef.h>
+
+	extern int writer_start(void (*run)(int fd, const unsigned char *msg,
+		size_t size, int tag));
+	extern bool writer_busy(int fd);
+	extern int writer_submit(int fd, const unsigned char *msg, size_t size,
+		int tag);
+	extern void writer_forget(int fd);
+	extern void writer_stop(void);
+
+#endif /* WRITER_H */
@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Minimal WebSocket client, talking to the server on port 8080.
+#
+
+import base64
+import os
+import socket
+import struct
+
+PORT = 8080
+
+# Fancy colors =)
+RED="\033[0;31m"
+GREEN="\033[0;32m"
+NC="\033[0m"
+
+class Client:
+	def __init__(self, timeout=5, rcvbuf=0):
+		self.s = socket.socket()
+		if rcvbuf:
+			self.s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+		self.s.connect(("127.0.0.1", PORT))
+		self.s.settimeout(timeout)
+		self.buf = b""
+
+		key = base64.b64encode(os.urandom(16)).decode()
+		self.s.sendall(("GET / HTTP/1.1\r\nHost: localhost\r\n"
+			"Upgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: {}\r\n"
+			"Sec-WebSocket-Version: 13\r\n\r\n").format(key).encode())
+
+		while b"\r\n\r\n" not in self.buf:
+			self.fill()
+		self.buf = self.buf.split(b"\r\n\r\n", 1)[1]
+
+	def fill(self):
+		d = self.s.recv(1 << 16)
+		if not d:
+			raise EOFError
+		self.buf += d
+
+	def need(self, n):
+		while len(self.buf) < n:
+			self.fill()
+		r = self.buf[:n]
+		self.buf = self.buf[n:]
+		return r
+
+	def send(self, text):
+		data = text.encode()
+		n    = len(data)
+		h    = bytes([0x81])
+		if n < 126:
+			h += bytes([0x80 | n])
+		elif n < 65536:
+			h += bytes([0x80 | 126]) + struct.pack(">H", n)
+		else:
+			h += bytes([0x80 | 127]) + struct.pack(">Q", n)
+
+		m = os.urandom(4)
+		self.s.sendall(h + m + bytes(b ^ m[i % 4] for i, b in enumerate(data)))
+
+	def recv(self):
+		h  = self.need(2)
+		op = h[0] & 15
+		n  = h[1] & 127
+		if n == 126:
+			n = struct.unpack(">H", self.need(2))[0]
+		elif n == 127:
+			n = struct.unpack(">Q", self.need(8))[0]
+		return (op, self.need(n))
+
+	# Next text message, skipping the binary ones (webcam frames).
+	def recv_text(self):
+		while True:
+			op, d = self.recv()
+			if op == 1:
+				return d.decode()
+
+	# Sends a command, returns its answer.
+	def ask(self, text):
+		self.send(text)
+		return self.recv_text()
+
+	# Printer states, by name.
+	def states(self):
+		lines = self.ask("get#").split("\n")
+		return dict((l.split("&")[0], l.split("&")[2]) for l in lines if l)
+
+	def close(self):
+		self.s.close()
+
+# Runs the tests, printing their results; returns the exit code.
+def run(tests):
+	ret = 0
+	for test in tests:
+		name = test.__name__[5:]
+		try:
+			test()
+			print("{:<24} {}passed{}".format(name, GREEN, NC))
+		except Exception as e:
+			print("{:<24} {}FAILED{}: {}".format(name, RED, NC, repr(e)))
+			ret = 1
+	return ret
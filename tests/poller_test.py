@@ -0,0 +1,84 @@
+#!/usr/bin/env python
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Printer poller (-p), against stand-in printers that answer, answer
+# with an error, stall, or are not there: the ones not answering go
+# NOK, and get their state back once they answer again.
+#
+
+import sys
+import time
+
+from client import Client, run
+from standin import Printer, free_port
+
+# First probe within the shortest interval, plus the probe timeout,
+# plus the longest interval, for a printer that failed twice.
+DEADLINE = 5 + 2 + 10 + 3
+
+def wait_states(c, want, flip={}, keep={}):
+	t0 = time.time()
+	while time.time() - t0 < DEADLINE:
+		st = c.states()
+		for name, state in keep.items():
+			assert st[name] == state, "{} went {}".format(name, st[name])
+
+		# Answering again as soon as seen down, before the back off.
+		for name, printer in list(flip.items()):
+			if st[name] == "NOK":
+				printer.mode = "ok"
+				del flip[name]
+
+		if all(st[name] == state for name, state in want.items()):
+			return
+		time.sleep(0.1)
+
+	raise AssertionError("states: {}".format(dict((name, st[name])
+		for name in want)))
+
+# Printers answering, even with a client error, stay as they are;
+# the others go NOK and, once answering again, get their state back,
+# BUSY included.
+def test_transitions():
+	up    = Printer("ok")
+	nf    = Printer("notfound")
+	err   = Printer("error")
+	stall = Printer("stall")
+	busy  = Printer("stall")
+	dead  = "127.0.0.1:{}".format(free_port())
+
+	c = Client()
+	for name, ip, state in (("pl-up", up.ip, "OK"), ("pl-nf", nf.ip, "OK"),
+		("pl-err", err.ip, "OK"), ("pl-stall", stall.ip, "OK"),
+		("pl-busy", busy.ip, "BUSY"), ("pl-dead", dead, "OK")):
+		assert c.ask("add#{}&{}&{}".format(name, ip, state)) == "OK\n", \
+			"cannot add " + name
+
+	keep = {"pl-up": "OK", "pl-nf": "OK"}
+	flip = {"pl-err": err, "pl-stall": stall, "pl-busy": busy}
+	wait_states(c, {"pl-err": "NOK", "pl-stall": "NOK", "pl-busy": "NOK",
+		"pl-dead": "NOK"}, flip, keep)
+	wait_states(c, {"pl-err": "OK", "pl-stall": "OK", "pl-busy": "BUSY",
+		"pl-dead": "NOK"}, flip, keep)
+
+	assert up.probes > 0 and nf.probes > 0, "not probed"
+	c.close()
+
+sys.exit(run([test_transitions]))
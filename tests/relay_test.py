@@ -0,0 +1,143 @@
+#!/usr/bin/env python
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Webcam relay (cam#), against a stand-in printer streaming MJPEG:
+# one stream per webcam, whatever the amount of clients watching it,
+# relayed whole and in order.
+#
+
+import sys
+import time
+
+from client import Client, run
+from standin import Printer, jpeg, jpeg_index
+
+cam = Printer()
+
+# Image number of a relayed frame, checked against what the printer
+# sent.
+def image(d, name=b"rl-cam"):
+	assert d[0] == 0x86, "not a webcam frame"
+	assert d[1] == len(name) and d[2:2 + len(name)] == name, "wrong name"
+	img = d[2 + len(name):]
+	i   = jpeg_index(img)
+	assert img == jpeg(i), "image {} damaged".format(i)
+	return i
+
+# Images received by c for secs seconds, checked.
+def watch(c, secs, name=b"rl-cam"):
+	got = []
+	t0  = time.time()
+	while time.time() - t0 < secs:
+		op, d = c.recv()
+		if op == 2:
+			got.append(image(d, name))
+	return got
+
+def wait_streams(n, timeout=5):
+	t0 = time.time()
+	while cam.streams != n and time.time() - t0 < timeout:
+		time.sleep(0.05)
+	return cam.streams == n
+
+# Every client gets the images, including the ones bigger than a
+# read, whole and in order, from a single stream.
+def test_fan_out():
+	c = Client()
+	assert c.ask("add#rl-cam&{}&OK".format(cam.ip)) == "OK\n", "cannot add"
+	assert c.ask("cam#nobody") == "NOK\n", "unknown printer watched"
+	c.close()
+
+	cs = [Client() for _ in range(3)]
+	for c in cs:
+		assert c.ask("cam#rl-cam") == "OK\n", "cannot watch"
+
+	for c in cs:
+		got = watch(c, 2)
+		assert len(got) >= 10, "{} images".format(len(got))
+		assert got == sorted(set(got)), "images out of order"
+		assert any(i % 10 == 9 for i in got), "no big image"
+
+	assert cam.pulls == 1 and cam.streams == 1, \
+		"{} streams pulled".format(cam.pulls)
+
+	for c in cs:
+		c.send("camstat#")
+		sent = int(c.recv_text().split("&")[1])
+		assert sent > 0, "nothing counted"
+		c.close()
+
+# The stream ends once nobody watches it, whether clients stop
+# watching or leave.
+def test_leave():
+	a = Client()
+	b = Client()
+	for c in (a, b):
+		assert c.ask("cam#rl-cam") == "OK\n", "cannot watch"
+	assert wait_streams(1), "not pulled"
+
+	assert a.ask("cam#") == "OK\n", "cannot stop watching"
+	watch(b, 0.5)
+	assert cam.streams == 1, "stream ended with a client watching"
+
+	b.close()
+	assert wait_streams(0), "stream still pulled"
+	a.close()
+
+# A stream cut by the printer is pulled again.
+def test_reconnect():
+	c = Client()
+	assert c.ask("cam#rl-cam") == "OK\n", "cannot watch"
+	assert watch(c, 0.5), "nothing received"
+
+	pulls = cam.pulls
+	cam.cut_stream()
+	got = watch(c, 3)
+	assert cam.pulls == pulls + 1, "not pulled again"
+	assert got and got[-1] > 0, "nothing received after the cut"
+	c.close()
+	assert wait_streams(0), "stream still pulled"
+
+# A client not reading skips images, and does not hold up the
+# others.
+def test_slow_client():
+	# More than the socket buffers take in.
+	hd = Printer(fps=100)
+	c  = Client()
+	assert c.ask("add#rl-hd&{}&OK".format(hd.ip)) == "OK\n", "cannot add"
+	c.close()
+
+	slow = Client(timeout=10, rcvbuf=4096)
+	fast = Client()
+	for c in (slow, fast):
+		assert c.ask("cam#rl-hd") == "OK\n", "cannot watch"
+
+	got = watch(fast, 5, b"rl-hd")
+	assert len(got) >= 100, "{} images".format(len(got))
+
+	# Whatever was pending, then the answer.
+	slow.send("camstat#")
+	dropped = int(slow.recv_text().split("&")[2])
+	assert dropped > 0, "nothing skipped"
+
+	slow.close()
+	fast.close()
+
+sys.exit(run([test_fan_out, test_leave, test_reconnect, test_slow_client]))
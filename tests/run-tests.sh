@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Runs the server (port 8080, which must be free), polling the
+# printers, on an empty database, and the tests against it. The
+# printers are stand-ins, see standin.py.
+#
+# Environment: TESTS, ARGS (more server options, e.g: "-w 4").
+#
+
+cd "$(dirname "$0")"
+
+TESTS=${TESTS:-"poller_test.py relay_test.py"}
+ARGS=${ARGS:-}
+
+dir=$(mktemp -d)
+touch "$dir/printers.db"
+
+../_build/main -p -d "$dir/printers.db" $ARGS > "$dir/server.log" 2>&1 &
+server=$!
+sleep 0.5
+
+if ! kill -0 "$server" 2>/dev/null; then
+	echo "Server not running:"
+	cat "$dir/server.log"
+	rm -rf "$dir"
+	exit 1
+fi
+
+ret=0
+for test in $TESTS; do
+	python3 "$test" || ret=1
+done
+
+kill "$server" 2>/dev/null
+wait "$server" 2>/dev/null
+rm -rf "$dir"
+exit $ret
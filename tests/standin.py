@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+
+#
+# Copyright (C) 2022 Snakehater
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+
+#
+# Stand-in printer web interface, on 127.0.0.1: answers the poller
+# probes (GET /) as its mode says, and streams its webcam as MJPEG
+# (GET /webcam/?action=stream).
+#
+
+import random
+import socket
+import threading
+import time
+
+# Probe answers, by mode ("stall" never answers).
+ANSWERS = {
+	"ok":       b"HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok",
+	"notfound": b"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n",
+	"error":    b"HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n",
+}
+
+BOUNDARY = b"frame"
+
+# Webcam image i: a JPEG as far as the relay is concerned, some of
+# them bigger than its read size, with 0xFF bytes in the data.
+def jpeg(i):
+	size = 200000 if i % 10 == 9 else 2000 + i % 7
+	return (b"\xff\xd8" + b"img%06d" % i + b"\xff\x00" * (size // 2) +
+		b"\xff\xd9")
+
+# Number of the image in frame data, see jpeg().
+def jpeg_index(data):
+	return int(data[5:11])
+
+# A TCP port nothing listens on.
+def free_port():
+	s = socket.socket()
+	s.bind(("127.0.0.1", 0))
+	port = s.getsockname()[1]
+	s.close()
+	return port
+
+class Printer:
+	def __init__(self, mode="ok", fps=30):
+		self.mode    = mode
+		self.fps     = fps
+		self.probes  = 0
+		self.streams = 0 # Webcam streams open.
+		self.pulls   = 0 # Webcam streams ever opened.
+		self.cut     = False
+		self.lock    = threading.Lock()
+
+		self.s = socket.socket()
+		self.s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		self.s.bind(("127.0.0.1", 0))
+		self.s.listen(64)
+		self.port = self.s.getsockname()[1]
+		self.ip   = "127.0.0.1:{}".format(self.port)
+		threading.Thread(target=self.accept, daemon=True).start()
+
+	def accept(self):
+		while True:
+			c, _ = self.s.accept()
+			threading.Thread(target=self.serve, args=(c,), daemon=True).start()
+
+	def serve(self, c):
+		try:
+			req = b""
+			while b"\r\n\r\n" not in req:
+				d = c.recv(4096)
+				if not d:
+					return
+				req += d
+
+			if req.startswith(b"GET /webcam/"):
+				self.stream(c)
+				return
+
+			with self.lock:
+				self.probes += 1
+			mode = self.mode
+			if mode == "stall":
+				# Until the poller gives up.
+				while c.recv(4096):
+					pass
+			else:
+				c.sendall(ANSWERS[mode])
+		except OSError:
+			pass
+		finally:
+			c.close()
+
+	# Sends the images in random pieces, so that they end up split
+	# across the relay reads, until the relay or cut_stream() closes
+	# the stream.
+	def stream(self, c):
+		with self.lock:
+			self.streams += 1
+			self.pulls   += 1
+		try:
+			c.sendall(b"HTTP/1.0 200 OK\r\nContent-Type: "
+				b"multipart/x-mixed-replace;boundary=" + BOUNDARY + b"\r\n\r\n")
+			i = 0
+			while not self.cut:
+				img  = jpeg(i)
+				part = (b"--" + BOUNDARY + b"\r\nContent-Type: image/jpeg\r\n"
+					b"Content-Length: %d\r\n\r\n" % len(img) + img + b"\r\n")
+				while part:
+					n = random.choice([1, 3, 100, 5000, 70000])
+					c.sendall(part[:n])
+					part = part[n:]
+				i += 1
+				time.sleep(1 / self.fps)
+		except OSError:
+			pass
+		finally:
+			with self.lock:
+				self.streams -= 1
+
+	def cut_stream(self):
+		self.cut = True
+		while self.streams:
+			time.sleep(0.01)
+		self.cut = False